@@ -18,8 +18,39 @@
 #include <boost/filesystem.hpp>
 #include <boost/algorithm/string.hpp>
 #include <string>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// SSSE3 is not part of the x86-64 baseline: unless the module is compiled with
+// -mssse3, the byte shuffles of 24 bit pixels are compiled for the SSSE3
+// target only and chosen at run time on processors that support them.
+#if defined(__SSSE3__)
+#define BMP_SSSE3
+#define BMP_SSSE3_TARGET
+static bool bmp_has_ssse3() { return true; }
+#elif defined(__SSE2__) && defined(__GNUC__)
+#define BMP_SSSE3
+#define BMP_SSSE3_TARGET __attribute__((target("ssse3")))
+static bool bmp_has_ssse3()
+{
+  static const bool supported = __builtin_cpu_supports("ssse3");
+  return supported;
+}
+#endif
+#ifdef BMP_SSSE3
+#include <tmmintrin.h>
+#endif
 
 #include <bob.io.image/bmp.h>
+#include <bob.io.image/image.h>
 
 // The following documentation is mostly coming from wikipedia:
 // http://en.wikipedia.org/wiki/BMP_file_format
@@ -176,6 +207,7 @@ typedef struct
   size_t width;
   size_t depth;
   size_t cmap_size;
+  uint32_t compression; ///< BI_RGB, BI_RLE8, BI_RLE4 or BI_BITFIELDS
   bool has_bitmask;
   uint32_t r_bitmask;
   uint32_t g_bitmask;
@@ -256,20 +288,93 @@ bmp_print_dib_header(bmp_dib_header_t *hdr)
 }
 */
 
-// Read the 14 bytes header from the current FILE position
-// The FILE pointer is increased of 14 bytes
+/**
+ * The bytes of a BMP file, mapped into memory for one read. The headers are
+ * copied field by field out of the mapping, and the rows are converted
+ * straight out of it, so that reading an image or a region does not copy the
+ * raster.
+ */
+typedef struct
+{
+  const uint8_t *data;
+  size_t size;
+  boost::shared_ptr<void> mapping; ///< unmaps the file
+} bmp_memory_t;
+
+/**
+ * Maps the file privately and read-only into memory; the file is closed
+ * right away. Each read maps the file again and parses its headers again, so
+ * that a file that was replaced since it was opened is detected, and no file
+ * stays open between reads. Pages beyond the end of a file that another
+ * process truncates while it is read raise SIGBUS when touched, as for any
+ * mapped file.
+ */
+static boost::shared_ptr<const bmp_memory_t> bmp_map_file(const std::string& filename)
+{
+  const int fd = open(filename.c_str(), O_RDONLY);
+  struct stat status;
+  if(fd < 0 || fstat(fd, &status) != 0 || status.st_size == 0)
+  {
+    if(fd >= 0) close(fd);
+    boost::format m("could not open file `%s'");
+    m % filename;
+    throw std::runtime_error(m.str());
+  }
+  const size_t size = status.st_size;
+  void* data = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(data == MAP_FAILED)
+  {
+    boost::format m("bmp: cannot map file `%s' into memory");
+    m % filename;
+    throw std::runtime_error(m.str());
+  }
+
+  boost::shared_ptr<bmp_memory_t> memory = boost::make_shared<bmp_memory_t>();
+  memory->data = static_cast<const uint8_t*>(data);
+  memory->size = size;
+  memory->mapping.reset(data, [size](void* p){ munmap(p, size); });
+  return memory;
+}
+
+// A read position in the mapped file, which advances like the position of a FILE
+typedef struct
+{
+  const uint8_t *data;
+  size_t size;
+  size_t position;
+} bmp_input_t;
+
+static bmp_input_t bmp_make_input(const bmp_memory_t& memory)
+{
+  bmp_input_t input = {memory.data, memory.size, 0};
+  return input;
+}
+
+// Copies count elements of the given size from the current position, like
+// fread; returns the number of elements that were available
+static size_t bmp_read(void *buffer, size_t size, size_t count, bmp_input_t * const input)
+{
+  count = std::min(count, (input->size - std::min(input->position, input->size)) / size);
+  std::memcpy(buffer, input->data + input->position, size * count);
+  input->position += size * count;
+  return count;
+}
+
+// Read the 14 bytes header from the current position
+// The position is increased by 14 bytes
 static void
-bmp_read_bmp_header(FILE * const input_file, bmp_header_t *hdr)
+bmp_read_bmp_header(bmp_input_t * const input, bmp_header_t *hdr)
 {
-  if(fread(&hdr->signature[0], sizeof(uint8_t), 2, input_file) != 2)
+  if(bmp_read(&hdr->signature[0], sizeof(uint8_t), 2, input) != 2)
     throw std::runtime_error("bmp: error while reading bmp header (signature)");
-  if(fread(&hdr->file_size, sizeof(uint32_t), 1, input_file) != 1)
+  if(bmp_read(&hdr->file_size, sizeof(uint32_t), 1, input) != 1)
     throw std::runtime_error("bmp: error while reading bmp header (file size)");
-  if(fread(&hdr->reserved1, sizeof(uint16_t), 1, input_file) != 1)
+  if(bmp_read(&hdr->reserved1, sizeof(uint16_t), 1, input) != 1)
     throw std::runtime_error("bmp: error while reading bmp header (reserved1)");
-  if(fread(&hdr->reserved2, sizeof(uint16_t), 1, input_file) != 1)
+  if(bmp_read(&hdr->reserved2, sizeof(uint16_t), 1, input) != 1)
     throw std::runtime_error("bmp: error while reading bmp header (reserved2)");
-  if(fread(&hdr->offset, sizeof(uint32_t), 1, input_file) != 1)
+  if(bmp_read(&hdr->offset, sizeof(uint32_t), 1, input) != 1)
     throw std::runtime_error("bmp: error while reading bmp header (offset)");
 }
 
@@ -314,47 +419,52 @@ static void bmp_update_bitmask_structure(uint32_t r, uint32_t g, uint32_t b, bmp
 }
 
 
-// Read the and parse the windows DIB header bitmasks from the current FILE position
-static void bmp_read_bitmask_win_dib_header(FILE * const input_file, bmp_dib_header_t *dib_hdr)
+// Read the and parse the windows DIB header bitmasks from the current position
+static void bmp_read_bitmask_win_dib_header(bmp_input_t * const input, bmp_dib_header_t *dib_hdr)
 {
   dib_hdr->has_bitmask = true;
-  if(fread(&dib_hdr->r_bitmask, sizeof(uint32_t), 1, input_file) != 1)
+  if(bmp_read(&dib_hdr->r_bitmask, sizeof(uint32_t), 1, input) != 1)
     throw std::runtime_error("bmp: error while reading bmp DIB header (Red bitmask)");
-  if(fread(&dib_hdr->g_bitmask, sizeof(uint32_t), 1, input_file) != 1)
+  if(bmp_read(&dib_hdr->g_bitmask, sizeof(uint32_t), 1, input) != 1)
     throw std::runtime_error("bmp: error while reading bmp DIB header (Green bitmask)");
-  if(fread(&dib_hdr->b_bitmask, sizeof(uint32_t), 1, input_file) != 1)
+  if(bmp_read(&dib_hdr->b_bitmask, sizeof(uint32_t), 1, input) != 1)
     throw std::runtime_error("bmp: error while reading bmp DIB header (Blue bitmask)");
   bmp_update_bitmask_structure(dib_hdr->r_bitmask, dib_hdr->g_bitmask, dib_hdr->b_bitmask, &dib_hdr->bitmask);
 }
 
-// Read the Winv1 DIB header from the current FILE position
-// The FILE pointer is increased according to the size of the DIB header
+// Read the Winv1 DIB header from the current position
+// The position is increased according to the size of the DIB header
 //  (if DIB type is supported)
 static void
-bmp_read_winv1_dib_header(FILE * const input_file, bmp_dib_header_t *dib_hdr, const bool winv1=true)
+bmp_read_winv1_dib_header(bmp_input_t * const input, bmp_dib_header_t *dib_hdr, const bool winv1=true)
 {
-  if(fread(&dib_hdr->dib_header.win.width, sizeof(int32_t), 1, input_file) != 1)
+  if(bmp_read(&dib_hdr->dib_header.win.width, sizeof(int32_t), 1, input) != 1)
     throw std::runtime_error("bmp: error while reading bmp DIB header (width)");
-  if(fread(&dib_hdr->dib_header.win.height, sizeof(int32_t), 1, input_file) != 1)
+  if(bmp_read(&dib_hdr->dib_header.win.height, sizeof(int32_t), 1, input) != 1)
     throw std::runtime_error("bmp: error while reading bmp DIB header (height)");
-  if(fread(&dib_hdr->dib_header.win.n_planes, sizeof(uint16_t), 1, input_file) != 1)
+  if(bmp_read(&dib_hdr->dib_header.win.n_planes, sizeof(uint16_t), 1, input) != 1)
     throw std::runtime_error("bmp: error while reading bmp DIB header (number of planes)");
-  if(fread(&dib_hdr->dib_header.win.depth, sizeof(uint16_t), 1, input_file) != 1)
+  if(bmp_read(&dib_hdr->dib_header.win.depth, sizeof(uint16_t), 1, input) != 1)
     throw std::runtime_error("bmp: error while reading bmp DIB header (depth)");
-  if(fread(&dib_hdr->dib_header.win.compression_type, sizeof(uint32_t), 1, input_file) != 1)
+  if(bmp_read(&dib_hdr->dib_header.win.compression_type, sizeof(uint32_t), 1, input) != 1)
     throw std::runtime_error("bmp: error while reading bmp DIB header (compression type)");
   if(dib_hdr->dib_header.win.compression_type != BI_RGB &&
+     dib_hdr->dib_header.win.compression_type != BI_RLE8 &&
+     dib_hdr->dib_header.win.compression_type != BI_RLE4 &&
      dib_hdr->dib_header.win.compression_type != BI_BITFIELDS)
     throw std::runtime_error("bmp: unsupported compression type in header");
-  if(fread(&dib_hdr->dib_header.win.image_size, sizeof(uint32_t), 1, input_file) != 1)
+  if((dib_hdr->dib_header.win.compression_type == BI_RLE8 && dib_hdr->dib_header.win.depth != 8) ||
+     (dib_hdr->dib_header.win.compression_type == BI_RLE4 && dib_hdr->dib_header.win.depth != 4))
+    throw std::runtime_error("bmp: error while reading bmp DIB header (RLE compression with unsupported depth)");
+  if(bmp_read(&dib_hdr->dib_header.win.image_size, sizeof(uint32_t), 1, input) != 1)
     throw std::runtime_error("bmp: error while reading bmp DIB header (image size)");
-  if(fread(&dib_hdr->dib_header.win.hres, sizeof(int32_t), 1, input_file) != 1)
+  if(bmp_read(&dib_hdr->dib_header.win.hres, sizeof(int32_t), 1, input) != 1)
     throw std::runtime_error("bmp: error while reading bmp DIB header (horizontal resolution)");
-  if(fread(&dib_hdr->dib_header.win.vres, sizeof(int32_t), 1, input_file) != 1)
+  if(bmp_read(&dib_hdr->dib_header.win.vres, sizeof(int32_t), 1, input) != 1)
     throw std::runtime_error("bmp: error while reading bmp DIB header (vertical resolution)");
-  if(fread(&dib_hdr->dib_header.win.n_colors, sizeof(uint32_t), 1, input_file) != 1)
+  if(bmp_read(&dib_hdr->dib_header.win.n_colors, sizeof(uint32_t), 1, input) != 1)
     throw std::runtime_error("bmp: error while reading bmp DIB header (number of colors)");
-  if(fread(&dib_hdr->dib_header.win.n_impcolors, sizeof(uint32_t), 1, input_file) != 1)
+  if(bmp_read(&dib_hdr->dib_header.win.n_impcolors, sizeof(uint32_t), 1, input) != 1)
     throw std::runtime_error("bmp: error while reading bmp DIB header (number of important colors)");
 
   // Update "standard" DIB attributes
@@ -362,6 +472,10 @@ bmp_read_winv1_dib_header(FILE * const input_file, bmp_dib_header_t *dib_hdr, co
   dib_hdr->height = (dib_hdr->dib_header.win.height > 0 ? dib_hdr->dib_header.win.height : -dib_hdr->dib_header.win.height);
   dib_hdr->width = (dib_hdr->dib_header.win.width > 0 ? dib_hdr->dib_header.win.width : -dib_hdr->dib_header.win.width);
   dib_hdr->depth = dib_hdr->dib_header.win.depth;
+  dib_hdr->compression = dib_hdr->dib_header.win.compression_type;
+
+  if(dib_hdr->height == 0 || dib_hdr->width == 0)
+    throw std::runtime_error("bmp: error while reading bmp DIB header (the width or the height is 0)");
 
   // Update color map size attribute
   if(dib_hdr->depth <= 8)
@@ -383,73 +497,73 @@ bmp_read_winv1_dib_header(FILE * const input_file, bmp_dib_header_t *dib_hdr, co
 
   // If BIT_FIELD COMPRESSION_TYPE is set, we need to read the bitmasks
   if(winv1 && dib_hdr->dib_header.win.compression_type == BI_BITFIELDS)
-    bmp_read_bitmask_win_dib_header(input_file, dib_hdr);
+    bmp_read_bitmask_win_dib_header(input, dib_hdr);
   else
     dib_hdr->has_bitmask = false;
 }
 
-// Read the Winv4 DIB header part from the current FILE position
-// The FILE pointer is increased according to the size of the DIB header
+// Read the Winv4 DIB header part from the current position
+// The position is increased according to the size of the DIB header
 //  (if DIB type is supported)
 static void
-bmp_read_winv4_dib_header(FILE * const input_file, bmp_dib_header_t *dib_hdr)
+bmp_read_winv4_dib_header(bmp_input_t * const input, bmp_dib_header_t *dib_hdr)
 {
   // 1. RGBA bitmask
-  bmp_read_bitmask_win_dib_header(input_file, dib_hdr);
+  bmp_read_bitmask_win_dib_header(input, dib_hdr);
   dib_hdr->dib_header.win.r_bitmask = dib_hdr->r_bitmask;
   dib_hdr->dib_header.win.g_bitmask = dib_hdr->g_bitmask;
   dib_hdr->dib_header.win.b_bitmask = dib_hdr->b_bitmask;
-  if(fread(&dib_hdr->dib_header.win.a_bitmask, sizeof(uint32_t), 1, input_file) != 1)
+  if(bmp_read(&dib_hdr->dib_header.win.a_bitmask, sizeof(uint32_t), 1, input) != 1)
     throw std::runtime_error("bmp: error while reading bmp DIB header (Alpha bitmask)");
   // 2. Colorspace type
-  if(fread(&dib_hdr->dib_header.win.colorspace_type, sizeof(uint32_t), 1, input_file) != 1)
+  if(bmp_read(&dib_hdr->dib_header.win.colorspace_type, sizeof(uint32_t), 1, input) != 1)
     throw std::runtime_error("bmp: error while reading bmp DIB header (Colorspace type)");
   // 3. Colorspace endpoints
-  if(fread(&dib_hdr->dib_header.win.colorspace_endpoints, sizeof(uint32_t), 9, input_file) != 9)
+  if(bmp_read(&dib_hdr->dib_header.win.colorspace_endpoints, sizeof(uint32_t), 9, input) != 9)
     throw std::runtime_error("bmp: error while reading bmp DIB header (Colorspace endpoints)");
   // 4. Gamma RGB channels
-  if(fread(&dib_hdr->dib_header.win.r_gamma, sizeof(uint32_t), 1, input_file) != 1)
+  if(bmp_read(&dib_hdr->dib_header.win.r_gamma, sizeof(uint32_t), 1, input) != 1)
     throw std::runtime_error("bmp: error while reading bmp DIB header (Gamma red channel)");
-  if(fread(&dib_hdr->dib_header.win.g_gamma, sizeof(uint32_t), 1, input_file) != 1)
+  if(bmp_read(&dib_hdr->dib_header.win.g_gamma, sizeof(uint32_t), 1, input) != 1)
     throw std::runtime_error("bmp: error while reading bmp DIB header (Gamma green channel)");
-  if(fread(&dib_hdr->dib_header.win.b_gamma, sizeof(uint32_t), 1, input_file) != 1)
+  if(bmp_read(&dib_hdr->dib_header.win.b_gamma, sizeof(uint32_t), 1, input) != 1)
     throw std::runtime_error("bmp: error while reading bmp DIB header (Gamma blue channel)");
 }
 
-// Read the Winv5 DIB header part from the current FILE position
-// The FILE pointer is increased according to the size of the DIB header
+// Read the Winv5 DIB header part from the current position
+// The position is increased according to the size of the DIB header
 //  (if DIB type is supported)
 static void
-bmp_read_winv5_dib_header(FILE * const input_file, bmp_dib_header_t *dib_hdr)
+bmp_read_winv5_dib_header(bmp_input_t * const input, bmp_dib_header_t *dib_hdr)
 {
   // 1. Intent
-  if(fread(&dib_hdr->dib_header.win.intent, sizeof(uint32_t), 1, input_file) != 1)
+  if(bmp_read(&dib_hdr->dib_header.win.intent, sizeof(uint32_t), 1, input) != 1)
     throw std::runtime_error("bmp: error while reading bmp DIB header (Intent)");
   // 2. Profile data
-  if(fread(&dib_hdr->dib_header.win.profile_data, sizeof(uint32_t), 1, input_file) != 1)
+  if(bmp_read(&dib_hdr->dib_header.win.profile_data, sizeof(uint32_t), 1, input) != 1)
     throw std::runtime_error("bmp: error while reading bmp DIB header (Profile data)");
   // 3. Profile size
-  if(fread(&dib_hdr->dib_header.win.profile_size, sizeof(uint32_t), 1, input_file) != 1)
+  if(bmp_read(&dib_hdr->dib_header.win.profile_size, sizeof(uint32_t), 1, input) != 1)
     throw std::runtime_error("bmp: error while reading bmp DIB header (Profile size)");
   // 4. Reserved
-  if(fread(&dib_hdr->dib_header.win.reserved, sizeof(uint32_t), 1, input_file) != 1)
+  if(bmp_read(&dib_hdr->dib_header.win.reserved, sizeof(uint32_t), 1, input) != 1)
     throw std::runtime_error("bmp: error while reading bmp DIB header (Reserved)");
 }
 
-// Read the OS2v1 DIB header from the current FILE position
-// The FILE pointer is increased according to the size of the DIB header
+// Read the OS2v1 DIB header from the current position
+// The position is increased according to the size of the DIB header
 //  (if DIB type is supported)
 static void
-bmp_read_os2v1_dib_header(FILE * const input_file, bmp_dib_header_t *dib_hdr)
+bmp_read_os2v1_dib_header(bmp_input_t * const input, bmp_dib_header_t *dib_hdr)
 {
   // Read the OS2v1 DIB header
-  if(fread(&dib_hdr->dib_header.os2v1.width, sizeof(uint16_t), 1, input_file) != 1)
+  if(bmp_read(&dib_hdr->dib_header.os2v1.width, sizeof(uint16_t), 1, input) != 1)
     throw std::runtime_error("bmp: error while reading bmp DIB header (width)");
-  if(fread(&dib_hdr->dib_header.os2v1.height, sizeof(uint16_t), 1, input_file) != 1)
+  if(bmp_read(&dib_hdr->dib_header.os2v1.height, sizeof(uint16_t), 1, input) != 1)
     throw std::runtime_error("bmp: error while reading bmp DIB header (height)");
-  if(fread(&dib_hdr->dib_header.os2v1.n_planes, sizeof(uint16_t), 1, input_file) != 1)
+  if(bmp_read(&dib_hdr->dib_header.os2v1.n_planes, sizeof(uint16_t), 1, input) != 1)
     throw std::runtime_error("bmp: error while reading bmp DIB header (number of planes)");
-  if(fread(&dib_hdr->dib_header.os2v1.depth, sizeof(uint16_t), 1, input_file) != 1)
+  if(bmp_read(&dib_hdr->dib_header.os2v1.depth, sizeof(uint16_t), 1, input) != 1)
     throw std::runtime_error("bmp: error while reading bmp DIB header (depth)");
 
   // Update "standard" DIB attributes
@@ -457,6 +571,10 @@ bmp_read_os2v1_dib_header(FILE * const input_file, bmp_dib_header_t *dib_hdr)
   dib_hdr->height = dib_hdr->dib_header.os2v1.height;
   dib_hdr->width = dib_hdr->dib_header.os2v1.width;
   dib_hdr->depth = dib_hdr->dib_header.os2v1.depth;
+  dib_hdr->compression = BI_RGB;
+
+  if(dib_hdr->height == 0 || dib_hdr->width == 0)
+    throw std::runtime_error("bmp: error while reading bmp DIB header (the width or the height is 0)");
 
   // Update color map size attribute
   if(dib_hdr->depth <= 8)
@@ -467,14 +585,14 @@ bmp_read_os2v1_dib_header(FILE * const input_file, bmp_dib_header_t *dib_hdr)
     throw std::runtime_error("bmp: error while reading bmp DIB header (Colormap: Unrecognized bits per pixel in OS2 BMP file header).");
 }
 
-// Read the DIB header from the current FILE position
-// The FILE pointer is increased according to the size of the DIB header
+// Read the DIB header from the current position
+// The position is increased according to the size of the DIB header
 //  (if DIB type is supported)
 static void
-bmp_read_dib_header(FILE * const input_file, bmp_dib_header_t *dib_hdr)
+bmp_read_dib_header(bmp_input_t * const input, bmp_dib_header_t *dib_hdr)
 {
   uint32_t dib_hdr_size;
-  if(fread(&dib_hdr_size, sizeof(uint32_t), 1, input_file) != 1)
+  if(bmp_read(&dib_hdr_size, sizeof(uint32_t), 1, input) != 1)
     throw std::runtime_error("bmp: error while reading DIB bmp header (header size)");
 
   // Set the DIB header type according to the read value
@@ -505,28 +623,28 @@ bmp_read_dib_header(FILE * const input_file, bmp_dib_header_t *dib_hdr)
   {
     case WINV1:
       // Read the windows WINV1 DIB header
-      bmp_read_winv1_dib_header(input_file, dib_hdr);
+      bmp_read_winv1_dib_header(input, dib_hdr);
       break;
 
     case WINV4:
       // Read the windows WINV1 DIB header part
-      bmp_read_winv1_dib_header(input_file, dib_hdr, false);
+      bmp_read_winv1_dib_header(input, dib_hdr, false);
       // Read the windows WINV4 DIB header part
-      bmp_read_winv4_dib_header(input_file, dib_hdr);
+      bmp_read_winv4_dib_header(input, dib_hdr);
       break;
 
     case WINV5:
       // Read the windows WINV1 DIB header part
-      bmp_read_winv1_dib_header(input_file, dib_hdr, false);
+      bmp_read_winv1_dib_header(input, dib_hdr, false);
       // Read the windows WINV4 DIB header part
-      bmp_read_winv4_dib_header(input_file, dib_hdr);
+      bmp_read_winv4_dib_header(input, dib_hdr);
       // Read the windows WINV5 DIB header part
-      bmp_read_winv5_dib_header(input_file, dib_hdr);
+      bmp_read_winv5_dib_header(input, dib_hdr);
       break;
 
     case OS2V1:
       // Read the OS2v1 DIB header
-      bmp_read_os2v1_dib_header(input_file, dib_hdr);
+      bmp_read_os2v1_dib_header(input, dib_hdr);
       break;
 
     default:
@@ -534,35 +652,26 @@ bmp_read_dib_header(FILE * const input_file, bmp_dib_header_t *dib_hdr)
   }
 }
 
-// Read the colormap
+// Read the colormap in place; its entries have 3 bytes (BGR) in OS/2 files
+// and 4 bytes (BGR and a reserved byte) in Windows files
 static void
-bmp_read_colormap(FILE * const input_file, pixel_t *color_map, size_t cmap_size, bmp_dib_header_type hdr_type)
+bmp_read_colormap(bmp_input_t * const input, pixel_t *color_map, size_t cmap_size, bmp_dib_header_type hdr_type)
 {
-  for(size_t i=0; i<cmap_size; ++i)
+  const size_t entry_size = (hdr_type == OS2V1 ? 3 : 4);
+  if(input->position > input->size || (input->size - input->position) / entry_size < cmap_size)
+    throw std::runtime_error("bmp: error while reading color map");
+
+  /* From Netpbm: There is a document that says the bytes are ordered R,G,B,Z,
+     but in practice it appears to be the following instead:
+   */
+  const uint8_t *entry = input->data + input->position;
+  for(size_t i=0; i<cmap_size; ++i, entry += entry_size)
   {
-    /* From Netpbm: There is a document that says the bytes are ordered R,G,B,Z,
-       but in practice it appears to be the following instead:
-     */
-    uint8_t r, g, b;
-
-    size_t s_el = sizeof(uint8_t);
-    if(fread(&b, s_el, 1, input_file) != 1)
-      throw std::runtime_error("bmp: error while reading color map");
-    if(fread(&g, s_el, 1, input_file) != 1)
-      throw std::runtime_error("bmp: error while reading color map");
-    if(fread(&r, s_el, 1, input_file) != 1)
-      throw std::runtime_error("bmp: error while reading color map");
-
-    color_map[i].r = r;
-    color_map[i].g = g;
-    color_map[i].b = b;
-
-    if(hdr_type == WINV1)
-    {
-      if(fread(&r, s_el, 1, input_file) != 1)
-        throw std::runtime_error("bmp: error while reading color map");
-    }
+    color_map[i].r = entry[2];
+    color_map[i].g = entry[1];
+    color_map[i].b = entry[0];
   }
+  input->position += cmap_size * entry_size;
 }
 
 // Allocate buffer for raster
@@ -571,22 +680,168 @@ static size_t bmp_get_nbytes_per_row(const bmp_dib_header_t *dib_hdr)
   return (dib_hdr->width * dib_hdr->depth + 31) / 32 * 4;
 }
 
-// Read the raster data
+// Images of 8 bits or less are gray images if their color map holds only
+// gray colors
+static bool bmp_is_gray(const bmp_dib_header_t *dib_hdr, const pixel_t *color_map)
+{
+  if(dib_hdr->depth > 8 || dib_hdr->has_bitmask)
+    return false;
+  for(size_t i=0; i<dib_hdr->cmap_size; ++i)
+    if(color_map[i].r != color_map[i].g || color_map[i].g != color_map[i].b)
+      return false;
+  return true;
+}
+
+// Reads the bytes of compressed raster data one by one, checking for the end
+// of the file
+class bmp_byte_stream
+{
+  public:
+    bmp_byte_stream(const uint8_t *data, const uint8_t *end)
+    : m_data(data), m_end(end)
+    { }
+
+    uint8_t next()
+    {
+      if(m_data == m_end)
+        throw std::runtime_error("bmp: error while reading RLE raster data (unexpected end of file)");
+      return *m_data++;
+    }
+
+  private:
+    const uint8_t *m_data;
+    const uint8_t *m_end;
+};
+
+// Decodes the RLE8 or RLE4 raster data from data to end into the
+// rows y0 to y0+rows-1 (counted from the top of the image), which are stored
+// like uncompressed rows of 8 or 4 bits per pixel. Pixels that are skipped by
+// the delta and end of line escapes keep the color index 0. Decoding stops
+// after the last row of the region.
 static void
-bmp_read_raster(FILE * const input_file, const bmp_dib_header_t *dib_hdr, size_t n_bytes_per_row, uint8_t *data)
+bmp_read_rle_raster(const uint8_t *raster, const uint8_t *end, const bmp_dib_header_t *dib_hdr, size_t n_bytes_per_row, uint8_t *data,
+  size_t y0, size_t rows)
 {
-  if(dib_hdr->bottom_up)
-    for(size_t i=0; i<dib_hdr->height; ++i)
+  std::fill(data, data + n_bytes_per_row*rows, 0);
+  const bool rle4 = (dib_hdr->compression == BI_RLE4);
+  const size_t height = dib_hdr->height, width = dib_hdr->width;
+  // the rows are stored bottom-up in the file
+  const size_t lines = (dib_hdr->bottom_up ? height - y0 : y0 + rows);
+
+  bmp_byte_stream stream(raster, end);
+  size_t line = 0, x = 0;
+  uint8_t *row = 0; // the row of the current line, if it is part of the region
+  auto select_row = [&]()
+  {
+    const size_t y = (dib_hdr->bottom_up ? height - 1 - line : line);
+    row = (line < height && y >= y0 && y < y0 + rows) ? data + (y - y0)*n_bytes_per_row : 0;
+  };
+  auto put = [&](uint8_t index)
+  {
+    if(row && x < width)
     {
-      if(fread(&data[(dib_hdr->height-1-i)*n_bytes_per_row], 1, n_bytes_per_row, input_file) != n_bytes_per_row)
-        throw std::runtime_error("bmp: error while reading raster data");
+      if(!rle4) row[x] = index;
+      else if(x & 1) row[x >> 1] = (row[x >> 1] & 0xf0) | index;
+      else row[x >> 1] = (row[x >> 1] & 0x0f) | (index << 4);
     }
-  else
-    for(size_t i=0; i<dib_hdr->height; ++i)
+    ++x;
+  };
+
+  select_row();
+  while(line < lines)
+  {
+    const uint8_t count = stream.next();
+    const uint8_t value = stream.next();
+    if(count > 0)
+    {
+      // encoded mode: a run of count pixels
+      if(!rle4)
+      {
+        if(row && x < width) std::fill(row + x, row + std::min(x + count, width), value);
+        x += count;
+      }
+      else
+        for(size_t k=0; k<count; ++k) put(k & 1 ? value & 0x0f : value >> 4);
+      continue;
+    }
+
+    switch(value)
     {
-      if(fread(&data[i*n_bytes_per_row], 1, n_bytes_per_row, input_file) != n_bytes_per_row)
-        throw std::runtime_error("bmp: error while reading raster data");
+      case 0: // end of line
+        ++line;
+        x = 0;
+        select_row();
+        break;
+      case 1: // end of bitmap
+        return;
+      case 2: // delta: moves right and up (to the following lines of the file)
+        x += stream.next();
+        line += stream.next();
+        select_row();
+        break;
+      default: // absolute mode: value pixels, padded to 16 bits
+        if(!rle4)
+        {
+          for(size_t k=0; k<value; ++k) put(stream.next());
+          if(value & 1) stream.next();
+        }
+        else
+        {
+          uint8_t byte = 0;
+          for(size_t k=0; k<value; ++k)
+          {
+            if(!(k & 1)) byte = stream.next();
+            put(k & 1 ? byte & 0x0f : byte >> 4);
+          }
+          if(((value + 1) / 2) & 1) stream.next();
+        }
     }
+  }
+}
+
+// The rows of a region of the raster: row i starts at first + i*stride
+typedef struct
+{
+  const uint8_t *first;
+  ptrdiff_t stride;
+} bmp_rows_t;
+
+// Locates the rows y0 to y0+rows-1 (counted from the top of the image) of the
+// raster that starts at the given offset of the file. Uncompressed rows are
+// referenced in the mapping, compressed rows are decoded into the buffer.
+static bmp_rows_t
+bmp_read_raster(const bmp_memory_t& memory, size_t offset, const bmp_dib_header_t *dib_hdr, size_t n_bytes_per_row,
+  std::vector<uint8_t>& buffer, size_t y0, size_t rows)
+{
+  if(offset > memory.size || n_bytes_per_row == 0)
+    throw std::runtime_error("bmp: error while reading raster data");
+
+  bmp_rows_t region;
+  if(dib_hdr->compression == BI_RLE8 || dib_hdr->compression == BI_RLE4)
+  {
+    buffer.resize(n_bytes_per_row*rows);
+    bmp_read_rle_raster(memory.data + offset, memory.data + memory.size, dib_hdr, n_bytes_per_row, buffer.data(), y0, rows);
+    region.first = buffer.data();
+    region.stride = n_bytes_per_row;
+    return region;
+  }
+
+  // bottom-up images store the last row of the region first
+  const size_t stored = (dib_hdr->bottom_up ? dib_hdr->height - y0 - rows : y0);
+  if((memory.size - offset) / n_bytes_per_row < stored + rows)
+    throw std::runtime_error("bmp: error while reading raster data");
+  const uint8_t *raster = memory.data + offset + stored*n_bytes_per_row;
+  if(dib_hdr->bottom_up)
+  {
+    region.first = raster + (rows > 0 ? rows-1 : 0)*n_bytes_per_row;
+    region.stride = -(ptrdiff_t)n_bytes_per_row;
+  }
+  else
+  {
+    region.first = raster;
+    region.stride = n_bytes_per_row;
+  }
+  return region;
 }
 
 static boost::shared_ptr<std::FILE> make_cfile(const char *filename, const char *flags)
@@ -600,314 +855,614 @@ static boost::shared_ptr<std::FILE> make_cfile(const char *filename, const char
   return boost::shared_ptr<std::FILE>(fp, std::fclose);
 }
 
+/**
+ * ROW CONVERSION
+ */
+// The planes of a color map, with black for the indices after its end
+struct bmp_palette_t
+{
+  uint8_t r[256];
+  uint8_t g[256];
+  uint8_t b[256];
+};
+
+static void bmp_make_palette(const pixel_t *color_map, size_t cmap_size, bmp_palette_t *palette)
+{
+  std::memset(palette, 0, sizeof(bmp_palette_t));
+  for(size_t i=0; i<cmap_size && i<256; ++i)
+  {
+    palette->r[i] = color_map[i].r;
+    palette->g[i] = color_map[i].g;
+    palette->b[i] = color_map[i].b;
+  }
+}
+
+#ifdef BMP_SSSE3
+// Interleaved BGR pixels (24 bits) to planes, 16 pixels at a time; returns the
+// number of converted pixels
+BMP_SSSE3_TARGET static size_t bmp_convert_bgr_ssse3(const uint8_t *in, size_t width, uint8_t *r, uint8_t *g, uint8_t *b)
+{
+  size_t j = 0;
+  // 16 pixels from 48 bytes: each plane gathers its bytes from the three registers
+  const __m128i b0 = _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+  const __m128i b1 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1);
+  const __m128i b2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13);
+  const __m128i g0 = _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+  const __m128i g1 = _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1);
+  const __m128i g2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14);
+  const __m128i r0 = _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+  const __m128i r1 = _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1);
+  const __m128i r2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15);
+  for(; j + 16 <= width; j += 16)
+  {
+    const __m128i v0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 3*j));
+    const __m128i v1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 3*j + 16));
+    const __m128i v2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 3*j + 32));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(b + j), _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v0, b0), _mm_shuffle_epi8(v1, b1)), _mm_shuffle_epi8(v2, b2)));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(g + j), _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v0, g0), _mm_shuffle_epi8(v1, g1)), _mm_shuffle_epi8(v2, g2)));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(r + j), _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v0, r0), _mm_shuffle_epi8(v1, r1)), _mm_shuffle_epi8(v2, r2)));
+  }
+  return j;
+}
+#endif
+
+// Interleaved BGR pixels (24 bits) to planes
+static void bmp_convert_bgr(const uint8_t *in, size_t width, uint8_t *r, uint8_t *g, uint8_t *b)
+{
+  size_t j = 0;
+#ifdef BMP_SSSE3
+  if(bmp_has_ssse3()) j = bmp_convert_bgr_ssse3(in, width, r, g, b);
+#endif
+  for(; j < width; ++j)
+  {
+    b[j] = in[3*j];
+    g[j] = in[3*j+1];
+    r[j] = in[3*j+2];
+  }
+}
+
+// Interleaved BGRX pixels (32 bits) to planes
+static void bmp_convert_bgrx(const uint8_t *in, size_t width, uint8_t *r, uint8_t *g, uint8_t *b)
+{
+  size_t j = 0;
+#ifdef __SSE2__
+  // 16 pixels from 64 bytes: the bytes of each plane are masked and packed
+  const __m128i low = _mm_set1_epi32(0xff);
+  for(; j + 16 <= width; j += 16)
+  {
+    __m128i v[4], planes[3][4];
+    for(int k=0; k<4; ++k)
+    {
+      v[k] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 4*j + 16*k));
+      planes[0][k] = _mm_and_si128(v[k], low);
+      planes[1][k] = _mm_and_si128(_mm_srli_epi32(v[k], 8), low);
+      planes[2][k] = _mm_and_si128(_mm_srli_epi32(v[k], 16), low);
+    }
+    uint8_t *out[3] = {b + j, g + j, r + j};
+    for(int p=0; p<3; ++p)
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(out[p]), _mm_packus_epi16(
+        _mm_packs_epi32(planes[p][0], planes[p][1]), _mm_packs_epi32(planes[p][2], planes[p][3])));
+  }
+#endif
+  for(; j < width; ++j)
+  {
+    b[j] = in[4*j];
+    g[j] = in[4*j+1];
+    r[j] = in[4*j+2];
+  }
+}
+
+/**
+ * The scaled channel values of bit field images, for each value of the
+ * pixel (16 bits) or of the masked channel (24 and 32 bits, up to 16 bits
+ * per channel); other images scale each pixel.
+ */
+struct bmp_bitfield_tables_t
+{
+  size_t bytes; ///< the bytes per pixel
+  bool masked; ///< the tables are indexed by the masked channel instead of the pixel
+  std::vector<uint8_t> r;
+  std::vector<uint8_t> g;
+  std::vector<uint8_t> b;
+};
+
+static inline uint8_t bmp_scale(uint32_t v, uint32_t shift, uint32_t mask)
+{
+  return mask ? (uint64_t)((v >> shift) & mask) * 255 / mask : 0;
+}
+
+static void bmp_make_bitfield_tables(const bmp_bitmask_t& bm, size_t bytes, bmp_bitfield_tables_t *tables)
+{
+  tables->bytes = bytes;
+  tables->masked = (bytes > 2);
+  if(bytes == 2)
+  {
+    tables->r.resize(1 << 16);
+    tables->g.resize(1 << 16);
+    tables->b.resize(1 << 16);
+    for(uint32_t v=0; v<(1 << 16); ++v)
+    {
+      tables->r[v] = bmp_scale(v, bm.r_shift, bm.r_mask);
+      tables->g[v] = bmp_scale(v, bm.g_shift, bm.g_mask);
+      tables->b[v] = bmp_scale(v, bm.b_shift, bm.b_mask);
+    }
+  }
+  else if(bm.r_mask <= 0xffff && bm.g_mask <= 0xffff && bm.b_mask <= 0xffff)
+  {
+    tables->r.resize(bm.r_mask + 1);
+    tables->g.resize(bm.g_mask + 1);
+    tables->b.resize(bm.b_mask + 1);
+    for(uint32_t v=0; v<=bm.r_mask; ++v) tables->r[v] = bmp_scale(v, 0, bm.r_mask);
+    for(uint32_t v=0; v<=bm.g_mask; ++v) tables->g[v] = bmp_scale(v, 0, bm.g_mask);
+    for(uint32_t v=0; v<=bm.b_mask; ++v) tables->b[v] = bmp_scale(v, 0, bm.b_mask);
+  }
+}
+
+// Bit field pixels of 16, 24 or 32 bits to planes
+static void bmp_convert_bitfields(const uint8_t *in, size_t width, const bmp_bitmask_t& bm, const bmp_bitfield_tables_t& tables,
+  uint8_t *r, uint8_t *g, uint8_t *b)
+{
+  if(tables.bytes == 2)
+  {
+    const uint8_t *tr = tables.r.data(), *tg = tables.g.data(), *tb = tables.b.data();
+    for(size_t j=0; j<width; ++j)
+    {
+      const uint16_t v = in[2*j] | in[2*j+1] << 8;
+      r[j] = tr[v];
+      g[j] = tg[v];
+      b[j] = tb[v];
+    }
+    return;
+  }
+
+  const size_t bytes = tables.bytes;
+  for(size_t j=0; j<width; ++j, in += bytes)
+  {
+    const uint32_t v = (bytes == 4 ? (uint32_t)in[3] << 24 : 0) | in[2] << 16 | in[1] << 8 | in[0];
+    if(tables.r.empty())
+    {
+      r[j] = bmp_scale(v, bm.r_shift, bm.r_mask);
+      g[j] = bmp_scale(v, bm.g_shift, bm.g_mask);
+      b[j] = bmp_scale(v, bm.b_shift, bm.b_mask);
+    }
+    else
+    {
+      r[j] = tables.r[(v >> bm.r_shift) & bm.r_mask];
+      g[j] = tables.g[(v >> bm.g_shift) & bm.g_mask];
+      b[j] = tables.b[(v >> bm.b_shift) & bm.b_mask];
+    }
+  }
+}
+
+// For each byte of packed color indices of 1, 2 or 4 bits, the indices in
+// memory order
+static std::vector<uint8_t> bmp_make_unpack_table(size_t depth)
+{
+  const size_t per_byte = 8 / depth;
+  const uint8_t mask = (1 << depth) - 1;
+  std::vector<uint8_t> table(256 * 8, 0);
+  for(size_t v=0; v<256; ++v)
+    for(size_t k=0; k<per_byte; ++k)
+      table[8*v + k] = (v >> (8 - (k+1)*depth)) & mask;
+  return table;
+}
+
+static const std::vector<uint8_t> s_unpack_1 = bmp_make_unpack_table(1);
+static const std::vector<uint8_t> s_unpack_2 = bmp_make_unpack_table(2);
+static const std::vector<uint8_t> s_unpack_4 = bmp_make_unpack_table(4);
+
+// Unpacks the color indices x0 to x0+width-1 of a row of 1, 2, 4 or 8 bits per pixel
+static void bmp_unpack_indices(const uint8_t *row, size_t depth, size_t x0, size_t width, uint8_t *indices)
+{
+  if(depth == 8)
+  {
+    std::memcpy(indices, row + x0, width);
+    return;
+  }
+
+  const std::vector<uint8_t>& table = (depth == 1 ? s_unpack_1 : depth == 2 ? s_unpack_2 : s_unpack_4);
+  const size_t per_byte = 8 / depth;
+  const uint8_t *in = row + x0 / per_byte;
+  size_t skip = x0 % per_byte, j = 0;
+  // the first byte, if the region starts inside of it
+  for(; skip > 0 && skip < per_byte && j < width; ++skip, ++j)
+    indices[j] = table[8 * *in + skip];
+  if(skip > 0) ++in;
+  // whole bytes, copying all 8 table entries so that the copy has a fixed size
+  for(; j + 8 <= width; j += per_byte)
+    std::memcpy(indices + j, &table[8 * *in++], 8);
+  for(size_t k=0; j < width; ++j, ++k)
+  {
+    if(k == per_byte) { k = 0; ++in; }
+    indices[j] = table[8 * *in + k];
+  }
+}
+
+// Color indices to planes
+static void bmp_convert_indices(const uint8_t *indices, size_t width, const bmp_palette_t& palette, uint8_t *r, uint8_t *g, uint8_t *b)
+{
+  for(size_t j=0; j<width; ++j)
+  {
+    const uint8_t index = indices[j];
+    r[j] = palette.r[index];
+    g[j] = palette.g[index];
+    b[j] = palette.b[index];
+  }
+}
+
 /**
  * LOADING
  */
-static void im_peek(const std::string& path, bob::io::base::array::typeinfo& info) {
+static void im_peek(const bmp_memory_t& memory, bob::io::base::array::typeinfo& info) {
   // 1. BMP structures
   bmp_header_t bmp_hdr;
   bmp_dib_header_t bmp_dib_hdr;
 
-  // 2. BMP file opening
-  boost::shared_ptr<std::FILE> in_file = make_cfile(path.c_str(), "rb");
+  // 2. BMP file position; only the headers and the color map are touched
+  bmp_input_t input = bmp_make_input(memory);
 
   // 3. Read headers
-  bmp_read_bmp_header(in_file.get(), &bmp_hdr);
-  bmp_read_dib_header(in_file.get(), &bmp_dib_hdr);
+  bmp_read_bmp_header(&input, &bmp_hdr);
+  bmp_read_dib_header(&input, &bmp_dib_hdr);
 
-  // 4. Read color map
+  // 4. Read color map, which tells gray images; the position after it is only
+  //    validated for untrusted input
   boost::shared_array<pixel_t> cmap(new pixel_t[bmp_dib_hdr.cmap_size]);
-  bmp_read_colormap(in_file.get(), cmap.get(), bmp_dib_hdr.cmap_size, bmp_dib_hdr.header_type);
-
-  if(ftell(in_file.get()) != (long)bmp_hdr.offset)
+  bmp_read_colormap(&input, cmap.get(), bmp_dib_hdr.cmap_size, bmp_dib_hdr.header_type);
+  if(!bob::io::image::get_trusted_input() && input.position != bmp_hdr.offset)
     throw std::runtime_error("bmp: error while parsing bmp header (current file position does not match the offset value indicating where the data is stored)");
 
   // 5.  Set depth and number of dimensions
   info.dtype = bob::io::base::array::t_uint8;
-  info.nd = 3;
-  info.shape[0] = 3;
-  info.shape[1] = bmp_dib_hdr.height;
-  info.shape[2] = bmp_dib_hdr.width;
+  if(bmp_is_gray(&bmp_dib_hdr, cmap.get()))
+  {
+    info.nd = 2;
+    info.shape[0] = bmp_dib_hdr.height;
+    info.shape[1] = bmp_dib_hdr.width;
+  }
+  else
+  {
+    info.nd = 3;
+    info.shape[0] = 3;
+    info.shape[1] = bmp_dib_hdr.height;
+    info.shape[2] = bmp_dib_hdr.width;
+  }
   info.update_strides();
 }
 
-static void im_load(const std::string& filename, bob::io::base::array::interface& b) {
+// Reads the image, or the region of the size of the buffer with the upper left
+// corner at (y0, x0); only the rows of the region are touched. Gray images are
+// read into gray (H x W) or color (3 x H x W) buffers
+static void im_load(const bmp_memory_t& memory, const std::string& filename, bob::io::base::array::interface& b,
+  const size_t y0 = 0, const size_t x0 = 0) {
   // 1. BMP structures
   bmp_header_t bmp_hdr;
   bmp_dib_header_t bmp_dib_hdr;
 
-  // 2. BMP file opening
-  boost::shared_ptr<std::FILE> in_file = make_cfile(filename.c_str(), "rb");
+  // 2. BMP file position
+  bmp_input_t input = bmp_make_input(memory);
 
   // 3. Read headers
-  bmp_read_bmp_header(in_file.get(), &bmp_hdr);
-  bmp_read_dib_header(in_file.get(), &bmp_dib_hdr);
+  bmp_read_bmp_header(&input, &bmp_hdr);
+  bmp_read_dib_header(&input, &bmp_dib_hdr);
 
   // 4. Read color map
   boost::shared_array<pixel_t> cmap(new pixel_t[bmp_dib_hdr.cmap_size]);
-  bmp_read_colormap(in_file.get(), cmap.get(), bmp_dib_hdr.cmap_size, bmp_dib_hdr.header_type);
+  bmp_read_colormap(&input, cmap.get(), bmp_dib_hdr.cmap_size, bmp_dib_hdr.header_type);
 
-  // 5. Read data
+  // 5. Locate (or decode) the rows of the region, which the file needs to
+  //    contain still
+  const bob::io::base::array::typeinfo& info = b.type();
+  const size_t height = info.shape[info.nd-2];
+  const size_t width = info.shape[info.nd-1];
+  if(y0 + height > (size_t)bmp_dib_hdr.height || x0 + width > (size_t)bmp_dib_hdr.width ||
+      (info.nd == 2 && !bmp_is_gray(&bmp_dib_hdr, cmap.get())))
+  {
+    boost::format m("bmp: the image in file `%s' changed since the file was opened");
+    m % filename;
+    throw std::runtime_error(m.str());
+  }
   size_t n_bytes_per_row = bmp_get_nbytes_per_row( &bmp_dib_hdr);
-  boost::shared_array<uint8_t> rasterdata(new uint8_t[n_bytes_per_row*bmp_dib_hdr.height]);
-  bmp_read_raster(in_file.get(), &bmp_dib_hdr, n_bytes_per_row, rasterdata.get());
+  std::vector<uint8_t> rasterdata;
+  const bmp_rows_t rows = bmp_read_raster(memory, bmp_hdr.offset, &bmp_dib_hdr, n_bytes_per_row, rasterdata, y0, height);
 
-  // 6. Convert data using the color map and put it in the RGB buffer
-  const bob::io::base::array::typeinfo& info = b.type();
-  long unsigned int frame_size = info.shape[1] * info.shape[2];
+  // 6. Convert the rows using the color map and put them in the RGB buffer
+  const size_t frame_size = height * width;
   uint8_t *element_r = static_cast<uint8_t*>(b.ptr());
-  uint8_t *element_g = element_r+frame_size;
-  uint8_t *element_b = element_g+frame_size;
+  uint8_t *element_g = element_r + frame_size;
+  uint8_t *element_b = element_g + frame_size;
 
-  if(bmp_dib_hdr.depth == 24)
+  if(bmp_dib_hdr.depth <= 8)
   {
     if(bmp_dib_hdr.has_bitmask)
+      throw std::runtime_error("bmp: usage of bitfields is currently restricted to 16bits depth images.");
+    bmp_palette_t palette;
+    bmp_make_palette(cmap.get(), bmp_dib_hdr.cmap_size, &palette);
+    std::vector<uint8_t> indices(width);
+    if(info.nd == 2)
     {
-      for(size_t i=0; i<bmp_dib_hdr.height; ++i)
+      // the gray levels are the red components of the gray color map
+      for(size_t i=0; i<height; ++i)
       {
-        for(size_t j=0; j<bmp_dib_hdr.width; ++j)
-        {
-          uint32_t v = rasterdata[i*n_bytes_per_row+j*3+2] << 16 | rasterdata[i*n_bytes_per_row+j*3+1] << 8 | rasterdata[i*n_bytes_per_row+j*3];
-          *element_b++ = ((v >> bmp_dib_hdr.bitmask.b_shift) & bmp_dib_hdr.bitmask.b_mask) * 255 / bmp_dib_hdr.bitmask.b_mask;
-          *element_g++ = ((v >> bmp_dib_hdr.bitmask.g_shift) & bmp_dib_hdr.bitmask.g_mask) * 255 / bmp_dib_hdr.bitmask.g_mask;
-          *element_r++ = ((v >> bmp_dib_hdr.bitmask.r_shift) & bmp_dib_hdr.bitmask.r_mask) * 255 / bmp_dib_hdr.bitmask.r_mask;
-        }
+        bmp_unpack_indices(rows.first + i*rows.stride, bmp_dib_hdr.depth, x0, width, indices.data());
+        uint8_t *element = element_r + i*width;
+        for(size_t j=0; j<width; ++j)
+          element[j] = palette.r[indices[j]];
       }
+      return;
     }
-    else
+    for(size_t i=0; i<height; ++i)
     {
-      for(size_t i=0; i<bmp_dib_hdr.height; ++i)
-      {
-        for(size_t j=0; j<bmp_dib_hdr.width; ++j)
-        {
-          *element_b++ = rasterdata[i*n_bytes_per_row+j*3];
-          *element_g++ = rasterdata[i*n_bytes_per_row+j*3+1];
-          *element_r++ = rasterdata[i*n_bytes_per_row+j*3+2];
-        }
-      }
+      bmp_unpack_indices(rows.first + i*rows.stride, bmp_dib_hdr.depth, x0, width, indices.data());
+      bmp_convert_indices(indices.data(), width, palette, element_r + i*width, element_g + i*width, element_b + i*width);
     }
   }
-  else if(bmp_dib_hdr.depth == 16)
+  else if(bmp_dib_hdr.has_bitmask || bmp_dib_hdr.depth == 16)
   {
-    if(bmp_dib_hdr.has_bitmask)
-    {
-      for(size_t i=0; i<bmp_dib_hdr.height; ++i)
-      {
-        for(size_t j=0; j<bmp_dib_hdr.width; ++j)
-        {
-          uint16_t v =  rasterdata[i*n_bytes_per_row+j*2+1] << 8 | rasterdata[i*n_bytes_per_row+j*2];
-          *element_b++ = ((v >> bmp_dib_hdr.bitmask.b_shift) & bmp_dib_hdr.bitmask.b_mask) * 255 / bmp_dib_hdr.bitmask.b_mask;
-          *element_g++ = ((v >> bmp_dib_hdr.bitmask.g_shift) & bmp_dib_hdr.bitmask.g_mask) * 255 / bmp_dib_hdr.bitmask.g_mask;
-          *element_r++ = ((v >> bmp_dib_hdr.bitmask.r_shift) & bmp_dib_hdr.bitmask.r_mask) * 255 / bmp_dib_hdr.bitmask.r_mask;
-        }
-      }
-    }
-    else
-    {
-      // Assumes 555 16 bits image by default
-      for(size_t i=0; i<bmp_dib_hdr.height; ++i)
-      {
-        for(size_t j=0; j<bmp_dib_hdr.width; ++j)
-        {
-          uint16_t v =  rasterdata[i*n_bytes_per_row+j*2+1] << 8 | rasterdata[i*n_bytes_per_row+j*2];
-          *element_b++ = ((v >> 0) & 0x1F) * 255 / 0x1F;
-          *element_g++ = ((v >> 5) & 0x1F) * 255 / 0x1F;
-          *element_r++ = ((v >> 10) & 0x1F) * 255 / 0x1F;
-        }
-      }
-    }
+    // 16 bits images without bit fields store 5 bits per channel
+    bmp_bitmask_t bitmask = bmp_dib_hdr.bitmask;
+    if(!bmp_dib_hdr.has_bitmask)
+      bmp_update_bitmask_structure(0x7c00, 0x03e0, 0x001f, &bitmask);
+    bmp_bitfield_tables_t tables;
+    const size_t bytes = bmp_dib_hdr.depth / 8;
+    bmp_make_bitfield_tables(bitmask, bytes, &tables);
+    for(size_t i=0; i<height; ++i)
+      bmp_convert_bitfields(rows.first + i*rows.stride + x0*bytes, width, bitmask, tables,
+        element_r + i*width, element_g + i*width, element_b + i*width);
   }
-  else if(bmp_dib_hdr.depth == 32)
+  else if(bmp_dib_hdr.depth == 24)
   {
-    if(bmp_dib_hdr.has_bitmask)
-    {
-      for(size_t i=0; i<bmp_dib_hdr.height; ++i)
-      {
-        for(size_t j=0; j<bmp_dib_hdr.width; ++j)
-        {
-          uint32_t v = rasterdata[i*n_bytes_per_row+j*4+2] << 16 | rasterdata[i*n_bytes_per_row+j*4+1] << 8 | rasterdata[i*n_bytes_per_row+j*4];
-          *element_b++ = ((v >> bmp_dib_hdr.bitmask.b_shift) & bmp_dib_hdr.bitmask.b_mask) * 255 / bmp_dib_hdr.bitmask.b_mask;
-          *element_g++ = ((v >> bmp_dib_hdr.bitmask.g_shift) & bmp_dib_hdr.bitmask.g_mask) * 255 / bmp_dib_hdr.bitmask.g_mask;
-          *element_r++ = ((v >> bmp_dib_hdr.bitmask.r_shift) & bmp_dib_hdr.bitmask.r_mask) * 255 / bmp_dib_hdr.bitmask.r_mask;
-        }
-      }
-    }
-    else
-    {
-      for(size_t i=0; i<bmp_dib_hdr.height; ++i)
-      {
-        for(size_t j=0; j<bmp_dib_hdr.width; ++j)
-        {
-          *element_b++ = rasterdata[i*n_bytes_per_row+j*4];
-          *element_g++ = rasterdata[i*n_bytes_per_row+j*4+1];
-          *element_r++ = rasterdata[i*n_bytes_per_row+j*4+2];
-        }
-      }
-    }
+    for(size_t i=0; i<height; ++i)
+      bmp_convert_bgr(rows.first + i*rows.stride + x0*3, width, element_r + i*width, element_g + i*width, element_b + i*width);
   }
-  else if(bmp_dib_hdr.depth == 8)
+  else
   {
-    if(bmp_dib_hdr.has_bitmask)
-      throw std::runtime_error("bmp: usage of bitfields is currently restricted to 16bits depth images.");
-    pixel_t v;
-    for(size_t i=0; i<bmp_dib_hdr.height; ++i)
-    {
-      for(size_t j=0; j<bmp_dib_hdr.width; ++j)
-      {
-        v = cmap[rasterdata[i*n_bytes_per_row+j]];
-        *element_b++ = v.b;
-        *element_g++ = v.g;
-        *element_r++ = v.r;
-      }
-    }
+    for(size_t i=0; i<height; ++i)
+      bmp_convert_bgrx(rows.first + i*rows.stride + x0*4, width, element_r + i*width, element_g + i*width, element_b + i*width);
   }
-  else if(bmp_dib_hdr.depth < 8)
+}
+
+// Reads the color map indices of images with 8 bits or less, without
+// expanding them
+static void im_load_indexed(const bmp_memory_t& memory, const std::string& filename, blitz::Array<uint8_t,2>& indices, blitz::Array<uint8_t,2>& palette) {
+  // 1. BMP structures
+  bmp_header_t bmp_hdr;
+  bmp_dib_header_t bmp_dib_hdr;
+
+  // 2. BMP file position
+  bmp_input_t input = bmp_make_input(memory);
+
+  // 3. Read headers
+  bmp_read_bmp_header(&input, &bmp_hdr);
+  bmp_read_dib_header(&input, &bmp_dib_hdr);
+  if(bmp_dib_hdr.depth > 8 || bmp_dib_hdr.has_bitmask) {
+    boost::format m("bmp: the image in file `%s' does not have a color map");
+    m % filename;
+    throw std::runtime_error(m.str());
+  }
+
+  // 4. Read color map
+  boost::shared_array<pixel_t> cmap(new pixel_t[bmp_dib_hdr.cmap_size]);
+  bmp_read_colormap(&input, cmap.get(), bmp_dib_hdr.cmap_size, bmp_dib_hdr.header_type);
+  palette.resize(bmp_dib_hdr.cmap_size, 3);
+  for(size_t i=0; i<bmp_dib_hdr.cmap_size; ++i)
   {
-    if(bmp_dib_hdr.has_bitmask)
-      throw std::runtime_error("bmp: usage of bitfields is currently restricted to 16bits depth images.");
-    // It's a bit field color index
-    const uint8_t mask = (1 << bmp_dib_hdr.depth) - 1;
-    pixel_t v;
-    for(size_t i=0; i<bmp_dib_hdr.height; ++i)
-    {
-      for(size_t j=0; j<bmp_dib_hdr.width; ++j)
-      {
-        const unsigned int cursor = (j*bmp_dib_hdr.depth)/8;
-        const unsigned int shift = 8 - ((j*bmp_dib_hdr.depth) % 8) - bmp_dib_hdr.depth;
-        const unsigned int index = (rasterdata[i*n_bytes_per_row+cursor] & (mask << shift)) >> shift;
-        v = cmap[index];
-        *element_b++ = v.b;
-        *element_g++ = v.g;
-        *element_r++ = v.r;
-      }
-    }
+    palette(i,0) = cmap[i].r;
+    palette(i,1) = cmap[i].g;
+    palette(i,2) = cmap[i].b;
   }
+
+  // 5. Locate (or decode) the rows
+  size_t n_bytes_per_row = bmp_get_nbytes_per_row( &bmp_dib_hdr);
+  std::vector<uint8_t> rasterdata;
+  const bmp_rows_t rows = bmp_read_raster(memory, bmp_hdr.offset, &bmp_dib_hdr, n_bytes_per_row, rasterdata, 0, bmp_dib_hdr.height);
+
+  // 6. Unpack the indices
+  indices.resize(bmp_dib_hdr.height, bmp_dib_hdr.width);
+  for(size_t i=0; i<bmp_dib_hdr.height; ++i)
+    bmp_unpack_indices(rows.first + i*rows.stride, bmp_dib_hdr.depth, 0, bmp_dib_hdr.width, indices.data() + i*bmp_dib_hdr.width);
 }
 
 /**
  * SAVING
  */
-static void bmp_write_header(FILE * out_file, size_t file_size, size_t offset)
-{
-  // Signature
-  static uint8_t signature[] = {'B', 'M'};
-  if(fwrite(signature, sizeof(uint8_t), 2, out_file) != 2)
-    throw std::runtime_error("bmp: error while writing bmp header (signature)");
-  uint32_t v32;
-  // File size
-  v32 = file_size;
-  if(fwrite(&v32, sizeof(uint32_t), 1, out_file) != 1)
-    throw std::runtime_error("bmp: error while writing bmp header (file size)");
-  uint16_t v16;
-  // Reserved 1 and 2
-  v16 = 0;
-  if(fwrite(&v16, sizeof(uint16_t), 1, out_file) != 1)
-    throw std::runtime_error("bmp: error while writing bmp header (reserved1)");
-  if(fwrite(&v16, sizeof(uint16_t), 1, out_file) != 1)
-    throw std::runtime_error("bmp: error while writing bmp header (reserved2)");
-  // Offset
-  v32 = offset;
-  if(fwrite(&v32, sizeof(uint32_t), 1, out_file) != 1)
-    throw std::runtime_error("bmp: error while writing bmp header (offset)");
-}
-
-static void bmp_write_dib_header(FILE * out_file, size_t height, size_t width)
-{
-  uint32_t v32;
-  // 1. DIB Header size
-  v32 = 40;
-  if(fwrite(&v32, sizeof(uint32_t), 1, out_file) != 1)
-    throw std::runtime_error("bmp: error while writing bmp DIB header (header size)");
-  int32_t s32;
-  // 2. The bitmap width in pixels (signed integer).
-  s32 = width;
-  if(fwrite(&s32, sizeof(int32_t), 1, out_file) != 1)
-    throw std::runtime_error("bmp: error while writing bmp DIB header (width)");
-  // 3. The bitmap height in pixels (signed integer).
-  s32 = height;
-  if(fwrite(&s32, sizeof(int32_t), 1, out_file) != 1)
-    throw std::runtime_error("bmp: error while writing bmp DIB header (height)");
-  uint16_t v16;
-  // 4. The number of color planes being used. Must be set to 1.
-  v16 = 1;
-  if(fwrite(&v16, sizeof(uint16_t), 1, out_file) != 1)
-    throw std::runtime_error("bmp: error while writing bmp DIB header (number of planes)");
-  // 5. The number of bits per pixel, which is the color depth of the image.
-  //    Typical values are 1, 4, 8, 16, 24 and 32.
-  v16 = 24;
-  if(fwrite(&v16, sizeof(uint16_t), 1, out_file) != 1)
-    throw std::runtime_error("bmp: error while writing bmp DIB header (number of bits per pixel)");
-  // 6. The compression method being used. See the next table for a list of
-  //    possible values.
-  v32 = 0; // No compression
-  if(fwrite(&v32, sizeof(uint32_t), 1, out_file) != 1)
-    throw std::runtime_error("bmp: error while writing bmp DIB header (compression type)");
-  // 7. The image size. This is the size of the raw bitmap data (see below),
-  //    and should not be confused with the file size.
-  v32 = height * width;
-  if(fwrite(&v32, sizeof(uint32_t), 1, out_file) != 1)
-    throw std::runtime_error("bmp: error while writing bmp DIB header (image size)");
-  // 8. The horizontal resolution of the image. (pixel per meter, signed integer)
-  s32 = 3780;
-  if(fwrite(&s32, sizeof(int32_t), 1, out_file) != 1)
-    throw std::runtime_error("bmp: error while writing bmp DIB header (horizontal resolution)");
-  // 9. The vertical resolution of the image. (pixel per meter, signed integer)
-  if(fwrite(&s32, sizeof(int32_t), 1, out_file) != 1)
-    throw std::runtime_error("bmp: error while writing bmp DIB header (vertical resolution)");
-  // 10. The number of colors in the color palette, or 0 to default to 2^n
-  v32 = 0;
-  if(fwrite(&v32, sizeof(uint32_t), 1, out_file) != 1)
-    throw std::runtime_error("bmp: error while writing bmp DIB header (number of colors)");
-  // 11. The number of important colors used, or 0 when every color is
-  //     important; generally ignored.
-  if(fwrite(&v32, sizeof(uint32_t), 1, out_file) != 1)
-    throw std::runtime_error("bmp: error while writing bmp DIB header (number of important colors)");
+static inline void bmp_put16(uint8_t *out, uint16_t v)
+{
+  out[0] = v & 0xff;
+  out[1] = v >> 8;
+}
+
+static inline void bmp_put32(uint8_t *out, uint32_t v)
+{
+  bmp_put16(out, v & 0xffff);
+  bmp_put16(out + 2, v >> 16);
+}
+
+// Writes the file header and the Windows V1 DIB header in a single call; the
+// color map of the given number of colors follows them
+static void bmp_write_headers(FILE * out_file, size_t height, size_t width, size_t depth, size_t colors, bool top_down, size_t image_size)
+{
+  const size_t offset = 54 + 4 * colors;
+  uint8_t header[54];
+  // 1. Signature
+  header[0] = 'B';
+  header[1] = 'M';
+  // 2. File size
+  bmp_put32(header + 2, offset + image_size);
+  // 3. Reserved 1 and 2
+  bmp_put32(header + 6, 0);
+  // 4. Offset of the raster
+  bmp_put32(header + 10, offset);
+  // 5. DIB Header size
+  bmp_put32(header + 14, 40);
+  // 6. The bitmap width and height in pixels (signed integers); a negative
+  //    height stores the rows top-down
+  bmp_put32(header + 18, width);
+  bmp_put32(header + 22, top_down ? -(int32_t)height : (int32_t)height);
+  // 7. The number of color planes being used. Must be set to 1.
+  bmp_put16(header + 26, 1);
+  // 8. The number of bits per pixel, which is the color depth of the image.
+  bmp_put16(header + 28, depth);
+  // 9. The compression method being used: none
+  bmp_put32(header + 30, 0);
+  // 10. The image size. This is the size of the raw bitmap data, and should
+  //     not be confused with the file size.
+  bmp_put32(header + 34, image_size);
+  // 11. The horizontal and vertical resolution of the image (pixel per meter)
+  bmp_put32(header + 38, 3780);
+  bmp_put32(header + 42, 3780);
+  // 12. The number of colors in the color palette, or 0 to default to 2^n,
+  //     and the number of important colors used, or 0 when every color is
+  //     important
+  bmp_put32(header + 46, colors);
+  bmp_put32(header + 50, 0);
+  if(fwrite(header, sizeof(header), 1, out_file) != 1)
+    throw std::runtime_error("bmp: error while writing bmp header");
+}
+
+#ifdef BMP_SSSE3
+// Planes to interleaved BGR pixels (24 bits), 16 pixels at a time; returns the
+// number of converted pixels
+BMP_SSSE3_TARGET static size_t bmp_interleave_bgr_ssse3(const uint8_t *r, const uint8_t *g, const uint8_t *b, size_t width, uint8_t *out)
+{
+  size_t j = 0;
+  // 16 pixels to 48 bytes: each output register gathers its bytes from the three planes
+  const __m128i b0 = _mm_setr_epi8(0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5);
+  const __m128i b1 = _mm_setr_epi8(-1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1);
+  const __m128i b2 = _mm_setr_epi8(-1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1);
+  const __m128i g0 = _mm_setr_epi8(-1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1);
+  const __m128i g1 = _mm_setr_epi8(5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10);
+  const __m128i g2 = _mm_setr_epi8(-1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1);
+  const __m128i r0 = _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1);
+  const __m128i r1 = _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1);
+  const __m128i r2 = _mm_setr_epi8(10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15);
+  for(; j + 16 <= width; j += 16)
+  {
+    const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + j));
+    const __m128i vg = _mm_loadu_si128(reinterpret_cast<const __m128i*>(g + j));
+    const __m128i vr = _mm_loadu_si128(reinterpret_cast<const __m128i*>(r + j));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 3*j), _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(vb, b0), _mm_shuffle_epi8(vg, g0)), _mm_shuffle_epi8(vr, r0)));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 3*j + 16), _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(vb, b1), _mm_shuffle_epi8(vg, g1)), _mm_shuffle_epi8(vr, r1)));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 3*j + 32), _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(vb, b2), _mm_shuffle_epi8(vg, g2)), _mm_shuffle_epi8(vr, r2)));
+  }
+  return j;
+}
+#endif
+
+// Planes to interleaved BGR pixels (24 bits)
+static void bmp_interleave_bgr(const uint8_t *r, const uint8_t *g, const uint8_t *b, size_t width, uint8_t *out)
+{
+  size_t j = 0;
+#ifdef BMP_SSSE3
+  if(bmp_has_ssse3()) j = bmp_interleave_bgr_ssse3(r, g, b, width, out);
+#endif
+  for(; j < width; ++j)
+  {
+    out[3*j] = b[j];
+    out[3*j+1] = g[j];
+    out[3*j+2] = r[j];
+  }
 }
 
-// Save images in Windows V1 format with a 24 bits depth (without color map)
-static void im_save_color(const bob::io::base::array::interface& b, FILE * out_file)
+// Planes to interleaved BGRA pixels (32 bits) with an opaque alpha channel
+static void bmp_interleave_bgra(const uint8_t *r, const uint8_t *g, const uint8_t *b, size_t width, uint8_t *out)
+{
+  size_t j = 0;
+#ifdef __SSE2__
+  const __m128i alpha = _mm_set1_epi8(-1);
+  for(; j + 16 <= width; j += 16)
+  {
+    const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + j));
+    const __m128i vg = _mm_loadu_si128(reinterpret_cast<const __m128i*>(g + j));
+    const __m128i vr = _mm_loadu_si128(reinterpret_cast<const __m128i*>(r + j));
+    const __m128i bg_low = _mm_unpacklo_epi8(vb, vg), bg_high = _mm_unpackhi_epi8(vb, vg);
+    const __m128i ra_low = _mm_unpacklo_epi8(vr, alpha), ra_high = _mm_unpackhi_epi8(vr, alpha);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 4*j), _mm_unpacklo_epi16(bg_low, ra_low));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 4*j + 16), _mm_unpackhi_epi16(bg_low, ra_low));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 4*j + 32), _mm_unpacklo_epi16(bg_high, ra_high));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 4*j + 48), _mm_unpackhi_epi16(bg_high, ra_high));
+  }
+#endif
+  for(; j < width; ++j)
+  {
+    out[4*j] = b[j];
+    out[4*j+1] = g[j];
+    out[4*j+2] = r[j];
+    out[4*j+3] = 0xff;
+  }
+}
+
+// Save images in Windows V1 format with a 24 or 32 bits depth (without color map)
+static void im_save_color(const bob::io::base::array::interface& b, FILE * out_file, const bob::io::image::BMPWriteOptions& options)
 {
   const bob::io::base::array::typeinfo& info = b.type();
 
-  size_t height = info.shape[1];
-  size_t width = info.shape[2];
-  size_t frame_size = height * width;
+  const size_t height = info.shape[1];
+  const size_t width = info.shape[2];
+  const size_t frame_size = height * width;
+  const size_t depth = options.alpha ? 32 : 24;
   // The number of bytes per row in a bitmap file should be aligned to 4 bytes
-  size_t bytes_per_row = 3 * width;
-  size_t offset_per_row = (bytes_per_row % 4 ? 4 - (bytes_per_row % 4) : 0);
-  bytes_per_row += offset_per_row;
-  size_t image_size = height * bytes_per_row; // size without header
+  const size_t bytes_per_row = (width * depth / 8 + 3) / 4 * 4;
+  const size_t image_size = height * bytes_per_row; // size without header
 
   const uint8_t *element_r = static_cast<const uint8_t*>(b.ptr());
   const uint8_t *element_g = element_r + frame_size;
   const uint8_t *element_b = element_g + frame_size;
 
   // Write headers
-  size_t file_size = image_size + 54;
-  bmp_write_header(out_file, file_size, 54);
-  bmp_write_dib_header(out_file, height, width);
+  bmp_write_headers(out_file, height, width, depth, 0, options.top_down, image_size);
 
-  // Write data
-  uint8_t zero = 0;
+  // Write data, one padded row at a time; the padding stays zero
+  std::vector<uint8_t> row(bytes_per_row, 0);
   for(size_t i=0; i<height; ++i)
   {
-    for(size_t j=0; j<width; ++j)
-    {
-      if(fwrite(&element_b[(height-1-i)*width+j], sizeof(uint8_t), 1, out_file) != 1)
-        throw std::runtime_error("bmp: error while writing bmp raster data");
-      if(fwrite(&element_g[(height-1-i)*width+j], sizeof(uint8_t), 1, out_file) != 1)
-        throw std::runtime_error("bmp: error while writing bmp raster data");
-      if(fwrite(&element_r[(height-1-i)*width+j], sizeof(uint8_t), 1, out_file) != 1)
-        throw std::runtime_error("bmp: error while writing bmp raster data");
-    }
-    for(size_t j=0; j<offset_per_row; ++j)
-      if(fwrite(&zero, sizeof(uint8_t), 1, out_file) != 1)
-        throw std::runtime_error("bmp: error while writing bmp raster data");
+    const size_t offset = (options.top_down ? i : height-1-i) * width;
+    if(options.alpha)
+      bmp_interleave_bgra(element_r + offset, element_g + offset, element_b + offset, width, row.data());
+    else
+      bmp_interleave_bgr(element_r + offset, element_g + offset, element_b + offset, width, row.data());
+    if(fwrite(row.data(), 1, bytes_per_row, out_file) != bytes_per_row)
+      throw std::runtime_error("bmp: error while writing bmp raster data");
+  }
+}
+
+// Save gray images in Windows V1 format with 8 bits per pixel and a gray
+// color map, in which each gray level is its own color index
+static void im_save_gray(const bob::io::base::array::interface& b, FILE * out_file, const bob::io::image::BMPWriteOptions& options)
+{
+  const bob::io::base::array::typeinfo& info = b.type();
+
+  const size_t height = info.shape[0];
+  const size_t width = info.shape[1];
+  // The number of bytes per row in a bitmap file should be aligned to 4 bytes
+  const size_t bytes_per_row = (width + 3) / 4 * 4;
+  const size_t image_size = height * bytes_per_row; // size without header
+
+  const uint8_t *element = static_cast<const uint8_t*>(b.ptr());
 
+  // Write headers and color map
+  bmp_write_headers(out_file, height, width, 8, 256, options.top_down, image_size);
+  uint8_t color_map[4*256];
+  for(size_t i=0; i<256; ++i)
+  {
+    color_map[4*i] = color_map[4*i+1] = color_map[4*i+2] = i;
+    color_map[4*i+3] = 0;
+  }
+  if(fwrite(color_map, sizeof(color_map), 1, out_file) != 1)
+    throw std::runtime_error("bmp: error while writing bmp color map");
+
+  // Write data, one padded row at a time; the padding stays zero
+  std::vector<uint8_t> row(bytes_per_row, 0);
+  for(size_t i=0; i<height; ++i)
+  {
+    const size_t offset = (options.top_down ? i : height-1-i) * width;
+    std::copy(element + offset, element + offset + width, row.begin());
+    if(fwrite(row.data(), 1, bytes_per_row, out_file) != bytes_per_row)
+      throw std::runtime_error("bmp: error while writing bmp raster data");
   }
 }
 
-static void im_save(const std::string& filename, const bob::io::base::array::interface& array) {
+static void im_save(const std::string& filename, const bob::io::base::array::interface& array, const bob::io::image::BMPWriteOptions& options) {
   const bob::io::base::array::typeinfo& info = array.type();
 
   // 1. BMP file opening
@@ -915,9 +1470,12 @@ static void im_save(const std::string& filename, const bob::io::base::array::int
 
   // 2. Write image
   if(info.dtype == bob::io::base::array::t_uint8) {
-    if(info.nd == 3) {
+    if(info.nd == 2) {
+      im_save_gray(array, out_file.get(), options);
+    }
+    else if(info.nd == 3) {
       if(info.shape[0] != 3) throw std::runtime_error("color image does not have 3 planes on 1st. dimension");
-      im_save_color(array, out_file.get());
+      im_save_color(array, out_file.get(), options);
     }
     else {
       boost::format m("the image in file `%s' has a number of dimensions for which this bmp codec has no support for");
@@ -947,7 +1505,7 @@ bob::io::image::BMPFile::BMPFile(const char* path, char mode)
   }
 
   if (mode == 'r' || (mode == 'a' && boost::filesystem::exists(path))) {
-    im_peek(path, m_type);
+    im_peek(*bmp_map_file(path), m_type);
     m_length = 1;
     m_newfile = false;
   } else {
@@ -960,18 +1518,35 @@ void bob::io::image::BMPFile::read(bob::io::base::array::interface& buffer, size
   if (m_newfile)
     throw std::runtime_error("uninitialized image file cannot be read");
 
-  if (!buffer.type().is_compatible(m_type)) buffer.set(m_type);
+  // gray images can be read as color images
+  if (!buffer.type().is_compatible(m_type) && !(m_type.nd == 2 && bob::io::image::is_color_of(buffer.type(), m_type))) buffer.set(m_type);
 
   if (index != 0)
     throw std::runtime_error("cannot read image with index > 0 -- there is only one image in an image file");
 
-  if(!buffer.type().is_compatible(m_type)) buffer.set(m_type);
-  im_load(m_filename, buffer);
+  im_load(*bmp_map_file(m_filename), m_filename, buffer);
+}
+
+void bob::io::image::BMPFile::read_region(bob::io::base::array::interface& buffer, size_t y, size_t x, size_t h, size_t w) {
+  if (m_newfile)
+    throw std::runtime_error("uninitialized image file cannot be read");
+
+  const bob::io::base::array::typeinfo region = bob::io::image::region_type(m_type, y, x, h, w, m_filename);
+  if (!buffer.type().is_compatible(region) && !(region.nd == 2 && bob::io::image::is_color_of(buffer.type(), region))) buffer.set(region);
+
+  im_load(*bmp_map_file(m_filename), m_filename, buffer, y, x);
+}
+
+void bob::io::image::BMPFile::read_indexed(blitz::Array<uint8_t,2>& indices, blitz::Array<uint8_t,2>& palette) {
+  if (m_newfile)
+    throw std::runtime_error("uninitialized image file cannot be read");
+
+  im_load_indexed(*bmp_map_file(m_filename), m_filename, indices, palette);
 }
 
 size_t bob::io::image::BMPFile::append(const bob::io::base::array::interface& buffer) {
   if (m_newfile) {
-    im_save(m_filename, buffer);
+    im_save(m_filename, buffer, m_options);
     m_type = buffer.type();
     m_newfile = false;
     m_length = 1;
@@ -991,7 +1566,9 @@ void bob::io::image::BMPFile::write(const bob::io::base::array::interface& buffe
   throw std::runtime_error("image files only accept a single array");
 }
 
-
+void bob::io::image::BMPFile::set_write_options(const BMPWriteOptions& options) {
+  m_options = options;
+}
 
 std::string bob::io::image::BMPFile::s_codecname = "bob.image_bmp";
 
@@ -19,274 +19,24 @@
 #include <boost/format.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/algorithm/string.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <exception>
+#include <functional>
+#include <future>
+#include <limits>
 #include <string>
+#include <thread>
+#include <vector>
 
+#include <bob.core/logging.h>
 #include <bob.io.image/gif.h>
+#include <bob.io.image/image.h>
 
 extern "C" {
 #include <gif_lib.h>
-
-#if GIFLIB_MAJOR > 5 || GIFLIB_MAJOR == 5 && GIFLIB_MINOR >= 2 || GIFLIB_MAJOR == 5 && GIFLIB_MINOR == 1 && GIFLIB_RELEASE >= 9
-//see https://sourceforge.net/p/giflib/bugs/132/
-//and https://sourceforge.net/p/giflib/bugs/142/
-#include <quantize.h>
-#endif
-
 }
 
-// QuantizeBuffer function definition that was inlined (only) in giflib 4.2
-#if defined(GIFLIB_MAJOR) && GIFLIB_MAJOR < 5
-
-#define ABS(x)    ((x) > 0 ? (x) : (-(x)))
-#define COLOR_ARRAY_SIZE 32768
-#define BITS_PER_PRIM_COLOR 5
-#define MAX_PRIM_COLOR 0x1f
-
-static int SortRGBAxis;
-
-typedef struct QuantizedColorType {
-  GifByteType RGB[3];
-  GifByteType NewColorIndex;
-  long Count;
-  struct QuantizedColorType *Pnext;
-} QuantizedColorType;
-
-typedef struct NewColorMapType {
-  GifByteType RGBMin[3], RGBWidth[3];
-  unsigned int NumEntries; /* # of QuantizedColorType in linked list below */
-  unsigned long Count; /* Total number of pixels in all the entries */
-  QuantizedColorType *QuantizedColors;
-} NewColorMapType;
-
-// Routine called by qsort to compare two entries.
-static int
-SortCmpRtn(const void *Entry1, const void *Entry2)
-{
-  return (*((QuantizedColorType **) Entry1))->RGB[SortRGBAxis] -
-    (*((QuantizedColorType **) Entry2))->RGB[SortRGBAxis];
-}
-
-// Routine to subdivide the RGB space recursively using median cut in each
-// axes alternatingly until ColorMapSize different cubes exists.
-// The biggest cube in one dimension is subdivide unless it has only one entry.
-// Returns GIF_ERROR if failed, otherwise GIF_OK.
-static int
-SubdivColorMap(NewColorMapType * NewColorSubdiv,
-    unsigned int ColorMapSize,
-    unsigned int *NewColorMapSize) {
-  int MaxSize;
-  unsigned int i, j, Index = 0, NumEntries, MinColor, MaxColor;
-  long Sum, Count;
-  QuantizedColorType *QuantizedColor, **SortArray;
-  while (ColorMapSize > *NewColorMapSize) {
-    // Find candidate for subdivision:
-    MaxSize = -1;
-    for (i = 0; i < *NewColorMapSize; i++) {
-      for (j = 0; j < 3; j++) {
-        if ((((int)NewColorSubdiv[i].RGBWidth[j]) > MaxSize) &&
-            (NewColorSubdiv[i].NumEntries > 1)) {
-          MaxSize = NewColorSubdiv[i].RGBWidth[j];
-          Index = i;
-          SortRGBAxis = j;
-        }
-      }
-    }
-    if (MaxSize == -1)
-      return GIF_OK;
-    // Split the entry Index into two along the axis SortRGBAxis:
-    // Sort all elements in that entry along the given axis and split at
-    // the median.
-    SortArray = (QuantizedColorType **)malloc(
-        sizeof(QuantizedColorType *) *
-        NewColorSubdiv[Index].NumEntries);
-    if (SortArray == NULL)
-      return GIF_ERROR;
-    for (j = 0, QuantizedColor = NewColorSubdiv[Index].QuantizedColors;
-        j < NewColorSubdiv[Index].NumEntries && QuantizedColor != NULL;
-        j++, QuantizedColor = QuantizedColor->Pnext)
-      SortArray[j] = QuantizedColor;
-    qsort(SortArray, NewColorSubdiv[Index].NumEntries,
-        sizeof(QuantizedColorType *), SortCmpRtn);
-    // Relink the sorted list into one:
-    for (j = 0; j < NewColorSubdiv[Index].NumEntries - 1; j++)
-      SortArray[j]->Pnext = SortArray[j + 1];
-    SortArray[NewColorSubdiv[Index].NumEntries - 1]->Pnext = NULL;
-    NewColorSubdiv[Index].QuantizedColors = QuantizedColor = SortArray[0];
-    free((char *)SortArray);
-    // Now simply add the Counts until we have half of the Count:
-    Sum = NewColorSubdiv[Index].Count / 2 - QuantizedColor->Count;
-    NumEntries = 1;
-    Count = QuantizedColor->Count;
-    while (QuantizedColor->Pnext != NULL &&
-        (Sum -= QuantizedColor->Pnext->Count) >= 0 &&
-        QuantizedColor->Pnext->Pnext != NULL) {
-      QuantizedColor = QuantizedColor->Pnext;
-      NumEntries++;
-      Count += QuantizedColor->Count;
-    }
-    // Save the values of the last color of the first half, and first
-    // of the second half so we can update the Bounding Boxes later.
-    // Also as the colors are quantized and the BBoxes are full 0..255,
-    // they need to be rescaled.
-    MaxColor = QuantizedColor->RGB[SortRGBAxis]; // Max. of first half
-    // coverity[var_deref_op]
-    MinColor = QuantizedColor->Pnext->RGB[SortRGBAxis]; // of second
-    MaxColor <<= (8 - BITS_PER_PRIM_COLOR);
-    MinColor <<= (8 - BITS_PER_PRIM_COLOR);
-    // Partition right here:
-    NewColorSubdiv[*NewColorMapSize].QuantizedColors =
-      QuantizedColor->Pnext;
-    QuantizedColor->Pnext = NULL;
-    NewColorSubdiv[*NewColorMapSize].Count = Count;
-    NewColorSubdiv[Index].Count -= Count;
-    NewColorSubdiv[*NewColorMapSize].NumEntries =
-      NewColorSubdiv[Index].NumEntries - NumEntries;
-    NewColorSubdiv[Index].NumEntries = NumEntries;
-    for (j = 0; j < 3; j++) {
-      NewColorSubdiv[*NewColorMapSize].RGBMin[j] =
-        NewColorSubdiv[Index].RGBMin[j];
-      NewColorSubdiv[*NewColorMapSize].RGBWidth[j] =
-        NewColorSubdiv[Index].RGBWidth[j];
-    }
-    NewColorSubdiv[*NewColorMapSize].RGBWidth[SortRGBAxis] =
-      NewColorSubdiv[*NewColorMapSize].RGBMin[SortRGBAxis] +
-      NewColorSubdiv[*NewColorMapSize].RGBWidth[SortRGBAxis] - MinColor;
-    NewColorSubdiv[*NewColorMapSize].RGBMin[SortRGBAxis] = MinColor;
-    NewColorSubdiv[Index].RGBWidth[SortRGBAxis] =
-      MaxColor - NewColorSubdiv[Index].RGBMin[SortRGBAxis];
-    (*NewColorMapSize)++;
-  }
-  return GIF_OK;
-}
-
-// Quantize high resolution image into lower one. Input image consists of a
-// 2D array for each of the RGB colors with size Width by Height. There is no
-// Color map for the input. Output is a quantized image with 2D array of
-// indexes into the output color map.
-// Note input image can be 24 bits at the most (8 for red/green/blue) and
-// the output has 256 colors at the most (256 entries in the color map.).
-// ColorMapSize specifies size of color map up to 256 and will be updated to
-// real size before returning.
-// Also non of the parameter are allocated by this routine.
-// This function returns GIF_OK if succesfull, GIF_ERROR otherwise.
-static int
-QuantizeBuffer(unsigned int Width, unsigned int Height, int *ColorMapSize,
-  GifByteType * RedInput, GifByteType * GreenInput, GifByteType * BlueInput,
-  GifByteType * OutputBuffer, GifColorType * OutputColorMap)
-{
-  unsigned int Index, NumOfEntries;
-  int i, j, MaxRGBError[3];
-  unsigned int NewColorMapSize;
-  long Red, Green, Blue;
-  NewColorMapType NewColorSubdiv[256];
-  QuantizedColorType *ColorArrayEntries, *QuantizedColor;
-  ColorArrayEntries = (QuantizedColorType *)malloc(
-      sizeof(QuantizedColorType) * COLOR_ARRAY_SIZE);
-  if (ColorArrayEntries == NULL) {
-    return GIF_ERROR;
-  }
-  for (i = 0; i < COLOR_ARRAY_SIZE; i++) {
-    ColorArrayEntries[i].RGB[0] = i >> (2 * BITS_PER_PRIM_COLOR);
-    ColorArrayEntries[i].RGB[1] = (i >> BITS_PER_PRIM_COLOR) &
-      MAX_PRIM_COLOR;
-    ColorArrayEntries[i].RGB[2] = i & MAX_PRIM_COLOR;
-    ColorArrayEntries[i].Count = 0;
-  }
-  // Sample the colors and their distribution:
-  for (i = 0; i < (int)(Width * Height); i++) {
-    Index = ((RedInput[i] >> (8 - BITS_PER_PRIM_COLOR)) <<
-        (2 * BITS_PER_PRIM_COLOR)) +
-      ((GreenInput[i] >> (8 - BITS_PER_PRIM_COLOR)) <<
-       BITS_PER_PRIM_COLOR) +
-      (BlueInput[i] >> (8 - BITS_PER_PRIM_COLOR));
-    ColorArrayEntries[Index].Count++;
-  }
-  // Put all the colors in the first entry of the color map, and call the
-  // recursive subdivision process.
-  for (i = 0; i < 256; i++) {
-    NewColorSubdiv[i].QuantizedColors = NULL;
-    NewColorSubdiv[i].Count = NewColorSubdiv[i].NumEntries = 0;
-    for (j = 0; j < 3; j++) {
-      NewColorSubdiv[i].RGBMin[j] = 0;
-      NewColorSubdiv[i].RGBWidth[j] = 255;
-    }
-  }
-  // Find the non empty entries in the color table and chain them:
-  for (i = 0; i < COLOR_ARRAY_SIZE; i++)
-    if (ColorArrayEntries[i].Count > 0)
-      break;
-  QuantizedColor = NewColorSubdiv[0].QuantizedColors = &ColorArrayEntries[i];
-  NumOfEntries = 1;
-  while (++i < COLOR_ARRAY_SIZE)
-    if (ColorArrayEntries[i].Count > 0) {
-      QuantizedColor->Pnext = &ColorArrayEntries[i];
-      QuantizedColor = &ColorArrayEntries[i];
-      NumOfEntries++;
-    }
-  QuantizedColor->Pnext = NULL;
-  NewColorSubdiv[0].NumEntries = NumOfEntries; // Different sampled colors
-  NewColorSubdiv[0].Count = ((long)Width) * Height; // Pixels
-  NewColorMapSize = 1;
-  if (SubdivColorMap(NewColorSubdiv, *ColorMapSize, &NewColorMapSize) !=
-      GIF_OK) {
-    free((char *)ColorArrayEntries);
-    return GIF_ERROR;
-  }
-  if (NewColorMapSize < *ColorMapSize) {
-    // And clear rest of color map:
-    for (i = NewColorMapSize; i < *ColorMapSize; i++)
-      OutputColorMap[i].Red = OutputColorMap[i].Green =
-        OutputColorMap[i].Blue = 0;
-  }
-  // Average the colors in each entry to be the color to be used in the
-  // output color map, and plug it into the output color map itself.
-  for (i = 0; i < NewColorMapSize; i++) {
-    if ((j = NewColorSubdiv[i].NumEntries) > 0) {
-      QuantizedColor = NewColorSubdiv[i].QuantizedColors;
-      Red = Green = Blue = 0;
-      while (QuantizedColor) {
-        QuantizedColor->NewColorIndex = i;
-        Red += QuantizedColor->RGB[0];
-        Green += QuantizedColor->RGB[1];
-        Blue += QuantizedColor->RGB[2];
-        QuantizedColor = QuantizedColor->Pnext;
-      }
-      OutputColorMap[i].Red = (Red << (8 - BITS_PER_PRIM_COLOR)) / j;
-      OutputColorMap[i].Green = (Green << (8 - BITS_PER_PRIM_COLOR)) / j;
-      OutputColorMap[i].Blue = (Blue << (8 - BITS_PER_PRIM_COLOR)) / j;
-    } else
-      fprintf(stderr,
-          "\n: Null entry in quantized color map - that's weird.\n");
-  }
-  // Finally scan the input buffer again and put the mapped index in the
-  // output buffer.
-  MaxRGBError[0] = MaxRGBError[1] = MaxRGBError[2] = 0;
-  for (i = 0; i < (int)(Width * Height); i++) {
-    Index = ((RedInput[i] >> (8 - BITS_PER_PRIM_COLOR)) <<
-        (2 * BITS_PER_PRIM_COLOR)) +
-      ((GreenInput[i] >> (8 - BITS_PER_PRIM_COLOR)) <<
-       BITS_PER_PRIM_COLOR) +
-      (BlueInput[i] >> (8 - BITS_PER_PRIM_COLOR));
-    Index = ColorArrayEntries[Index].NewColorIndex;
-    OutputBuffer[i] = Index;
-    if (MaxRGBError[0] < ABS(OutputColorMap[Index].Red - RedInput[i]))
-      MaxRGBError[0] = ABS(OutputColorMap[Index].Red - RedInput[i]);
-    if (MaxRGBError[1] < ABS(OutputColorMap[Index].Green - GreenInput[i]))
-      MaxRGBError[1] = ABS(OutputColorMap[Index].Green - GreenInput[i]);
-    if (MaxRGBError[2] < ABS(OutputColorMap[Index].Blue - BlueInput[i]))
-      MaxRGBError[2] = ABS(OutputColorMap[Index].Blue - BlueInput[i]);
-  }
-  free((char *)ColorArrayEntries);
-  *ColorMapSize = NewColorMapSize;
-  return GIF_OK;
-}
-
-#undef ABS
-#undef COLOR_ARRAY_SIZE
-#undef BITS_PER_PRIM_COLOR
-#undef MAX_PRIM_COLOR
-#endif // End of ugly QuantizeBuffer definition for giflib 4.2
-
 static void GifErrorHandler(const char* fname, int error) {
 #if defined(GIF_LIB_VERSION) || (GIFLIB_MAJOR < 5)
   const char* error_string = "unknown error (giflib < 5)";
@@ -319,10 +69,28 @@ static int DGifDeleter (GifFileType* ptr) {
 #endif
 }
 
-static boost::shared_ptr<GifFileType> make_dfile(const char *filename)
+static boost::shared_ptr<std::FILE> make_cfile(const char *filename, const char *flags)
+{
+  std::FILE* fp = std::fopen(filename, flags);
+  if(fp == 0) {
+    boost::format m("could not open file `%s'");
+    m % filename;
+    throw std::runtime_error(m.str());
+  }
+  return boost::shared_ptr<std::FILE>(fp, std::fclose);
+}
+
+// Reads the GIF data from the C file in UserData, so that the decoder can be
+// positioned at any indexed frame by seeking in that file
+static int read_cfile(GifFileType* gif, GifByteType* bytes, int size)
+{
+  return std::fread(bytes, 1, size, static_cast<std::FILE*>(gif->UserData));
+}
+
+static boost::shared_ptr<GifFileType> make_dfile(boost::shared_ptr<std::FILE> file, const char *filename)
 {
 #if defined(GIF_LIB_VERSION) || (GIFLIB_MAJOR < 5)
-  GifFileType* fp = DGifOpenFileName(filename);
+  GifFileType* fp = DGifOpen(file.get(), read_cfile);
   if (!fp) {
     boost::format m("cannot open file `%s'");
     m % filename;
@@ -330,10 +98,16 @@ static boost::shared_ptr<GifFileType> make_dfile(const char *filename)
   }
 #else
   int error = GIF_OK;
-  GifFileType* fp = DGifOpenFileName(filename, &error);
-  if (!fp) GifErrorHandler("DGifOpenFileName", error);
+  GifFileType* fp = DGifOpen(file.get(), read_cfile, &error);
+  if (!fp) {
+    const char* error_string = GifErrorString(error);
+    boost::format m("cannot open file `%s': %s");
+    m % filename % (error_string ? error_string : "unknown error");
+    throw std::runtime_error(m.str());
+  }
 #endif
-  return boost::shared_ptr<GifFileType>(fp, DGifDeleter);
+  // the decoder keeps the file open as long as it is used
+  return boost::shared_ptr<GifFileType>(fp, [file](GifFileType* ptr) { DGifDeleter(ptr); });
 }
 
 
@@ -376,58 +150,95 @@ static boost::shared_ptr<GifFileType> make_efile(const char *filename)
 /**
  * LOADING
  */
-static void im_peek(const std::string& path, bob::io::base::array::typeinfo& info)
+// The disposal methods of the graphics control extension that change the
+// canvas after the frame was shown
+static const int s_dispose_background = 2;
+static const int s_dispose_previous = 3;
+
+// Returns the first frame that needs to be drawn onto the background to
+// recreate the canvas that the next frame after the given ones is drawn onto
+static size_t im_base(const std::vector<bob::io::image::GIFFrame>& frames, size_t height, size_t width)
+{
+  if (frames.empty()) return 0;
+  const bob::io::image::GIFFrame& last = frames.back();
+  const bool covers = last.top == 0 && last.left == 0 && last.height == height && last.width == width;
+  switch (last.disposal) {
+    case s_dispose_background:
+      return covers ? frames.size() : last.base;
+    case s_dispose_previous:
+      return last.base;
+    default:
+      // an opaque frame that covers the canvas hides all frames before it
+      return covers && last.transparent < 0 ? frames.size() - 1 : last.base;
+  }
+}
+
+// Whether the color map holds only gray colors; no color map is black
+static bool im_is_gray(const ColorMapObject* ColorMap)
+{
+  if (!ColorMap) return true;
+  for (int i = 0; i < ColorMap->ColorCount; ++i) {
+    const GifColorType& color = ColorMap->Colors[i];
+    if (color.Red != color.Green || color.Green != color.Blue) return false;
+  }
+  return true;
+}
+
+// The gray level of the color, with the weights of ITU-R BT.601
+static inline uint8_t im_gray(const GifColorType& color)
+{
+  return (299 * color.Red + 587 * color.Green + 114 * color.Blue + 500) / 1000;
+}
+
+// Files are gray images (H x W) if the global color map and the color map of
+// their first frame are gray, and color images (3 x H x W) otherwise
+static void im_peek(const std::string& path, const bool gray_frames, bob::io::base::array::typeinfo& info)
 {
   // 1. GIF file opening
-  boost::shared_ptr<GifFileType> in_file = make_dfile(path.c_str());
+  boost::shared_ptr<std::FILE> file = make_cfile(path.c_str(), "rb");
+  boost::shared_ptr<GifFileType> in_file = make_dfile(file, path.c_str());
 
   // 2. Set typeinfo variables
   info.dtype = bob::io::base::array::t_uint8;
-  info.nd = 3;
-  info.shape[0] = 3;
-  info.shape[1] = in_file->SHeight;
-  info.shape[2] = in_file->SWidth;
+  if (gray_frames && im_is_gray(in_file->SColorMap)) {
+    info.nd = 2;
+    info.shape[0] = in_file->SHeight;
+    info.shape[1] = in_file->SWidth;
+  }
+  else {
+    info.nd = 3;
+    info.shape[0] = 3;
+    info.shape[1] = in_file->SHeight;
+    info.shape[2] = in_file->SWidth;
+  }
   info.update_strides();
 }
 
-static void im_load_color(boost::shared_ptr<GifFileType> in_file, bob::io::base::array::interface& b)
+/**
+ * Adds the frames of the file after the given offset to the index, until it
+ * holds count frames or the file ends. The LZW data of the frames is skipped
+ * without decoding it. Returns the offset after the last indexed frame, or 0
+ * at the end of the file.
+ */
+static long im_index(const std::string& path, long offset, size_t count, std::vector<bob::io::image::GIFFrame>& frames)
 {
-  const bob::io::base::array::typeinfo& info = b.type();
-  const size_t height0 = info.shape[1];
-  const size_t width0 = info.shape[2];
-  const size_t frame_size = height0*width0;
-
-  // The following piece of code is based on the giflib utility called gif2rgb
-  // Allocate the screen as vector of column of rows. Note this
-  // screen is device independent - it's the screen defined by the
-  // GIF file parameters.
-  std::vector<boost::shared_array<GifPixelType> > screen_buffer;
-  // The second buffer is just used if the image has already been read
-  boost::shared_array<GifPixelType> temp_buffer(new GifPixelType[in_file->SWidth]);
-
-  // Size in bytes one row.
-  int size = in_file->SWidth*sizeof(GifPixelType);
-  // First row
-  screen_buffer.push_back(boost::shared_array<GifPixelType>(new GifPixelType[in_file->SWidth]));
-
-  // Set its color to BackGround
-  for(int i=0; i<in_file->SWidth; ++i)
-    screen_buffer[0][i] = in_file->SBackGroundColor;
-  for(int i=1; i<in_file->SHeight; ++i) {
-    // Allocate the other rows, and set their color to background too:
-    screen_buffer.push_back(boost::shared_array<GifPixelType>(new GifPixelType[in_file->SWidth]));
-    memcpy(screen_buffer[i].get(), screen_buffer[0].get(), size);
-  }
-
-  // Scan the content of the GIF file and load the image(s) in:
+  // 1. GIF file opening; the first scan starts after the screen descriptor
+  boost::shared_ptr<std::FILE> file = make_cfile(path.c_str(), "rb");
+  boost::shared_ptr<GifFileType> in_file = make_dfile(file, path.c_str());
+  if (offset && std::fseek(file.get(), offset, SEEK_SET) != 0) {
+    boost::format m("GIF: cannot seek to offset %d in file `%s'");
+    m % offset % path;
+    throw std::runtime_error(m.str());
+  }
+
+  // 2. Scan the records of the file
+  bob::io::image::GIFFrame frame = bob::io::image::GIFFrame();
+  frame.transparent = -1;
   GifRecordType record_type;
-  GifByteType *extension;
-  int InterlacedOffset[] = { 0, 4, 2, 1 }; // The way Interlaced image should.
-  int InterlacedJumps[] = { 8, 8, 4, 2 }; // be read - offsets and jumps...
-  int row, col, width, height, ext_code;
-  bool terminated = false;
-  bool image_found = false;
-  do{
+  GifByteType *block;
+  int ext_code, code_size;
+  while (frames.size() < count) {
+    offset = std::ftell(file.get());
     int error = DGifGetRecordType(in_file.get(), &record_type);
     if(error == GIF_ERROR)
       GifErrorHandler("DGifGetRecordType", in_file->Error);
@@ -435,198 +246,774 @@ static void im_load_color(boost::shared_ptr<GifFileType> in_file, bob::io::base:
       case IMAGE_DESC_RECORD_TYPE:
         error = DGifGetImageDesc(in_file.get());
         if (error == GIF_ERROR) GifErrorHandler("DGifGetImageDesc", in_file->Error);
-        row = in_file->Image.Top; // Image Position relative to Screen.
-        col = in_file->Image.Left;
-        width = in_file->Image.Width;
-        height = in_file->Image.Height;
         if(in_file->Image.Left + in_file->Image.Width > in_file->SWidth ||
           in_file->Image.Top + in_file->Image.Height > in_file->SHeight)
         {
           throw std::runtime_error("GIF: the dimensions of image larger than the dimensions of the canvas.");
         }
-        if(in_file->Image.Interlace) {
-          // Need to perform 4 passes on the images:
-          for(int i=0; i<4; ++i)
-            for(int j=row+InterlacedOffset[i]; j<row+height; j+=InterlacedJumps[i]) {
-              if (image_found)
-                // image buffer already filled; read in into junk buffer
-                error = DGifGetLine(in_file.get(), &temp_buffer[col], width);
-              else
-                // read into image buffer
-                error = DGifGetLine(in_file.get(), &screen_buffer[j][col], width);
-              if(error == GIF_ERROR) GifErrorHandler("DGifGetLine", in_file->Error);
-            }
-        }
-        else {
-          for(int i=0; i<height; ++i) {
-            if (image_found)
-              // image buffer already filled; read in into junk buffer
-              error = DGifGetLine(in_file.get(), &temp_buffer[col], width);
-            else
-              // read into image buffer
-              error = DGifGetLine(in_file.get(), &screen_buffer[row++][col], width);
-            if(error == GIF_ERROR) GifErrorHandler("DGifGetLine", in_file->Error);
-          }
+        frame.offset = offset;
+        frame.top = in_file->Image.Top;
+        frame.left = in_file->Image.Left;
+        frame.height = in_file->Image.Height;
+        frame.width = in_file->Image.Width;
+        frame.base = im_base(frames, in_file->SHeight, in_file->SWidth);
+        frame.gray = im_is_gray(in_file->Image.ColorMap ? in_file->Image.ColorMap : in_file->SColorMap);
+        frames.push_back(frame);
+        // skip the image data
+        error = DGifGetCode(in_file.get(), &code_size, &block);
+        if (error == GIF_ERROR) GifErrorHandler("DGifGetCode", in_file->Error);
+        while(block != NULL) {
+          error = DGifGetCodeNext(in_file.get(), &block);
+          if(error == GIF_ERROR) GifErrorHandler("DGifGetCodeNext", in_file->Error);
         }
-        image_found = true;
+        // the graphics control extension only applies to the next image
+        frame.disposal = 0;
+        frame.transparent = -1;
+        frame.delay = 0;
         break;
       case EXTENSION_RECORD_TYPE:
-        // Skip any extension blocks in file:
-        error = DGifGetExtension(in_file.get(), &ext_code, &extension);
+        error = DGifGetExtension(in_file.get(), &ext_code, &block);
         if (error == GIF_ERROR) GifErrorHandler("DGifGetExtension", in_file->Error);
-        while(extension != NULL) {
-          error = DGifGetExtensionNext(in_file.get(), &extension);
+        if (ext_code == GRAPHICS_EXT_FUNC_CODE && block != NULL && block[0] >= 4) {
+          // packed fields, delay time and transparent color index
+          frame.disposal = (block[1] >> 2) & 0x07;
+          frame.delay = block[2] | (block[3] << 8);
+          frame.transparent = (block[1] & 0x01) ? block[4] : -1;
+        }
+        while(block != NULL) {
+          error = DGifGetExtensionNext(in_file.get(), &block);
           if(error == GIF_ERROR) GifErrorHandler("DGifGetExtensionNext", in_file->Error);
         }
         break;
       case TERMINATE_RECORD_TYPE:
-        terminated = true;
-        break;
+        if (frames.empty())
+          throw std::runtime_error("GIF: image does not contain an image section");
+        return 0;
       default: // Should be trapped by DGifGetRecordType.
         break;
     }
-  } while (!terminated);
+  }
+  return std::ftell(file.get());
+}
+
+// Decodes the color indices of the frame (height x width) at its indexed
+// offset, and returns the color map to be used with them
+static ColorMapObject* im_load_indices(boost::shared_ptr<std::FILE> file, boost::shared_ptr<GifFileType> in_file, const bob::io::image::GIFFrame& frame, std::vector<GifPixelType>& indices)
+{
+  // 1. Position the decoder at the image descriptor
+  GifRecordType record_type;
+  if (std::fseek(file.get(), frame.offset, SEEK_SET) != 0 || DGifGetRecordType(in_file.get(), &record_type) == GIF_ERROR || record_type != IMAGE_DESC_RECORD_TYPE)
+    throw std::runtime_error("GIF: cannot find the indexed image in the file");
+  int error = DGifGetImageDesc(in_file.get());
+  if (error == GIF_ERROR) GifErrorHandler("DGifGetImageDesc", in_file->Error);
 
-  if (!image_found){
-    throw std::runtime_error("GIF: image does not contain an image section");
+  // 2. Read the rows into one contiguous buffer
+  int InterlacedOffset[] = { 0, 4, 2, 1 }; // The way Interlaced image should.
+  int InterlacedJumps[] = { 8, 8, 4, 2 }; // be read - offsets and jumps...
+  const int rows = frame.height, columns = frame.width;
+  indices.resize(frame.height * frame.width);
+  if(in_file->Image.Interlace) {
+    // Need to perform 4 passes on the images:
+    for(int i=0; i<4; ++i)
+      for(int j=InterlacedOffset[i]; j<rows; j+=InterlacedJumps[i]) {
+        error = DGifGetLine(in_file.get(), &indices[j*columns], columns);
+        if(error == GIF_ERROR) GifErrorHandler("DGifGetLine", in_file->Error);
+      }
+  }
+  else {
+    for(int i=0; i<rows; ++i) {
+      error = DGifGetLine(in_file.get(), &indices[i*columns], columns);
+      if(error == GIF_ERROR) GifErrorHandler("DGifGetLine", in_file->Error);
+    }
   }
 
-  // Lets dump it - set the global variables required and do it:
   ColorMapObject *ColorMap = (in_file->Image.ColorMap ? in_file->Image.ColorMap : in_file->SColorMap);
   if(ColorMap == 0)
     throw std::runtime_error("GIF: image does not have a colormap");
+  return ColorMap;
+}
+
+// The color that the canvas is cleared to: the background color of the
+// global color map, or black without global color map
+static GifColorType im_background(boost::shared_ptr<GifFileType> in_file)
+{
+  GifColorType color = {0, 0, 0};
+  if (in_file->SColorMap && in_file->SBackGroundColor < in_file->SColorMap->ColorCount)
+    color = in_file->SColorMap->Colors[in_file->SBackGroundColor];
+  return color;
+}
 
-  // Put data into C-style buffer
-  uint8_t *element_r = reinterpret_cast<uint8_t*>(b.ptr());
-  uint8_t *element_g = element_r + frame_size;
-  uint8_t *element_b = element_g + frame_size;
-  GifRowType gif_row;
-  GifColorType *ColorMapEntry;
-  for(int i=0; i<in_file->SHeight; ++i) {
-    gif_row = screen_buffer[i].get();
-    for(int j=0; j<in_file->SWidth; ++j) {
-      ColorMapEntry = &ColorMap->Colors[gif_row[j]];
-      *element_r++ = ColorMapEntry->Red;
-      *element_g++ = ColorMapEntry->Green;
-      *element_b++ = ColorMapEntry->Blue;
+// The planes of a color for canvases with 3 planes, or its gray level for
+// canvases with a single plane
+static void im_planes(const GifColorType& color, size_t planes, uint8_t* values)
+{
+  if (planes == 1) {
+    values[0] = im_gray(color);
+    return;
+  }
+  values[0] = color.Red;
+  values[1] = color.Green;
+  values[2] = color.Blue;
+}
+
+// Fills the rectangle of the frame on the canvas (planes x height x width) with the color
+static void im_fill(uint8_t* canvas, size_t planes, size_t height, size_t width, const bob::io::image::GIFFrame& frame, const GifColorType& color)
+{
+  uint8_t values[3];
+  im_planes(color, planes, values);
+  for(size_t p=0; p<planes; ++p)
+    for(size_t i=frame.top; i<frame.top+frame.height; ++i) {
+      uint8_t* element = canvas + (p*height + i)*width + frame.left;
+      std::fill(element, element + frame.width, values[p]);
     }
+}
+
+// Decodes the frame and draws it onto the canvas (planes x height x width);
+// transparent pixels leave the canvas unchanged
+static void im_draw(boost::shared_ptr<std::FILE> file, boost::shared_ptr<GifFileType> in_file, const bob::io::image::GIFFrame& frame, uint8_t* canvas, size_t planes, size_t height, size_t width, std::vector<GifPixelType>& indices)
+{
+  ColorMapObject *ColorMap = im_load_indices(file, in_file, frame, indices);
+
+  // one lookup table per plane; indices outside of the color map are black
+  uint8_t lut[3][256] = {{0}};
+  for(int i=0; i<ColorMap->ColorCount && i<256; ++i) {
+    uint8_t values[3];
+    im_planes(ColorMap->Colors[i], planes, values);
+    for(size_t p=0; p<planes; ++p) lut[p][i] = values[p];
   }
+
+  for(size_t p=0; p<planes; ++p)
+    for(size_t i=0; i<frame.height; ++i) {
+      const GifPixelType* gif_row = &indices[i*frame.width];
+      uint8_t* element = canvas + (p*height + frame.top+i)*width + frame.left;
+      if (frame.transparent < 0) {
+        for(size_t j=0; j<frame.width; ++j)
+          element[j] = lut[p][gif_row[j]];
+      }
+      else {
+        for(size_t j=0; j<frame.width; ++j) {
+          if (gif_row[j] == frame.transparent) continue;
+          element[j] = lut[p][gif_row[j]];
+        }
+      }
+    }
 }
 
-static void im_load(const std::string& filename, bob::io::base::array::interface& b)
+// Returns the number of planes of the canvas in the buffer, which holds color
+// images with nd dimensions or gray images with one dimension less
+static size_t im_check_type(const std::string& filename, const bob::io::base::array::typeinfo& info, size_t nd)
+{
+  if (info.dtype != bob::io::base::array::t_uint8 || (info.nd != nd && info.nd != nd-1)) {
+    boost::format m("GIF: cannot read object of type `%s' from file `%s'");
+    m % info.str() % filename;
+    throw std::runtime_error(m.str());
+  }
+  return info.nd == nd ? 3 : 1;
+}
+
+// Reads the frame with the given index composited onto the canvas. Only the
+// frames since the base of the frame are redrawn, and frames that are
+// disposed after showing them are not decoded
+static void im_load(const std::string& filename, const std::vector<bob::io::image::GIFFrame>& frames, size_t index, bob::io::base::array::interface& b)
 {
   // 1. GIF file opening
-  boost::shared_ptr<GifFileType> in_file = make_dfile(filename.c_str());
+  boost::shared_ptr<std::FILE> file = make_cfile(filename.c_str(), "rb");
+  boost::shared_ptr<GifFileType> in_file = make_dfile(file, filename.c_str());
 
   // 2. Read content
   const bob::io::base::array::typeinfo& info = b.type();
-  if (info.dtype == bob::io::base::array::t_uint8) {
-    if (info.nd == 3) im_load_color(in_file, b);
-    else {
-      boost::format m("GIF: cannot read object of type `%s' from file `%s'");
-      m % info.str() % filename;
-      throw std::runtime_error(m.str());
+  const size_t planes = im_check_type(filename, info, 3);
+  const size_t height = info.shape[info.nd-2];
+  const size_t width = info.shape[info.nd-1];
+  uint8_t* canvas = reinterpret_cast<uint8_t*>(b.ptr());
+
+  const GifColorType background = im_background(in_file);
+  bob::io::image::GIFFrame screen = bob::io::image::GIFFrame();
+  screen.height = height;
+  screen.width = width;
+  im_fill(canvas, planes, height, width, screen, background);
+
+  std::vector<GifPixelType> indices;
+  for (size_t i = frames[index].base; i < index; ++i) {
+    if (frames[i].disposal == s_dispose_background)
+      im_fill(canvas, planes, height, width, frames[i], background);
+    else if (frames[i].disposal != s_dispose_previous)
+      im_draw(file, in_file, frames[i], canvas, planes, height, width, indices);
+  }
+  im_draw(file, in_file, frames[index], canvas, planes, height, width, indices);
+}
+
+// Reads all frames (N x 3 x H x W or N x H x W), decoding each frame once
+static void im_load_frames(const std::string& filename, const std::vector<bob::io::image::GIFFrame>& frames, bob::io::base::array::interface& b)
+{
+  // 1. GIF file opening
+  boost::shared_ptr<std::FILE> file = make_cfile(filename.c_str(), "rb");
+  boost::shared_ptr<GifFileType> in_file = make_dfile(file, filename.c_str());
+
+  // 2. Read content
+  const bob::io::base::array::typeinfo& info = b.type();
+  const size_t planes = im_check_type(filename, info, 4);
+  const size_t height = info.shape[info.nd-2];
+  const size_t width = info.shape[info.nd-1];
+  const size_t image_size = planes*height*width;
+
+  // the canvas that the next frame is drawn onto, and the one before the last
+  // frame for frames that restore it
+  std::vector<uint8_t> canvas(image_size), previous;
+  const GifColorType background = im_background(in_file);
+  bob::io::image::GIFFrame screen = bob::io::image::GIFFrame();
+  screen.height = height;
+  screen.width = width;
+  im_fill(canvas.data(), planes, height, width, screen, background);
+
+  std::vector<GifPixelType> indices;
+  uint8_t* image = reinterpret_cast<uint8_t*>(b.ptr());
+  for (size_t i = 0; i < frames.size(); ++i, image += image_size) {
+    if (frames[i].disposal == s_dispose_previous) previous = canvas;
+    im_draw(file, in_file, frames[i], canvas.data(), planes, height, width, indices);
+    std::copy(canvas.begin(), canvas.end(), image);
+    if (frames[i].disposal == s_dispose_background)
+      im_fill(canvas.data(), planes, height, width, frames[i], background);
+    else if (frames[i].disposal == s_dispose_previous)
+      canvas.swap(previous);
+  }
+}
+
+// Reads the color indices of the first frame on the screen, which is filled
+// with the background color index, without expanding them
+static void im_load_indexed(const std::string& filename, const bob::io::image::GIFFrame& frame, blitz::Array<uint8_t,2>& indices, blitz::Array<uint8_t,2>& palette)
+{
+  boost::shared_ptr<std::FILE> file = make_cfile(filename.c_str(), "rb");
+  boost::shared_ptr<GifFileType> in_file = make_dfile(file, filename.c_str());
+
+  std::vector<GifPixelType> frame_indices;
+  ColorMapObject *ColorMap = im_load_indices(file, in_file, frame, frame_indices);
+
+  palette.resize(ColorMap->ColorCount, 3);
+  for(int i=0; i<ColorMap->ColorCount; ++i) {
+    palette(i,0) = ColorMap->Colors[i].Red;
+    palette(i,1) = ColorMap->Colors[i].Green;
+    palette(i,2) = ColorMap->Colors[i].Blue;
+  }
+
+  indices.resize(in_file->SHeight, in_file->SWidth);
+  indices = in_file->SBackGroundColor;
+  for(size_t i=0; i<frame.height; ++i)
+    std::copy(&frame_indices[i*frame.width], &frame_indices[i*frame.width] + frame.width, indices.data() + (frame.top+i)*in_file->SWidth + frame.left);
+}
+
+/**
+ * QUANTIZATION
+ */
+// Images with less pixels are quantized on a single thread; each thread
+// also needs its own histogram of s_cells colors
+static const size_t s_parallel_pixels = 1 << 18;
+static const size_t s_cells = 1 << 15;
+
+// Runs work(band, begin, end) on the given number of threads, each on a band
+// of consecutive pixels
+static void im_parallel(size_t size, size_t bands, const std::function<void(size_t, size_t, size_t)>& work)
+{
+  std::vector<std::exception_ptr> errors(bands);
+  auto worker = [&](const size_t band)
+  {
+    try
+    {
+      work(band, size * band / bands, size * (band+1) / bands);
     }
+    catch(...)
+    {
+      errors[band] = std::current_exception();
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for(size_t band = 1; band < bands; ++band)
+    threads.emplace_back(worker, band);
+  worker(0);
+  for(auto& thread : threads) thread.join();
+  for(auto& error : errors)
+    if(error) std::rethrow_exception(error);
+}
+
+static size_t im_bands(size_t size)
+{
+  if(size < s_parallel_pixels) return 1;
+  return std::max<size_t>(1, std::min(bob::io::image::get_decoding_threads(), size / s_parallel_pixels));
+}
+
+// The histogram cell of a color, from the 5 upper bits of its components
+static inline size_t im_cell(uint8_t r, uint8_t g, uint8_t b)
+{
+  return ((r >> 3) << 10) | ((g >> 3) << 5) | (b >> 3);
+}
+
+// The red, green or blue component of a histogram cell (5 bits each)
+static inline int im_component(size_t cell, int axis)
+{
+  return (cell >> (10 - 5*axis)) & 0x1f;
+}
+
+// The colors of images with at most 256 colors, in the order of their first
+// occurrence, with an open addressing hash of the 24-bit colors plus one
+// (0 marks empty slots)
+struct exact_colors
+{
+  static const uint32_t slots = 1024;
+  std::vector<uint32_t> keys;
+  std::vector<GifByteType> values;
+  std::vector<GifColorType> colors;
+
+  exact_colors() : keys(slots, 0), values(slots) { }
+};
+
+static inline uint32_t im_slot(const exact_colors& exact, uint32_t key)
+{
+  uint32_t slot = (key * 2654435761u) >> 22;
+  while(exact.keys[slot] && exact.keys[slot] != key) slot = (slot + 1) & (exact_colors::slots - 1);
+  return slot;
+}
+
+/**
+ * Adds the colors of the image to the exact colors and sets the indices of
+ * the pixels into them, if indices is given. Returns false as soon as the
+ * 257th color is found.
+ */
+static bool im_exact_colors(const uint8_t* r, const uint8_t* g, const uint8_t* b, size_t size, exact_colors& exact, GifByteType* indices)
+{
+  uint32_t last = 0;
+  GifByteType last_index = 0;
+  for(size_t i = 0; i < size; ++i) {
+    const uint32_t key = ((uint32_t(r[i]) << 16) | (uint32_t(g[i]) << 8) | b[i]) + 1;
+    if(key != last) {
+      const uint32_t slot = im_slot(exact, key);
+      if(!exact.keys[slot]) {
+        if(exact.colors.size() == 256) return false;
+        exact.keys[slot] = key;
+        exact.values[slot] = exact.colors.size();
+        GifColorType color = {r[i], g[i], b[i]};
+        exact.colors.push_back(color);
+      }
+      last = key;
+      last_index = exact.values[slot];
+    }
+    if(indices) indices[i] = last_index;
+  }
+  return true;
+}
+
+// Adds the pixel count and the sums of the 8-bit components of the pixels
+// of each cell to the histogram (4 x s_cells)
+static void im_histogram(const uint8_t* r, const uint8_t* g, const uint8_t* b, size_t size, std::vector<uint64_t>& histogram)
+{
+  const size_t bands = im_bands(size);
+  std::vector<std::vector<uint64_t> > histograms(bands);
+  im_parallel(size, bands, [&](size_t band, size_t begin, size_t end)
+  {
+    std::vector<uint64_t>& counts = histograms[band];
+    counts.assign(4 * s_cells, 0);
+    for(size_t i = begin; i < end; ++i) {
+      uint64_t* cell = &counts[4 * im_cell(r[i], g[i], b[i])];
+      cell[0] += 1;
+      cell[1] += r[i];
+      cell[2] += g[i];
+      cell[3] += b[i];
+    }
+  });
+  for(size_t band = 0; band < bands; ++band)
+    for(size_t k = 0; k < 4 * s_cells; ++k)
+      histogram[k] += histograms[band][k];
+}
+
+// A box of the RGB cube in the median cut: its cells are cells[begin, end)
+struct color_box
+{
+  size_t begin;
+  size_t end;
+  uint64_t count;
+  int min[3];
+  int max[3];
+};
+
+static void im_shrink(color_box& box, const std::vector<uint16_t>& cells)
+{
+  for(int axis = 0; axis < 3; ++axis) {
+    box.min[axis] = 0x1f;
+    box.max[axis] = 0;
+  }
+  for(size_t k = box.begin; k < box.end; ++k)
+    for(int axis = 0; axis < 3; ++axis) {
+      box.min[axis] = std::min(box.min[axis], im_component(cells[k], axis));
+      box.max[axis] = std::max(box.max[axis], im_component(cells[k], axis));
+    }
+}
+
+/**
+ * Quantizes the histogram to at most 256 colors with its median cut, like
+ * GifQuantizeBuffer, but without global state, so that several images can
+ * be quantized at the same time. Each color is the mean of the pixels of its
+ * box, and lut holds the color index of each cell of the histogram.
+ */
+static void im_median_cut(const std::vector<uint64_t>& histogram, std::vector<GifColorType>& colors, std::vector<GifByteType>& lut)
+{
+  // 1. split the box with the longest side at the median of its pixels along
+  // that side, until there are 256 boxes or all boxes hold a single cell
+  std::vector<uint16_t> cells;
+  uint64_t size = 0;
+  for(size_t cell = 0; cell < s_cells; ++cell)
+    if(histogram[4*cell]) {
+      cells.push_back(cell);
+      size += histogram[4*cell];
+    }
+
+  std::vector<color_box> boxes(1);
+  boxes[0].begin = 0;
+  boxes[0].end = cells.size();
+  boxes[0].count = size;
+  im_shrink(boxes[0], cells);
+  while(boxes.size() < 256) {
+    size_t index = boxes.size();
+    int axis = 0, side = -1;
+    for(size_t i = 0; i < boxes.size(); ++i) {
+      if(boxes[i].end - boxes[i].begin < 2) continue;
+      for(int j = 0; j < 3; ++j)
+        if(boxes[i].max[j] - boxes[i].min[j] > side) {
+          index = i;
+          axis = j;
+          side = boxes[i].max[j] - boxes[i].min[j];
+        }
+    }
+    if(index == boxes.size()) break;
+
+    color_box& box = boxes[index];
+    std::sort(cells.begin() + box.begin, cells.begin() + box.end, [axis](uint16_t c1, uint16_t c2)
+    {
+      return im_component(c1, axis) < im_component(c2, axis);
+    });
+    size_t split = box.begin;
+    uint64_t count = 0;
+    while(split < box.end - 1 && 2 * count < box.count)
+      count += histogram[4*cells[split++]];
+
+    color_box upper = box;
+    upper.begin = split;
+    upper.count = box.count - count;
+    box.end = split;
+    box.count = count;
+    im_shrink(box, cells);
+    im_shrink(upper, cells);
+    boxes.push_back(upper);
+  }
+
+  // 2. the colors and the color index of each cell
+  lut.assign(s_cells, 0);
+  colors.resize(boxes.size());
+  for(size_t i = 0; i < boxes.size(); ++i) {
+    uint64_t sums[3] = {0, 0, 0};
+    for(size_t k = boxes[i].begin; k < boxes[i].end; ++k) {
+      for(int axis = 0; axis < 3; ++axis) sums[axis] += histogram[4*cells[k] + 1 + axis];
+      lut[cells[k]] = i;
+    }
+    colors[i].Red = (sums[0] + boxes[i].count / 2) / boxes[i].count;
+    colors[i].Green = (sums[1] + boxes[i].count / 2) / boxes[i].count;
+    colors[i].Blue = (sums[2] + boxes[i].count / 2) / boxes[i].count;
+  }
+}
+
+// Sets the index of the closest color to the center of each cell
+static void im_nearest(const std::vector<GifColorType>& colors, std::vector<GifByteType>& lut)
+{
+  lut.resize(s_cells);
+  for(size_t cell = 0; cell < s_cells; ++cell) {
+    int center[3], best = std::numeric_limits<int>::max();
+    for(int axis = 0; axis < 3; ++axis) center[axis] = (im_component(cell, axis) << 3) + 4;
+    for(size_t i = 0; i < colors.size(); ++i) {
+      const int dr = colors[i].Red - center[0], dg = colors[i].Green - center[1], db = colors[i].Blue - center[2];
+      const int distance = dr*dr + dg*dg + db*db;
+      if(distance < best) {
+        best = distance;
+        lut[cell] = i;
+      }
+    }
+  }
+}
+
+// Sets the color index of each pixel: the exact color if it is in the hash,
+// or else the color of its cell
+static void im_map(const uint8_t* r, const uint8_t* g, const uint8_t* b, size_t size, const exact_colors* exact, const std::vector<GifByteType>& lut, GifByteType* indices)
+{
+  im_parallel(size, im_bands(size), [&](size_t, size_t begin, size_t end)
+  {
+    for(size_t i = begin; i < end; ++i) {
+      if(exact) {
+        const uint32_t slot = im_slot(*exact, ((uint32_t(r[i]) << 16) | (uint32_t(g[i]) << 8) | b[i]) + 1);
+        if(exact->keys[slot]) {
+          indices[i] = exact->values[slot];
+          continue;
+        }
+      }
+      indices[i] = lut[im_cell(r[i], g[i], b[i])];
+    }
+  });
+}
+
+// A color map shared by the frames of an animated GIF
+struct gif_palette
+{
+  boost::shared_ptr<exact_colors> exact; ///< the colors of the sampled frames, if there are at most 256
+  std::vector<GifColorType> colors;
+  std::vector<GifByteType> lut; ///< the closest color of each cell
+};
+
+// Computes the color map of the frames (3 x H x W each): their exact colors
+// if they have at most 256 colors together, or their joint median cut
+static void im_palette(const std::vector<std::vector<uint8_t> >& frames, size_t size, gif_palette& palette)
+{
+  boost::shared_ptr<exact_colors> exact = boost::make_shared<exact_colors>();
+  bool is_exact = true;
+  for(size_t k = 0; k < frames.size() && is_exact; ++k) {
+    const uint8_t* r = frames[k].data();
+    is_exact = im_exact_colors(r, r + size, r + 2*size, size, *exact, 0);
+  }
+
+  if(is_exact) {
+    palette.exact = exact;
+    palette.colors = exact->colors;
   }
   else {
-    boost::format m("GIF: cannot read object of type `%s' from file `%s'");
-    m % info.str() % filename;
-    throw std::runtime_error(m.str());
+    std::vector<uint64_t> histogram(4 * s_cells, 0);
+    for(size_t k = 0; k < frames.size(); ++k) {
+      const uint8_t* r = frames[k].data();
+      im_histogram(r, r + size, r + 2*size, size, histogram);
+    }
+    std::vector<GifByteType> lut;
+    im_median_cut(histogram, palette.colors, lut);
   }
+  // frames after the sampled ones may hold other colors
+  im_nearest(palette.colors, palette.lut);
 }
 
+
 /**
  * SAVING
  */
-static void im_save_color(const bob::io::base::array::interface& b, boost::shared_ptr<GifFileType> out_file)
+// A quantized frame; frames with no colors use the global color map
+struct gif_frame
 {
-  const bob::io::base::array::typeinfo& info = b.type();
-  const int height = info.shape[1];
-  const int width = info.shape[2];
-  const size_t frame_size = height * width;
+  std::vector<GifColorType> colors;
+  boost::shared_array<GifByteType> indices;
+  int delay;
+};
 
-  // pointer to a single row (tiff_bytep is a typedef to unsigned char or char)
-  const uint8_t *element_r = static_cast<const uint8_t*>(b.ptr());
-  const uint8_t *element_g = element_r + frame_size;
-  const uint8_t *element_b = element_g + frame_size;
+// Quantizes the frame (3 x H x W) to its own color map, which holds its
+// exact colors if it has at most 256 of them
+static void im_quantize(const uint8_t* r, size_t size, gif_frame& frame)
+{
+  const uint8_t* g = r + size;
+  const uint8_t* b = g + size;
+  frame.indices.reset(new GifByteType[size]);
 
-  GifByteType *red_buffer = const_cast<GifByteType*>(reinterpret_cast<const GifByteType*>(element_r));
-  GifByteType *green_buffer = const_cast<GifByteType*>(reinterpret_cast<const GifByteType*>(element_g));
-  GifByteType *blue_buffer = const_cast<GifByteType*>(reinterpret_cast<const GifByteType*>(element_b));
-  boost::shared_array<GifByteType> output_buffer(new GifByteType[width*height]);
+  // images with at most 256 colors are stored without loss
+  exact_colors exact;
+  if(im_exact_colors(r, g, b, size, exact, frame.indices.get())) {
+    frame.colors = exact.colors;
+    return;
+  }
 
-  // The following piece of code is based on the giflib utility called gif2rgb
-  const int ExpNumOfColors = 8;
-  int ColorMapSize = 1 << ExpNumOfColors;
-  ColorMapObject *OutputColorMap = 0;
+  std::vector<uint64_t> histogram(4 * s_cells, 0);
+  std::vector<GifByteType> lut;
+  im_histogram(r, g, b, size, histogram);
+  im_median_cut(histogram, frame.colors, lut);
+  im_map(r, g, b, size, 0, lut, frame.indices.get());
+}
+
+static boost::shared_ptr<ColorMapObject> im_color_map(std::vector<GifColorType> colors)
+{
+  // the size of a color map needs to be a power of 2
+  int bits = 1;
+  while((1u << bits) < colors.size()) ++bits;
+  colors.resize(1 << bits, GifColorType());
 
 #if defined(GIF_LIB_VERSION) || (GIFLIB_MAJOR < 5)
-  if((OutputColorMap = MakeMapObject(ColorMapSize, NULL)) == 0)
+  boost::shared_ptr<ColorMapObject> color_map(MakeMapObject(colors.size(), colors.data()), FreeMapObject);
 #else
-  if((OutputColorMap = GifMakeMapObject(ColorMapSize, NULL)) == 0)
+  boost::shared_ptr<ColorMapObject> color_map(GifMakeMapObject(colors.size(), colors.data()), GifFreeMapObject);
 #endif
+  if(!color_map.get())
     throw std::runtime_error("GIF: error in GifMakeMapObject().");
+  return color_map;
+}
 
+/**
+ * The state of a GIF file that is being written. Each frame is quantized in
+ * append() while the frame before it is LZW-encoded on another thread. The
+ * first frame is only encoded when the second one is appended or the file is
+ * closed, since single images are written as GIF87a without extensions.
+ */
+struct bob::io::image::GIFWriter
+{
+  boost::shared_ptr<GifFileType> file;
+  bob::io::base::array::typeinfo type;
+  bob::io::image::GIFWriteOptions options;
+  size_t frames; ///< the number of appended frames
+  size_t encoded; ///< the number of frames that are written to the file
+  std::vector<std::vector<uint8_t> > samples; ///< the first frames, until the global color map is computed
+  std::vector<int> sample_delays;
+  int delay; ///< the delay of the frames that are appended next
+  boost::shared_ptr<gif_palette> palette; ///< the global color map, if the options ask for one
+  boost::shared_ptr<gif_frame> pending; ///< the first frame, until it is known whether the file is animated
+  std::future<void> encoding; ///< the encoding of the frame that was pushed last
+};
+
+// Writes the frame, and the screen descriptor before the first frame
+static void im_encode(bob::io::image::GIFWriter& writer, const gif_frame& frame, bool animated)
+{
+  GifFileType* out_file = writer.file.get();
+  const int height = writer.type.shape[writer.type.nd-2];
+  const int width = writer.type.shape[writer.type.nd-1];
   int error;
+
+  if(writer.encoded == 0) {
+    if(animated) {
 #if defined(GIF_LIB_VERSION) || (GIFLIB_MAJOR < 5)
-  error = QuantizeBuffer(width, height, &ColorMapSize,
-      red_buffer, green_buffer, blue_buffer, output_buffer.get(),
-      OutputColorMap->Colors);
+      EGifSetGifVersion("89a");
 #else
-  error = GifQuantizeBuffer(width, height, &ColorMapSize,
-      red_buffer, green_buffer, blue_buffer, output_buffer.get(),
-      OutputColorMap->Colors);
+      EGifSetGifVersion(out_file, true);
 #endif
-  if (error == GIF_ERROR) GifErrorHandler("GifQuantizeBuffer", error);
+    }
+    boost::shared_ptr<ColorMapObject> color_map = im_color_map(writer.palette ? writer.palette->colors : frame.colors);
+    error = EGifPutScreenDesc(out_file, width, height, 8, 0, color_map.get());
+    if (error == GIF_ERROR) GifErrorHandler("EGifPutScreenDesc", out_file->Error);
 
-  error = EGifPutScreenDesc(out_file.get(), width, height, ExpNumOfColors, 0,
-      OutputColorMap);
-  if (error == GIF_ERROR) GifErrorHandler("EGifPutScreenDesc", out_file->Error);
+    if(animated) {
+      // the NETSCAPE2.0 application extension holds the number of loops
+      char netscape[] = "NETSCAPE2.0";
+      GifByteType loops[3] = {1, GifByteType(writer.options.loops & 0xff), GifByteType((writer.options.loops >> 8) & 0xff)};
+#if defined(GIF_LIB_VERSION) || (GIFLIB_MAJOR < 5)
+      error = EGifPutExtensionFirst(out_file, APPLICATION_EXT_FUNC_CODE, 11, netscape);
+      if (error != GIF_ERROR) error = EGifPutExtensionLast(out_file, APPLICATION_EXT_FUNC_CODE, 3, loops);
+#else
+      error = EGifPutExtensionLeader(out_file, APPLICATION_EXT_FUNC_CODE);
+      if (error != GIF_ERROR) error = EGifPutExtensionBlock(out_file, 11, netscape);
+      if (error != GIF_ERROR) error = EGifPutExtensionBlock(out_file, 3, loops);
+      if (error != GIF_ERROR) error = EGifPutExtensionTrailer(out_file);
+#endif
+      if (error == GIF_ERROR) GifErrorHandler("EGifPutExtension", out_file->Error);
+    }
+  }
 
-  error = EGifPutImageDesc(out_file.get(), 0, 0, width, height, false, NULL);
+  if(animated) {
+    // graphics control extension: the frames are opaque and are not disposed
+    GifByteType control[4] = {1 << 2, GifByteType(frame.delay & 0xff), GifByteType((frame.delay >> 8) & 0xff), 0};
+    error = EGifPutExtension(out_file, GRAPHICS_EXT_FUNC_CODE, 4, control);
+    if (error == GIF_ERROR) GifErrorHandler("EGifPutExtension", out_file->Error);
+  }
+
+  // the first frame uses the global color map
+  boost::shared_ptr<ColorMapObject> color_map;
+  if(writer.encoded > 0 && !frame.colors.empty()) color_map = im_color_map(frame.colors);
+  error = EGifPutImageDesc(out_file, 0, 0, width, height, false, color_map.get());
   if (error == GIF_ERROR) GifErrorHandler("EGifPutImageDesc", out_file->Error);
 
-  GifByteType *ptr = output_buffer.get();
+  GifByteType *ptr = frame.indices.get();
   for(int i=0; i<height; ++i) {
-    error = EGifPutLine(out_file.get(), ptr, width);
-    if (error == GIF_ERROR) GifErrorHandler("EGifPutImageDesc", out_file->Error);
+    error = EGifPutLine(out_file, ptr, width);
+    if (error == GIF_ERROR) GifErrorHandler("EGifPutLine", out_file->Error);
     ptr += width;
   }
+  ++writer.encoded;
+}
 
-  // Free map object
-#if defined(GIF_LIB_VERSION) || (GIFLIB_MAJOR < 5)
-  FreeMapObject(OutputColorMap);
-#else
-  GifFreeMapObject(OutputColorMap);
-#endif
+// Encodes the frame on another thread once the frame before it is written,
+// so that the next frame is quantized meanwhile. The first frame is kept
+// until the second one arrives, and is then encoded before it
+static void im_push(bob::io::image::GIFWriter& writer, boost::shared_ptr<gif_frame> frame)
+{
+  if(!writer.pending && !writer.encoding.valid()) {
+    writer.pending = frame;
+    return;
+  }
+  if(writer.encoding.valid()) writer.encoding.get();
+  bob::io::image::GIFWriter* state = &writer;
+  boost::shared_ptr<gif_frame> first = writer.pending;
+  writer.pending.reset();
+  writer.encoding = std::async(std::launch::async, [state, first, frame]() {
+    if(first) im_encode(*state, *first, true);
+    im_encode(*state, *frame, true);
+  });
 }
 
-static void im_save(const std::string& filename, const bob::io::base::array::interface& array)
+// Maps the sampled frames to the global color map computed from them
+static void im_flush_samples(bob::io::image::GIFWriter& writer)
 {
-  // 1. GIF file opening
-  boost::shared_ptr<GifFileType> out_file = make_efile(filename.c_str());
+  const size_t size = writer.type.shape[writer.type.nd-2] * writer.type.shape[writer.type.nd-1];
+  writer.palette = boost::make_shared<gif_palette>();
+  im_palette(writer.samples, size, *writer.palette);
+  for(size_t k = 0; k < writer.samples.size(); ++k) {
+    const uint8_t* r = writer.samples[k].data();
+    boost::shared_ptr<gif_frame> frame = boost::make_shared<gif_frame>();
+    frame->indices.reset(new GifByteType[size]);
+    frame->delay = writer.sample_delays[k];
+    im_map(r, r + size, r + 2*size, size, writer.palette->exact.get(), writer.palette->lut, frame->indices.get());
+    im_push(writer, frame);
+  }
+  writer.samples.clear();
+  writer.sample_delays.clear();
+}
+
+// The global color map of gray files: the gray levels are their own indices
+static boost::shared_ptr<gif_palette> im_gray_palette()
+{
+  boost::shared_ptr<gif_palette> palette = boost::make_shared<gif_palette>();
+  palette->colors.resize(256);
+  for(size_t k = 0; k < 256; ++k)
+    palette->colors[k].Red = palette->colors[k].Green = palette->colors[k].Blue = k;
+  return palette;
+}
 
-  // 2. Set the image information here:
-  const bob::io::base::array::typeinfo& info = array.type();
+// Adds the frame (3 x H x W, or H x W to gray files) to the file
+static void im_append(bob::io::image::GIFWriter& writer, const uint8_t* pixels)
+{
+  const size_t size = writer.type.shape[writer.type.nd-2] * writer.type.shape[writer.type.nd-1];
+  ++writer.frames;
 
-  // 3. Writes content
-  if(info.dtype == bob::io::base::array::t_uint8) {
-    if(info.nd == 3) {
-      if(info.shape[0] != 3)
-        throw std::runtime_error("color image does not have 3 planes on 1st. dimension");
-      im_save_color(array, out_file);
-    }
-    else {
-      boost::format m("GIF: cannot save object of type `%s' to file `%s'");
-      m % info.str() % filename;
-      throw std::runtime_error(m.str());
-    }
+  if(writer.type.nd == 2) {
+    // gray frames are stored without loss
+    boost::shared_ptr<gif_frame> frame = boost::make_shared<gif_frame>();
+    frame->delay = writer.delay;
+    frame->indices.reset(new GifByteType[size]);
+    std::copy(pixels, pixels + size, frame->indices.get());
+    im_push(writer, frame);
+    return;
   }
-  else {
-    boost::format m("GIF: cannot save object of type `%s' to file `%s'");
-    m % info.str() % filename;
-    throw std::runtime_error(m.str());
+
+  if(writer.options.palette_frames > 0 && !writer.palette) {
+    writer.samples.push_back(std::vector<uint8_t>(pixels, pixels + 3*size));
+    writer.sample_delays.push_back(writer.delay);
+    if(writer.samples.size() == writer.options.palette_frames) im_flush_samples(writer);
+    return;
   }
+
+  boost::shared_ptr<gif_frame> frame = boost::make_shared<gif_frame>();
+  frame->delay = writer.delay;
+  if(writer.palette) {
+    frame->indices.reset(new GifByteType[size]);
+    im_map(pixels, pixels + size, pixels + 2*size, size, writer.palette->exact.get(), writer.palette->lut, frame->indices.get());
+  }
+  else
+    im_quantize(pixels, size, *frame);
+  im_push(writer, frame);
+}
+
+// Writes the frames that are not written yet and closes the file
+static void im_finish(bob::io::image::GIFWriter& writer)
+{
+  if(!writer.samples.empty()) im_flush_samples(writer);
+  if(writer.encoding.valid()) writer.encoding.get();
+  // a single frame is still pending
+  if(writer.pending) im_encode(writer, *writer.pending, false);
+  writer.pending.reset();
+  writer.file.reset();
 }
 
 
@@ -635,7 +1022,8 @@ static void im_save(const std::string& filename, const bob::io::base::array::int
 */
 bob::io::image::GIFFile::GIFFile(const char* path, char mode)
 : m_filename(path),
-  m_newfile(true) {
+  m_newfile(true),
+  m_index_offset(0) {
 
   //checks if file exists
   if (mode == 'r' && !boost::filesystem::exists(path)) {
@@ -645,44 +1033,199 @@ bob::io::image::GIFFile::GIFFile(const char* path, char mode)
   }
 
   if (mode == 'r' || (mode == 'a' && boost::filesystem::exists(path))) {
-    im_peek(path, m_type);
-    m_length = 1;
+    index_type();
     m_newfile = false;
   }
   else {
-    m_length = 0;
     m_newfile = true;
   }
 }
 
+bob::io::image::GIFFile::~GIFFile() {
+  try {
+    close();
+  }
+  catch (std::exception& e) {
+    bob::core::error << "Cannot write GIF file `" << m_filename << "': " << e.what() << std::endl;
+  }
+}
+
+void bob::io::image::GIFFile::index_type() {
+  m_frames.clear();
+  m_index_offset = im_index(m_filename, 0, 1, m_frames);
+  // the other frames are indexed when they are read; their colors are
+  // converted to gray levels when they are read into the buffers of gray files
+  im_peek(m_filename, m_frames[0].gray, m_type);
+}
+
+void bob::io::image::GIFFile::index_frames(size_t count) const {
+  // an empty index starts after the screen descriptor
+  if ((m_index_offset || m_frames.empty()) && m_frames.size() < count)
+    m_index_offset = im_index(m_filename, m_index_offset, count, m_frames);
+}
+
+size_t bob::io::image::GIFFile::size() const {
+  if (m_writer) return m_writer->frames;
+  index_frames(std::numeric_limits<size_t>::max());
+  return m_frames.size();
+}
+
+const bob::io::base::array::typeinfo& bob::io::image::GIFFile::type_all() const {
+  // the frames stacked along the first dimension, as read_frames() reads them
+  m_type_all = m_type;
+  const size_t frames = size();
+  if (frames > 1) {
+    m_type_all.nd = m_type.nd + 1;
+    m_type_all.shape[0] = frames;
+    for (size_t i = 0; i < m_type.nd; ++i) m_type_all.shape[i+1] = m_type.shape[i];
+    m_type_all.update_strides();
+  }
+  return m_type_all;
+}
+
+const bob::io::image::GIFFrame& bob::io::image::GIFFile::frame(size_t index) const {
+  if (m_writer) {
+    boost::format m("GIF file `%s' is being written; close() it before reading its frames");
+    m % m_filename;
+    throw std::runtime_error(m.str());
+  }
+  index_frames(index + 1);
+  if (index >= m_frames.size()) {
+    boost::format m("cannot read frame %d of GIF file `%s' with %d frames");
+    m % index % m_filename % m_frames.size();
+    throw std::runtime_error(m.str());
+  }
+  return m_frames[index];
+}
+
+void bob::io::image::GIFFile::read_all(bob::io::base::array::interface& buffer) {
+  close();
+  if (size() == 1) {
+    read(buffer, 0);
+    return;
+  }
+  read_frames(buffer);
+}
+
+void bob::io::image::GIFFile::read_frames(bob::io::base::array::interface& buffer) {
+  close();
+  if (m_newfile)
+    throw std::runtime_error("uninitialized image file cannot be read");
+
+  bob::io::base::array::typeinfo info;
+  info.dtype = m_type.dtype;
+  info.nd = m_type.nd + 1;
+  info.shape[0] = size();
+  for (size_t i = 0; i < m_type.nd; ++i) info.shape[i+1] = m_type.shape[i];
+  info.update_strides();
+  // the frames of gray files are expanded to color buffers
+  if (!buffer.type().is_compatible(info) && !(m_type.nd == 2 && bob::io::image::is_color_of(buffer.type(), info)))
+    buffer.set(info);
+
+  im_load_frames(m_filename, m_frames, buffer);
+}
+
 void bob::io::image::GIFFile::read(bob::io::base::array::interface& buffer, size_t index) {
+  close();
   if (m_newfile)
     throw std::runtime_error("uninitialized image file cannot be read");
 
-  if (!buffer.type().is_compatible(m_type)) buffer.set(m_type);
+  frame(index);
+  // gray files are expanded to color buffers
+  if(!buffer.type().is_compatible(m_type) && !(m_type.nd == 2 && bob::io::image::is_color_of(buffer.type(), m_type)))
+    buffer.set(m_type);
+  im_load(m_filename, m_frames, index, buffer);
+}
 
-  if (index != 0)
-    throw std::runtime_error("cannot read image with index > 0 -- there is only one image in an image file");
+void bob::io::image::GIFFile::read_region(bob::io::base::array::interface& buffer, size_t y, size_t x, size_t h, size_t w) {
+  close();
+  if (m_newfile)
+    throw std::runtime_error("uninitialized image file cannot be read");
 
-  if(!buffer.type().is_compatible(m_type)) buffer.set(m_type);
-  im_load(m_filename, buffer);
+  const bob::io::base::array::typeinfo region = bob::io::image::region_type(m_type, y, x, h, w, m_filename);
+  const bool expand = m_type.nd == 2 && bob::io::image::is_color_of(buffer.type(), region);
+  if (!buffer.type().is_compatible(region) && !expand) buffer.set(region);
+
+  // the LZW stream is decoded completely, since interlaced images store their rows out of order
+  bob::io::base::array::typeinfo type = m_type;
+  if (expand) {
+    type.nd = 3;
+    type.shape[0] = 3;
+    type.shape[1] = m_type.shape[0];
+    type.shape[2] = m_type.shape[1];
+    type.update_strides();
+  }
+  bob::io::base::array::blitz_array image(type);
+  frame(0);
+  im_load(m_filename, m_frames, 0, image);
+  bob::io::image::copy_region(image, y, x, buffer);
+}
+
+void bob::io::image::GIFFile::read_indexed(blitz::Array<uint8_t,2>& indices, blitz::Array<uint8_t,2>& palette) {
+  close();
+  if (m_newfile)
+    throw std::runtime_error("uninitialized image file cannot be read");
+
+  im_load_indexed(m_filename, frame(0), indices, palette);
 }
 
 size_t bob::io::image::GIFFile::append(const bob::io::base::array::interface& buffer) {
-  if (m_newfile) {
-    im_save(m_filename, buffer);
-    m_type = buffer.type();
-    m_newfile = false;
-    m_length = 1;
-    return 0;
+  if (!m_newfile && !m_writer)
+    throw std::runtime_error("GIF frames can only be appended to new files");
+
+  // the first frame decides whether the file is gray (H x W) or color
+  // (3 x H x W); several frames are stacked along an additional dimension
+  const bob::io::base::array::typeinfo& info = buffer.type();
+  const bool gray = m_writer ? m_writer->type.nd == 2 : info.nd == 2;
+  const size_t frame_nd = gray ? 2 : 3;
+  const size_t nd = info.nd == frame_nd + 1 ? frame_nd + 1 : frame_nd;
+  if (info.dtype != bob::io::base::array::t_uint8 || info.nd != nd || (!gray && info.shape[nd-3] != 3)) {
+    boost::format m("GIF: cannot save object of type `%s' to file `%s'");
+    m % info.str() % m_filename;
+    throw std::runtime_error(m.str());
+  }
+  if (m_writer && (info.shape[nd-2] != m_type.shape[m_type.nd-2] || info.shape[nd-1] != m_type.shape[m_type.nd-1])) {
+    boost::format m("GIF: cannot append frame of size %dx%d to file `%s' with frames of size %dx%d");
+    m % info.shape[nd-2] % info.shape[nd-1] % m_filename % m_type.shape[m_type.nd-2] % m_type.shape[m_type.nd-1];
+    throw std::runtime_error(m.str());
   }
 
-  throw std::runtime_error("image files only accept a single array");
+  if (!m_writer) {
+    m_type.dtype = bob::io::base::array::t_uint8;
+    m_type.nd = frame_nd;
+    if (!gray) m_type.shape[0] = 3;
+    m_type.shape[frame_nd-2] = info.shape[nd-2];
+    m_type.shape[frame_nd-1] = info.shape[nd-1];
+    m_type.update_strides();
+
+    m_writer = boost::make_shared<GIFWriter>();
+    m_writer->file = make_efile(m_filename.c_str());
+    m_writer->type = m_type;
+    m_writer->options = m_options;
+    m_writer->delay = m_options.delay;
+    m_writer->frames = 0;
+    m_writer->encoded = 0;
+    if (gray) m_writer->palette = im_gray_palette();
+  }
+
+  const size_t index = m_writer->frames;
+  const size_t count = nd > frame_nd ? info.shape[0] : 1;
+  const uint8_t* pixels = static_cast<const uint8_t*>(buffer.ptr());
+  try {
+    for (size_t k = 0; k < count; ++k)
+      im_append(*m_writer, pixels + k * m_type.buffer_size());
+  }
+  catch (...) {
+    // the file cannot be completed
+    m_writer.reset();
+    throw;
+  }
+  return index;
 }
 
 void bob::io::image::GIFFile::write (const bob::io::base::array::interface& buffer) {
   //overwriting position 0 should always work
-  if (m_newfile) {
+  if (m_newfile && !m_writer) {
     append(buffer);
     return;
   }
@@ -690,6 +1233,23 @@ void bob::io::image::GIFFile::write (const bob::io::base::array::interface& buff
   throw std::runtime_error("image files only accept a single array");
 }
 
+void bob::io::image::GIFFile::set_write_options(const GIFWriteOptions& options) {
+  m_options = options;
+  if (m_writer) m_writer->delay = options.delay;
+}
+
+void bob::io::image::GIFFile::close() {
+  if (!m_writer) return;
+
+  boost::shared_ptr<GIFWriter> writer = m_writer;
+  m_writer.reset();
+  im_finish(*writer);
+  // the file keeps the type of the appended frames, which are indexed when they are read
+  m_frames.clear();
+  m_index_offset = 0;
+  m_newfile = false;
+}
+
 std::string bob::io::image::GIFFile::s_codecname = "bob.image_gif";
 
 boost::shared_ptr<bob::io::base::File> make_gif_file (const char* path, char mode) {
@@ -8,6 +8,13 @@
  */
 
 #include <stdint.h>
+#include <atomic>
+#include <cstring>
+#include <thread>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include <boost/assign/list_of.hpp>
 #include <bob.io.image/image.h>
 
@@ -47,6 +54,7 @@ static std::map<std::string, std::vector<std::vector<uint8_t>>> _initialize_magi
   magic_numbers[".tiff"].push_back(boost::assign::list_of(0x49)(0x20)(0x49));
   magic_numbers[".tiff"].push_back(boost::assign::list_of(0x49)(0x49)(0x2A)(0x00));
   magic_numbers[".tiff"].push_back(boost::assign::list_of(0x4D)(0x4D)(0x00)(0x2A));
+  magic_numbers[".tiff"].push_back(boost::assign::list_of(0x49)(0x49)(0x2B)(0x00));
   magic_numbers[".tiff"].push_back(boost::assign::list_of(0x4D)(0x4D)(0x00)(0x2B));
 #endif // HAVE_LIBTIFF
   return magic_numbers;
@@ -76,13 +84,131 @@ const std::string& get_correct_image_extension(const std::string& image_name){
   throw std::runtime_error("The given image '" + image_name + "' does not contain an image of a known type");
 }
 
+// For each byte of packed bits, the eight unpacked pixels (0 or 1) in memory order
+static std::vector<uint64_t> _initialize_unpack_table(){
+  std::vector<uint64_t> table(256);
+  for (int b = 0; b < 256; ++b){
+    uint8_t pixels[8];
+    for (int k = 0; k < 8; ++k)
+      pixels[k] = (b >> (7 - k)) & 1;
+    std::memcpy(&table[b], pixels, 8);
+  }
+  return table;
+}
+
+static std::vector<uint64_t> unpack_table = _initialize_unpack_table();
+
+#ifdef __SSE2__
+// Reverses the bit order of a byte
+static std::vector<uint8_t> _initialize_reverse_table(){
+  std::vector<uint8_t> table(256);
+  for (int b = 0; b < 256; ++b)
+    for (int k = 0; k < 8; ++k)
+      if (b & (1 << k)) table[b] |= 1 << (7 - k);
+  return table;
+}
+
+static std::vector<uint8_t> reverse_table = _initialize_reverse_table();
+#endif
+
+void pack_bits(const uint8_t* pixels, size_t width, uint8_t* bits){
+  size_t x = 0;
+#ifdef __SSE2__
+  // 16 pixels at a time: compare with zero, and collect one bit per pixel
+  const __m128i zero = _mm_setzero_si128();
+  for (; x + 16 <= width; x += 16){
+    const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels + x));
+    const int set = ~_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+    // movemask puts the first pixel in the lowest bit
+    *bits++ = reverse_table[set & 0xff];
+    *bits++ = reverse_table[(set >> 8) & 0xff];
+  }
+#endif
+  for (; x < width; x += 8){
+    uint8_t byte = 0;
+    const size_t n = std::min<size_t>(8, width - x);
+    for (size_t k = 0; k < n; ++k)
+      byte |= (pixels[x + k] != 0) << (7 - k);
+    *bits++ = byte;
+  }
+}
+
+void unpack_bits(const uint8_t* bits, size_t width, uint8_t value, uint8_t* pixels){
+  size_t x = 0;
+#ifdef __SSE2__
+  // 16 pixels at a time: spread each of two bytes over eight bytes, and select
+  // one bit per byte, the first pixel in the most significant bit
+  const __m128i mask = _mm_set1_epi64x(0x0102040810204080LL);
+  const __m128i set = _mm_set1_epi8(static_cast<char>(value));
+  for (; x + 16 <= width; x += 16, bits += 2){
+    __m128i v = _mm_cvtsi32_si128(bits[0] | (bits[1] << 8));
+    v = _mm_unpacklo_epi8(v, v);
+    v = _mm_unpacklo_epi16(v, v);
+    v = _mm_unpacklo_epi32(v, v);
+    const __m128i on = _mm_cmpeq_epi8(_mm_and_si128(v, mask), mask);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(pixels + x), _mm_and_si128(on, set));
+  }
+#endif
+  // 8 pixels per table lookup; bytes are 0 or 1, so the multiplication does not carry
+  for (; x + 8 <= width; x += 8){
+    const uint64_t p = unpack_table[*bits++] * value;
+    std::memcpy(pixels + x, &p, 8);
+  }
+  for (size_t k = 0; x < width; ++x, ++k)
+    pixels[x] = ((*bits >> (7 - k)) & 1) * value;
+}
+
+void invert_bits(uint8_t* bits, size_t width){
+  const size_t bytes = (width + 7) / 8;
+  for (size_t k = 0; k < bytes; ++k)
+    bits[k] = ~bits[k];
+  if (width % 8)
+    bits[bytes - 1] &= 0xff << (8 - width % 8);
+}
+
+static std::atomic<bool> s_trusted_input(false);
+
+void set_trusted_input(bool trusted){
+  s_trusted_input = trusted;
+}
+
+bool get_trusted_input(){
+  return s_trusted_input;
+}
+
+static std::atomic<size_t> s_decoding_threads(0);
+
+void set_decoding_threads(size_t threads){
+  s_decoding_threads = threads;
+}
+
+// the limit of the calling thread, 0 if there is none
+static thread_local size_t s_thread_decoding_threads = 0;
+
+size_t get_decoding_threads(){
+  size_t threads = s_decoding_threads;
+  if (!threads) threads = std::max(std::thread::hardware_concurrency(), 1u);
+  if (s_thread_decoding_threads) threads = std::min(threads, s_thread_decoding_threads);
+  return threads;
+}
+
+DecodingThreadsLimit::DecodingThreadsLimit(size_t threads)
+: m_previous(s_thread_decoding_threads)
+{
+  s_thread_decoding_threads = std::max<size_t>(threads, 1);
+}
+
+DecodingThreadsLimit::~DecodingThreadsLimit(){
+  s_thread_decoding_threads = m_previous;
+}
+
 bool is_color_image(const std::string& filename, std::string extension){
   if (extension.empty())
     extension = boost::filesystem::path(filename).extension().string();
   boost::algorithm::to_lower(extension);
-  if (extension == ".bmp") return true;
+  if (extension == ".bmp") return is_color_bmp(filename);
 #ifdef HAVE_GIFLIB
-  if (extension == ".gif") return true;
+  if (extension == ".gif") return is_color_gif(filename);
 #endif
 #ifdef HAVE_LIBPNG
   if (extension == ".png") return is_color_png(filename);
@@ -20,10 +20,13 @@
 #include <boost/format.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/algorithm/string.hpp>
+#include <boost/type_traits/is_same.hpp>
 #include <string>
+#include <algorithm>
 
 #include <bob.core/logging.h>
 #include <bob.io.image/jpeg.h>
+#include <bob.io.image/image.h>
 
 #include <jpeglib.h>
 
@@ -67,6 +70,10 @@ static void my_output_message(j_common_ptr cinfo){
   bob::core::debug << "In image '" << reinterpret_cast<char*>(cinfo->client_data) << "' JPEG warning has occured -> " << message << std::endl;
 }
 
+static void my_ignore_message(j_common_ptr){
+  // trusted input -> warnings are not formatted at all
+}
+
 
 /**
  * LOADING
@@ -77,7 +84,7 @@ static void im_peek(const std::string& path, bob::io::base::array::typeinfo& inf
   struct jpeg_error_mgr jerr;
   cinfo.err = jpeg_std_error(&jerr);
   jerr.error_exit = my_error_exit;
-  jerr.output_message = my_output_message;
+  jerr.output_message = bob::io::image::get_trusted_input() ? my_ignore_message : my_output_message;
   // set image name as client data; used for warning and error messages
   cinfo.client_data = const_cast<char*>(path.c_str());
   jpeg_create_decompress(&cinfo);
@@ -114,32 +121,47 @@ static void im_peek(const std::string& path, bob::io::base::array::typeinfo& inf
   jpeg_destroy_decompress(&cinfo);
 }
 
-template <typename T> static
-void im_load_gray(struct jpeg_decompress_struct *cinfo, bob::io::base::array::interface& b) {
+// Reads the next scanlines into the gray image of type D, starting at the
+// column skip of each scanline
+template <typename D> static
+void im_load_gray(struct jpeg_decompress_struct *cinfo, bob::io::base::array::interface& b, const size_t skip) {
   const bob::io::base::array::typeinfo& info = b.type();
 
-  T *element = static_cast<T*>(b.ptr());
+  D *element = static_cast<D*>(b.ptr());
   const int row_stride = info.shape[1];
   JSAMPROW buffer_pptr[1];
-  while (cinfo->output_scanline < cinfo->image_height) {
-    buffer_pptr[0] = element;
+  if (boost::is_same<D,JSAMPLE>::value && cinfo->output_width == info.shape[1]) {
+    // decode in place
+    for (size_t y = 0; y < info.shape[0]; ++y) {
+      buffer_pptr[0] = reinterpret_cast<JSAMPLE*>(element);
+      jpeg_read_scanlines(cinfo, buffer_pptr, 1);
+      element += row_stride;
+    }
+    return;
+  }
+
+  // convert each scanline into the destination
+  boost::shared_array<JSAMPLE> buffer(new JSAMPLE[cinfo->output_width]);
+  buffer_pptr[0] = buffer.get();
+  for (size_t y = 0; y < info.shape[0]; ++y) {
     jpeg_read_scanlines(cinfo, buffer_pptr, 1);
+    bob::io::image::convert_samples(buffer.get() + skip, row_stride, element);
     element += row_stride;
   }
 }
 
-template <typename T> static
-void imbuffer_to_rgb(size_t size, const T* im, T* r, T* g, T* b) {
+template <typename D> static
+void imbuffer_to_rgb(size_t size, const JSAMPLE* im, D* r, D* g, D* b) {
   for (size_t k=0; k<size; ++k) {
-    r[k] = im[3*k];
-    g[k] = im[3*k +1];
-    b[k] = im[3*k +2];
+    r[k] = bob::io::image::convert_sample<D>(im[3*k]);
+    g[k] = bob::io::image::convert_sample<D>(im[3*k +1]);
+    b[k] = bob::io::image::convert_sample<D>(im[3*k +2]);
   }
 }
 
-template <typename T> static
-void cmyk_imbuffer_to_rgb(size_t size, const T* im, T* r, T* g, T* b, bool adobe_marker) {
-  T C,M,Y,K;
+template <typename D> static
+void cmyk_imbuffer_to_rgb(size_t size, const JSAMPLE* im, D* r, D* g, D* b, bool adobe_marker) {
+  int C,M,Y,K;
   for (size_t k=0; k<size; ++k) {
     if (adobe_marker){
       C = *im++;
@@ -152,45 +174,56 @@ void cmyk_imbuffer_to_rgb(size_t size, const T* im, T* r, T* g, T* b, bool adobe
       Y = 255-*im++;
       K = 255-*im++;
     }
-    *r++ = C * K / 255;
-    *g++ = M * K / 255;
-    *b++ = Y * K / 255;
+    *r++ = bob::io::image::convert_sample<D>(static_cast<uint8_t>(C * K / 255));
+    *g++ = bob::io::image::convert_sample<D>(static_cast<uint8_t>(M * K / 255));
+    *b++ = bob::io::image::convert_sample<D>(static_cast<uint8_t>(Y * K / 255));
   }
 }
 
-template <typename T> static
-void im_load_color(struct jpeg_decompress_struct *cinfo, bob::io::base::array::interface& b) {
+template <typename D> static
+void im_load_color(struct jpeg_decompress_struct *cinfo, bob::io::base::array::interface& b, const size_t skip) {
   const bob::io::base::array::typeinfo& info = b.type();
 
   long unsigned int frame_size = info.shape[1] * info.shape[2];
-  T *element_r = static_cast<T*>(b.ptr());
-  T *element_g = element_r+frame_size;
-  T *element_b = element_g+frame_size;
+  D *element_r = static_cast<D*>(b.ptr());
+  D *element_g = element_r+frame_size;
+  D *element_b = element_g+frame_size;
 
   const int row_stride = cinfo->output_width * cinfo->output_components;
   JSAMPROW buffer_pptr[1];
   boost::shared_array<JSAMPLE> buffer(new JSAMPLE[row_stride]);
   buffer_pptr[0] = buffer.get();
-  while (cinfo->output_scanline < cinfo->output_height) {
+  const JSAMPLE* pixels = buffer.get() + skip * cinfo->output_components;
+  for (size_t y = 0; y < info.shape[1]; ++y) {
     jpeg_read_scanlines(cinfo, buffer_pptr, 1);
     if (cinfo->output_components == 3)
-      imbuffer_to_rgb<T>(info.shape[2], reinterpret_cast<T*>(buffer_pptr[0]), element_r, element_g, element_b);
+      imbuffer_to_rgb<D>(info.shape[2], pixels, element_r, element_g, element_b);
     else
-      cmyk_imbuffer_to_rgb<T>(info.shape[2], reinterpret_cast<T*>(buffer_pptr[0]), element_r, element_g, element_b, cinfo->saw_Adobe_marker);
+      cmyk_imbuffer_to_rgb<D>(info.shape[2], pixels, element_r, element_g, element_b, cinfo->saw_Adobe_marker);
 
-    element_r += cinfo->output_width;
-    element_g += cinfo->output_width;
-    element_b += cinfo->output_width;
+    element_r += info.shape[2];
+    element_g += info.shape[2];
+    element_b += info.shape[2];
   }
 }
 
-static void im_load(const std::string& filename, bob::io::base::array::interface& b) {
+template <typename D> static
+void im_load_content(struct jpeg_decompress_struct *cinfo, bob::io::base::array::interface& b, const size_t skip) {
+  if (b.type().nd == 2) im_load_gray<D>(cinfo, b, skip);
+  else im_load_color<D>(cinfo, b, skip);
+}
+
+// Reads the image, or the region of the size of the buffer with the upper left
+// corner at (y, x). Scanlines above the region are skipped without running the
+// inverse DCT, and only the iMCU columns that overlap the region are decoded;
+// decompression stops after the last scanline of the region.
+static void im_load(const std::string& filename, bob::io::base::array::interface& b, const size_t y = 0, const size_t x = 0) {
   // 1. JPEG structures
   struct jpeg_decompress_struct cinfo;
   struct jpeg_error_mgr jerr;
   cinfo.err = jpeg_std_error(&jerr);
   jerr.error_exit = my_error_exit;
-  jerr.output_message = my_output_message;
+  jerr.output_message = bob::io::image::get_trusted_input() ? my_ignore_message : my_output_message;
   // set image name as client data; used for warning and error messages
   cinfo.client_data = const_cast<char*>(filename.c_str());
   jpeg_create_decompress(&cinfo);
@@ -211,25 +244,60 @@ static void im_load(const std::string& filename, bob::io::base::array::interface
   // 5. Start decompression and get information
   jpeg_start_decompress(&cinfo);
 
-  // 6. Read content
+  // 6. Read content, converting it to the data type of the destination
   const bob::io::base::array::typeinfo& info = b.type();
-  if(info.dtype == bob::io::base::array::t_uint8) {
-    if(info.nd == 2) im_load_gray<uint8_t>(&cinfo, b);
-    else if( info.nd == 3) im_load_color<uint8_t>(&cinfo, b);
-    else {
-      boost::format m("the image in file `%s' has a number of dimensions this jpeg codec has no support for: %s");
+  if(info.nd != 2 && info.nd != 3) {
+    boost::format m("the image in file `%s' has a number of dimensions this jpeg codec has no support for: %s");
+    m % filename % info.str();
+    throw std::runtime_error(m.str());
+  }
+  // the cropped scanlines start at the iMCU column left of x; one more column
+  // on each side keeps the upsampled chroma at the borders of the region
+  // identical to the one of the full image
+  size_t skip = x;
+  if(x > 0 || info.shape[info.nd-1] < cinfo.output_width) {
+#ifdef LIBJPEG_TURBO_VERSION_NUMBER
+    JDIMENSION x_offset = x > 0 ? x - 1 : 0;
+    JDIMENSION width = std::min<JDIMENSION>(x + info.shape[info.nd-1] + 1, cinfo.output_width) - x_offset;
+    jpeg_crop_scanline(&cinfo, &x_offset, &width);
+    skip = x - x_offset;
+#endif
+  }
+  if(y > 0) {
+#ifdef LIBJPEG_TURBO_VERSION_NUMBER
+    jpeg_skip_scanlines(&cinfo, y);
+#else
+    boost::shared_array<JSAMPLE> discard(new JSAMPLE[cinfo.output_width * cinfo.output_components]);
+    JSAMPROW discard_pptr[1] = {discard.get()};
+    while(cinfo.output_scanline < y)
+      jpeg_read_scanlines(&cinfo, discard_pptr, 1);
+#endif
+  }
+  switch(info.dtype) {
+    case bob::io::base::array::t_uint8:
+      im_load_content<uint8_t>(&cinfo, b, skip);
+      break;
+    case bob::io::base::array::t_uint16:
+      im_load_content<uint16_t>(&cinfo, b, skip);
+      break;
+    case bob::io::base::array::t_float32:
+      im_load_content<float>(&cinfo, b, skip);
+      break;
+    case bob::io::base::array::t_float64:
+      im_load_content<double>(&cinfo, b, skip);
+      break;
+    default: {
+      boost::format m("the image in file `%s' has a data type this jpeg codec has no support for: %s");
       m % filename % info.str();
       throw std::runtime_error(m.str());
     }
   }
-  else {
-    boost::format m("the image in file `%s' has a data type this jpeg codec has no support for: %s");
-    m % filename % info.str();
-    throw std::runtime_error(m.str());
-  }
 
-  // 7. Finish decompression
-  jpeg_finish_decompress(&cinfo);
+  // 7. Finish decompression; the scanlines below a region are not decoded
+  if(cinfo.output_scanline < cinfo.output_height)
+    jpeg_abort_decompress(&cinfo);
+  else
+    jpeg_finish_decompress(&cinfo);
 
   // 8. Release JPEG decompression object
   jpeg_destroy_decompress(&cinfo);
@@ -373,17 +441,26 @@ void bob::io::image::JPEGFile::read(bob::io::base::array::interface& buffer, siz
   if (m_newfile)
     throw std::runtime_error("uninitialized image file cannot be read");
 
-  if (!buffer.type().is_compatible(m_type)) buffer.set(m_type);
+  // pixel values are converted while decoding into buffers of other types
+  if (!bob::io::image::is_decodable_as(buffer.type(), m_type)) buffer.set(m_type);
 
   if (index != 0)
     throw std::runtime_error("cannot read image with index > 0 -- there is only one image in an image file");
 
-  if(!buffer.type().is_compatible(m_type)) buffer.set(m_type);
-
   // load jpeg
   im_load(m_filename, buffer);
 }
 
+void bob::io::image::JPEGFile::read_region(bob::io::base::array::interface& buffer, size_t y, size_t x, size_t h, size_t w) {
+  if (m_newfile)
+    throw std::runtime_error("uninitialized image file cannot be read");
+
+  const bob::io::base::array::typeinfo region = bob::io::image::region_type(m_type, y, x, h, w, m_filename);
+  if (!bob::io::image::is_decodable_as(buffer.type(), region)) buffer.set(region);
+
+  im_load(m_filename, buffer, y, x);
+}
+
 size_t bob::io::image::JPEGFile::append(const bob::io::base::array::interface& buffer) {
   if (m_newfile) {
     im_save(m_filename, buffer);
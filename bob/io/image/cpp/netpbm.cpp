@@ -18,8 +18,11 @@
 #include <boost/format.hpp>
 #include <boost/algorithm/string.hpp>
 #include <string>
+#include <vector>
+#include <algorithm>
 
 #include <bob.io.image/netpbm.h>
+#include <bob.io.image/image.h>
 
 #include "pnmio.h"
 
@@ -277,12 +280,49 @@ static void im_peek(const std::string& path, bob::io::base::array::typeinfo& inf
   }
 }
 
+// Reads the pixels of a PBM image bit-packed, (width+7)/8 bytes per row
+static void pnm_readpam_packed(struct pam * const pamP, uint8_t *bits) {
+  const size_t row_bytes = (pamP->width + 7) / 8;
+  if (pamP->format == PBM_BINARY) {
+    // the rows of binary PBM files are already stored packed
+    if (fread(bits, 1, row_bytes * pamP->height, pamP->file) != row_bytes * pamP->height) {
+      boost::format m("pnm_readpam_packed(): The image file ends before all %d rows could be read.");
+      m % pamP->height;
+      throw std::runtime_error(m.str());
+    }
+  } else if (pamP->format == PBM_ASCII) {
+    int *img_data = pnm_allocpam(pamP);
+    pnm_readpam(pamP, img_data);
+    std::vector<uint8_t> row(pamP->width);
+    for (int y = 0; y < pamP->height; ++y) {
+      std::copy(img_data + y * pamP->width, img_data + (y+1) * pamP->width, row.begin());
+      bob::io::image::pack_bits(row.data(), pamP->width, bits + y * row_bytes);
+    }
+    free(img_data);
+  } else {
+    boost::format m("pnm_readpam_packed(): Only PBM images can be read bit-packed.");
+    throw std::runtime_error(m.str());
+  }
+}
+
 template <typename T> static
 void im_load_gray(struct pam *in_pam, bob::io::base::array::interface& b) {
   const bob::io::base::array::typeinfo& info = b.type();
   int c=0;
 
   T *element = static_cast<T*>(b.ptr());
+  if (in_pam->format == PBM_BINARY) {
+    // unpack the rows directly, instead of going through an int per pixel
+    const size_t row_bytes = (in_pam->width + 7) / 8;
+    boost::shared_array<uint8_t> bits(new uint8_t[row_bytes * in_pam->height]);
+    std::vector<uint8_t> row(in_pam->width);
+    pnm_readpam_packed(in_pam, bits.get());
+    for (int y = 0; y < in_pam->height; ++y, element += in_pam->width) {
+      bob::io::image::unpack_bits(bits.get() + y * row_bytes, in_pam->width, 1, row.data());
+      std::copy(row.begin(), row.end(), element);
+    }
+    return;
+  }
   int *img_data = pnm_allocpam(in_pam);
   pnm_readpam(in_pam, img_data);
   for(size_t y=0; y<info.shape[0]; ++y)
@@ -322,7 +362,44 @@ void im_load_color(struct pam *in_pam, bob::io::base::array::interface& b) {
   free(img_data);
 }
 
-static void im_load (const std::string& filename, bob::io::base::array::interface& b) {
+// Reads the region of the size of the buffer with the upper left corner at
+// (y0, x0) of a binary PGM or PPM image, whose rows have a fixed size, so that
+// the rows above the region are skipped and the rows below are not read
+template <typename T> static
+void im_load_region(struct pam *in_pam, bob::io::base::array::interface& b, const size_t y0, const size_t x0) {
+  const bob::io::base::array::typeinfo& info = b.type();
+  const size_t height = info.shape[info.nd-2];
+  const size_t width = info.shape[info.nd-1];
+  const size_t frame_size = height * width;
+  const size_t depth = in_pam->depth;
+  const size_t bytes = in_pam->bytes_per_sample;
+  const size_t row_bytes = in_pam->width * depth * bytes;
+
+  if (y0 > 0 && fseek(in_pam->file, y0 * row_bytes, SEEK_CUR) != 0)
+    throw std::runtime_error("im_load_region(): Cannot seek to the first row of the region.");
+
+  std::vector<uint8_t> row(row_bytes);
+  T *element = static_cast<T*>(b.ptr());
+  for (size_t y = 0; y < height; ++y) {
+    if (fread(row.data(), 1, row_bytes, in_pam->file) != row_bytes) {
+      boost::format m("im_load_region(): The image file ends before row %d of the region could be read.");
+      m % (y0 + y);
+      throw std::runtime_error(m.str());
+    }
+    for (size_t x = 0; x < width; ++x) {
+      for (size_t c = 0; c < depth; ++c) {
+        // 16 bit samples are stored most significant byte first
+        const uint8_t* sample = &row[((x0 + x) * depth + c) * bytes];
+        element[c * frame_size + y * width + x] = (bytes == 1 ? sample[0] : (sample[0] << 8 | sample[1]));
+      }
+    }
+  }
+}
+
+// Reads the image, or the region of the size of the buffer with the upper left
+// corner at (y0, x0); regions of plain (text) and PBM images are copied from
+// the complete image
+static void im_load (const std::string& filename, bob::io::base::array::interface& b, const size_t y0 = 0, const size_t x0 = 0) {
 
   struct pam in_pam;
   boost::shared_ptr<std::FILE> in_file = make_cfile(filename.c_str(), "r");
@@ -330,6 +407,28 @@ static void im_load (const std::string& filename, bob::io::base::array::interfac
 
   const bob::io::base::array::typeinfo& info = b.type();
 
+  if ((int)info.shape[info.nd-2] < in_pam.height || (int)info.shape[info.nd-1] < in_pam.width) {
+    if ((in_pam.format == PGM_BINARY || in_pam.format == PPM_BINARY) && (info.nd == 2) == (in_pam.depth == 1)) {
+      if (info.dtype == bob::io::base::array::t_uint8) im_load_region<uint8_t>(&in_pam, b, y0, x0);
+      else if (info.dtype == bob::io::base::array::t_uint16) im_load_region<uint16_t>(&in_pam, b, y0, x0);
+      else {
+        boost::format m("(netpbm) unsupported image type found in file `%s': %s");
+        m % filename % info.str();
+        throw std::runtime_error(m.str());
+      }
+      return;
+    }
+    in_file.reset();
+    bob::io::base::array::typeinfo full(info);
+    full.shape[full.nd-2] = in_pam.height;
+    full.shape[full.nd-1] = in_pam.width;
+    full.update_strides();
+    bob::io::base::array::blitz_array image(full);
+    im_load(filename, image);
+    bob::io::image::copy_region(image, y0, x0, b);
+    return;
+  }
+
   if (info.dtype == bob::io::base::array::t_uint8) {
     if(info.nd == 2) im_load_gray<uint8_t>(&in_pam, b);
     else if( info.nd == 3) im_load_color<uint8_t>(&in_pam, b);
@@ -357,6 +456,19 @@ static void im_load (const std::string& filename, bob::io::base::array::interfac
   }
 }
 
+static void im_load_packed(const std::string& filename, blitz::Array<uint8_t,2>& bits) {
+  struct pam in_pam;
+  boost::shared_ptr<std::FILE> in_file = make_cfile(filename.c_str(), "r");
+  pnm_readpaminit(in_file.get(), &in_pam, sizeof(struct pam));
+  if (in_pam.format != PBM_ASCII && in_pam.format != PBM_BINARY) {
+    boost::format m("(netpbm) cannot read file `%s' bit-packed: only PBM images are bilevel");
+    m % filename;
+    throw std::runtime_error(m.str());
+  }
+  bits.resize(in_pam.height, (in_pam.width + 7) / 8);
+  pnm_readpam_packed(&in_pam, bits.data());
+}
+
 /**
  * SAVING
  */
@@ -483,6 +595,31 @@ static void im_save (const std::string& filename, const bob::io::base::array::in
   }
 }
 
+static void im_save_packed(const std::string& filename, const blitz::Array<uint8_t,2>& bits, int width) {
+  if (bits.extent(1) != (width + 7) / 8) {
+    boost::format m("(netpbm) cannot write %d bytes per row of packed bits for an image of width %d");
+    m % bits.extent(1) % width;
+    throw std::runtime_error(m.str());
+  }
+  std::string ext = boost::filesystem::path(filename).extension().c_str();
+  boost::algorithm::to_lower(ext);
+  if (ext.compare(".pbm")) {
+    boost::format m("(netpbm) cannot write packed bits to file `%s': filename extension .pbm is required");
+    m % filename;
+    throw std::runtime_error(m.str());
+  }
+
+  const blitz::Array<uint8_t,2> packed = bits.isStorageContiguous() ? bits : bits.copy();
+  boost::shared_ptr<std::FILE> out_file = make_cfile(filename.c_str(), "w");
+  // binary PBM stores exactly the packed rows
+  fprintf(out_file.get(), "P4\n%d %d\n", width, packed.extent(0));
+  if (fwrite(packed.data(), 1, packed.size(), out_file.get()) != packed.size()) {
+    boost::format m("(netpbm) cannot write packed bits to file `%s'");
+    m % filename;
+    throw std::runtime_error(m.str());
+  }
+}
+
 
 /**
  * NetPBM class
@@ -544,6 +681,37 @@ void bob::io::image::NetPBMFile::write(const bob::io::base::array::interface& bu
   throw std::runtime_error("image files only accept a single array");
 }
 
+void bob::io::image::NetPBMFile::read_region(bob::io::base::array::interface& buffer, size_t y, size_t x, size_t h, size_t w) {
+  if (m_newfile)
+    throw std::runtime_error("uninitialized image file cannot be read");
+
+  const bob::io::base::array::typeinfo region = bob::io::image::region_type(m_type, y, x, h, w, m_filename);
+  if (!buffer.type().is_compatible(region)) buffer.set(region);
+
+  im_load(m_filename, buffer, y, x);
+}
+
+void bob::io::image::NetPBMFile::read_packed(blitz::Array<uint8_t,2>& bits) {
+  if (m_newfile)
+    throw std::runtime_error("uninitialized image file cannot be read");
+
+  im_load_packed(m_filename, bits);
+}
+
+void bob::io::image::NetPBMFile::write_packed(const blitz::Array<uint8_t,2>& bits, int width) {
+  if (!m_newfile)
+    throw std::runtime_error("image files only accept a single array");
+
+  im_save_packed(m_filename, bits, width);
+  m_type.dtype = bob::io::base::array::t_uint8;
+  m_type.nd = 2;
+  m_type.shape[0] = bits.extent(0);
+  m_type.shape[1] = width;
+  m_type.update_strides();
+  m_newfile = false;
+  m_length = 1;
+}
+
 std::string bob::io::image::NetPBMFile::s_codecname = "bob.image_netpbm";
 
 
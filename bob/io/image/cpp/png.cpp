@@ -19,10 +19,17 @@
 #include <boost/format.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/algorithm/string.hpp>
+#include <boost/type_traits/is_same.hpp>
 #include <string>
+#include <algorithm>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include <bob.core/logging.h>
 #include <bob.io.image/png.h>
+#include <bob.io.image/image.h>
 
 extern "C" {
 #include <png.h>
@@ -63,6 +70,35 @@ static void my_png_warning(png_structp png_ptr, png_const_charp message){
   bob::core::debug << "In image '" << reinterpret_cast<char*>(png_get_error_ptr(png_ptr)) << "' PNG warning has occured -> " << message << std::endl;
 }
 
+static void my_png_ignore_warning(png_structp, png_const_charp){
+  // trusted input -> warnings are not formatted at all
+}
+
+// For trusted input, decoding skips checks and chunks that are not needed to
+// get the pixels: CRCs (and the zlib checksum, if libpng supports skipping
+// it) are not verified and all ancillary chunks are skipped unparsed
+static png_structp create_read_struct(const std::string& filename)
+{
+  const bool trusted = bob::io::image::get_trusted_input();
+  png_structp png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, const_cast<char*>(filename.c_str()), my_png_error, trusted ? my_png_ignore_warning : my_png_warning);
+  if(png_ptr == NULL) throw std::runtime_error("PNG: error while creating read png structure (function png_create_read_struct())");
+  if(!trusted) return png_ptr;
+
+  png_set_crc_action(png_ptr, PNG_CRC_QUIET_USE, PNG_CRC_QUIET_USE);
+#if defined(PNG_IGNORE_ADLER32) && defined(PNG_SET_OPTION_SUPPORTED)
+  png_set_option(png_ptr, PNG_IGNORE_ADLER32, PNG_OPTION_ON);
+#endif
+#ifdef PNG_HANDLE_AS_UNKNOWN_SUPPORTED
+  // tRNS is kept, since it decides whether the alpha channel is stripped
+  static const png_byte ancillary_chunks[] =
+    "bKGD\0cHRM\0eXIf\0gAMA\0hIST\0iCCP\0iTXt\0oFFs\0pCAL\0pHYs\0"
+    "sBIT\0sCAL\0sPLT\0sRGB\0tEXt\0tIME\0zTXt";
+  png_set_keep_unknown_chunks(png_ptr, PNG_HANDLE_CHUNK_NEVER, NULL, 0);
+  png_set_keep_unknown_chunks(png_ptr, PNG_HANDLE_CHUNK_NEVER, ancillary_chunks, sizeof(ancillary_chunks) / 5);
+#endif
+  return png_ptr;
+}
+
 /**
  * LOADING
  */
@@ -78,8 +114,7 @@ static void im_peek(const std::string& path, bob::io::base::array::typeinfo& inf
   // 3. Create and initialize the png_struct. The compiler header file version
   //    is supplied, so that we know if the application was compiled with a
   //    compatible version of the library.
-  png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, const_cast<char*>(path.c_str()), my_png_error, my_png_warning);
-  if(png_ptr == NULL) throw std::runtime_error("PNG: error while creating read png structure (function png_create_read_struct())");
+  png_ptr = create_read_struct(path);
 
   // Allocate/initialize the memory for image information.
   info_ptr = png_create_info_struct(png_ptr);
@@ -124,79 +159,126 @@ static uint16_t switch_endianess(const uint16_t p){
   return p / 256 + p % 256 * 256;
 }
 
-template <typename T> static
-void imbuffer_to_gray(const size_t size, const T* im, T* g)
-{
-  std::copy(im, im+size, g);
+static bool is_little_endian(){
+  const uint16_t v = 1;
+  return *reinterpret_cast<const uint8_t*>(&v) == 1;
 }
 
-template <>
-void imbuffer_to_gray(const size_t size, const uint16_t* im, uint16_t* g)
+// Geometry of the seven Adam7 passes: first row/column and increments of the
+// pixels that are stored in a pass, and the size of the block that a pixel of
+// this pass covers when decoding stops early (coarse preview)
+static const size_t s_adam7_ystart[7] = {0, 0, 4, 0, 2, 0, 1};
+static const size_t s_adam7_yinc[7]   = {8, 8, 8, 4, 4, 2, 2};
+static const size_t s_adam7_xstart[7] = {0, 4, 0, 2, 0, 1, 0};
+static const size_t s_adam7_xinc[7]   = {8, 8, 4, 4, 2, 2, 1};
+static const size_t s_adam7_height[7] = {8, 8, 4, 4, 2, 2, 1};
+static const size_t s_adam7_width[7]  = {8, 4, 4, 2, 2, 1, 1};
+
+// Scatters one decoded row of an Adam7 pass (interleaved, with the given
+// number of channels) into the planes of the destination image. Each pixel is
+// replicated into a block of block_h x block_w pixels (clipped at the image
+// borders); for a complete decode, the block size is 1x1.
+template <typename S, typename D> static
+void adam7_scatter_row(const S* row, const size_t channels, const size_t y,
+  const size_t x0, const size_t dx, const size_t block_h, const size_t block_w,
+  const size_t height, const size_t width, D* image)
 {
-  for(size_t k=0; k<size; ++k)
+  const size_t frame_size = height * width;
+  const size_t y1 = std::min(y + block_h, height);
+  for(size_t c=0; c<channels; ++c)
   {
-    *g++ = switch_endianess(*im++);
+    D* plane = image + c*frame_size;
+    const S* pixel = row + c;
+    for(size_t x=x0; x<width; x+=dx, pixel+=channels)
+    {
+      const size_t x1 = std::min(x + block_w, width);
+      const D value = bob::io::image::convert_sample<D>(*pixel);
+      for(size_t yy=y; yy<y1; ++yy)
+        std::fill(plane + yy*width + x, plane + yy*width + x1, value);
+    }
   }
 }
 
+// Reads the first max_passes passes of an Adam7 interlaced image straight into
+// the destination planes. libpng's own interlace handling is not used, so
+// every png_read_row() delivers the pixels of one row of the reduced pass
+// image, and no pixel is ever read from an uninitialized row buffer.
+template <typename S, typename D> static
+void im_load_interlaced(png_structp png_ptr, const size_t channels,
+  const size_t height, const size_t width, const int max_passes, D* image)
+{
+  boost::shared_array<S> row(new S[channels*width]);
+  png_bytep row_pointer = reinterpret_cast<png_bytep>(row.get());
 
+  const bool preview = max_passes < 7;
+  for(int pass=0; pass<max_passes; ++pass)
+  {
+    // libpng skips passes that do not contain any pixel
+    if(s_adam7_xstart[pass] >= width || s_adam7_ystart[pass] >= height)
+      continue;
+    const size_t block_h = preview ? s_adam7_height[pass] : 1;
+    const size_t block_w = preview ? s_adam7_width[pass] : 1;
+    for(size_t y=s_adam7_ystart[pass]; y<height; y+=s_adam7_yinc[pass])
+    {
+      png_read_row(png_ptr, row_pointer, NULL);
+      adam7_scatter_row(row.get(), channels, y, s_adam7_xstart[pass],
+        s_adam7_xinc[pass], block_h, block_w, height, width, image);
+    }
+  }
+}
 
-template <typename T> static
-void im_load_gray(png_structp png_ptr, bob::io::base::array::interface& b)
+// Reads rows of samples of type S into the gray image of type D; regions of
+// non-interlaced images start at row y0 and column x0 of rows of image_width
+template <typename S, typename D> static
+void im_load_gray(png_structp png_ptr, bob::io::base::array::interface& b, const int number_passes, const int max_passes,
+  const size_t image_width, const size_t y0, const size_t x0)
 {
   const bob::io::base::array::typeinfo& info = b.type();
   const size_t height = info.shape[0];
   const size_t width = info.shape[1];
+  D* image = reinterpret_cast<D*>(b.ptr());
 
-#ifdef PNG_READ_INTERLACING_SUPPORTED
-  // Turn on interlace handling.
-  int number_passes = png_set_interlace_handling(png_ptr);
-#else
-  int number_passes = 1;
-#endif // PNG_READ_INTERLACING_SUPPORTED
+  if(number_passes > 1)
+  {
+    im_load_interlaced<S>(png_ptr, 1, height, width, max_passes, image);
+    return;
+  }
 
-  // Allocate array to contain a row of pixels
-  boost::shared_array<T> row(new T[width]);
-  png_bytep row_pointer = reinterpret_cast<png_bytep>(row.get());
+  boost::shared_array<S> row(new S[image_width]);
+  for(size_t y=0; y<y0; ++y)
+    png_read_row(png_ptr, reinterpret_cast<png_bytep>(row.get()), NULL);
 
-  // Read the image (one row at a time)
-  // This can deal with interlacing
-  for(int pass=0; pass<number_passes; ++pass)
+  if(boost::is_same<S,D>::value && width == image_width)
   {
-    // Loop over the rows
+    // Read the image (one row at a time) in place
     for(size_t y=0; y<height; ++y)
-    {
-      png_read_row(png_ptr, row_pointer, NULL);
-      imbuffer_to_gray(width, reinterpret_cast<T*>(row_pointer), reinterpret_cast<T*>(b.ptr())+y*width);
-    }
+      png_read_row(png_ptr, reinterpret_cast<png_bytep>(image + y*width), NULL);
+    return;
   }
-}
 
-template <typename T> static
-void imbuffer_to_rgb(const size_t size, const T* im, T* r, T* g, T* b)
-{
-  for(size_t k=0; k<size; ++k)
+  // Convert each row into the destination, while it is still in the cache
+  for(size_t y=0; y<height; ++y)
   {
-    *r++ = *im++;
-    *g++ = *im++;
-    *b++ = *im++;
+    png_read_row(png_ptr, reinterpret_cast<png_bytep>(row.get()), NULL);
+    bob::io::image::convert_samples(row.get() + x0, width, image + y*width);
   }
 }
 
-template <>
-void imbuffer_to_rgb(const size_t size, const uint16_t* im, uint16_t* r, uint16_t* g, uint16_t* b)
+template <typename S, typename D> static
+void imbuffer_to_rgb(const size_t size, const S* im, D* r, D* g, D* b)
 {
   for(size_t k=0; k<size; ++k)
   {
-    *r++ = switch_endianess(*im++);
-    *g++ = switch_endianess(*im++);
-    *b++ = switch_endianess(*im++);
+    *r++ = bob::io::image::convert_sample<D>(*im++);
+    *g++ = bob::io::image::convert_sample<D>(*im++);
+    *b++ = bob::io::image::convert_sample<D>(*im++);
   }
 }
 
 
-template <typename T> static
-void im_load_color(png_structp png_ptr, bob::io::base::array::interface& b)
+template <typename S, typename D> static
+void im_load_color(png_structp png_ptr, bob::io::base::array::interface& b, const int number_passes, const int max_passes,
+  const size_t image_width, const size_t y0, const size_t x0)
 {
   const bob::io::base::array::typeinfo& info = b.type();
   const size_t height = info.shape[1];
@@ -204,40 +286,56 @@ void im_load_color(png_structp png_ptr, bob::io::base::array::interface& b)
   const size_t frame_size = height * width;
   const size_t row_color_stride = width;
 
+  if(number_passes > 1)
+  {
+    im_load_interlaced<S>(png_ptr, 3, height, width, max_passes, reinterpret_cast<D*>(b.ptr()));
+    return;
+  }
+
   // Allocate array to contains a row of RGB-like pixels
-  boost::shared_array<T> row(new T[3*width]);
+  boost::shared_array<S> row(new S[3*image_width]);
   png_bytep row_pointer = reinterpret_cast<png_bytep>(row.get());
-
-#ifdef PNG_READ_INTERLACING_SUPPORTED
-  // Turn on interlace handling.
-  int number_passes = png_set_interlace_handling(png_ptr);
-#else
-  int number_passes = 1;
-#endif // PNG_READ_INTERLACING_SUPPORTED
+  for(size_t y=0; y<y0; ++y)
+    png_read_row(png_ptr, row_pointer, NULL);
 
   // Read the image (one row at a time)
-  // This can deal with interlacing
-  T *element_r;
-  T *element_g;
-  T *element_b;
-  for(int pass=0; pass<number_passes; ++pass)
+  D *element_r = reinterpret_cast<D*>(b.ptr());
+  D *element_g = element_r + frame_size;
+  D *element_b = element_g + frame_size;
+  for(size_t y=0; y<height; ++y)
   {
-    element_r = reinterpret_cast<T*>(b.ptr());
-    element_g = element_r + frame_size;
-    element_b = element_g + frame_size;
-    // Loop over the rows
-    for(size_t y=0; y<height; ++y)
-    {
-      png_read_row(png_ptr, row_pointer, NULL);
-      imbuffer_to_rgb(row_color_stride, reinterpret_cast<T*>(row_pointer), element_r, element_g, element_b);
-      element_r += row_color_stride;
-      element_g += row_color_stride;
-      element_b += row_color_stride;
-    }
+    png_read_row(png_ptr, row_pointer, NULL);
+    imbuffer_to_rgb(row_color_stride, row.get() + 3*x0, element_r, element_g, element_b);
+    element_r += row_color_stride;
+    element_g += row_color_stride;
+    element_b += row_color_stride;
   }
 }
 
-static void im_load(const std::string& filename, bob::io::base::array::interface& b)
+// Reads the image with samples of type S (after all libpng transformations)
+// into the destination of type D
+template <typename S, typename D> static
+void im_load_content(png_structp png_ptr, bob::io::base::array::interface& b, const int number_passes, const int max_passes,
+  const size_t image_width, const size_t y0, const size_t x0)
+{
+  if(b.type().nd == 2) im_load_gray<S,D>(png_ptr, b, number_passes, max_passes, image_width, y0, x0);
+  else im_load_color<S,D>(png_ptr, b, number_passes, max_passes, image_width, y0, x0);
+}
+
+template <typename D> static
+void im_load_content(png_structp png_ptr, bob::io::base::array::interface& b, const int bit_depth, const int number_passes, const int max_passes,
+  const size_t image_width, const size_t y0, const size_t x0)
+{
+  if(bit_depth == 16) im_load_content<uint16_t,D>(png_ptr, b, number_passes, max_passes, image_width, y0, x0);
+  else im_load_content<uint8_t,D>(png_ptr, b, number_passes, max_passes, image_width, y0, x0);
+}
+
+// Reads the image, or the region of the size of the buffer with the upper left
+// corner at (y0, x0): the rows above the region are decompressed into a
+// scratch row, and decompression stops after the last row of the region.
+// Interlaced images are decoded completely, and the region is copied.
+static void im_load(const std::string& filename, bob::io::base::array::interface& b, const int max_passes,
+  const size_t y0 = 0, const size_t x0 = 0)
 {
   // 1. PNG structure declarations
   png_structp png_ptr;
@@ -249,8 +347,7 @@ static void im_load(const std::string& filename, bob::io::base::array::interface
   // 3. Create and initialize the png_struct with the desired error handler
   // functions. The compiler header file version is supplied, so that we
   // know if the application was compiled with a compatible version of the library.
-  png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, const_cast<char*>(filename.c_str()), my_png_error, my_png_warning);
-  if(png_ptr == NULL) throw std::runtime_error("PNG: error while creating read png structure (function png_create_read_struct())");
+  png_ptr = create_read_struct(filename);
 
   // Allocate/initialize the memory for image informatio
   info_ptr = png_create_info_struct(png_ptr);
@@ -270,6 +367,7 @@ static void im_load(const std::string& filename, bob::io::base::array::interface
   int bit_depth, color_type, interlace_type;
   png_get_IHDR(png_ptr, info_ptr, &width, &height, &bit_depth, &color_type,
        &interlace_type, NULL, NULL);
+  const bob::io::base::array::typeinfo& info = b.type();
 
   // Extract multiple pixels with bit depths of 1, 2, and 4 from a single
   // byte into separate bytes (useful for paletted and grayscale images).
@@ -283,6 +381,25 @@ static void im_load(const std::string& filename, bob::io::base::array::interface
   // skip the alpha channel
   if ((color_type & PNG_COLOR_MASK_ALPHA) || png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS))
     png_set_strip_alpha(png_ptr);
+  // 16 bit images that are read as 8 bit are scaled down by libpng, so that
+  // the rows can be decoded straight into the destination
+  if(bit_depth == 16 && info.dtype == bob::io::base::array::t_uint8)
+  {
+#ifdef PNG_READ_SCALE_16_TO_8_SUPPORTED
+    png_set_scale_16(png_ptr);
+#else
+    png_set_strip_16(png_ptr);
+#endif
+    bit_depth = 8;
+  }
+  // PNG stores 16 bit samples in network byte order; let libpng swap them
+  // so that rows can be decoded straight into the destination
+  if(bit_depth == 16 && is_little_endian())
+    png_set_swap(png_ptr);
+
+  // Adam7 interlaced images are decoded pass by pass; decoding may stop
+  // early, after max_passes, to get a coarse preview of the image
+  const int number_passes = (interlace_type == PNG_INTERLACE_ADAM7 ? 7 : 1);
 
   // Check color type
   switch (color_type){
@@ -297,41 +414,149 @@ static void im_load(const std::string& filename, bob::io::base::array::interface
       throw std::runtime_error("PNG: codec does not support images with color spaces different than GRAY, GRAY+alpha, RGB, RGB+alpha or Indexed colors (Palette)");
   }
 
-  // 6. Read content
-  const bob::io::base::array::typeinfo& info = b.type();
-  if(info.dtype == bob::io::base::array::t_uint8) {
-    if(info.nd == 2) im_load_gray<uint8_t>(png_ptr, b);
-    else if(info.nd == 3) im_load_color<uint8_t>(png_ptr, b);
-    else {
-      png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
-      boost::format m("the image in file `%s' has a number of dimensions for which this png codec has no support for: %s");
-      m % info.str();
-      throw std::runtime_error(m.str());
-    }
+  // 6. Read content, converting it to the data type of the destination
+  if(info.nd != 2 && info.nd != 3) {
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    boost::format m("the image in file `%s' has a number of dimensions for which this png codec has no support for: %s");
+    m % filename % info.str();
+    throw std::runtime_error(m.str());
   }
-  else if(info.dtype == bob::io::base::array::t_uint16) {
-    if(info.nd == 2) im_load_gray<uint16_t>(png_ptr, b);
-    else if( info.nd == 3) im_load_color<uint16_t>(png_ptr, b);
-    else {
+  const bool region = (info.shape[info.nd-2] < height || info.shape[info.nd-1] < width);
+  if(region && number_passes > 1)
+  {
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    bob::io::base::array::typeinfo full(info);
+    full.shape[full.nd-2] = height;
+    full.shape[full.nd-1] = width;
+    full.update_strides();
+    bob::io::base::array::blitz_array image(full);
+    im_load(filename, image, max_passes);
+    bob::io::image::copy_region(image, y0, x0, b);
+    return;
+  }
+  switch(info.dtype) {
+    case bob::io::base::array::t_uint8:
+      im_load_content<uint8_t>(png_ptr, b, bit_depth, number_passes, max_passes, width, y0, x0);
+      break;
+    case bob::io::base::array::t_uint16:
+      im_load_content<uint16_t>(png_ptr, b, bit_depth, number_passes, max_passes, width, y0, x0);
+      break;
+    case bob::io::base::array::t_float32:
+      im_load_content<float>(png_ptr, b, bit_depth, number_passes, max_passes, width, y0, x0);
+      break;
+    case bob::io::base::array::t_float64:
+      im_load_content<double>(png_ptr, b, bit_depth, number_passes, max_passes, width, y0, x0);
+      break;
+    default: {
       png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
-      boost::format m("the image in file `%s' has a number of dimensions for which this png codec has no support for: %s");
-      m % info.str();
+      boost::format m("the image in file `%s' has a data type this png codec has no support for: %s");
+      m % filename % info.str();
       throw std::runtime_error(m.str());
     }
   }
-  else {
+
+  // 8. Clean up after the read, and free any memory allocated
+  // Read rest of file, and get additional chunks in info_ptr; when only a
+  // preview was requested, the remaining passes are not decompressed at all
+  if((number_passes == 1 && y0 + info.shape[info.nd-2] == height) || (number_passes > 1 && max_passes >= number_passes))
+    png_read_end(png_ptr, NULL);
+  png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+}
+
+// Reads the palette indices of a palette image, without expanding them
+static void im_load_indexed(const std::string& filename, blitz::Array<uint8_t,2>& indices, blitz::Array<uint8_t,2>& palette)
+{
+  boost::shared_ptr<std::FILE> in_file = make_cfile(filename.c_str(), "rb");
+  png_structp png_ptr = create_read_struct(filename);
+  png_infop info_ptr = png_create_info_struct(png_ptr);
+  if(info_ptr == NULL) {
+    png_destroy_read_struct(&png_ptr, NULL, NULL);
+    throw std::runtime_error("PNG: error while creating info png structure (function png_create_info_struct())");
+  }
+  png_init_io(png_ptr, in_file.get());
+  png_read_info(png_ptr, info_ptr);
+
+  png_uint_32 width, height;
+  int bit_depth, color_type, interlace_type;
+  png_get_IHDR(png_ptr, info_ptr, &width, &height, &bit_depth, &color_type,
+       &interlace_type, NULL, NULL);
+  png_colorp colors;
+  int num_colors;
+  if(color_type != PNG_COLOR_TYPE_PALETTE || !png_get_PLTE(png_ptr, info_ptr, &colors, &num_colors)) {
     png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
-    boost::format m("the image in file `%s' has a data type this png codec has no support for: %s");
-    m % info.str();
+    boost::format m("the image in file `%s' is not a palette image");
+    m % filename;
     throw std::runtime_error(m.str());
   }
 
-  // 8. Clean up after the read, and free any memory allocated
-  // Read rest of file, and get additional chunks in info_ptr
+  palette.resize(num_colors, 3);
+  for(int i=0; i<num_colors; ++i) {
+    palette(i,0) = colors[i].red;
+    palette(i,1) = colors[i].green;
+    palette(i,2) = colors[i].blue;
+  }
+
+  // Indices with 1, 2 or 4 bits are unpacked to one byte each, and decoded
+  // straight into the output
+  png_set_packing(png_ptr);
+  indices.resize(height, width);
+  uint8_t* image = indices.data();
+  if(interlace_type == PNG_INTERLACE_ADAM7)
+    im_load_interlaced<uint8_t>(png_ptr, 1, height, width, 7, image);
+  else
+    for(size_t y=0; y<height; ++y)
+      png_read_row(png_ptr, image + y*width, NULL);
+
   png_read_end(png_ptr, NULL);
   png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
 }
 
+// Reads a 1 bit gray image bit-packed; PNG stores white pixels as set bits,
+// which are inverted to black ones
+static void im_load_packed(const std::string& filename, blitz::Array<uint8_t,2>& bits)
+{
+  boost::shared_ptr<std::FILE> in_file = make_cfile(filename.c_str(), "rb");
+  png_structp png_ptr = create_read_struct(filename);
+  png_infop info_ptr = png_create_info_struct(png_ptr);
+  if(info_ptr == NULL) {
+    png_destroy_read_struct(&png_ptr, NULL, NULL);
+    throw std::runtime_error("PNG: error while creating info png structure (function png_create_info_struct())");
+  }
+  png_init_io(png_ptr, in_file.get());
+  png_read_info(png_ptr, info_ptr);
+
+  png_uint_32 width, height;
+  int bit_depth, color_type, interlace_type;
+  png_get_IHDR(png_ptr, info_ptr, &width, &height, &bit_depth, &color_type,
+       &interlace_type, NULL, NULL);
+  if(color_type != PNG_COLOR_TYPE_GRAY || bit_depth != 1) {
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    boost::format m("the image in file `%s' is not a bilevel (1 bit gray) image");
+    m % filename;
+    throw std::runtime_error(m.str());
+  }
+
+  const size_t row_bytes = (width + 7) / 8;
+  bits.resize(height, row_bytes);
+  uint8_t* image = bits.data();
+  if(interlace_type == PNG_INTERLACE_ADAM7)
+  {
+    // passes only cover parts of the rows; collect them unpacked first
+    png_set_packing(png_ptr);
+    boost::shared_array<uint8_t> pixels(new uint8_t[height * width]);
+    im_load_interlaced<uint8_t>(png_ptr, 1, height, width, 7, pixels.get());
+    for(size_t y=0; y<height; ++y)
+      bob::io::image::pack_bits(pixels.get() + y*width, width, image + y*row_bytes);
+  }
+  else
+    for(size_t y=0; y<height; ++y)
+      png_read_row(png_ptr, image + y*row_bytes, NULL);
+  for(size_t y=0; y<height; ++y)
+    bob::io::image::invert_bits(image + y*row_bytes, width);
+
+  png_read_end(png_ptr, NULL);
+  png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+}
 
 /**
  * SAVING
@@ -424,7 +649,229 @@ static void im_save_color(const bob::io::base::array::interface& b, png_structp
   }
 }
 
-static void im_save(const std::string& filename, const bob::io::base::array::interface& array)
+/**
+ * AUTO-PACKING
+ */
+// The smallest PNG representation that stores all pixel values of an image
+// exactly; for 16 bit images, this might be an 8 bit representation
+struct png_packing {
+  int bit_depth;
+  int color_type;
+  // maps 8 bit gray values to the stored samples or palette indices
+  png_byte gray_lut[256];
+  // the palette, and a hash table from packed RGB colors to palette indices
+  std::vector<png_color> palette;
+  std::vector<png_uint_32> colors;
+  std::vector<png_byte> indices;
+};
+
+// Size of the open addressing color table; a power of 2 that stays sparse
+// with 256 colors
+static const size_t s_color_table_bits = 10;
+
+static inline png_uint_32 pack_rgb(const unsigned r, const unsigned g, const unsigned b)
+{
+  // the extra bit makes sure that no color is packed to the empty key 0
+  return 0x1000000 | (r << 16) | (g << 8) | b;
+}
+
+// Returns the slot of the given color in the table, which is empty if the
+// color has not been inserted yet
+static inline size_t color_slot(const std::vector<png_uint_32>& colors, const png_uint_32 key)
+{
+  const size_t mask = colors.size() - 1;
+  size_t slot = (key * 2654435761u) >> (32 - s_color_table_bits);
+  while(colors[slot] != 0 && colors[slot] != key) slot = (slot + 1) & mask;
+  return slot;
+}
+
+static bool fits_8_bits(const uint8_t*, const size_t)
+{
+  return true;
+}
+
+// All values are below 256 when none of them has a bit of its high byte set;
+// the values are or-ed 8 at a time with SSE2
+static bool fits_8_bits(const uint16_t* data, const size_t size)
+{
+  size_t k = 0;
+#ifdef __SSE2__
+  __m128i bits = _mm_setzero_si128();
+  for(; k + 8 <= size; k += 8)
+    bits = _mm_or_si128(bits, _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + k)));
+  if(_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_srli_epi16(bits, 8), _mm_setzero_si128())) != 0xffff)
+    return false;
+#endif
+  uint16_t rest = 0;
+  for(; k < size; ++k) rest |= data[k];
+  return rest <= 255;
+}
+
+static int palette_bit_depth(const size_t colors)
+{
+  return colors <= 2 ? 1 : colors <= 4 ? 2 : colors <= 16 ? 4 : 8;
+}
+
+// Gray images are stored with 1, 2 or 4 bits when all values lie on the grid
+// to which libpng expands these depths (multiples of 255, 85 or 17), or else
+// with 8 bits. Palettes would make them color images when they are read, so
+// that only label maps ask for a palette of the used values in increasing
+// order, which keeps the labels 0, 1, ... as their palette indices.
+static void find_gray_packing(const bool* used, const bool gray_palette, png_packing& pack)
+{
+  for(int depth=1; depth<8; depth*=2)
+  {
+    const int step = 255 / ((1 << depth) - 1);
+    bool fits = true;
+    for(int v=0; v<256 && fits; ++v)
+      fits = !used[v] || v % step == 0;
+    if(fits)
+    {
+      pack.bit_depth = depth;
+      pack.color_type = PNG_COLOR_TYPE_GRAY;
+      for(int v=0; v<256; ++v) pack.gray_lut[v] = v / step;
+      return;
+    }
+  }
+
+  if(gray_palette && std::count(used, used+256, true) <= 16)
+  {
+    for(int v=0; v<256; ++v)
+    {
+      if(!used[v]) continue;
+      pack.gray_lut[v] = pack.palette.size();
+      png_color c = {(png_byte)v, (png_byte)v, (png_byte)v};
+      pack.palette.push_back(c);
+    }
+    pack.bit_depth = palette_bit_depth(pack.palette.size());
+    pack.color_type = PNG_COLOR_TYPE_PALETTE;
+    return;
+  }
+
+  pack.bit_depth = 8;
+  pack.color_type = PNG_COLOR_TYPE_GRAY;
+  for(int v=0; v<256; ++v) pack.gray_lut[v] = v;
+}
+
+template <typename T> static
+void find_packing(const bob::io::base::array::interface& b, const bob::io::image::PNGPackOptions& options, png_packing& pack)
+{
+  const bob::io::base::array::typeinfo& info = b.type();
+  const T* data = static_cast<const T*>(b.ptr());
+  const size_t size = info.size();
+  if(!fits_8_bits(data, size)) return;
+
+  if(info.nd == 2)
+  {
+    // histogram of the used gray values
+    bool used[256] = {false};
+    for(size_t k=0; k<size; ++k) used[data[k]] = true;
+    find_gray_packing(used, options.gray_palette, pack);
+    return;
+  }
+
+  // collect up to 256 distinct colors; consecutive pixels often share their
+  // color, so the last color is checked before the table lookup
+  const size_t frame_size = size / 3;
+  const T* r = data;
+  const T* g = r + frame_size;
+  const T* bl = g + frame_size;
+  pack.colors.assign(1 << s_color_table_bits, 0);
+  pack.indices.assign(1 << s_color_table_bits, 0);
+  png_uint_32 last = 0;
+  for(size_t k=0; k<frame_size; ++k)
+  {
+    const png_uint_32 key = pack_rgb(r[k], g[k], bl[k]);
+    if(key == last) continue;
+    last = key;
+    const size_t slot = color_slot(pack.colors, key);
+    if(pack.colors[slot] != 0) continue;
+    if(pack.palette.size() == 256)
+    {
+      // too many colors for a palette, but 8 bits suffice
+      pack.palette.clear();
+      pack.colors.clear();
+      pack.indices.clear();
+      pack.bit_depth = 8;
+      return;
+    }
+    pack.colors[slot] = key;
+    pack.indices[slot] = pack.palette.size();
+    png_color c = {(png_byte)r[k], (png_byte)g[k], (png_byte)bl[k]};
+    pack.palette.push_back(c);
+  }
+  pack.bit_depth = palette_bit_depth(pack.palette.size());
+  pack.color_type = PNG_COLOR_TYPE_PALETTE;
+}
+
+// Writes gray images, or gray palette indices, with one byte per pixel; the
+// samples are packed to lower bit depths by libpng
+template <typename T>
+static void im_save_gray_packed(const bob::io::base::array::interface& b, png_structp png_ptr, const png_packing& pack)
+{
+  const bob::io::base::array::typeinfo& info = b.type();
+  const size_t height = info.shape[0];
+  const size_t width = info.shape[1];
+
+  const T* element = static_cast<const T*>(b.ptr());
+  boost::shared_array<png_byte> row(new png_byte[width]);
+  for(size_t y=0; y<height; ++y)
+  {
+    for(size_t x=0; x<width; ++x) row[x] = pack.gray_lut[*element++];
+    png_write_row(png_ptr, row.get());
+  }
+}
+
+// Writes palette color images, or 8 bit color images from 16 bit data
+template <typename T>
+static void im_save_color_packed(const bob::io::base::array::interface& b, png_structp png_ptr, const png_packing& pack)
+{
+  const bob::io::base::array::typeinfo& info = b.type();
+  const size_t height = info.shape[1];
+  const size_t width = info.shape[2];
+  const size_t frame_size = height * width;
+  const bool palette = pack.color_type == PNG_COLOR_TYPE_PALETTE;
+
+  const T *element_r = static_cast<const T*>(b.ptr());
+  const T *element_g = element_r + frame_size;
+  const T *element_b = element_g + frame_size;
+  boost::shared_array<png_byte> row(new png_byte[(palette ? 1 : 3)*width]);
+  for(size_t y=0; y<height; ++y)
+  {
+    png_byte* p = row.get();
+    for(size_t x=0; x<width; ++x, ++element_r, ++element_g, ++element_b)
+    {
+      if(palette)
+        *p++ = pack.indices[color_slot(pack.colors, pack_rgb(*element_r, *element_g, *element_b))];
+      else
+      {
+        *p++ = *element_r;
+        *p++ = *element_g;
+        *p++ = *element_b;
+      }
+    }
+    png_write_row(png_ptr, row.get());
+  }
+}
+
+template <typename T>
+static void im_save_content(const bob::io::base::array::interface& b, png_structp png_ptr, const png_packing& pack)
+{
+  const bool packed = pack.color_type == PNG_COLOR_TYPE_PALETTE || pack.bit_depth < 8 * (int)sizeof(T);
+  if(b.type().nd == 2)
+  {
+    if(packed) im_save_gray_packed<T>(b, png_ptr, pack);
+    else im_save_gray<T>(b, png_ptr);
+  }
+  else
+  {
+    if(packed) im_save_color_packed<T>(b, png_ptr, pack);
+    else im_save_color<T>(b, png_ptr);
+  }
+}
+
+static void im_save(const std::string& filename, const bob::io::base::array::interface& array, const bool auto_pack,
+  const bob::io::image::PNGPackOptions& options)
 {
   // 1. PNG structures
   png_structp png_ptr;
@@ -457,10 +904,21 @@ static void im_save(const std::string& filename, const bob::io::base::array::int
   const bob::io::base::array::typeinfo& info = array.type();
   png_uint_32 height = (info.nd == 2 ? info.shape[0] : info.shape[1]);
   png_uint_32 width = (info.nd == 2 ? info.shape[1] : info.shape[2]);
-  int bit_depth = (info.dtype == bob::io::base::array::t_uint8 ? 8 : 16);
-  png_set_IHDR(png_ptr, info_ptr, width, height, bit_depth,
-    (info.nd == 2 ? PNG_COLOR_TYPE_GRAY : PNG_COLOR_TYPE_RGB),
+  png_packing pack;
+  pack.bit_depth = (info.dtype == bob::io::base::array::t_uint8 ? 8 : 16);
+  pack.color_type = (info.nd == 2 ? PNG_COLOR_TYPE_GRAY : PNG_COLOR_TYPE_RGB);
+  // With auto-packing, the image is scanned once for the smallest bit depth
+  // or palette that represents it exactly; 16 bit images keep their depth,
+  // unless they may be read back as 8 bit images
+  if(auto_pack && (info.nd == 2 || (info.nd == 3 && info.shape[0] == 3)))
+  {
+    if(info.dtype == bob::io::base::array::t_uint8) find_packing<uint8_t>(array, options, pack);
+    else if(info.dtype == bob::io::base::array::t_uint16 && options.narrow_16_bits) find_packing<uint16_t>(array, options, pack);
+  }
+  png_set_IHDR(png_ptr, info_ptr, width, height, pack.bit_depth, pack.color_type,
     PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+  if(pack.color_type == PNG_COLOR_TYPE_PALETTE)
+    png_set_PLTE(png_ptr, info_ptr, &pack.palette[0], pack.palette.size());
 
   // Write the file header information.
   png_write_info(png_ptr, info_ptr);
@@ -470,14 +928,14 @@ static void im_save(const std::string& filename, const bob::io::base::array::int
 
   // 6. Writes content
   if(info.dtype == bob::io::base::array::t_uint8) {
-    if(info.nd == 2) im_save_gray<uint8_t>(array, png_ptr);
+    if(info.nd == 2) im_save_content<uint8_t>(array, png_ptr, pack);
     else if(info.nd == 3) {
       if(info.shape[0] != 3)
       {
         png_destroy_write_struct(&png_ptr, &info_ptr);
         throw std::runtime_error("PNG: color image does not have 3 planes on 1st. dimension");
       }
-      im_save_color<uint8_t>(array, png_ptr);
+      im_save_content<uint8_t>(array, png_ptr, pack);
     }
     else
     {
@@ -488,14 +946,14 @@ static void im_save(const std::string& filename, const bob::io::base::array::int
     }
   }
   else if(info.dtype == bob::io::base::array::t_uint16) {
-    if(info.nd == 2) im_save_gray<uint16_t>(array, png_ptr);
+    if(info.nd == 2) im_save_content<uint16_t>(array, png_ptr, pack);
     else if(info.nd == 3) {
       if(info.shape[0] != 3)
       {
       png_destroy_write_struct(&png_ptr, &info_ptr);
         throw std::runtime_error("PNG: color image does not have 3 planes on 1st. dimension");
       }
-      im_save_color<uint16_t>(array, png_ptr);
+      im_save_content<uint16_t>(array, png_ptr, pack);
     }
     else
     {
@@ -519,13 +977,53 @@ static void im_save(const std::string& filename, const bob::io::base::array::int
   png_destroy_write_struct(&png_ptr, &info_ptr);
 }
 
+// Writes bit-packed rows of black pixels as a 1 bit gray image, in which set
+// bits are white
+static void im_save_packed(const std::string& filename, const blitz::Array<uint8_t,2>& bits, const int width)
+{
+  if(bits.extent(1) != (width + 7) / 8) {
+    boost::format m("PNG: cannot write %d bytes per row of packed bits for an image of width %d");
+    m % bits.extent(1) % width;
+    throw std::runtime_error(m.str());
+  }
+  const blitz::Array<uint8_t,2> packed = bits.isStorageContiguous() ? bits : bits.copy();
+
+  boost::shared_ptr<std::FILE> out_file = make_cfile(filename.c_str(), "wb");
+  png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, const_cast<char*>(filename.c_str()), my_png_error, my_png_warning);
+  if(png_ptr == NULL)
+    throw std::runtime_error("PNG: error while creating write png structure (function png_create_write_struct())");
+  png_infop info_ptr = png_create_info_struct(png_ptr);
+  if(info_ptr == NULL)
+  {
+    png_destroy_write_struct(&png_ptr,  NULL);
+    throw std::runtime_error("PNG: error while creating info png structure (function png_create_info_struct())");
+  }
+  png_init_io(png_ptr, out_file.get());
+
+  png_set_IHDR(png_ptr, info_ptr, width, packed.extent(0), 1, PNG_COLOR_TYPE_GRAY,
+    PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+  png_write_info(png_ptr, info_ptr);
+
+  std::vector<png_byte> row(packed.extent(1));
+  for(int y=0; y<packed.extent(0); ++y) {
+    std::copy(packed.data() + y*packed.extent(1), packed.data() + (y+1)*packed.extent(1), row.begin());
+    bob::io::image::invert_bits(row.data(), width);
+    png_write_row(png_ptr, row.data());
+  }
+
+  png_write_end(png_ptr, NULL);
+  png_destroy_write_struct(&png_ptr, &info_ptr);
+}
+
 
 /**
  * PNG class
 */
 bob::io::image::PNGFile::PNGFile(const char* path, char mode)
 : m_filename(path),
-  m_newfile(true)
+  m_newfile(true),
+  m_interlace_passes(7),
+  m_auto_pack(false)
 {
   //checks if file exists
   if (mode == 'r' && !boost::filesystem::exists(path)) {
@@ -549,18 +1047,70 @@ void bob::io::image::PNGFile::read(bob::io::base::array::interface& buffer, size
   if (m_newfile)
     throw std::runtime_error("uninitialized image file cannot be read");
 
-  if (!buffer.type().is_compatible(m_type)) buffer.set(m_type);
+  // pixel values are converted while decoding into buffers of other types
+  if (!bob::io::image::is_decodable_as(buffer.type(), m_type)) buffer.set(m_type);
 
   if (index != 0)
     throw std::runtime_error("cannot read image with index > 0 -- there is only one image in an image file");
 
-  if(!buffer.type().is_compatible(m_type)) buffer.set(m_type);
-  im_load(m_filename, buffer);
+  im_load(m_filename, buffer, m_interlace_passes);
+}
+
+void bob::io::image::PNGFile::read_region(bob::io::base::array::interface& buffer, size_t y, size_t x, size_t h, size_t w) {
+  if (m_newfile)
+    throw std::runtime_error("uninitialized image file cannot be read");
+
+  const bob::io::base::array::typeinfo region = bob::io::image::region_type(m_type, y, x, h, w, m_filename);
+  if (!bob::io::image::is_decodable_as(buffer.type(), region)) buffer.set(region);
+
+  im_load(m_filename, buffer, 7, y, x);
+}
+
+void bob::io::image::PNGFile::read_indexed(blitz::Array<uint8_t,2>& indices, blitz::Array<uint8_t,2>& palette) {
+  if (m_newfile)
+    throw std::runtime_error("uninitialized image file cannot be read");
+
+  im_load_indexed(m_filename, indices, palette);
+}
+
+void bob::io::image::PNGFile::read_packed(blitz::Array<uint8_t,2>& bits) {
+  if (m_newfile)
+    throw std::runtime_error("uninitialized image file cannot be read");
+
+  im_load_packed(m_filename, bits);
+}
+
+void bob::io::image::PNGFile::write_packed(const blitz::Array<uint8_t,2>& bits, int width) {
+  if (!m_newfile)
+    throw std::runtime_error("image files only accept a single array");
+
+  im_save_packed(m_filename, bits, width);
+  m_type.dtype = bob::io::base::array::t_uint8;
+  m_type.nd = 2;
+  m_type.shape[0] = bits.extent(0);
+  m_type.shape[1] = width;
+  m_type.update_strides();
+  m_newfile = false;
+  m_length = 1;
+}
+
+void bob::io::image::PNGFile::set_interlace_passes(int passes) {
+  if (passes < 1 || passes > 7) {
+    boost::format m("the number of Adam7 passes to decode must be between 1 and 7, not %d");
+    m % passes;
+    throw std::runtime_error(m.str());
+  }
+  m_interlace_passes = passes;
+}
+
+void bob::io::image::PNGFile::set_auto_pack(bool auto_pack, const bob::io::image::PNGPackOptions& options) {
+  m_auto_pack = auto_pack;
+  m_pack_options = options;
 }
 
 size_t bob::io::image::PNGFile::append(const bob::io::base::array::interface& buffer) {
   if (m_newfile) {
-    im_save(m_filename, buffer);
+    im_save(m_filename, buffer, m_auto_pack, m_pack_options);
     m_type = buffer.type();
     m_newfile = false;
     m_length = 1;
@@ -0,0 +1,266 @@
+/**
+ * @brief Implements the random patch sampler over image collections
+ *
+ * Copyright (c) 2016, Regents of the University of Colorado on behalf of the University of Colorado Colorado Springs.
+ */
+
+#include <boost/filesystem.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/format.hpp>
+#include <boost/algorithm/string.hpp>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <thread>
+
+#include <bob.io.image/sampler.h>
+#include <bob.io.image/image.h>
+
+
+/**
+ * READERS
+ */
+struct bob::io::image::PatchReader
+{
+  boost::shared_ptr<bob::io::base::File> file;
+  std::function<void(bob::io::base::array::interface&, size_t, size_t, size_t, size_t)> read_region;
+  bool random_access; ///< regions are decoded without decoding the rows above them
+  bool crops; ///< regions are decoded cropped, but after the rows above them
+  bool converts; ///< pixels are converted to the data type of the buffer while decoding
+};
+
+template <typename F> static
+boost::shared_ptr<bob::io::image::PatchReader> make_reader(const std::string& filename, const bool random_access,
+  const bool crops, const bool converts)
+{
+  boost::shared_ptr<F> file = boost::make_shared<F>(filename.c_str(), 'r');
+  boost::shared_ptr<bob::io::image::PatchReader> reader = boost::make_shared<bob::io::image::PatchReader>();
+  reader->file = file;
+  reader->read_region = [file](bob::io::base::array::interface& buffer, size_t y, size_t x, size_t h, size_t w)
+  {
+    file->read_region(buffer, y, x, h, w);
+  };
+  reader->random_access = random_access;
+  reader->crops = crops;
+  reader->converts = converts;
+  return reader;
+}
+
+// Binary PGM and PPM files read the rows of a region only
+static bool is_binary_netpbm(const std::string& filename)
+{
+  char magic[2] = {0, 0};
+  std::ifstream stream(filename.c_str(), std::ios::binary);
+  stream.read(magic, 2);
+  return magic[0] == 'P' && (magic[1] == '5' || magic[1] == '6');
+}
+
+static boost::shared_ptr<bob::io::image::PatchReader> open_image(const std::string& filename)
+{
+  std::string extension = boost::filesystem::path(filename).extension().string();
+  boost::algorithm::to_lower(extension);
+#ifdef HAVE_LIBTIFF
+  if (extension == ".tif" || extension == ".tiff") return make_reader<bob::io::image::TIFFFile>(filename, true, true, true);
+#endif
+  if (extension == ".bmp") return make_reader<bob::io::image::BMPFile>(filename, true, true, false);
+#ifdef HAVE_LIBJPEG
+  if (extension == ".jpg" || extension == ".jpeg") return make_reader<bob::io::image::JPEGFile>(filename, false, true, true);
+#endif
+#ifdef HAVE_LIBPNG
+  if (extension == ".png") return make_reader<bob::io::image::PNGFile>(filename, false, false, true);
+#endif
+#ifdef HAVE_GIFLIB
+  if (extension == ".gif") return make_reader<bob::io::image::GIFFile>(filename, false, false, false);
+#endif
+  if (extension == ".pbm" || extension == ".pgm" || extension == ".ppm") {
+    const bool binary = is_binary_netpbm(filename);
+    return make_reader<bob::io::image::NetPBMFile>(filename, binary, binary, false);
+  }
+
+  boost::format m("The filename extension '%s' of file `%s' is not known or not supported for patch sampling");
+  m % extension % filename;
+  throw std::runtime_error(m.str());
+}
+
+// Runs work(task) for all tasks on get_decoding_threads() threads and
+// rethrows the first exception of any task. The workers share the decoding
+// threads, so that large TIFF images do not start further threads per worker.
+static void run_tasks(const size_t tasks, const std::function<void(size_t)>& work)
+{
+  const size_t decoding_threads = bob::io::image::get_decoding_threads();
+  const size_t workers = std::min(decoding_threads, tasks);
+  std::atomic<size_t> next(0);
+  std::vector<std::exception_ptr> errors(workers);
+  auto worker = [&](const size_t index)
+  {
+    try
+    {
+      bob::io::image::DecodingThreadsLimit limit(decoding_threads / workers);
+      for(size_t task = next++; task < tasks; task = next++)
+        work(task);
+    }
+    catch(...)
+    {
+      errors[index] = std::current_exception();
+      next = tasks;
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for(size_t index = 1; index < workers; ++index)
+    threads.emplace_back(worker, index);
+  if(workers > 0) worker(0);
+  for(auto& thread : threads) thread.join();
+  for(auto& error : errors)
+    if(error) std::rethrow_exception(error);
+}
+
+
+/**
+ * PatchSampler class
+ */
+bob::io::image::PatchSampler::PatchSampler(const std::vector<std::string>& filenames, size_t height, size_t width, size_t count, unsigned seed,
+  size_t open_files)
+: m_filenames(filenames),
+  m_types(filenames.size()),
+  m_height(height),
+  m_width(width),
+  m_count(count),
+  m_channels(0),
+  m_generator(seed),
+  m_open_files(open_files)
+{
+  if (m_filenames.empty() || height == 0 || width == 0)
+    throw std::runtime_error("patches need to be sampled from at least one image, with a size of at least one pixel");
+
+  run_tasks(m_filenames.size(), [this](size_t file)
+  {
+    m_types[file] = open_image(m_filenames[file])->file->type();
+  });
+
+  m_channels = (m_types[0].nd == 3 ? 3 : 1);
+  for (size_t file = 0; file < m_types.size(); ++file) {
+    const bob::io::base::array::typeinfo& info = m_types[file];
+    if ((info.nd == 3 ? 3u : 1u) != m_channels) {
+      boost::format m("the image in file `%s' has %d channels, but the image in file `%s' has %d");
+      m % m_filenames[file] % (info.nd == 3 ? 3 : 1) % m_filenames[0] % m_channels;
+      throw std::runtime_error(m.str());
+    }
+    if (info.shape[info.nd-2] < height || info.shape[info.nd-1] < width) {
+      boost::format m("the image of size %dx%d in file `%s' is smaller than the patches of size %dx%d");
+      m % info.shape[info.nd-2] % info.shape[info.nd-1] % m_filenames[file] % height % width;
+      throw std::runtime_error(m.str());
+    }
+  }
+}
+
+void bob::io::image::PatchSampler::sample(bob::io::base::array::interface& batch) {
+  bob::io::base::array::typeinfo info;
+  info.dtype = batch.type().dtype;
+  info.nd = 4;
+  info.shape[0] = m_count;
+  info.shape[1] = m_channels;
+  info.shape[2] = m_height;
+  info.shape[3] = m_width;
+  info.update_strides();
+  if (!bob::io::image::is_decodable_as(batch.type(), info)) {
+    info.dtype = bob::io::base::array::t_uint8;
+    info.update_strides();
+    batch.set(info);
+  }
+
+  // 1. Draw the patches
+  m_patches.resize(m_count);
+  std::uniform_int_distribution<size_t> files(0, m_filenames.size() - 1);
+  for (size_t n = 0; n < m_count; ++n) {
+    Patch& patch = m_patches[n];
+    patch.file = files(m_generator);
+    const bob::io::base::array::typeinfo& image = m_types[patch.file];
+    patch.y = std::uniform_int_distribution<size_t>(0, image.shape[image.nd-2] - m_height)(m_generator);
+    patch.x = std::uniform_int_distribution<size_t>(0, image.shape[image.nd-1] - m_width)(m_generator);
+  }
+
+  // 2. Group the patches by file
+  std::vector<size_t> order(m_count);
+  for (size_t n = 0; n < m_count; ++n) order[n] = n;
+  std::stable_sort(order.begin(), order.end(), [this](size_t a, size_t b) { return m_patches[a].file < m_patches[b].file; });
+  std::vector<size_t> groups;
+  for (size_t k = 0; k < m_count; ++k)
+    if (k == 0 || m_patches[order[k]].file != m_patches[order[k-1]].file) groups.push_back(k);
+  groups.push_back(m_count);
+
+  // 3. Decode each file once, into the slots of its patches
+  bob::io::base::array::typeinfo slot;
+  slot.dtype = info.dtype;
+  slot.nd = (m_channels == 3 ? 3 : 2);
+  if (m_channels == 3) slot.shape[0] = 3;
+  slot.shape[slot.nd-2] = m_height;
+  slot.shape[slot.nd-1] = m_width;
+  slot.update_strides();
+  unsigned char* data = static_cast<unsigned char*>(batch.ptr());
+
+  // the files that are still open from earlier batches are taken out of the
+  // list, and put back in front of it with the newly opened ones afterwards
+  std::vector<boost::shared_ptr<bob::io::image::PatchReader> > readers(groups.size() - 1);
+  for (size_t group = 0; group + 1 < groups.size(); ++group) {
+    const size_t file = m_patches[order[groups[group]]].file;
+    auto it = std::find_if(m_readers.begin(), m_readers.end(), [file](const std::pair<size_t, boost::shared_ptr<bob::io::image::PatchReader> >& open) { return open.first == file; });
+    if (it != m_readers.end()) {
+      readers[group] = it->second;
+      m_readers.erase(it);
+    }
+  }
+
+  run_tasks(groups.size() - 1, [&](size_t group)
+  {
+    const size_t begin = groups[group], end = groups[group+1];
+    const size_t file = m_patches[order[begin]].file;
+    if (!readers[group]) readers[group] = open_image(m_filenames[file]);
+    const bob::io::image::PatchReader& reader = *readers[group];
+    if (!reader.converts && m_types[file].dtype != slot.dtype) {
+      boost::format m("the image in file `%s' of type %s cannot be converted to the data type of the batch");
+      m % m_filenames[file] % m_types[file].str();
+      throw std::runtime_error(m.str());
+    }
+
+    size_t y0 = m_patches[order[begin]].y, x0 = m_patches[order[begin]].x, y1 = y0, x1 = x0;
+    for (size_t k = begin; k < end; ++k) {
+      const Patch& patch = m_patches[order[k]];
+      y0 = std::min(y0, patch.y); y1 = std::max(y1, patch.y);
+      x0 = std::min(x0, patch.x); x1 = std::max(x1, patch.x);
+    }
+    bob::io::base::array::typeinfo box(slot);
+    box.shape[box.nd-2] = y1 - y0 + m_height;
+    box.shape[box.nd-1] = x1 - x0 + m_width;
+    box.update_strides();
+
+    // cropped regions are worth decoding one by one when the patches cover
+    // less than half of their bounding box
+    if (reader.random_access || (reader.crops && 2 * (end - begin) * slot.size() < box.size())) {
+      for (size_t k = begin; k < end; ++k) {
+        const Patch& patch = m_patches[order[k]];
+        bob::io::base::array::blitz_array buffer(data + order[k] * slot.buffer_size(), slot);
+        reader.read_region(buffer, patch.y, patch.x, m_height, m_width);
+      }
+      return;
+    }
+
+    // decodes the bounding box of all patches of the file once
+    bob::io::base::array::blitz_array region(box);
+    reader.read_region(region, y0, x0, box.shape[box.nd-2], box.shape[box.nd-1]);
+    for (size_t k = begin; k < end; ++k) {
+      const Patch& patch = m_patches[order[k]];
+      bob::io::base::array::blitz_array buffer(data + order[k] * slot.buffer_size(), slot);
+      bob::io::image::copy_region(region, patch.y - y0, patch.x - x0, buffer);
+    }
+  });
+
+  for (size_t group = readers.size(); group-- > 0;)
+    m_readers.emplace_front(m_patches[order[groups[group]]].file, readers[group]);
+  while (m_readers.size() > m_open_files) m_readers.pop_back();
+}
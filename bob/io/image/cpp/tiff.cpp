@@ -17,11 +17,30 @@
 #include <boost/shared_ptr.hpp>
 #include <boost/make_shared.hpp>
 #include <boost/format.hpp>
-#include <boost/filesystem.hpp>
+#include <boost/type_traits/is_same.hpp>
 #include <boost/algorithm/string.hpp>
 #include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <list>
+#include <map>
+#include <tuple>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <bob.io.image/tiff.h>
+#include <bob.io.image/image.h>
 
 extern "C" {
 #include <tiffio.h>
@@ -39,14 +58,250 @@ static boost::shared_ptr<TIFF> make_cfile(const char *filename, const char *flag
 }
 
 /**
- * LOADING
+ * The bytes of TIFF files that are read, either mapped into memory or given
+ * by the caller. libtiff accesses them through TIFFClientOpen with one cursor
+ * per handle, and decodes the strips and tiles straight out of the memory
+ * through the map procedure, so that several handles (e.g., of the decoding
+ * threads) share a single mapping.
  */
-static void im_peek(const std::string& path, bob::io::base::array::typeinfo& info)
+struct bob::io::image::TIFFMemory
 {
-  // 1. TIFF file opening
-  boost::shared_ptr<TIFF> in_file = make_cfile(path.c_str(), "r");
+  const unsigned char* data;
+  uint64_t size;
+  boost::shared_ptr<void> mapping; ///< unmaps the file, if it was mapped
+  blitz::Array<uint8_t,1> array; ///< keeps the data of the caller alive
+  std::string identity; ///< identifies the content in the chunk cache
+};
+
+struct tiff_cursor
+{
+  boost::shared_ptr<const bob::io::image::TIFFMemory> memory;
+  uint64_t position;
+};
+
+static tsize_t memory_read(thandle_t handle, void* buffer, tsize_t size)
+{
+  tiff_cursor* cursor = static_cast<tiff_cursor*>(handle);
+  const uint64_t available = cursor->memory->size - std::min(cursor->position, cursor->memory->size);
+  const uint64_t count = std::min<uint64_t>(size, available);
+  std::memcpy(buffer, cursor->memory->data + cursor->position, count);
+  cursor->position += count;
+  return count;
+}
+
+static tsize_t memory_write(thandle_t, void*, tsize_t)
+{
+  return 0;
+}
+
+static toff_t memory_seek(thandle_t handle, toff_t offset, int whence)
+{
+  tiff_cursor* cursor = static_cast<tiff_cursor*>(handle);
+  switch(whence)
+  {
+    case SEEK_SET: cursor->position = offset; break;
+    case SEEK_CUR: cursor->position += offset; break;
+    case SEEK_END: cursor->position = cursor->memory->size + offset; break;
+  }
+  return cursor->position;
+}
+
+static int memory_close(thandle_t handle)
+{
+  delete static_cast<tiff_cursor*>(handle);
+  return 0;
+}
+
+static toff_t memory_size(thandle_t handle)
+{
+  return static_cast<tiff_cursor*>(handle)->memory->size;
+}
+
+static int memory_map(thandle_t handle, void** base, toff_t* size)
+{
+  tiff_cursor* cursor = static_cast<tiff_cursor*>(handle);
+  *base = const_cast<unsigned char*>(cursor->memory->data);
+  *size = cursor->memory->size;
+  return 1;
+}
+
+static void memory_unmap(thandle_t, void*, toff_t)
+{
+}
+
+/**
+ * A growing file in memory that libtiff writes to through TIFFClientOpen, so
+ * that worker threads can compress the strips or tiles of an image that is
+ * written, while only the calling thread writes to the file itself.
+ */
+struct tiff_sink
+{
+  std::vector<unsigned char> data;
+  uint64_t position;
+};
+
+static tsize_t sink_read(thandle_t handle, void* buffer, tsize_t size)
+{
+  tiff_sink* sink = static_cast<tiff_sink*>(handle);
+  const uint64_t available = sink->data.size() - std::min<uint64_t>(sink->position, sink->data.size());
+  const uint64_t count = std::min<uint64_t>(size, available);
+  std::memcpy(buffer, sink->data.data() + sink->position, count);
+  sink->position += count;
+  return count;
+}
+
+static tsize_t sink_write(thandle_t handle, void* buffer, tsize_t size)
+{
+  tiff_sink* sink = static_cast<tiff_sink*>(handle);
+  if(sink->position + size > sink->data.size()) sink->data.resize(sink->position + size);
+  std::memcpy(sink->data.data() + sink->position, buffer, size);
+  sink->position += size;
+  return size;
+}
+
+static toff_t sink_seek(thandle_t handle, toff_t offset, int whence)
+{
+  tiff_sink* sink = static_cast<tiff_sink*>(handle);
+  switch(whence)
+  {
+    case SEEK_SET: sink->position = offset; break;
+    case SEEK_CUR: sink->position += offset; break;
+    case SEEK_END: sink->position = sink->data.size() + offset; break;
+  }
+  return sink->position;
+}
+
+static int sink_close(thandle_t)
+{
+  return 0;
+}
+
+static toff_t sink_size(thandle_t handle)
+{
+  return static_cast<tiff_sink*>(handle)->data.size();
+}
+
+static int sink_map(thandle_t, void**, toff_t*)
+{
+  return 0;
+}
+
+// Opens a file in memory with the image layout and compression of the
+// directory that is being written to out_file. The file is never completed,
+// so that the handle is released without writing its directory.
+static boost::shared_ptr<TIFF> open_sink(tiff_sink& sink, boost::shared_ptr<TIFF> out_file)
+{
+  sink.position = 0;
+  TIFF* fp = TIFFClientOpen(TIFFFileName(out_file.get()), "w", &sink, sink_read, sink_write, sink_seek, sink_close,
+    sink_size, sink_map, memory_unmap);
+  if(fp == 0)
+    throw std::runtime_error("TIFFClientOpen(): cannot open a TIFF file in memory");
+  boost::shared_ptr<TIFF> file(fp, TIFFCleanup);
+
+  uint32 value32;
+  for(const uint32 tag : {TIFFTAG_IMAGEWIDTH, TIFFTAG_IMAGELENGTH, TIFFTAG_TILEWIDTH, TIFFTAG_TILELENGTH, TIFFTAG_ROWSPERSTRIP})
+    if(TIFFGetField(out_file.get(), tag, &value32)) TIFFSetField(fp, tag, value32);
+  // the compression comes before the predictor, which is a tag of its codec
+  uint16 value16;
+  for(const uint32 tag : {TIFFTAG_BITSPERSAMPLE, TIFFTAG_SAMPLESPERPIXEL, TIFFTAG_PHOTOMETRIC, TIFFTAG_PLANARCONFIG, TIFFTAG_COMPRESSION, TIFFTAG_PREDICTOR})
+    if(TIFFGetField(out_file.get(), tag, &value16)) TIFFSetField(fp, tag, value16);
+  return file;
+}
+
+// Identifies the file independent of its path, i.e., by device and inode
+static std::string file_prefix(const struct stat& status)
+{
+  return (boost::format("%d:%d:") % status.st_dev % status.st_ino).str();
+}
+
+// Identifies the content of the file in the chunk cache: files that are
+// changed get another identity through their size and modification time
+static std::string file_identity(const struct stat& status)
+{
+#ifdef __APPLE__
+  const long mtime_nsec = status.st_mtimespec.tv_nsec;
+#else
+  const long mtime_nsec = status.st_mtim.tv_nsec;
+#endif
+  boost::format identity("%s%d:%d.%09d");
+  identity % file_prefix(status) % status.st_size % status.st_mtime % mtime_nsec;
+  return identity.str();
+}
 
-  // 2. Get file information
+// Maps the file read-only and privately into memory; a file that is
+// truncated by another process while a page is read still raises SIGBUS
+static boost::shared_ptr<const bob::io::image::TIFFMemory> map_file(const std::string& filename)
+{
+  const int fd = open(filename.c_str(), O_RDONLY);
+  struct stat status;
+  if(fd < 0 || fstat(fd, &status) != 0 || status.st_size == 0)
+  {
+    if(fd >= 0) close(fd);
+    boost::format m("TIFF: cannot open file `%s' for reading");
+    m % filename;
+    throw std::runtime_error(m.str());
+  }
+  const size_t size = status.st_size;
+  void* data = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(data == MAP_FAILED)
+  {
+    boost::format m("TIFF: cannot map file `%s' into memory");
+    m % filename;
+    throw std::runtime_error(m.str());
+  }
+
+  boost::shared_ptr<bob::io::image::TIFFMemory> memory = boost::make_shared<bob::io::image::TIFFMemory>();
+  memory->data = static_cast<const unsigned char*>(data);
+  memory->size = size;
+  memory->mapping.reset(data, [size](void* p){ munmap(p, size); });
+  memory->identity = file_identity(status);
+  return memory;
+}
+
+// References the data of the caller
+static boost::shared_ptr<const bob::io::image::TIFFMemory> wrap_memory(const blitz::Array<uint8_t,1>& data)
+{
+  boost::shared_ptr<bob::io::image::TIFFMemory> memory = boost::make_shared<bob::io::image::TIFFMemory>();
+  memory->array.reference(data.isStorageContiguous() ? data : data.copy());
+  memory->data = memory->array.data();
+  memory->size = memory->array.extent(0);
+  static std::atomic<size_t> s_memory_count(0);
+  memory->identity = (boost::format("<memory %d>") % s_memory_count++).str();
+  return memory;
+}
+
+// Opens a new handle to read the TIFF file in memory
+static boost::shared_ptr<TIFF> open_memory(boost::shared_ptr<const bob::io::image::TIFFMemory> memory, const std::string& name)
+{
+  tiff_cursor* cursor = new tiff_cursor;
+  cursor->memory = memory;
+  cursor->position = 0;
+  TIFF* fp = TIFFClientOpen(name.c_str(), "r", cursor, memory_read, memory_write, memory_seek, memory_close,
+    memory_size, memory_map, memory_unmap);
+  if(fp == 0) {
+    delete cursor;
+    boost::format m("TIFFClientOpen(): cannot read TIFF file `%s'");
+    m % name;
+    throw std::runtime_error(m.str());
+  }
+  return boost::shared_ptr<TIFF>(fp, TIFFClose);
+}
+
+// Tells the kernel how the mapped file will be accessed
+static void advise(boost::shared_ptr<TIFF> in_file, const int advice)
+{
+  const bob::io::image::TIFFMemory& memory = *static_cast<tiff_cursor*>(TIFFClientdata(in_file.get()))->memory;
+  if(memory.mapping)
+    madvise(const_cast<unsigned char*>(memory.data), memory.size, advice);
+}
+
+/**
+ * LOADING
+ */
+// Gets the type of the current directory; returns false if the color type is not supported
+static bool im_peek(boost::shared_ptr<TIFF> in_file, bob::io::base::array::typeinfo& info)
+{
   uint32 w, h;
   TIFFGetField(in_file.get(), TIFFTAG_IMAGEWIDTH, &w);
   TIFFGetField(in_file.get(), TIFFTAG_IMAGELENGTH, &h);
@@ -57,16 +312,14 @@ static void im_peek(const std::string& path, bob::io::base::array::typeinfo& inf
   TIFFGetField(in_file.get(), TIFFTAG_BITSPERSAMPLE, &bps);
   TIFFGetField(in_file.get(), TIFFTAG_SAMPLESPERPIXEL, &spp);
 
-  // 3. Set typeinfo variables
   info.dtype = (bps <= 8 ? bob::io::base::array::t_uint8 : bob::io::base::array::t_uint16);
   if(spp == 1)
     info.nd = 2;
   else if (spp == 3)
     info.nd = 3;
   else { // Unsupported color type
-    boost::format m("TIFF: found unsupported object of type `%s' at file `%s': unsupported color type");
-    m % info.str() % path;
-    throw std::runtime_error(m.str());
+    info.reset();
+    return false;
   }
   if(info.nd == 2)
   {
@@ -80,209 +333,537 @@ static void im_peek(const std::string& path, bob::io::base::array::typeinfo& inf
     info.shape[2] = width;
   }
   info.update_strides();
+  return true;
 }
 
-template <typename T> static
-void im_load_gray(boost::shared_ptr<TIFF> in_file, bob::io::base::array::interface& b)
+// Indexes the reduced-resolution levels of the current directory, which are
+// stored as SubIFDs, through another handle that peeks at each level
+static void im_index_levels(const std::function<boost::shared_ptr<TIFF>()>& open_handle, const std::string& path,
+  boost::shared_ptr<TIFF> in_file, std::vector<uint64_t>& offsets, std::vector<bob::io::base::array::typeinfo>& types)
 {
-  const bob::io::base::array::typeinfo& info = b.type();
-  const size_t height = info.shape[0];
-  const size_t width = info.shape[1];
+  uint16 count = 0;
+  uint64* subifds = 0;
+  if(!TIFFGetField(in_file.get(), TIFFTAG_SUBIFD, &count, &subifds) || count == 0) return;
+
+  boost::shared_ptr<TIFF> level_file = open_handle();
+  for(uint16 level = 0; level < count; ++level)
+  {
+    if(!TIFFSetSubDirectory(level_file.get(), subifds[level]))
+    {
+      boost::format m("TIFF: cannot find the reduced-resolution level at offset %d in file `%s'");
+      m % subifds[level] % path;
+      throw std::runtime_error(m.str());
+    }
+    bob::io::base::array::typeinfo info;
+    im_peek(level_file, info);
+    offsets.push_back(subifds[level]);
+    types.push_back(info);
+  }
+}
+
+// Indexes all directories (pages) of the file by walking the directory chain
+// once, so that each page can later be read directly through its offset
+static void im_index(boost::shared_ptr<const bob::io::image::TIFFMemory> memory, const std::string& path,
+  std::vector<uint64_t>& offsets, std::vector<bob::io::base::array::typeinfo>& types,
+  std::vector<std::vector<uint64_t> >& level_offsets, std::vector<std::vector<bob::io::base::array::typeinfo> >& level_types)
+{
+  boost::shared_ptr<TIFF> in_file = open_memory(memory, path);
+  do
+  {
+    bob::io::base::array::typeinfo info;
+    if(!im_peek(in_file, info) && offsets.empty())
+    {
+      boost::format m("TIFF: found unsupported color type in file `%s'");
+      m % path;
+      throw std::runtime_error(m.str());
+    }
+    offsets.push_back(TIFFCurrentDirOffset(in_file.get()));
+    types.push_back(info);
+    level_offsets.push_back(std::vector<uint64_t>());
+    level_types.push_back(std::vector<bob::io::base::array::typeinfo>());
+    im_index_levels([&](){ return open_memory(memory, path); }, path, in_file, level_offsets.back(), level_types.back());
+  } while(TIFFReadDirectory(in_file.get()));
+}
 
-  // Read in the possibly multiple strips
-  tsize_t strip_size = TIFFStripSize(in_file.get());
-  tstrip_t n_strips = TIFFNumberOfStrips(in_file.get());
+// Opens the file at the directory with the given offset
+static boost::shared_ptr<TIFF> open_page(boost::shared_ptr<const bob::io::image::TIFFMemory> memory, const std::string& filename, const uint64_t offset)
+{
+  boost::shared_ptr<TIFF> in_file = open_memory(memory, filename);
+  if(TIFFCurrentDirOffset(in_file.get()) != offset && !TIFFSetSubDirectory(in_file.get(), offset))
+  {
+    boost::format m("TIFF: cannot find the directory at offset %d in file `%s'");
+    m % offset % filename;
+    throw std::runtime_error(m.str());
+  }
+  return in_file;
+}
 
-  unsigned long buffer_size = n_strips * strip_size;
-  boost::shared_array<unsigned char> buffer_(new unsigned char[buffer_size]);
-  unsigned char* buffer = buffer_.get();
-  if(buffer == 0) throw std::runtime_error("TIFF: error while getting the color buffer");
+// Decodes the strips of a bilevel image into bit-packed rows of (width+7)/8
+// bytes, set bits being black. libtiff already delivers the bits of each byte
+// in MSB2LSB order, whatever the fill order of the file.
+static void im_load_bits(boost::shared_ptr<TIFF> in_file, const size_t height, const size_t width, uint8_t* bits)
+{
+  uint16 bps = 1, spp = 1;
+  TIFFGetField(in_file.get(), TIFFTAG_BITSPERSAMPLE, &bps);
+  TIFFGetField(in_file.get(), TIFFTAG_SAMPLESPERPIXEL, &spp);
+  if(bps != 1 || spp != 1)
+  {
+    boost::format m("TIFF: cannot read %d samples of %d bits per pixel as a bilevel image");
+    m % spp % bps;
+    throw std::runtime_error(m.str());
+  }
 
+  const tsize_t data_size = height * ((width + 7) / 8);
+  const tstrip_t n_strips = TIFFNumberOfStrips(in_file.get());
   tsize_t result;
   tsize_t image_offset = 0;
-  for(tstrip_t strip_count=0; strip_count<n_strips; ++strip_count)
+  for(tstrip_t strip_count=0; strip_count<n_strips && image_offset<data_size; ++strip_count)
   {
-    if((result = TIFFReadEncodedStrip(in_file.get(), strip_count, buffer+image_offset, strip_size)) == -1)
+    if((result = TIFFReadEncodedStrip(in_file.get(), strip_count, bits+image_offset, data_size-image_offset)) == -1)
       throw std::runtime_error("TIFF: error in function TIFFReadEncodedStrip()");
     image_offset += result;
   }
 
-  //Comment just to document
-  //PHOTOMETRIC_PALETTE: In this model, a color is described with a single component. The value of the component is used as an index into the red, green and blue curves in the ColorMap field to retrieve an RGB triplet that defines the color. When PhotometricInterpretation=3
-
-  // Deal with photometric interpretations
   uint16 photo = PHOTOMETRIC_MINISBLACK;
-  if(TIFFGetField(in_file.get(), TIFFTAG_PHOTOMETRIC, &photo) == 0 || (photo != PHOTOMETRIC_MINISBLACK && photo != PHOTOMETRIC_MINISWHITE && photo != PHOTOMETRIC_PALETTE)){
+  if(TIFFGetField(in_file.get(), TIFFTAG_PHOTOMETRIC, &photo) == 0 || (photo != PHOTOMETRIC_MINISBLACK && photo != PHOTOMETRIC_MINISWHITE))
     throw std::runtime_error("TIFF: error in function TIFFGetField()");
-  }
+  if(photo == PHOTOMETRIC_MINISBLACK)
+    for(size_t y=0; y<height; ++y)
+      bob::io::image::invert_bits(bits + y*((width + 7) / 8), width);
+}
 
-  if(photo == PHOTOMETRIC_MINISWHITE)
+// Converts the columns [x0, x1) of one decoded row of interleaved samples of
+// type S into the planes of the destination; bilevel rows hold 8 pixels per
+// byte, which are unpacked to black and white
+template <typename S, typename D> static
+void convert_row(const unsigned char* row, const bool bilevel, const size_t channels,
+  const size_t x0, const size_t x1, D* destination, const size_t frame_size)
+{
+  if(bilevel)
+  {
+    for(size_t x=x0; x<x1; ++x)
+      destination[x-x0] = bob::io::image::convert_sample<D>(static_cast<uint8_t>(((row[x>>3] >> (7 - (x&7))) & 1) * 255));
+    return;
+  }
+  const S* samples = reinterpret_cast<const S*>(row);
+  for(size_t c=0; c<channels; ++c)
   {
-    // Flip bits
-    for(unsigned long count=0; count<buffer_size; ++count)
-      buffer[count] = ~buffer[count];
+    D* plane = destination + c*frame_size;
+    for(size_t x=x0; x<x1; ++x)
+      plane[x-x0] = bob::io::image::convert_sample<D>(samples[x*channels + c]);
   }
+}
+
+/**
+ * A byte-budgeted LRU cache of decoded strips and tiles, shared by all TIFF
+ * files and threads. Chunks are identified by the content of the file, the
+ * directory offset of the page and the index of the strip or tile. A chunk
+ * that is missing is decoded by the first reader only; concurrent readers of
+ * the same chunk wait for its decoding to finish.
+ */
+class chunk_cache
+{
+  public:
+    typedef boost::shared_ptr<const std::vector<unsigned char> > chunk_data;
+    typedef std::tuple<std::string, uint64_t, uint32> key;
+
+    chunk_cache() : m_budget(0), m_bytes(0), m_hits(0), m_misses(0) { }
 
-  // Deal with fillorder
-  uint16 fillorder = FILLORDER_MSB2LSB;
-  TIFFGetField(in_file.get(), TIFFTAG_FILLORDER, &fillorder);
+    bool enabled() const { return m_budget > 0; }
 
-  if(fillorder != FILLORDER_MSB2LSB) {
-    // We need to swap bits -- ABCDEFGH becomes HGFEDCBA
-    for(unsigned long count=0; count<buffer_size; ++count)
+    // Returns the cached chunk, or the one that the decode function returns
+    chunk_data get(const key& k, const std::function<chunk_data()>& decode)
     {
-      unsigned char tempbyte = 0;
-      if(buffer[count] & 128) tempbyte += 1;
-      if(buffer[count] & 64) tempbyte += 2;
-      if(buffer[count] & 32) tempbyte += 4;
-      if(buffer[count] & 16) tempbyte += 8;
-      if(buffer[count] & 8) tempbyte += 16;
-      if(buffer[count] & 4) tempbyte += 32;
-      if(buffer[count] & 2) tempbyte += 64;
-      if(buffer[count] & 1) tempbyte += 128;
-      buffer[count] = tempbyte;
+      std::unique_lock<std::mutex> lock(m_mutex);
+      auto it = m_entries.find(k);
+      if(it != m_entries.end())
+      {
+        ++m_hits;
+        if(it->second.ready)
+          m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+        std::shared_future<chunk_data> future = it->second.future;
+        lock.unlock();
+        return future.get();
+      }
+
+      ++m_misses;
+      std::promise<chunk_data> promise;
+      m_entries[k].future = promise.get_future().share();
+      lock.unlock();
+
+      chunk_data data;
+      try
+      {
+        data = decode();
+      }
+      catch(...)
+      {
+        // readers that wait get the error, later readers try again
+        promise.set_exception(std::current_exception());
+        lock.lock();
+        m_entries.erase(k);
+        throw;
+      }
+      promise.set_value(data);
+
+      lock.lock();
+      auto inserted = m_entries.find(k);
+      if(inserted != m_entries.end())
+      {
+        inserted->second.ready = true;
+        inserted->second.bytes = data->size();
+        inserted->second.lru = m_lru.insert(m_lru.begin(), k);
+        m_bytes += data->size();
+        evict();
+      }
+      return data;
     }
-  }
 
-  // Copy to output array
-  T *element = reinterpret_cast<T*>(b.ptr());
-  T *b_in = reinterpret_cast<T*>(buffer);
-  memcpy(element, b_in, height*width*sizeof(T));
-}
+    // Removes the cached chunks of the files whose identity starts with the
+    // prefix; chunks that are being decoded are kept
+    void invalidate(const std::string& prefix)
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      auto it = m_entries.lower_bound(key(prefix, 0, 0));
+      while(it != m_entries.end() && std::get<0>(it->first).compare(0, prefix.size(), prefix) == 0)
+      {
+        if(!it->second.ready)
+        {
+          ++it;
+          continue;
+        }
+        m_bytes -= it->second.bytes;
+        m_lru.erase(it->second.lru);
+        it = m_entries.erase(it);
+      }
+    }
 
-template <typename T> static
-void imbuffer_to_rgb(const size_t size, const T* im, T* r, T* g, T* b)
+    void resize(const size_t budget)
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_budget = budget;
+      evict();
+    }
+
+    bob::io::image::TIFFCacheStatistics statistics()
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      bob::io::image::TIFFCacheStatistics result;
+      result.hits = m_hits;
+      result.misses = m_misses;
+      result.bytes = m_bytes;
+      result.chunks = m_lru.size();
+      return result;
+    }
+
+  private:
+    // Removes the least recently used chunks that exceed the budget
+    void evict()
+    {
+      while(m_bytes > m_budget && !m_lru.empty())
+      {
+        auto it = m_entries.find(m_lru.back());
+        m_bytes -= it->second.bytes;
+        m_entries.erase(it);
+        m_lru.pop_back();
+      }
+    }
+
+    struct entry
+    {
+      entry() : ready(false), bytes(0) { }
+      std::shared_future<chunk_data> future;
+      bool ready; ///< chunks that are being decoded are not in the LRU list
+      size_t bytes;
+      std::list<key>::iterator lru;
+    };
+
+    std::mutex m_mutex;
+    std::map<key, entry> m_entries;
+    std::list<key> m_lru; ///< the most recently used chunk first
+    std::atomic<size_t> m_budget;
+    size_t m_bytes;
+    size_t m_hits;
+    size_t m_misses;
+};
+
+static chunk_cache s_chunk_cache;
+
+// Removes the chunks of a file that was written from the cache, since its
+// modification time may not change between writes in quick succession
+static void invalidate_file(const std::string& filename)
 {
-  for(size_t k=0; k<size; ++k)
-  {
-    r[k] = im[3*k];
-    g[k] = im[3*k +1];
-    b[k] = im[3*k +2];
-  }
+  struct stat status;
+  if(s_chunk_cache.enabled() && stat(filename.c_str(), &status) == 0)
+    s_chunk_cache.invalidate(file_prefix(status));
 }
 
-template <typename T> static
-void im_load_color(boost::shared_ptr<TIFF> in_file, bob::io::base::array::interface& b)
+void bob::io::image::set_tiff_cache_size(size_t bytes){
+  s_chunk_cache.resize(bytes);
+}
+
+bob::io::image::TIFFCacheStatistics bob::io::image::get_tiff_cache_statistics(){
+  return s_chunk_cache.statistics();
+}
+
+// Regions with less pixels are decoded on a single thread, since the worker
+// threads need to open the file again
+static const size_t s_parallel_pixels = 1 << 18;
+
+// Reads the region of the image that starts at (y0, x0) and has the size of
+// the destination, converting samples of type S into the destination of type
+// D. Only the strips or tiles that overlap the region are decoded; large
+// regions are decoded on several threads, each with its own handle of the
+// page at the given directory offset, since libtiff handles are not thread-safe.
+template <typename S, typename D> static
+void im_load_region(boost::shared_ptr<const bob::io::image::TIFFMemory> memory, const std::string& filename, const uint64_t offset,
+  boost::shared_ptr<TIFF> in_file, bob::io::base::array::interface& b, const size_t y0, const size_t x0)
 {
   const bob::io::base::array::typeinfo& info = b.type();
-  const size_t height = info.shape[1];
-  const size_t width = info.shape[2];
+  const size_t channels = (info.nd == 2 ? 1 : 3);
+  const size_t height = info.shape[info.nd-2];
+  const size_t width = info.shape[info.nd-1];
   const size_t frame_size = height*width;
-  const size_t row_stride = width;
-  const size_t row_color_stride = 3*width;
 
-  // Read in the possibly multiple strips
-  tsize_t strip_size = TIFFStripSize(in_file.get());
-  tstrip_t n_strips = TIFFNumberOfStrips(in_file.get());
+  //Comment just to document
+  //PHOTOMETRIC_PALETTE: In this model, a color is described with a single component. The value of the component is used as an index into the red, green and blue curves in the ColorMap field to retrieve an RGB triplet that defines the color. When PhotometricInterpretation=3
 
-  unsigned long buffer_size = n_strips * strip_size;
-  boost::shared_array<unsigned char> buffer_(new unsigned char[buffer_size]);
-  unsigned char* buffer = buffer_.get();
-  if(buffer == 0) throw std::runtime_error("TIFF: error while getting the color buffer");
+  // Deal with photometric interpretations
+  uint16 photo = (channels == 1 ? PHOTOMETRIC_MINISBLACK : PHOTOMETRIC_RGB);
+  if(TIFFGetField(in_file.get(), TIFFTAG_PHOTOMETRIC, &photo) == 0 ||
+     (channels == 1 && photo != PHOTOMETRIC_MINISBLACK && photo != PHOTOMETRIC_MINISWHITE && photo != PHOTOMETRIC_PALETTE) ||
+     (channels == 3 && photo != PHOTOMETRIC_RGB)){
+    throw std::runtime_error("TIFF: error in function TIFFGetField()");
+  }
 
-  tsize_t result;
-  tsize_t image_offset = 0;
-  for(tstrip_t strip_count=0; strip_count<n_strips; ++strip_count)
-  {
-    if((result = TIFFReadEncodedStrip(in_file.get(), strip_count, buffer+image_offset, strip_size)) == -1)
-      throw std::runtime_error("TIFF: error in function TIFFReadEncodedStrip()");
+  // The fill order needs no handling: libtiff reverses the bits of the raw
+  // data of FILLORDER_LSB2MSB files (with TIFFReverseBits) before decoding
 
-    image_offset += result;
+  uint16 bps = 8;
+  TIFFGetField(in_file.get(), TIFFTAG_BITSPERSAMPLE, &bps);
+  const bool bilevel = (bps == 1);
+
+  // Color images store either interleaved samples, or each plane in its own chunks
+  uint16 planar = PLANARCONFIG_CONTIG;
+  TIFFGetField(in_file.get(), TIFFTAG_PLANARCONFIG, &planar);
+  const size_t planes = (planar == PLANARCONFIG_SEPARATE ? channels : 1);
+  const size_t samples = channels / planes;
+
+  // The chunks (strips or tiles) of the image, and the size of their rows
+  const bool tiled = TIFFIsTiled(in_file.get());
+  uint32 image_width, image_height, chunk_width, chunk_height;
+  TIFFGetField(in_file.get(), TIFFTAG_IMAGEWIDTH, &image_width);
+  TIFFGetField(in_file.get(), TIFFTAG_IMAGELENGTH, &image_height);
+  tsize_t chunk_size, row_size;
+  if(tiled)
+  {
+    TIFFGetField(in_file.get(), TIFFTAG_TILEWIDTH, &chunk_width);
+    TIFFGetField(in_file.get(), TIFFTAG_TILELENGTH, &chunk_height);
+    chunk_size = TIFFTileSize(in_file.get());
+    row_size = TIFFTileRowSize(in_file.get());
+  }
+  else
+  {
+    chunk_width = image_width;
+    TIFFGetFieldDefaulted(in_file.get(), TIFFTAG_ROWSPERSTRIP, &chunk_height);
+    chunk_height = std::min(chunk_height, image_height);
+    chunk_size = TIFFStripSize(in_file.get());
+    row_size = TIFFScanlineSize(in_file.get());
   }
 
-  // Deal with photometric interpretations
-  uint16 photo = PHOTOMETRIC_RGB;
-  if(TIFFGetField(in_file.get(), TIFFTAG_PHOTOMETRIC, &photo) == 0 || photo != PHOTOMETRIC_RGB)
-    throw std::runtime_error("TIFF: error in function TIFFGetField()");
+  // The upper left corners and planes of the chunks that overlap the region
+  struct chunk { size_t y, x, plane; };
+  std::vector<chunk> chunks;
+  for(size_t plane = 0; plane < planes; ++plane)
+    for(size_t cy = y0 - y0 % chunk_height; cy < y0 + height; cy += chunk_height)
+      for(size_t cx = x0 - x0 % chunk_width; cx < x0 + width; cx += chunk_width)
+        chunks.push_back(chunk{cy, cx, plane});
 
-  // Deal with fillorder
-  uint16 fillorder = FILLORDER_MSB2LSB;
-  TIFFGetField(in_file.get(), TIFFTAG_FILLORDER, &fillorder);
+  // Strips of a single sample per pixel (gray images, or the planes of
+  // separate plane images) that span whole rows of the region hold the
+  // destination rows already in Bob's layout, when no conversion is needed;
+  // they are decoded through the buffer only to be cached
+  const bool cached = s_chunk_cache.enabled();
+  const bool direct = boost::is_same<S,D>::value && !bilevel && !tiled && samples == 1 &&
+    x0 == 0 && width == image_width && !cached;
 
-  if(fillorder != FILLORDER_MSB2LSB) {
-    // We need to swap bits -- ABCDEFGH becomes HGFEDCBA
-    for(unsigned long count=0; count<(unsigned long)image_offset; ++count)
+  // Decodes a chunk into the buffer of chunk_size bytes, returning the decoded size
+  auto read_chunk = [&](TIFF* file, const chunk& c, unsigned char* buffer)
+  {
+    tsize_t result;
+    if(tiled)
     {
-      unsigned char tempbyte = 0;
-      if(buffer[count] & 128) tempbyte += 1;
-      if(buffer[count] & 64) tempbyte += 2;
-      if(buffer[count] & 32) tempbyte += 4;
-      if(buffer[count] & 16) tempbyte += 8;
-      if(buffer[count] & 8) tempbyte += 16;
-      if(buffer[count] & 4) tempbyte += 32;
-      if(buffer[count] & 2) tempbyte += 64;
-      if(buffer[count] & 1) tempbyte += 128;
-      buffer[count] = tempbyte;
+      if((result = TIFFReadEncodedTile(file, TIFFComputeTile(file, c.x, c.y, 0, c.plane), buffer, chunk_size)) == -1)
+        throw std::runtime_error("TIFF: error in function TIFFReadEncodedTile()");
+    }
+    else
+    {
+      if((result = TIFFReadEncodedStrip(file, TIFFComputeStrip(file, c.y, c.plane), buffer, chunk_size)) == -1)
+        throw std::runtime_error("TIFF: error in function TIFFReadEncodedStrip()");
     }
-  }
 
-  // Read the image (one row at a time)
-  // This can deal with interlacing
-  T *element_r = reinterpret_cast<T*>(b.ptr());
-  T *element_g = element_r + frame_size;
-  T *element_b = element_g + frame_size;
-  unsigned char *row_pointer = buffer;
-  // Loop over the rows
-  for(size_t y=0; y<height; ++y)
+    if(photo == PHOTOMETRIC_MINISWHITE)
+    {
+      // Flip bits
+      for(tsize_t count=0; count<result; ++count)
+        buffer[count] = ~buffer[count];
+    }
+    return result;
+  };
+
+  // Decodes (or looks up) one chunk and converts the part that overlaps the region
+  D* image = reinterpret_cast<D*>(b.ptr());
+  auto decode = [&](TIFF* file, boost::shared_array<unsigned char>& buffer_, const chunk& c)
   {
-    imbuffer_to_rgb(row_stride, reinterpret_cast<T*>(row_pointer), element_r, element_g, element_b);
-    element_r += row_stride;
-    element_g += row_stride;
-    element_b += row_stride;
-    row_pointer += row_color_stride * sizeof(T);
-  }
+    const size_t cy = c.y, cx = c.x;
+    tsize_t result;
+
+    const size_t rows = std::min<size_t>(chunk_height, image_height - cy);
+    if(direct && cy >= y0 && cy + rows <= y0 + height)
+    {
+      // Decodes the strip straight into the destination rows
+      unsigned char* destination = reinterpret_cast<unsigned char*>(image + c.plane * frame_size + (cy - y0) * width);
+      const tsize_t size = rows * row_size;
+      if((result = TIFFReadEncodedStrip(file, TIFFComputeStrip(file, cy, c.plane), destination, size)) == -1)
+        throw std::runtime_error("TIFF: error in function TIFFReadEncodedStrip()");
+      if(result < size)
+        throw std::runtime_error("TIFF: decoded chunk is smaller than expected");
+      if(photo == PHOTOMETRIC_MINISWHITE)
+        for(tsize_t count=0; count<size; ++count)
+          destination[count] = ~destination[count];
+      return;
+    }
+
+    const unsigned char* buffer;
+    chunk_cache::chunk_data data;
+    if(cached)
+    {
+      const uint32 index = (tiled ? TIFFComputeTile(file, cx, cy, 0, c.plane) : TIFFComputeStrip(file, cy, c.plane));
+      data = s_chunk_cache.get(chunk_cache::key(memory->identity, offset, index), [&]()
+      {
+        boost::shared_ptr<std::vector<unsigned char> > decoded = boost::make_shared<std::vector<unsigned char> >(chunk_size);
+        decoded->resize(read_chunk(file, c, decoded->data()));
+        return chunk_cache::chunk_data(decoded);
+      });
+      buffer = data->data();
+      result = data->size();
+    }
+    else
+    {
+      if(!buffer_) buffer_.reset(new unsigned char[chunk_size]);
+      result = read_chunk(file, c, buffer_.get());
+      buffer = buffer_.get();
+    }
+
+    // Copy the part of the chunk that overlaps the region
+    const size_t ya = std::max(cy, y0), yb = std::min<size_t>(cy + chunk_height, y0 + height);
+    const size_t xa = std::max(cx, x0), xb = std::min<size_t>(cx + chunk_width, x0 + width);
+    if((tsize_t)(yb - cy) * row_size > result)
+      throw std::runtime_error("TIFF: decoded chunk is smaller than expected");
+    for(size_t y=ya; y<yb; ++y)
+      convert_row<S,D>(buffer + (y - cy) * row_size, bilevel, samples, xa - cx, xb - cx,
+        image + c.plane * frame_size + (y - y0) * width + (xa - x0), frame_size);
+  };
+
+  // Regions need only some of the chunks, so that read-ahead would be wasted
+  advise(in_file, (height == image_height && width == image_width) ? MADV_SEQUENTIAL : MADV_RANDOM);
+
+  size_t workers = 1;
+  if(frame_size >= s_parallel_pixels)
+    workers = std::min(bob::io::image::get_decoding_threads(), chunks.size());
+
+  // The workers take the next chunk until all are decoded; the first worker
+  // runs on the calling thread and uses its handle
+  std::atomic<size_t> next(0);
+  std::vector<std::exception_ptr> errors(workers);
+  auto work = [&](const size_t worker)
+  {
+    try
+    {
+      boost::shared_ptr<TIFF> file = (worker == 0 ? in_file : open_page(memory, filename, offset));
+      boost::shared_array<unsigned char> buffer;
+      for(size_t k; (k = next++) < chunks.size(); )
+        decode(file.get(), buffer, chunks[k]);
+    }
+    catch(...)
+    {
+      errors[worker] = std::current_exception();
+      next = chunks.size();
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for(size_t worker=1; worker<workers; ++worker)
+    threads.push_back(std::thread(work, worker));
+  work(0);
+  for(size_t t=0; t<threads.size(); ++t)
+    threads[t].join();
+  for(size_t worker=0; worker<workers; ++worker)
+    if(errors[worker]) std::rethrow_exception(errors[worker]);
+}
+
+// Reads the region, converting the samples of the file into the data type D
+template <typename D> static
+void im_load_region(boost::shared_ptr<const bob::io::image::TIFFMemory> memory, const std::string& filename, const uint64_t offset,
+  boost::shared_ptr<TIFF> in_file, bob::io::base::array::interface& b, const size_t y0, const size_t x0)
+{
+  uint16 bps = 8;
+  TIFFGetField(in_file.get(), TIFFTAG_BITSPERSAMPLE, &bps);
+  if(bps == 16) im_load_region<uint16_t,D>(memory, filename, offset, in_file, b, y0, x0);
+  else im_load_region<uint8_t,D>(memory, filename, offset, in_file, b, y0, x0);
 }
 
-static void im_load(const std::string& filename, bob::io::base::array::interface& b)
+// Reads the region of the page at the given directory offset that starts at
+// (y0, x0) and has the size of the given buffer
+static void im_load(boost::shared_ptr<const bob::io::image::TIFFMemory> memory, const std::string& filename, const uint64_t offset,
+  bob::io::base::array::interface& b, const size_t y0 = 0, const size_t x0 = 0)
 {
   // 1. TIFF file opening
-  boost::shared_ptr<TIFF> in_file = make_cfile(filename.c_str(), "r");
+  boost::shared_ptr<TIFF> in_file = open_page(memory, filename, offset);
 
   // 2. Read content
   const bob::io::base::array::typeinfo& info = b.type();
-  if(info.dtype == bob::io::base::array::t_uint8) {
-    if(info.nd == 2) im_load_gray<uint8_t>(in_file, b);
-    else if( info.nd == 3) im_load_color<uint8_t>(in_file, b);
-    else {
-      boost::format m("TIFF: cannot read object of type `%s' from file `%s'");
-      m % info.str() % filename;
-      throw std::runtime_error(m.str());
-    }
+  if(info.nd != 2 && info.nd != 3) {
+    boost::format m("TIFF: cannot read object of type `%s' from file `%s'");
+    m % info.str() % filename;
+    throw std::runtime_error(m.str());
   }
-  else if(info.dtype == bob::io::base::array::t_uint16) {
-    if(info.nd == 2) im_load_gray<uint16_t>(in_file, b);
-    else if( info.nd == 3) im_load_color<uint16_t>(in_file, b);
-    else {
+  switch(info.dtype) {
+    case bob::io::base::array::t_uint8:
+      im_load_region<uint8_t>(memory, filename, offset, in_file, b, y0, x0);
+      break;
+    case bob::io::base::array::t_uint16:
+      im_load_region<uint16_t>(memory, filename, offset, in_file, b, y0, x0);
+      break;
+    case bob::io::base::array::t_float32:
+      im_load_region<float>(memory, filename, offset, in_file, b, y0, x0);
+      break;
+    case bob::io::base::array::t_float64:
+      im_load_region<double>(memory, filename, offset, in_file, b, y0, x0);
+      break;
+    default: {
       boost::format m("TIFF: cannot read object of type `%s' from file `%s'");
       m % info.str() % filename;
       throw std::runtime_error(m.str());
     }
   }
-  else {
-    boost::format m("TIFF: cannot read object of type `%s' from file `%s'");
-    m % info.str() % filename;
-    throw std::runtime_error(m.str());
-  }
+}
+
+static void im_load_packed(boost::shared_ptr<const bob::io::image::TIFFMemory> memory, const std::string& filename, const uint64_t offset,
+  blitz::Array<uint8_t,2>& bits)
+{
+  boost::shared_ptr<TIFF> in_file = open_page(memory, filename, offset);
+  uint32 w, h;
+  TIFFGetField(in_file.get(), TIFFTAG_IMAGEWIDTH, &w);
+  TIFFGetField(in_file.get(), TIFFTAG_IMAGELENGTH, &h);
+  bits.resize(h, (w + 7) / 8);
+  im_load_bits(in_file, h, w, bits.data());
 }
 
 
 /**
  * SAVING
  */
-template <typename T>
-static void im_save_gray(const bob::io::base::array::interface& b, boost::shared_ptr<TIFF> out_file)
-{
-  const bob::io::base::array::typeinfo& info = b.type();
-  const size_t height = info.shape[0];
-  const size_t width = info.shape[1];
-
-  unsigned char* row_pointer = const_cast<unsigned char*>(reinterpret_cast<const unsigned char*>(b.ptr()));
-  const size_t data_size = height * width * sizeof(T);
-
-  // Write the information to the file
-  TIFFWriteEncodedStrip(out_file.get(), 0, row_pointer, data_size);
-}
-
 template <typename T> static
 void rgb_to_imbuffer(const size_t size, const T* r, const T* g, const T* b, T* im)
 {
@@ -294,83 +875,472 @@ void rgb_to_imbuffer(const size_t size, const T* r, const T* g, const T* b, T* i
   }
 }
 
-template <typename T>
-static void im_save_color(const bob::io::base::array::interface& b, boost::shared_ptr<TIFF> out_file)
+// A strip or tile of an image that is written
+struct tiff_chunk
+{
+  uint32 index; ///< the strip or tile number in the file
+  size_t plane, y, x, rows, columns;
+};
+
+// Encodes the image chunk by chunk: each strip or tile is interleaved (or
+// copied, for single samples) into a buffer of the size of one chunk, which
+// libtiff may modify while encoding. Strips of gray images and of separate
+// planes are encoded straight from the image when no predictor modifies them.
+// The chunks of large images are compressed by several threads, each into its
+// own file in memory, and their compressed bytes are written to the file in
+// order by the calling thread; at most a few chunks per thread are held.
+template <typename T> static
+void im_save_chunks(const bob::io::base::array::interface& b, boost::shared_ptr<TIFF> out_file)
 {
   const bob::io::base::array::typeinfo& info = b.type();
-  const size_t height = info.shape[1];
-  const size_t width = info.shape[2];
+  const size_t channels = (info.nd == 2 ? 1 : 3);
+  const size_t height = info.shape[info.nd-2];
+  const size_t width = info.shape[info.nd-1];
   const size_t frame_size = height * width;
 
-  // Allocate array for a row as an RGB-like array
-  boost::shared_array<T> row(new T[3*width*height]);
-  unsigned char* row_pointer = reinterpret_cast<unsigned char*>(row.get());
+  uint16 planar = PLANARCONFIG_CONTIG;
+  TIFFGetField(out_file.get(), TIFFTAG_PLANARCONFIG, &planar);
+  const size_t planes = (planar == PLANARCONFIG_SEPARATE ? channels : 1);
+  const size_t samples = channels / planes;
+
+  const bool tiled = TIFFIsTiled(out_file.get());
+  uint32 chunk_width = width, chunk_height;
+  if(tiled)
+  {
+    TIFFGetField(out_file.get(), TIFFTAG_TILEWIDTH, &chunk_width);
+    TIFFGetField(out_file.get(), TIFFTAG_TILELENGTH, &chunk_height);
+  }
+  else
+    TIFFGetField(out_file.get(), TIFFTAG_ROWSPERSTRIP, &chunk_height);
+
+  uint16 predictor = PREDICTOR_NONE;
+  TIFFGetField(out_file.get(), TIFFTAG_PREDICTOR, &predictor);
+  const bool direct = (!tiled && samples == 1 && predictor == PREDICTOR_NONE);
+
+  // tiles are padded with zeros, the last strip is shorter; the chunks are
+  // numbered as libtiff does, which only sets up the number of chunks per
+  // plane when the first one is written
+  const size_t across = (width + chunk_width - 1) / chunk_width;
+  const size_t down = (height + chunk_height - 1) / chunk_height;
+  std::vector<tiff_chunk> chunks;
+  for(size_t plane = 0; plane < planes; ++plane)
+    for(size_t cy = 0; cy < height; cy += chunk_height)
+      for(size_t cx = 0; cx < width; cx += chunk_width)
+      {
+        tiff_chunk chunk;
+        chunk.index = (plane * down + cy / chunk_height) * across + cx / chunk_width;
+        chunk.plane = plane;
+        chunk.y = cy;
+        chunk.x = cx;
+        chunk.rows = std::min<size_t>(chunk_height, height - cy);
+        chunk.columns = std::min<size_t>(chunk_width, width - cx);
+        chunks.push_back(chunk);
+      }
+
+  // Encodes the chunk to the given file, using the buffer of one chunk
+  const size_t chunk_size = (size_t)chunk_width * chunk_height * samples;
+  const T* image = static_cast<const T*>(b.ptr());
+  auto encode = [&](TIFF* file, const tiff_chunk& chunk, T* buffer)
+  {
+    if(direct)
+    {
+      T* rows_pointer = const_cast<T*>(image + chunk.plane * frame_size + chunk.y * width);
+      if(TIFFWriteEncodedStrip(file, chunk.index, rows_pointer, (tsize_t)chunk.rows * width * sizeof(T)) == -1)
+        throw std::runtime_error("TIFF: error in function TIFFWriteEncodedStrip()");
+      return;
+    }
+    if(tiled)
+      std::fill(buffer, buffer + chunk_size, T(0));
+    for(size_t y = 0; y < chunk.rows; ++y)
+    {
+      const T* source = image + (chunk.y + y) * width + chunk.x;
+      T* row = buffer + y * chunk_width * samples;
+      if(samples == 1)
+        std::copy(source + chunk.plane * frame_size, source + chunk.plane * frame_size + chunk.columns, row);
+      else
+        rgb_to_imbuffer(chunk.columns, source, source + frame_size, source + 2 * frame_size, row);
+    }
+
+    if(tiled)
+    {
+      if(TIFFWriteEncodedTile(file, chunk.index, buffer, (tsize_t)chunk_size * sizeof(T)) == -1)
+        throw std::runtime_error("TIFF: error in function TIFFWriteEncodedTile()");
+    }
+    else
+    {
+      if(TIFFWriteEncodedStrip(file, chunk.index, buffer, (tsize_t)chunk.rows * width * samples * sizeof(T)) == -1)
+        throw std::runtime_error("TIFF: error in function TIFFWriteEncodedStrip()");
+    }
+  };
+
+  size_t workers = 1;
+  if(frame_size * channels >= s_parallel_pixels)
+    workers = std::min(bob::io::image::get_decoding_threads(), chunks.size());
+  if(workers <= 1)
+  {
+    boost::shared_array<T> buffer;
+    if(!direct) buffer.reset(new T[chunk_size]);
+    for(const tiff_chunk& chunk : chunks)
+      encode(out_file.get(), chunk, buffer.get());
+    return;
+  }
+
+  // The workers compress the next chunk, unless the calling thread is more
+  // than window chunks behind them
+  const size_t window = 4 * workers;
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::vector<std::vector<unsigned char> > encoded(chunks.size());
+  std::vector<bool> ready(chunks.size(), false);
+  size_t next = 0, written = 0;
+  std::exception_ptr error;
+  auto work = [&]()
+  {
+    try
+    {
+      tiff_sink sink;
+      boost::shared_ptr<TIFF> file = open_sink(sink, out_file);
+      boost::shared_array<T> buffer;
+      if(!direct) buffer.reset(new T[chunk_size]);
+      for(;;)
+      {
+        size_t k;
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          changed.wait(lock, [&]{ return error || next == chunks.size() || next < written + window; });
+          if(error || next == chunks.size()) return;
+          k = next++;
+        }
+        // the compressed chunk is appended to the file in memory, which is
+        // truncated again, since its chunks are never read back
+        const size_t start = sink.data.size();
+        encode(file.get(), chunks[k], buffer.get());
+        std::vector<unsigned char> bytes(sink.data.begin() + start, sink.data.end());
+        sink.data.resize(start);
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          encoded[k].swap(bytes);
+          ready[k] = true;
+        }
+        changed.notify_all();
+      }
+    }
+    catch(...)
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if(!error) error = std::current_exception();
+      changed.notify_all();
+    }
+  };
+  std::vector<std::thread> threads;
+  for(size_t worker = 0; worker < workers; ++worker) threads.emplace_back(work);
+
+  try
+  {
+    for(size_t k = 0; k < chunks.size(); ++k)
+    {
+      std::vector<unsigned char> bytes;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&]{ return error || ready[k]; });
+        if(error) break;
+        bytes.swap(encoded[k]);
+      }
+      const tsize_t size = bytes.size();
+      if((tiled ? TIFFWriteRawTile(out_file.get(), chunks[k].index, bytes.data(), size)
+                : TIFFWriteRawStrip(out_file.get(), chunks[k].index, bytes.data(), size)) != size)
+        throw std::runtime_error(tiled ? "TIFF: error in function TIFFWriteRawTile()" : "TIFF: error in function TIFFWriteRawStrip()");
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        ++written;
+      }
+      changed.notify_all();
+    }
+  }
+  catch(...)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if(!error) error = std::current_exception();
+    changed.notify_all();
+  }
+  for(auto& thread : threads) thread.join();
+  if(error) std::rethrow_exception(error);
+}
+
+// Sets the compression and chunk layout tags of the options
+static void im_set_layout(const std::string& filename, boost::shared_ptr<TIFF> out_file, const size_t channels,
+  const bob::io::image::TIFFWriteOptions& options)
+{
+  uint16 compression = COMPRESSION_NONE;
+  switch(options.compression)
+  {
+    case bob::io::image::TIFFWriteOptions::NONE: compression = COMPRESSION_NONE; break;
+    case bob::io::image::TIFFWriteOptions::LZW: compression = COMPRESSION_LZW; break;
+    case bob::io::image::TIFFWriteOptions::DEFLATE: compression = COMPRESSION_ADOBE_DEFLATE; break;
+    case bob::io::image::TIFFWriteOptions::PACKBITS: compression = COMPRESSION_PACKBITS; break;
+    case bob::io::image::TIFFWriteOptions::ZSTD:
+#ifdef COMPRESSION_ZSTD
+      compression = COMPRESSION_ZSTD;
+      break;
+#else
+      throw std::runtime_error("TIFF: ZSTD compression requires libtiff 4.0.10 or later");
+#endif
+  }
+  if(!TIFFIsCODECConfigured(compression))
+  {
+    boost::format m("TIFF: the compression scheme %d for file `%s' is not supported by this build of libtiff");
+    m % compression % filename;
+    throw std::runtime_error(m.str());
+  }
+  TIFFSetField(out_file.get(), TIFFTAG_COMPRESSION, compression);
+  if(options.predictor && compression != COMPRESSION_NONE && compression != COMPRESSION_PACKBITS)
+    TIFFSetField(out_file.get(), TIFFTAG_PREDICTOR, PREDICTOR_HORIZONTAL);
 
-  // pointer to a single row (tiff_bytep is a typedef to unsigned char or char)
-  const T *element_r = static_cast<const T*>(b.ptr());
-  const T *element_g = element_r + frame_size;
-  const T *element_b = element_g + frame_size;
-  rgb_to_imbuffer(frame_size, element_r, element_g, element_b, row.get());
+  if(channels == 3)
+    TIFFSetField(out_file.get(), TIFFTAG_PLANARCONFIG, (options.separate_planes ? PLANARCONFIG_SEPARATE : PLANARCONFIG_CONTIG));
 
-  // Write the information to the file
-  const size_t data_size = 3 * height * width * sizeof(T);
-  TIFFWriteEncodedStrip(out_file.get(), 0, row_pointer, data_size);
+  if(options.tile_width > 0 && options.tile_height > 0)
+  {
+    if(options.tile_width % 16 || options.tile_height % 16)
+    {
+      boost::format m("TIFF: the tile size %dx%d for file `%s' is not a multiple of 16");
+      m % options.tile_height % options.tile_width % filename;
+      throw std::runtime_error(m.str());
+    }
+    TIFFSetField(out_file.get(), TIFFTAG_TILEWIDTH, options.tile_width);
+    TIFFSetField(out_file.get(), TIFFTAG_TILELENGTH, options.tile_height);
+  }
+  else
+    TIFFSetField(out_file.get(), TIFFTAG_ROWSPERSTRIP,
+      (options.rows_per_strip > 0 ? (uint32)options.rows_per_strip : TIFFDefaultStripSize(out_file.get(), 0)));
 }
 
-static void im_save(const std::string& filename, const bob::io::base::array::interface& array)
+// Halves the size of the planes of an image by averaging 2x2 blocks of
+// pixels; the last row or column of odd sizes is averaged with itself. Large
+// images are reduced by several threads, each computing a band of rows.
+template <typename T> static
+void im_reduce(const T* source, const size_t planes, const size_t height, const size_t width, T* dest)
 {
-  // 1. Open the file
-  boost::shared_ptr<TIFF> out_file = make_cfile(filename.c_str(), "w");
+  const size_t dest_height = (height + 1) / 2, dest_width = (width + 1) / 2;
+  auto reduce = [&](const size_t y0, const size_t y1)
+  {
+    for(size_t plane = 0; plane < planes; ++plane)
+    {
+      for(size_t y = y0; y < y1; ++y)
+      {
+        const T* row0 = source + (plane * height + 2 * y) * width;
+        const T* row1 = (2 * y + 1 < height ? row0 + width : row0);
+        T* row = dest + (plane * dest_height + y) * dest_width;
+        for(size_t x = 0; x < dest_width; ++x)
+        {
+          const size_t x0 = 2 * x, x1 = std::min(2 * x + 1, width - 1);
+          row[x] = (T)(((uint32_t)row0[x0] + row0[x1] + row1[x0] + row1[x1] + 2) / 4);
+        }
+      }
+    }
+  };
 
-  // 2. Set the image information here:
-  const bob::io::base::array::typeinfo& info = array.type();
+  size_t workers = 1;
+  if(dest_height * dest_width * planes >= s_parallel_pixels)
+    workers = std::min(bob::io::image::get_decoding_threads(), dest_height);
+  if(workers <= 1)
+  {
+    reduce(0, dest_height);
+    return;
+  }
+  std::vector<std::thread> threads;
+  for(size_t worker = 0; worker < workers; ++worker)
+    threads.emplace_back(reduce, dest_height * worker / workers, dest_height * (worker + 1) / workers);
+  for(auto& thread : threads) thread.join();
+}
+
+// Sets the fields of an image of the given type for the next directory
+static void im_set_fields(const std::string& filename, boost::shared_ptr<TIFF> out_file,
+  const bob::io::base::array::typeinfo& info, const bob::io::image::TIFFWriteOptions& options)
+{
   const int height = (info.nd == 2 ? info.shape[0] : info.shape[1]);
   const int width = (info.nd == 2 ? info.shape[1] : info.shape[2]);
   TIFFSetField(out_file.get(), TIFFTAG_IMAGELENGTH, height);
   TIFFSetField(out_file.get(), TIFFTAG_IMAGEWIDTH, width);
   TIFFSetField(out_file.get(), TIFFTAG_BITSPERSAMPLE, (info.dtype == bob::io::base::array::t_uint8 ? 8 : 16));
   TIFFSetField(out_file.get(), TIFFTAG_SAMPLESPERPIXEL, (info.nd == 2 ? 1 : 3));
-
-  TIFFSetField(out_file.get(), TIFFTAG_COMPRESSION, COMPRESSION_NONE);
   TIFFSetField(out_file.get(), TIFFTAG_FILLORDER, FILLORDER_MSB2LSB);
-  if(info.nd == 3)
-    TIFFSetField(out_file.get(), TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
   TIFFSetField(out_file.get(), TIFFTAG_PHOTOMETRIC, (info.nd == 2 ? PHOTOMETRIC_MINISBLACK : PHOTOMETRIC_RGB));
+  im_set_layout(filename, out_file, (info.nd == 2 ? 1 : 3), options);
+}
 
-  // 3. Writes content
-  if(info.dtype == bob::io::base::array::t_uint8) {
-    if(info.nd == 2) im_save_gray<uint8_t>(array, out_file);
-    else if(info.nd == 3) {
-      if(info.shape[0] != 3)
-        throw std::runtime_error("color image does not have 3 planes on 1st. dimension");
-      im_save_color<uint8_t>(array, out_file);
-    }
-    else {
-      boost::format m("TIFF: cannot write object of type `%s' to file `%s'");
-      m % info.str() % filename;
-      throw std::runtime_error(m.str());
-    }
+// Encodes the array and finishes its directory
+static void im_save_directory(const bob::io::base::array::interface& array, boost::shared_ptr<TIFF> out_file)
+{
+  if(array.type().dtype == bob::io::base::array::t_uint8)
+    im_save_chunks<uint8_t>(array, out_file);
+  else
+    im_save_chunks<uint16_t>(array, out_file);
+
+  if(!TIFFWriteDirectory(out_file.get()))
+    throw std::runtime_error("TIFF: error in function TIFFWriteDirectory()");
+}
+
+// Writes the reduced-resolution levels 1 to levels-1 of the image as the
+// SubIFDs announced by the page that was just written. Each level is computed
+// from the one before, so that only two levels are held in memory.
+template <typename T> static
+void im_save_levels(const std::string& filename, const bob::io::base::array::interface& array, const size_t levels,
+  boost::shared_ptr<TIFF> out_file, const bob::io::image::TIFFWriteOptions& options)
+{
+  bob::io::base::array::typeinfo info(array.type());
+  const size_t planes = (info.nd == 2 ? 1 : 3);
+  boost::shared_array<T> previous, current;
+  const T* source = static_cast<const T*>(array.ptr());
+  for(size_t level = 1; level < levels; ++level)
+  {
+    const size_t height = info.shape[info.nd-2], width = info.shape[info.nd-1];
+    info.shape[info.nd-2] = (height + 1) / 2;
+    info.shape[info.nd-1] = (width + 1) / 2;
+    info.update_strides();
+    current.reset(new T[info.size()]);
+    im_reduce(source, planes, height, width, current.get());
+
+    im_set_fields(filename, out_file, info, options);
+    TIFFSetField(out_file.get(), TIFFTAG_SUBFILETYPE, FILETYPE_REDUCEDIMAGE);
+    bob::io::base::array::blitz_array reduced(current.get(), info);
+    im_save_directory(reduced, out_file);
+
+    previous = current;
+    source = previous.get();
   }
-  else if(info.dtype == bob::io::base::array::t_uint16) {
-    if(info.nd == 2) im_save_gray<uint16_t>(array, out_file);
-    else if(info.nd == 3) {
-      if(info.shape[0] != 3)
-        throw std::runtime_error("color image does not have 3 planes on 1st. dimension");
-      im_save_color<uint16_t>(array, out_file);
-    }
-    else {
-      boost::format m("TIFF: cannot write object of type `%s' to file `%s'");
-      m % info.str() % filename;
-      throw std::runtime_error(m.str());
-    }
+}
+
+// Classic TIFF files address at most 4 GB with 32 bit offsets; some space is
+// kept for the directories and the strip or tile offsets
+static const uint64_t s_classic_tiff_limit = (uint64_t(1) << 32) - (uint64_t(1) << 24);
+
+// Returns whether the existing file is a BigTIFF file, i.e., has version 43
+static bool is_bigtiff(const std::string& filename)
+{
+  unsigned char header[4] = {0, 0, 0, 0};
+  std::ifstream f(filename.c_str(), std::ios::binary);
+  f.read(reinterpret_cast<char*>(header), 4);
+  return (header[0] == 'I' && header[2] == 43) || (header[0] == 'M' && header[3] == 43);
+}
+
+// Selects the flags of TIFFOpen to write a page of data_size bytes of
+// uncompressed image data, either to a new file, or appended to the existing
+// one. New files are written as BigTIFF ("w8") on request, or when classic
+// TIFF cannot hold the uncompressed data; existing files keep their format.
+// The uncompressed size also bounds compressed pages, whose size is not known
+// before they are written.
+static const char* write_flags(const std::string& filename, const bool append, const uint64_t data_size, const bool bigtiff)
+{
+  if(!append)
+    return (bigtiff || data_size > s_classic_tiff_limit) ? "w8" : "w";
+  if(!is_bigtiff(filename) && boost::filesystem::file_size(filename) + data_size > s_classic_tiff_limit)
+  {
+    boost::format m("TIFF: cannot append %d bytes to file `%s', which would exceed the 4 GB of classic TIFF files; write the first page as BigTIFF instead");
+    m % data_size % filename;
+    throw std::runtime_error(m.str());
   }
-  else {
+  return "a";
+}
+
+// Checks that the array can be written as a page of the given number of levels
+static void im_check_save(const std::string& filename, const bob::io::base::array::interface& array, const size_t levels)
+{
+  const bob::io::base::array::typeinfo& info = array.type();
+  if((info.dtype != bob::io::base::array::t_uint8 && info.dtype != bob::io::base::array::t_uint16) || (info.nd != 2 && info.nd != 3)) {
     boost::format m("TIFF: cannot write object of type `%s' to file `%s'");
     m % info.str() % filename;
     throw std::runtime_error(m.str());
   }
+  if(info.nd == 3 && info.shape[0] != 3)
+    throw std::runtime_error("color image does not have 3 planes on 1st. dimension");
+  // each level halves the size of the image, down to a single pixel
+  const size_t size = std::max(info.shape[info.nd-2], info.shape[info.nd-1]);
+  if(levels == 0 || levels > 32 || (size_t(1) << (levels - 1)) > size)
+  {
+    boost::format m("TIFF: cannot write %d levels of an image of size %dx%d to file `%s'");
+    m % levels % info.shape[info.nd-2] % info.shape[info.nd-1] % filename;
+    throw std::runtime_error(m.str());
+  }
 }
 
+// Writes the array as a new directory of the open file; pages of more than
+// one level are followed by the SubIFDs of their reduced-resolution levels
+static void im_save(const std::string& filename, const bob::io::base::array::interface& array, boost::shared_ptr<TIFF> out_file,
+  const bob::io::image::TIFFWriteOptions& options, const size_t levels = 1)
+{
+  const bob::io::base::array::typeinfo& info = array.type();
+
+  // 1. Set the image information here:
+  im_set_fields(filename, out_file, info, options);
+  if(levels > 1)
+  {
+    // libtiff fills in the offsets of the SubIFDs that are written next
+    std::vector<uint64> subifds(levels - 1, 0);
+    TIFFSetField(out_file.get(), TIFFTAG_SUBFILETYPE, 0);
+    TIFFSetField(out_file.get(), TIFFTAG_SUBIFD, (uint16)subifds.size(), subifds.data());
+  }
+
+  // 2. Writes content and finishes the page
+  im_save_directory(array, out_file);
+
+  // 3. Writes the reduced-resolution levels
+  if(info.dtype == bob::io::base::array::t_uint8)
+    im_save_levels<uint8_t>(filename, array, levels, out_file, options);
+  else
+    im_save_levels<uint16_t>(filename, array, levels, out_file, options);
+}
+
+// Writes bit-packed rows as a bilevel image in a single strip; with
+// MINISWHITE, the set bits are black as in the packed rows
+static void im_save_packed(const std::string& filename, const blitz::Array<uint8_t,2>& bits, const int width, const bool bigtiff)
+{
+  if(bits.extent(1) != (width + 7) / 8)
+  {
+    boost::format m("TIFF: cannot write %d bytes per row of packed bits for an image of width %d");
+    m % bits.extent(1) % width;
+    throw std::runtime_error(m.str());
+  }
+  const blitz::Array<uint8_t,2> packed = bits.isStorageContiguous() ? bits : bits.copy();
+
+  boost::shared_ptr<TIFF> out_file = make_cfile(filename.c_str(), write_flags(filename, false, packed.size(), bigtiff));
+  TIFFSetField(out_file.get(), TIFFTAG_IMAGELENGTH, packed.extent(0));
+  TIFFSetField(out_file.get(), TIFFTAG_IMAGEWIDTH, width);
+  TIFFSetField(out_file.get(), TIFFTAG_BITSPERSAMPLE, 1);
+  TIFFSetField(out_file.get(), TIFFTAG_SAMPLESPERPIXEL, 1);
+  TIFFSetField(out_file.get(), TIFFTAG_COMPRESSION, COMPRESSION_NONE);
+  TIFFSetField(out_file.get(), TIFFTAG_FILLORDER, FILLORDER_MSB2LSB);
+  TIFFSetField(out_file.get(), TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISWHITE);
+
+  if(TIFFWriteEncodedStrip(out_file.get(), 0, const_cast<uint8_t*>(packed.data()), packed.size()) == -1)
+    throw std::runtime_error("TIFF: error in function TIFFWriteEncodedStrip()");
+}
+
+
+// The type of all pages stacked along a new first dimension; it is only
+// defined when all pages have the same type
+static bob::io::base::array::typeinfo im_pages_type(const std::vector<bob::io::base::array::typeinfo>& types)
+{
+  bob::io::base::array::typeinfo info(types[0]);
+  if(types.size() == 1 || info.nd >= BOB_MAX_DIM) return info;
+  for(size_t i=1; i<types.size(); ++i)
+    if(!types[i].is_compatible(types[0])) return info;
+  info.nd = types[0].nd + 1;
+  info.shape[0] = types.size();
+  for(size_t i=0; i<types[0].nd; ++i)
+    info.shape[i+1] = types[0].shape[i];
+  info.update_strides();
+  return info;
+}
+
+// The file that pages are appended to; it is kept open between appends, so
+// that libtiff links each new directory to the last one without walking the
+// directory chain again
+struct bob::io::image::TIFFWriter
+{
+  boost::shared_ptr<TIFF> file;
+};
+
 
 /**
  * TIFF class
@@ -378,6 +1348,7 @@ static void im_save(const std::string& filename, const bob::io::base::array::int
 
 bob::io::image::TIFFFile::TIFFFile(const char* path, char mode)
 : m_filename(path),
+  m_mode(mode),
   m_newfile(true)
 {
   //checks if file exists
@@ -388,38 +1359,177 @@ bob::io::image::TIFFFile::TIFFFile(const char* path, char mode)
   }
 
   if (mode == 'r' || (mode == 'a' && boost::filesystem::exists(path))) {
-    im_peek(path, m_type);
-    m_length = 1;
+    m_memory = map_file(path);
+    im_index(m_memory, path, m_offsets, m_types, m_level_offsets, m_level_types);
+    m_type = m_types[0];
+    m_type_all = im_pages_type(m_types);
     m_newfile = false;
   } else {
-    m_length = 0;
     m_newfile = true;
   }
 }
 
+bob::io::image::TIFFFile::TIFFFile(const blitz::Array<uint8_t,1>& data)
+: m_filename("<memory>"),
+  m_mode('r'),
+  m_newfile(false),
+  m_memory(wrap_memory(data))
+{
+  im_index(m_memory, m_filename, m_offsets, m_types, m_level_offsets, m_level_types);
+  m_type = m_types[0];
+  m_type_all = im_pages_type(m_types);
+}
+
+const bob::io::base::array::typeinfo& bob::io::image::TIFFFile::page_type(size_t index) const {
+  if (index >= m_offsets.size()) {
+    boost::format m("cannot read page %d of TIFF file `%s' with %d pages");
+    m % index % m_filename % m_offsets.size();
+    throw std::runtime_error(m.str());
+  }
+  if (m_types[index].nd == 0) {
+    boost::format m("TIFF: found unsupported color type in page %d of file `%s'");
+    m % index % m_filename;
+    throw std::runtime_error(m.str());
+  }
+  return m_types[index];
+}
+
+size_t bob::io::image::TIFFFile::levels(size_t index) const {
+  page_type(index);
+  return m_level_offsets[index].size() + 1;
+}
+
+const bob::io::base::array::typeinfo& bob::io::image::TIFFFile::level_type(size_t level, size_t index) const {
+  const bob::io::base::array::typeinfo& info = page_type(index);
+  if (level == 0) return info;
+  if (level > m_level_offsets[index].size()) {
+    boost::format m("cannot read level %d of page %d of TIFF file `%s' with %d levels");
+    m % level % index % m_filename % levels(index);
+    throw std::runtime_error(m.str());
+  }
+  if (m_level_types[index][level-1].nd == 0) {
+    boost::format m("TIFF: found unsupported color type in level %d of page %d of file `%s'");
+    m % level % index % m_filename;
+    throw std::runtime_error(m.str());
+  }
+  return m_level_types[index][level-1];
+}
+
+void bob::io::image::TIFFFile::set_write_options(const TIFFWriteOptions& options) {
+  m_options = options;
+}
+
+void bob::io::image::TIFFFile::check_writable() const {
+  if (m_memory && !m_memory->mapping)
+    throw std::runtime_error("TIFF images in memory cannot be extended");
+  if (m_mode != 'w' && m_mode != 'a') {
+    boost::format m("TIFF file `%s' is opened for reading; open it with mode 'w' or 'a' to append pages");
+    m % m_filename;
+    throw std::runtime_error(m.str());
+  }
+}
+
+// Adds the directory that was just appended to the file to the index; only
+// the new directory is read, starting from the one of the last page, through
+// a handle that reads the file without mapping it. The mapping of the grown
+// file is dropped and mapped again by the next read only, so that appending
+// does not map the whole file once per page.
+void bob::io::image::TIFFFile::index_page() {
+  m_memory.reset();
+  boost::shared_ptr<TIFF> in_file = make_cfile(m_filename.c_str(), "rm");
+  if (!m_offsets.empty() && (!TIFFSetSubDirectory(in_file.get(), m_offsets.back()) || !TIFFReadDirectory(in_file.get()))) {
+    boost::format m("TIFF: cannot find the appended page in file `%s'");
+    m % m_filename;
+    throw std::runtime_error(m.str());
+  }
+  bob::io::base::array::typeinfo info;
+  im_peek(in_file, info);
+  m_offsets.push_back(TIFFCurrentDirOffset(in_file.get()));
+  m_types.push_back(info);
+  m_level_offsets.push_back(std::vector<uint64_t>());
+  m_level_types.push_back(std::vector<bob::io::base::array::typeinfo>());
+  im_index_levels([this](){ return make_cfile(m_filename.c_str(), "rm"); }, m_filename, in_file, m_level_offsets.back(), m_level_types.back());
+  m_type = m_types[0];
+  m_type_all = im_pages_type(m_types);
+  m_newfile = false;
+}
+
+const boost::shared_ptr<const bob::io::image::TIFFMemory>& bob::io::image::TIFFFile::memory() {
+  if (!m_memory) m_memory = map_file(m_filename);
+  return m_memory;
+}
+
+void bob::io::image::TIFFFile::read_all(bob::io::base::array::interface& buffer) {
+  if (m_type_all.nd > m_type.nd) read_pages(buffer);
+  else read(buffer, 0);
+}
+
+bob::io::base::array::typeinfo bob::io::image::TIFFFile::pages_type() const {
+  if (m_newfile)
+    throw std::runtime_error("uninitialized image file cannot be read");
+  return m_type_all;
+}
+
+void bob::io::image::TIFFFile::read_pages(bob::io::base::array::interface& buffer) {
+  const bob::io::base::array::typeinfo info = pages_type();
+  if (info.nd != m_type.nd + 1) {
+    boost::format m("cannot read all %d pages of TIFF file `%s' into a single array, since they differ in type or shape");
+    m % m_offsets.size() % m_filename;
+    throw std::runtime_error(m.str());
+  }
+
+  if (!buffer.type().is_compatible(info)) buffer.set(info);
+
+  // reads the pages into consecutive frames of the buffer
+  unsigned char* frame = reinterpret_cast<unsigned char*>(buffer.ptr());
+  for (size_t index = 0; index < m_offsets.size(); ++index, frame += m_type.buffer_size()) {
+    bob::io::base::array::blitz_array page(frame, m_type);
+    im_load(memory(), m_filename, m_offsets[index], page);
+  }
+}
+
 void bob::io::image::TIFFFile::read(bob::io::base::array::interface& buffer, size_t index) {
   if (m_newfile)
     throw std::runtime_error("uninitialized image file cannot be read");
 
-  if (!buffer.type().is_compatible(m_type)) buffer.set(m_type);
+  const bob::io::base::array::typeinfo& info = page_type(index);
 
-  if (index != 0)
-    throw std::runtime_error("cannot read image with index > 0 -- there is only one image in an image file");
+  // pixel values are converted while decoding into buffers of other types
+  if (!bob::io::image::is_decodable_as(buffer.type(), info)) buffer.set(info);
 
-  if(!buffer.type().is_compatible(m_type)) buffer.set(m_type);
-  im_load(m_filename, buffer);
+  im_load(memory(), m_filename, m_offsets[index], buffer);
+}
+
+void bob::io::image::TIFFFile::read_region(bob::io::base::array::interface& buffer, size_t y, size_t x, size_t h, size_t w, size_t index, size_t level) {
+  if (m_newfile)
+    throw std::runtime_error("uninitialized image file cannot be read");
+
+  const bob::io::base::array::typeinfo region = bob::io::image::region_type(level_type(level, index), y, x, h, w, m_filename);
+  if (!bob::io::image::is_decodable_as(buffer.type(), region)) buffer.set(region);
+
+  im_load(memory(), m_filename, (level == 0 ? m_offsets[index] : m_level_offsets[index][level-1]), buffer, y, x);
 }
 
 size_t bob::io::image::TIFFFile::append(const bob::io::base::array::interface& buffer) {
-  if (m_newfile) {
-    im_save(m_filename, buffer);
-    m_type = buffer.type();
-    m_newfile = false;
-    m_length = 1;
-    return 0;
-  }
+  return append_pyramid(buffer, 1);
+}
+
+size_t bob::io::image::TIFFFile::append_pyramid(const bob::io::base::array::interface& buffer, size_t levels) {
+  check_writable();
+  im_check_save(m_filename, buffer, levels);
 
-  throw std::runtime_error("image files only accept a single array");
+  // the first page creates the file, later pages are added as new directories;
+  // the levels add at most a third to the data
+  const bob::io::base::array::typeinfo& info = buffer.type();
+  const char* flags = write_flags(m_filename, !m_newfile, info.buffer_size() + (levels > 1 ? info.buffer_size() / 3 : 0), m_options.bigtiff);
+  if (!m_writer) {
+    m_writer.reset(new TIFFWriter);
+    m_writer->file = make_cfile(m_filename.c_str(), flags);
+  }
+  im_save(m_filename, buffer, m_writer->file, m_options, levels);
+  invalidate_file(m_filename);
+  index_page();
+  return m_offsets.size() - 1;
 }
 
 void bob::io::image::TIFFFile::write(const bob::io::base::array::interface& buffer) {
@@ -429,7 +1539,24 @@ void bob::io::image::TIFFFile::write(const bob::io::base::array::interface& buff
     return;
   }
 
-  throw std::runtime_error("image files only accept a single array");
+  throw std::runtime_error("TIFF files can only be extended by appending pages");
+}
+
+void bob::io::image::TIFFFile::read_packed(blitz::Array<uint8_t,2>& bits) {
+  if (m_newfile)
+    throw std::runtime_error("uninitialized image file cannot be read");
+
+  im_load_packed(memory(), m_filename, m_offsets[0], bits);
+}
+
+void bob::io::image::TIFFFile::write_packed(const blitz::Array<uint8_t,2>& bits, int width) {
+  check_writable();
+  if (!m_newfile)
+    throw std::runtime_error("image files only accept a single array");
+
+  im_save_packed(m_filename, bits, width, m_options.bigtiff);
+  invalidate_file(m_filename);
+  index_page();
 }
 
 std::string bob::io::image::TIFFFile::s_codecname = "bob.image_tiff";
@@ -28,6 +28,7 @@
 #include <blitz/array.h>
 
 #include <bob.io.base/File.h>
+#include <bob.io.image/convert.h>
 
 
 /**
@@ -35,6 +36,20 @@
  */
 namespace bob { namespace io { namespace image {
 
+  /**
+   * The layout of written BMP images. By default, rows are stored bottom-up
+   * with 24 bits per pixel, which all readers support.
+   */
+  struct BMPWriteOptions {
+    bool alpha;    ///< writes 32 bits BGRA pixels with an opaque alpha channel
+    bool top_down; ///< stores the rows top-down (negative height), in the order of the image
+
+    BMPWriteOptions()
+    : alpha(false),
+      top_down(false)
+    { }
+  };
+
   class BMPFile: public bob::io::base::File {
 
     public: //api
@@ -67,12 +82,33 @@ namespace bob { namespace io { namespace image {
         read(buffer, 0); ///we only have 1 image in an image file anyways
       }
 
+      /**
+       * Reads the image: images with 8 bits per pixel or less and a gray
+       * color map are gray images (H x W), which can also be read into color
+       * buffers (3 x H x W); all other images are color images.
+       */
       virtual void read(bob::io::base::array::interface& buffer, size_t index);
 
       virtual size_t append (const bob::io::base::array::interface& buffer);
 
       virtual void write (const bob::io::base::array::interface& buffer);
 
+      /**
+       * Reads the color map indices (H x W) and the color map (colors x RGB)
+       * of images with a depth of 8 bits or less, without expanding the
+       * indices to colors.
+       */
+      void read_indexed(blitz::Array<uint8_t,2>& indices, blitz::Array<uint8_t,2>& palette);
+
+      /**
+       * Reads the region of h x w pixels with the upper left corner at (y, x);
+       * only the rows of the region are read from the file.
+       */
+      void read_region(bob::io::base::array::interface& buffer, size_t y, size_t x, size_t h, size_t w);
+
+      // Sets the layout of the image that is written afterwards
+      void set_write_options(const BMPWriteOptions& options);
+
       using bob::io::base::File::write;
       using bob::io::base::File::read;
 
@@ -81,18 +117,49 @@ namespace bob { namespace io { namespace image {
       bool m_newfile;
       bob::io::base::array::typeinfo m_type;
       size_t m_length;
+      BMPWriteOptions m_options;
 
       static std::string s_codecname;
 
   };
 
+  // Images with a gray color map are gray images (H x W); all others are color images (3 x H x W)
+  inline bool is_color_bmp(const std::string& filename){
+    BMPFile bmp(filename.c_str(), 'r');
+    return bmp.type().nd == 3;
+  }
+
+  // Reads the image as color image (3 x H x W), which expands gray images
   inline blitz::Array<uint8_t,3> read_bmp(const std::string& filename){
     BMPFile bmp(filename.c_str(), 'r');
-    return bmp.read<uint8_t,3>(0);
+    const bob::io::base::array::typeinfo& info = bmp.type();
+    blitz::Array<uint8_t,3> image(3, info.shape[info.nd-2], info.shape[info.nd-1]);
+    bob::io::base::array::blitz_array buffer(image);
+    bmp.read(buffer, 0);
+    return image;
+  }
+
+  // Reads an image with a gray color map (H x W)
+  inline blitz::Array<uint8_t,2> read_bmp_gray(const std::string& filename){
+    BMPFile bmp(filename.c_str(), 'r');
+    return read_converted<uint8_t,2>(bmp);
+  }
+
+  inline void read_bmp_indexed(const std::string& filename, blitz::Array<uint8_t,2>& indices, blitz::Array<uint8_t,2>& palette){
+    BMPFile bmp(filename.c_str(), 'r');
+    bmp.read_indexed(indices, palette);
+  }
+
+  inline void write_bmp(const blitz::Array<uint8_t,3>& image, const std::string& filename, const BMPWriteOptions& options = BMPWriteOptions()){
+    BMPFile bmp(filename.c_str(), 'w');
+    bmp.set_write_options(options);
+    bmp.write(image);
   }
 
-  inline void write_bmp(const blitz::Array<uint8_t,3>& image, const std::string& filename){
+  // Writes the gray image with 8 bits per pixel and a gray color map; the alpha option does not apply
+  inline void write_bmp(const blitz::Array<uint8_t,2>& image, const std::string& filename, const BMPWriteOptions& options = BMPWriteOptions()){
     BMPFile bmp(filename.c_str(), 'w');
+    bmp.set_write_options(options);
     bmp.write(image);
   }
 
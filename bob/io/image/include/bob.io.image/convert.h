@@ -0,0 +1,175 @@
+/**
+ * @brief Conversion of pixel values while decoding images
+ *
+ * The decoders can write rows straight into a destination of another pixel
+ * type than the one stored in the file, so that reading, e.g., a uint8_t
+ * image as float needs a single pass and a single allocation. Integer values
+ * are scaled from the full range of the stored type to the full range of the
+ * destination type; floating point values are normalized to [0,1].
+ *
+ * Copyright (c) 2016, Regents of the University of Colorado on behalf of the University of Colorado Colorado Springs.
+ */
+
+#ifndef BOB_IO_IMAGE_CONVERT_H
+#define BOB_IO_IMAGE_CONVERT_H
+
+#include <stdint.h>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <algorithm>
+
+#include <boost/format.hpp>
+#include <blitz/array.h>
+
+#include <bob.io.base/File.h>
+#include <bob.core/array_convert.h>
+
+
+namespace bob { namespace io { namespace image {
+
+  // floating point destinations are normalized to [0,1]
+  template <typename D, typename S>
+  inline D convert_sample(const S value){
+    return static_cast<D>(value) / static_cast<D>(std::numeric_limits<S>::max());
+  }
+
+  template <> inline uint8_t convert_sample<uint8_t,uint8_t>(const uint8_t value){
+    return value;
+  }
+
+  template <> inline uint8_t convert_sample<uint8_t,uint16_t>(const uint16_t value){
+    // rounds value * 255 / 65535
+    return (value + 128) / 257;
+  }
+
+  template <> inline uint16_t convert_sample<uint16_t,uint8_t>(const uint8_t value){
+    return value * 257;
+  }
+
+  template <> inline uint16_t convert_sample<uint16_t,uint16_t>(const uint16_t value){
+    return value;
+  }
+
+  template <typename D, typename S>
+  inline void convert_samples(const S* source, const size_t size, D* destination){
+    for (size_t k = 0; k < size; ++k)
+      destination[k] = convert_sample<D>(source[k]);
+  }
+
+  /**
+   * Returns whether a decoder can convert an image of the given type while
+   * decoding it into buffer: the shapes need to be identical, and the buffer
+   * needs to be of type uint8_t, uint16_t, float or double.
+   */
+  inline bool is_decodable_as(const bob::io::base::array::typeinfo& buffer, const bob::io::base::array::typeinfo& image){
+    if (buffer.nd != image.nd) return false;
+    for (size_t i = 0; i < image.nd; ++i)
+      if (buffer.shape[i] != image.shape[i]) return false;
+    switch (buffer.dtype){
+      case bob::io::base::array::t_uint8:
+      case bob::io::base::array::t_uint16:
+      case bob::io::base::array::t_float32:
+      case bob::io::base::array::t_float64:
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  /**
+   * Returns whether buffer holds the color planes (3 x H x W) of a gray image
+   * of the given type (H x W), or of each of its frames (N x 3 x H x W for
+   * N x H x W). The decoders of palette images, which detect gray color maps,
+   * expand gray images into such uint8_t buffers.
+   */
+  inline bool is_color_of(const bob::io::base::array::typeinfo& buffer, const bob::io::base::array::typeinfo& image){
+    if (buffer.dtype != bob::io::base::array::t_uint8 || image.dtype != bob::io::base::array::t_uint8) return false;
+    if (image.nd < 2 || buffer.nd != image.nd + 1 || buffer.shape[buffer.nd-3] != 3) return false;
+    for (size_t i = 0; i + 2 < image.nd; ++i)
+      if (buffer.shape[i] != image.shape[i]) return false;
+    return buffer.shape[buffer.nd-2] == image.shape[image.nd-2] && buffer.shape[buffer.nd-1] == image.shape[image.nd-1];
+  }
+
+  /**
+   * Returns the type of the region of h x w pixels with the upper left corner
+   * at (y, x) of an image of the given type; the region needs to be inside
+   * the image.
+   */
+  inline bob::io::base::array::typeinfo region_type(const bob::io::base::array::typeinfo& image,
+    size_t y, size_t x, size_t h, size_t w, const std::string& filename){
+    const size_t height = image.shape[image.nd-2], width = image.shape[image.nd-1];
+    if (h == 0 || w == 0 || y + h > height || x + w > width){
+      boost::format m("the region of size %dx%d at (%d,%d) is not inside the image of size %dx%d in file `%s'");
+      m % h % w % y % x % height % width % filename;
+      throw std::runtime_error(m.str());
+    }
+    bob::io::base::array::typeinfo region(image);
+    region.shape[region.nd-2] = h;
+    region.shape[region.nd-1] = w;
+    region.update_strides();
+    return region;
+  }
+
+  /**
+   * Copies the region at (y, x) of each plane of the image into the region
+   * buffer of the same data type, for decoders that cannot skip any part of
+   * the image.
+   */
+  inline void copy_region(const bob::io::base::array::interface& image, size_t y, size_t x,
+    bob::io::base::array::interface& region){
+    const bob::io::base::array::typeinfo& info = image.type();
+    const bob::io::base::array::typeinfo& part = region.type();
+    const size_t planes = (info.nd == 3 ? info.shape[0] : 1);
+    const size_t height = info.shape[info.nd-2], width = info.shape[info.nd-1];
+    const size_t h = part.shape[part.nd-2], w = part.shape[part.nd-1];
+    const size_t item = info.item_size();
+    const uint8_t* source = static_cast<const uint8_t*>(image.ptr());
+    uint8_t* dest = static_cast<uint8_t*>(region.ptr());
+    for (size_t p = 0; p < planes; ++p)
+      for (size_t r = 0; r < h; ++r)
+        std::copy(source + ((p * height + y + r) * width + x) * item,
+                  source + ((p * height + y + r) * width + x + w) * item,
+                  dest + (p * h + r) * w * item);
+  }
+
+  /**
+   * Decodes the image of the given file directly into an array of type T.
+   * Other data types than the ones of is_decodable_as() are converted with
+   * bob::core::array::convert after decoding the image in its stored type.
+   */
+  template <class T, int N>
+  blitz::Array<T,N> read_converted(bob::io::base::File& file){
+    const bob::io::base::array::typeinfo& info = file.type();
+    if (info.nd != N){
+      boost::format m("cannot read the image in file `%s' with %d dimensions into an array with %d dimensions");
+      m % file.filename() % info.nd % N;
+      throw std::runtime_error(m.str());
+    }
+    bob::io::base::array::typeinfo converted(info);
+    converted.dtype = bob::io::base::array::getElementType<T>();
+    if (!is_decodable_as(converted, info)){
+      switch (info.dtype){
+        case bob::io::base::array::t_uint8:
+          return bob::core::array::convert<T>(file.read<uint8_t,N>(0));
+        case bob::io::base::array::t_uint16:
+          return bob::core::array::convert<T>(file.read<uint16_t,N>(0));
+        default:{
+          boost::format m("cannot convert the image in file `%s' of type %s to the requested data type");
+          m % file.filename() % info.str();
+          throw std::runtime_error(m.str());
+        }
+      }
+    }
+    blitz::TinyVector<int,N> shape;
+    for (int i = 0; i < N; ++i)
+      shape[i] = info.shape[i];
+    blitz::Array<T,N> image(shape);
+    bob::io::base::array::blitz_array buffer(image);
+    file.read(buffer, 0);
+    return image;
+  }
+
+}}}
+
+#endif /* BOB_IO_IMAGE_CONVERT_H */
@@ -25,11 +25,13 @@
 
 #include <stdexcept>
 #include <string>
+#include <vector>
 
 #include <boost/shared_ptr.hpp>
 #include <blitz/array.h>
 
 #include <bob.io.base/File.h>
+#include <bob.io.image/convert.h>
 
 
 /**
@@ -37,65 +39,208 @@
  */
 namespace bob { namespace io { namespace image {
 
+  // A frame of an animated GIF, as indexed when the file is opened
+  struct GIFFrame {
+    long offset; ///< the position of the image descriptor in the file
+    size_t top; ///< the rectangle of the frame on the canvas
+    size_t left;
+    size_t height;
+    size_t width;
+    int disposal; ///< the disposal method of the graphics control extension
+    int transparent; ///< the transparent color index, or -1
+    int delay; ///< the time to show the frame, in 1/100 s
+    size_t base; ///< the first frame to draw onto the background to recreate the canvas below this frame
+    bool gray; ///< the color map of the frame holds only gray colors
+  };
+
+  /**
+   * The animation of written GIF images. Every array that is appended to a
+   * GIFFile opened for writing becomes a frame; the frames are encoded while
+   * they are appended, so that only the first palette_frames frames need to
+   * be held in memory.
+   */
+  struct GIFWriteOptions {
+    int delay;              ///< the time to show the frames that are appended next, in 1/100 s
+    int loops;              ///< how often the animation is repeated; 0 repeats it forever
+    size_t palette_frames;  ///< the first frames quantize a global color map for all frames; 0 quantizes each frame to its own color map
+
+    GIFWriteOptions()
+    : delay(10),
+      loops(0),
+      palette_frames(0)
+    { }
+  };
+
+  // The state of a GIF file that is being written
+  struct GIFWriter;
+
   class GIFFile: public bob::io::base::File {
 
     public: //api
 
       GIFFile(const char* path, char mode);
 
-      virtual ~GIFFile() { }
+      // Closes the file, if it is being written; errors are only logged here, close() throws them
+      virtual ~GIFFile();
 
       virtual const char* filename() const {
         return m_filename.c_str();
       }
 
-      virtual const bob::io::base::array::typeinfo& type_all() const {
-        return m_type;
-      }
+      // The frames stacked along the first dimension (N x 3 x H x W, or N x H x W for gray files)
+      virtual const bob::io::base::array::typeinfo& type_all() const;
 
       virtual const bob::io::base::array::typeinfo& type() const {
         return m_type;
       }
 
-      virtual size_t size() const {
-        return m_length;
-      }
+      // The number of frames in the file; all frames are indexed for it, or
+      // the number of appended frames while the file is written
+      virtual size_t size() const;
 
       virtual const char* name() const {
         return s_codecname.c_str();
       }
 
-      virtual void read_all(bob::io::base::array::interface& buffer) {
-        read(buffer, 0); ///we only have 1 image in an image file anyways
-      }
-
+      virtual void read_all(bob::io::base::array::interface& buffer);
+
+      /**
+       * Reads the frame with the given index as it is shown: composited onto
+       * the frames before it according to their disposal methods and
+       * transparent colors. The frames are found through their offsets,
+       * which are indexed up to the requested frame without decoding, and
+       * only the frames since the last one that covers the canvas are
+       * decoded again. Files whose global color map and the color map of the
+       * first frame are gray are gray images (H x W), which can also be read
+       * into color buffers (3 x H x W); later frames of such files with colors
+       * (see GIFFrame::gray) are converted to gray levels in gray buffers.
+       */
       virtual void read(bob::io::base::array::interface& buffer, size_t index);
 
+      // Reads all frames (N x 3 x H x W or N x H x W), decoding each frame once
+      void read_frames(bob::io::base::array::interface& buffer);
+
+      // The position, disposal, transparency and delay of the frame
+      const GIFFrame& frame(size_t index) const;
+
+      /**
+       * Appends a frame (3 x H x W) or several frames (N x 3 x H x W) of the
+       * size of the first frame, which are quantized here while the frame
+       * before them is encoded on another thread. Images with at most 256
+       * colors are stored without loss. If the first frame is gray (H x W),
+       * the file is gray: its frames (H x W or N x H x W) are stored without
+       * loss in a gray global color map. A single frame is stored as GIF87a,
+       * several frames as GIF89a animation with the options given to
+       * set_write_options(). Returns the index of the (first) frame.
+       */
       virtual size_t append (const bob::io::base::array::interface& buffer);
 
+      /**
+       * Sets the options of the animation. The delay applies to the frames
+       * that are appended afterwards; the other options need to be set before
+       * the first frame is appended.
+       */
+      void set_write_options(const GIFWriteOptions& options);
+
+      /**
+       * Encodes the frames that are not written yet and closes the file,
+       * which can be read afterwards. Files are closed when they are
+       * destroyed or read, but only close() reports errors.
+       */
+      void close();
+
       virtual void write (const bob::io::base::array::interface& buffer);
 
+      /**
+       * Reads the color indices of the image (H x W) and its color map
+       * (colors x RGB), without expanding the indices to colors.
+       */
+      void read_indexed(blitz::Array<uint8_t,2>& indices, blitz::Array<uint8_t,2>& palette);
+
+      // Reads the region of h x w pixels with the upper left corner at (y, x)
+      void read_region(bob::io::base::array::interface& buffer, size_t y, size_t x, size_t h, size_t w);
+
       using bob::io::base::File::write;
       using bob::io::base::File::read;
+      using bob::io::base::File::append;
+
+    private: //methods
+      // Indexes the first frame and determines the type of the file
+      void index_type();
+
+      // Indexes the frames of the file, until count frames are indexed
+      void index_frames(size_t count) const;
 
     private: //representation
       std::string m_filename;
       bool m_newfile;
       bob::io::base::array::typeinfo m_type;
-      size_t m_length;
+      mutable bob::io::base::array::typeinfo m_type_all;
+      mutable std::vector<GIFFrame> m_frames; ///< the frames of the file that are indexed so far
+      mutable long m_index_offset; ///< where the index continues in the file, or 0 when it is complete or not started
+      GIFWriteOptions m_options;
+      boost::shared_ptr<GIFWriter> m_writer; ///< the state of the file while it is written
 
       static std::string s_codecname;
 
   };
 
+  // Files with gray color maps are gray images (H x W); all others are color images (3 x H x W)
+  inline bool is_color_gif(const std::string& filename){
+    GIFFile gif(filename.c_str(), 'r');
+    return gif.type().nd == 3;
+  }
+
+  // Reads the first frame as color image (3 x H x W), which expands gray images
   inline blitz::Array<uint8_t,3> read_gif(const std::string& filename){
     GIFFile gif(filename.c_str(), 'r');
-    return gif.read<uint8_t,3>(0);
+    const bob::io::base::array::typeinfo& info = gif.type();
+    blitz::Array<uint8_t,3> image(3, info.shape[info.nd-2], info.shape[info.nd-1]);
+    bob::io::base::array::blitz_array buffer(image);
+    gif.read(buffer, 0);
+    return image;
+  }
+
+  // Reads the first frame of a file with gray color maps (H x W)
+  inline blitz::Array<uint8_t,2> read_gif_gray(const std::string& filename){
+    GIFFile gif(filename.c_str(), 'r');
+    return read_converted<uint8_t,2>(gif);
+  }
+
+  // Reads all frames of an animated GIF as color images (N x 3 x H x W)
+  inline blitz::Array<uint8_t,4> read_gif_frames(const std::string& filename){
+    GIFFile gif(filename.c_str(), 'r');
+    const bob::io::base::array::typeinfo& info = gif.type();
+    blitz::Array<uint8_t,4> frames(gif.size(), 3, info.shape[info.nd-2], info.shape[info.nd-1]);
+    bob::io::base::array::blitz_array buffer(frames);
+    gif.read_frames(buffer);
+    return frames;
+  }
+
+  inline void read_gif_indexed(const std::string& filename, blitz::Array<uint8_t,2>& indices, blitz::Array<uint8_t,2>& palette){
+    GIFFile gif(filename.c_str(), 'r');
+    gif.read_indexed(indices, palette);
   }
 
   inline void write_gif(const blitz::Array<uint8_t,3>& image, const std::string& filename){
     GIFFile gif(filename.c_str(), 'w');
     gif.write(image);
+    gif.close();
+  }
+
+  // Writes the gray image without loss, with a gray color map
+  inline void write_gif(const blitz::Array<uint8_t,2>& image, const std::string& filename){
+    GIFFile gif(filename.c_str(), 'w');
+    gif.write(image);
+    gif.close();
+  }
+
+  // Writes the frames (N x 3 x H x W) as animated GIF
+  inline void write_gif_frames(const blitz::Array<uint8_t,4>& frames, const std::string& filename, const GIFWriteOptions& options = GIFWriteOptions()){
+    GIFFile gif(filename.c_str(), 'w');
+    gif.set_write_options(options);
+    gif.write(frames);
+    gif.close();
   }
 
 }}}
@@ -36,8 +36,123 @@ namespace bob { namespace io { namespace image {
 
 const std::string& get_correct_image_extension(const std::string& image_name);
 
+/**
+ * Declares all images that are read afterwards as produced by ourselves. In
+ * this case, the decoders skip integrity checks (PNG chunk CRCs, BMP header
+ * consistency), ignore ancillary PNG chunks and do not format warnings.
+ * Corrupted files might then be decoded silently into wrong pixel values.
+ */
+void set_trusted_input(bool trusted);
+
+bool get_trusted_input();
+
+/**
+ * Sets the number of threads that decode or encode the strips or tiles of
+ * large TIFF images in parallel; 0 (the default) uses all cores of the machine
+ * and 1 decodes and encodes on the calling thread only.
+ */
+void set_decoding_threads(size_t threads);
+
+// Returns the number of threads that decode large images, which is at least 1
+size_t get_decoding_threads();
+
+/**
+ * Limits get_decoding_threads() on the calling thread to the given number of
+ * threads while the object exists, e.g., in the workers of the patch sampler,
+ * which decode several images in parallel already.
+ */
+class DecodingThreadsLimit {
+  public:
+    explicit DecodingThreadsLimit(size_t threads);
+    ~DecodingThreadsLimit();
+  private:
+    size_t m_previous;
+};
+
 bool is_color_image(const std::string& filename, std::string extension="");
 
+/**
+ * Bilevel images can be held bit-packed: each row is stored in (width+7)/8
+ * bytes, the first pixel in the most significant bit of the first byte. This
+ * is also the layout of PBM, 1 bit PNG and 1 bit TIFF images. As in PBM, set
+ * bits are the black foreground pixels for all formats.
+ */
+// Packs a row of width pixels (any non-zero value is set) into bits
+void pack_bits(const uint8_t* pixels, size_t width, uint8_t* bits);
+
+// Unpacks a row of width pixels from bits; set bits get the given value
+void unpack_bits(const uint8_t* bits, size_t width, uint8_t value, uint8_t* pixels);
+
+// Inverts a row of width pixels in bits; the padding bits stay zero
+void invert_bits(uint8_t* bits, size_t width);
+
+inline blitz::Array<uint8_t,2> pack_bits(const blitz::Array<uint8_t,2>& image){
+  const blitz::Array<uint8_t,2> pixels = image.isStorageContiguous() ? image : image.copy();
+  const int width = pixels.extent(1);
+  blitz::Array<uint8_t,2> bits(pixels.extent(0), (width + 7) / 8);
+  for (int y = 0; y < pixels.extent(0); ++y)
+    pack_bits(pixels.data() + y * width, width, bits.data() + y * bits.extent(1));
+  return bits;
+}
+
+inline blitz::Array<uint8_t,2> unpack_bits(const blitz::Array<uint8_t,2>& bits, int width, uint8_t value = 1){
+  if (bits.extent(1) != (width + 7) / 8)
+    throw std::runtime_error("The packed bits do not have the number of bytes per row required for the given width");
+  const blitz::Array<uint8_t,2> packed = bits.isStorageContiguous() ? bits : bits.copy();
+  blitz::Array<uint8_t,2> pixels(packed.extent(0), width);
+  for (int y = 0; y < packed.extent(0); ++y)
+    unpack_bits(packed.data() + y * packed.extent(1), width, value, pixels.data() + y * width);
+  return pixels;
+}
+
+// Reads a bilevel PBM, 1 bit PNG or 1 bit TIFF image bit-packed (set bits are black), and returns its width
+inline int read_packed(const std::string& filename, blitz::Array<uint8_t,2>& bits, std::string extension=""){
+  if (extension.empty())
+    extension = boost::filesystem::path(filename).extension().string();
+  boost::algorithm::to_lower(extension);
+  if (extension == ".pbm") return read_pbm_packed(filename, bits);
+#ifdef HAVE_LIBPNG
+  if (extension == ".png") return read_png_packed(filename, bits);
+#endif
+#ifdef HAVE_LIBTIFF
+  if (extension == ".tif" || extension == ".tiff") return read_tiff_packed(filename, bits);
+#endif
+
+  throw std::runtime_error("The filename extension '" + extension + "' is not known or not supported for bilevel images");
+}
+
+// Writes a bit-packed bilevel image (set bits are black) of the given width as PBM, 1 bit PNG or 1 bit TIFF
+inline void write_packed(const blitz::Array<uint8_t,2>& bits, int width, const std::string& filename, std::string extension=""){
+  if (extension.empty())
+    extension = boost::filesystem::path(filename).extension().string();
+  boost::algorithm::to_lower(extension);
+  if (extension == ".pbm") return write_pbm_packed(bits, width, filename);
+#ifdef HAVE_LIBPNG
+  if (extension == ".png") return write_png_packed(bits, width, filename);
+#endif
+#ifdef HAVE_LIBTIFF
+  if (extension == ".tif" || extension == ".tiff") return write_tiff_packed(bits, width, filename);
+#endif
+
+  throw std::runtime_error("The filename extension '" + extension + "' is not known or not supported for bilevel images");
+}
+
+// Reads the color indices (H x W) and the palette (colors x RGB) of palette images
+inline void read_indexed(const std::string& filename, blitz::Array<uint8_t,2>& indices, blitz::Array<uint8_t,2>& palette, std::string extension=""){
+  if (extension.empty())
+    extension = boost::filesystem::path(filename).extension().string();
+  boost::algorithm::to_lower(extension);
+  if (extension == ".bmp") return read_bmp_indexed(filename, indices, palette);
+#ifdef HAVE_GIFLIB
+  if (extension == ".gif") return read_gif_indexed(filename, indices, palette);
+#endif
+#ifdef HAVE_LIBPNG
+  if (extension == ".png") return read_png_indexed(filename, indices, palette);
+#endif
+
+  throw std::runtime_error("The filename extension '" + extension + "' is not known or not supported for palette images");
+}
+
 inline blitz::Array<uint8_t,3> read_color_image(const std::string& filename, std::string extension=""){
   if (extension.empty())
     extension = boost::filesystem::path(filename).extension().string();
@@ -64,6 +179,10 @@ inline blitz::Array<uint8_t,2> read_gray_image(const std::string& filename, std:
   if (extension.empty())
     extension = boost::filesystem::path(filename).extension().string();
   boost::algorithm::to_lower(extension);
+  if (extension == ".bmp") return read_bmp_gray(filename);
+#ifdef HAVE_GIFLIB
+  if (extension == ".gif") return read_gif_gray(filename);
+#endif
 #ifdef HAVE_LIBPNG
   if (extension == ".png") return read_png<uint8_t,2>(filename);
 #endif
@@ -106,6 +225,10 @@ inline void write_gray_image(const blitz::Array<uint8_t,2>& image, const std::st
   if (extension.empty())
     extension = boost::filesystem::path(filename).extension().string();
   boost::algorithm::to_lower(extension);
+  if (extension == ".bmp") return write_bmp(image, filename);
+#ifdef HAVE_GIFLIB
+  if (extension == ".gif") return write_gif(image, filename);
+#endif
 #ifdef HAVE_LIBPNG
   if (extension == ".png") return write_png(image, filename);
 #endif
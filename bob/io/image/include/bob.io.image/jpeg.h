@@ -30,6 +30,7 @@
 #include <blitz/array.h>
 
 #include <bob.io.base/File.h>
+#include <bob.io.image/convert.h>
 
 
 /**
@@ -79,6 +80,15 @@ namespace bob { namespace io { namespace image {
       using bob::io::base::File::write;
       using bob::io::base::File::read;
 
+      /**
+       * Reads the region of h x w pixels with the upper left corner at (y, x),
+       * converting the pixels to the data type of the buffer. The scanlines
+       * above the region are skipped without inverse DCT, the columns are
+       * cropped to the iMCUs that overlap the region, and decoding stops after
+       * the last row of the region.
+       */
+      void read_region(bob::io::base::array::interface& buffer, size_t y, size_t x, size_t h, size_t w);
+
     private: //representation
       std::string m_filename;
       bool m_newfile;
@@ -99,6 +109,13 @@ namespace bob { namespace io { namespace image {
     return jpeg.read<uint8_t,N>(0);
   }
 
+  // Reads a JPEG image, converting the pixels to T while decoding
+  template <class T, int N>
+  blitz::Array<T,N> read_jpeg(const std::string& filename){
+    JPEGFile jpeg(filename.c_str(), 'r');
+    return read_converted<T,N>(jpeg);
+  }
+
   template <int N>
   void write_jpeg(const blitz::Array<uint8_t,N>& image, const std::string& filename){
     JPEGFile jpeg(filename.c_str(), 'w');
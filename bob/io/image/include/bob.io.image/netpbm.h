@@ -28,6 +28,7 @@
 #include <blitz/array.h>
 
 #include <bob.io.base/File.h>
+#include <bob.io.image/convert.h>
 
 
 /**
@@ -76,6 +77,23 @@ namespace bob { namespace io { namespace image {
       using bob::io::base::File::write;
       using bob::io::base::File::read;
 
+      /**
+       * Reads a PBM image bit-packed: (width+7)/8 bytes per row, the first
+       * pixel in the most significant bit, set bits are black. The width is
+       * type().shape[1].
+       */
+      void read_packed(blitz::Array<uint8_t,2>& bits);
+
+      // Writes bit-packed rows of an image of the given width as binary PBM
+      void write_packed(const blitz::Array<uint8_t,2>& bits, int width);
+
+      /**
+       * Reads the region of h x w pixels with the upper left corner at (y, x).
+       * Only the rows of the region are read from binary PGM and PPM files;
+       * other images are decoded completely.
+       */
+      void read_region(bob::io::base::array::interface& buffer, size_t y, size_t x, size_t h, size_t w);
+
     private: //representation
       std::string m_filename;
       bool m_newfile;
@@ -98,6 +116,17 @@ namespace bob { namespace io { namespace image {
     pbm.write(image);
   }
 
+  inline int read_pbm_packed(const std::string& filename, blitz::Array<uint8_t,2>& bits){
+    NetPBMFile pbm(filename.c_str(), 'r');
+    pbm.read_packed(bits);
+    return pbm.type().shape[1];
+  }
+
+  inline void write_pbm_packed(const blitz::Array<uint8_t,2>& bits, int width, const std::string& filename){
+    NetPBMFile pbm(filename.c_str(), 'w');
+    pbm.write_packed(bits, width);
+  }
+
   template <class T>
   blitz::Array<T,2> read_pgm(const std::string& filename){
     NetPBMFile pgm(filename.c_str(), 'r');
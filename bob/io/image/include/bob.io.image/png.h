@@ -30,7 +30,7 @@
 #include <blitz/array.h>
 
 #include <bob.io.base/File.h>
-#include <bob.core/array_convert.h>
+#include <bob.io.image/convert.h>
 
 
 /**
@@ -38,6 +38,21 @@
  */
 namespace bob { namespace io { namespace image {
 
+  /**
+   * Representations that auto-packing may choose besides 1, 2 or 4 bit gray
+   * images and color palettes, since they change how the file is read back.
+   */
+  struct PNGPackOptions {
+    bool gray_palette;       ///< stores gray images with up to 16 values off the 1, 2 and 4 bit grids, such as
+                             ///< label maps, as palette indices; they are read back as color images or with read_indexed()
+    bool narrow_16_bits;     ///< stores uint16_t images with values below 256 with 8 bits; they are read back as uint8_t
+
+    PNGPackOptions()
+    : gray_palette(false),
+      narrow_16_bits(false)
+    { }
+  };
+
   class PNGFile: public bob::io::base::File {
 
     public: //api
@@ -77,6 +92,47 @@ namespace bob { namespace io { namespace image {
 
       virtual void write (const bob::io::base::array::interface& buffer);
 
+      /**
+       * Reads the palette indices of a palette image (H x W) and its palette
+       * (colors x RGB), without expanding the indices to colors.
+       */
+      void read_indexed(blitz::Array<uint8_t,2>& indices, blitz::Array<uint8_t,2>& palette);
+
+      /**
+       * Reads a 1 bit gray image bit-packed: (width+7)/8 bytes per row, the
+       * first pixel in the most significant bit, set bits are black as in
+       * PBM. The width is type().shape[1].
+       */
+      void read_packed(blitz::Array<uint8_t,2>& bits);
+
+      // Writes bit-packed rows of an image of the given width as 1 bit gray image
+      void write_packed(const blitz::Array<uint8_t,2>& bits, int width);
+
+      /**
+       * Decodes only the first passes (1 to 7) of Adam7 interlaced images.
+       * With less than 7 passes, each decoded pixel is replicated over its
+       * interlace block, which gives a coarse preview of the full image.
+       * Non-interlaced images are always decoded completely.
+       */
+      void set_interlace_passes(int passes);
+
+      /**
+       * When enabled, uint8_t images are written with the smallest
+       * representation that stores all pixel values exactly and that is read
+       * back as the same image: 1, 2 or 4 bit gray, or a palette for up to 256
+       * colors of color images. The options allow gray palettes and 8 bit
+       * samples for 16 bit data.
+       */
+      void set_auto_pack(bool auto_pack, const PNGPackOptions& options = PNGPackOptions());
+
+      /**
+       * Reads the region of h x w pixels with the upper left corner at (y, x),
+       * converting the pixels to the data type of the buffer. Decoding stops
+       * after the last row of the region; interlaced images are decoded
+       * completely.
+       */
+      void read_region(bob::io::base::array::interface& buffer, size_t y, size_t x, size_t h, size_t w);
+
       using bob::io::base::File::write;
       using bob::io::base::File::read;
 
@@ -85,6 +141,9 @@ namespace bob { namespace io { namespace image {
       bool m_newfile;
       bob::io::base::array::typeinfo m_type;
       size_t m_length;
+      int m_interlace_passes;
+      bool m_auto_pack;
+      PNGPackOptions m_pack_options;
 
       static std::string s_codecname;
   };
@@ -94,26 +153,46 @@ namespace bob { namespace io { namespace image {
     return png.type().nd == 3;
   }
 
+  template <class T, int N>
+  blitz::Array<T,N> read_png(PNGFile& png){
+    // the pixels are converted to T while decoding
+    return read_converted<T,N>(png);
+  }
+
   template <class T, int N>
   blitz::Array<T,N> read_png(const std::string& filename){
     PNGFile png(filename.c_str(), 'r');
-    switch (png.type().dtype){
-      case bob::io::base::array::t_uint8:{
-        blitz::Array<uint8_t, N> image(png.read<uint8_t, N>(0));
-        return bob::core::array::convert<T>(image);
-      }
-      case bob::io::base::array::t_uint16:{
-        blitz::Array<uint16_t, N> image(png.read<uint16_t, N>(0));
-        return bob::core::array::convert<T>(image);
-      }
-      default:
-        throw std::runtime_error("The png image has a weired data type");
-    }
+    return read_png<T,N>(png);
+  }
+
+  template <class T, int N>
+  blitz::Array<T,N> read_png_preview(const std::string& filename, int passes){
+    PNGFile png(filename.c_str(), 'r');
+    png.set_interlace_passes(passes);
+    return read_png<T,N>(png);
+  }
+
+  inline void read_png_indexed(const std::string& filename, blitz::Array<uint8_t,2>& indices, blitz::Array<uint8_t,2>& palette){
+    PNGFile png(filename.c_str(), 'r');
+    png.read_indexed(indices, palette);
+  }
+
+  inline int read_png_packed(const std::string& filename, blitz::Array<uint8_t,2>& bits){
+    PNGFile png(filename.c_str(), 'r');
+    png.read_packed(bits);
+    return png.type().shape[1];
+  }
+
+  inline void write_png_packed(const blitz::Array<uint8_t,2>& bits, int width, const std::string& filename){
+    PNGFile png(filename.c_str(), 'w');
+    png.write_packed(bits, width);
   }
 
   template <class T, int N>
-  void write_png(const blitz::Array<T,N>& image, const std::string& filename){
+  void write_png(const blitz::Array<T,N>& image, const std::string& filename, bool auto_pack = false,
+    const PNGPackOptions& options = PNGPackOptions()){
     PNGFile png(filename.c_str(), 'w');
+    png.set_auto_pack(auto_pack, options);
     png.write(image);
   }
 
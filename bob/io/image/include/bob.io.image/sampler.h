@@ -0,0 +1,105 @@
+/**
+ * @brief Random patches of large image collections, decoded partially
+ *
+ * Patch-based training draws many small random crops from large images. The
+ * sampler groups the patches of a batch by file and decodes only the part of
+ * each file that the patches need, on several threads, straight into a
+ * contiguous batch of N x C x h x w pixels.
+ *
+ * Copyright (c) 2016, Regents of the University of Colorado on behalf of the University of Colorado Colorado Springs.
+ */
+
+#ifndef BOB_IO_IMAGE_SAMPLER_H
+#define BOB_IO_IMAGE_SAMPLER_H
+
+#include <list>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include <blitz/array.h>
+
+#include <bob.io.base/File.h>
+
+
+namespace bob { namespace io { namespace image {
+
+  // An open image file with the partial decoder of its format
+  struct PatchReader;
+
+  class PatchSampler {
+
+    public: //api
+
+      // The position of a patch: the index of its file and its upper left corner
+      struct Patch {
+        size_t file;
+        size_t y;
+        size_t x;
+      };
+
+      /**
+       * Samples count patches of height x width pixels per batch from the
+       * given images, which need to be all gray or all color images at least
+       * as large as the patches. The headers of all images are read here.
+       * The open_files most recently sampled files are kept open between
+       * batches.
+       */
+      PatchSampler(const std::vector<std::string>& filenames, size_t height, size_t width, size_t count, unsigned seed = 0,
+        size_t open_files = 16);
+
+      // The number of channels of the images: 1 for gray and 3 for color images
+      size_t channels() const {
+        return m_channels;
+      }
+
+      // The type of the images with the given index
+      const bob::io::base::array::typeinfo& image_type(size_t file) const {
+        return m_types[file];
+      }
+
+      /**
+       * Fills the batch (count x channels x height x width) with new random
+       * patches, drawn uniformly over the files and the positions in each
+       * file. The files are decoded on get_decoding_threads() threads, which
+       * also share the threads that decode large TIFF images. TIFF, BMP and
+       * binary PGM and PPM images read only the strips, tiles or rows of each
+       * patch. JPEG images read each patch cropped to its iMCUs when the
+       * patches of a file are sparse; otherwise, and for PNG, GIF and other
+       * NetPBM images, the bounding box of the patches of a file is decoded
+       * once.
+       * Batches of uint16_t, float or double are converted while decoding
+       * TIFF, JPEG and PNG images, other formats require their stored type.
+       */
+      void sample(bob::io::base::array::interface& batch);
+
+      template <typename T> blitz::Array<T,4> sample() {
+        blitz::Array<T,4> batch(m_count, m_channels, m_height, m_width);
+        bob::io::base::array::blitz_array buffer(batch);
+        sample(buffer);
+        return batch;
+      }
+
+      // The patches of the last batch, in the order of the batch
+      const std::vector<Patch>& patches() const {
+        return m_patches;
+      }
+
+    private: //representation
+      std::vector<std::string> m_filenames;
+      std::vector<bob::io::base::array::typeinfo> m_types; ///< the types of the images
+      size_t m_height;
+      size_t m_width;
+      size_t m_count;
+      size_t m_channels;
+      std::mt19937 m_generator;
+      std::vector<Patch> m_patches;
+      size_t m_open_files;
+      std::list<std::pair<size_t, boost::shared_ptr<PatchReader> > > m_readers; ///< the open files, most recently sampled first
+  };
+
+}}}
+
+#endif /* BOB_IO_IMAGE_SAMPLER_H */
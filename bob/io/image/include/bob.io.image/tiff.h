@@ -25,11 +25,13 @@
 
 #include <stdexcept>
 #include <string>
+#include <vector>
 
 #include <boost/shared_ptr.hpp>
 #include <blitz/array.h>
 
 #include <bob.io.base/File.h>
+#include <bob.io.image/convert.h>
 
 
 /**
@@ -37,53 +39,221 @@
  */
 namespace bob { namespace io { namespace image {
 
+  /**
+   * The layout and compression of written TIFF images. Images are encoded
+   * chunk by chunk (strips or tiles), so that only a single chunk needs to be
+   * held in memory in addition to the image.
+   */
+  struct TIFFWriteOptions {
+    enum Compression { NONE, LZW, DEFLATE, PACKBITS, ZSTD };
+
+    Compression compression;
+    bool predictor;          ///< horizontal differencing before LZW, Deflate or ZSTD compression
+    int rows_per_strip;      ///< rows per strip; 0 selects strips of about 8 KB
+    int tile_width;          ///< writes tiles instead of strips if tile_width and tile_height are
+    int tile_height;         ///< set; both need to be multiples of 16
+    bool separate_planes;    ///< writes each plane of color images in its own chunks
+    bool bigtiff;            ///< writes BigTIFF (64 bit offsets); automatic above 4 GB of uncompressed data
+
+    TIFFWriteOptions()
+    : compression(NONE),
+      predictor(false),
+      rows_per_strip(0),
+      tile_width(0),
+      tile_height(0),
+      separate_planes(false),
+      bigtiff(false)
+    { }
+  };
+
+  /**
+   * Sets the size in bytes of the LRU cache of decoded strips and tiles,
+   * which is shared by all TIFF files and threads, so that reading the same
+   * regions again does not decode their chunks again. 0 (the default)
+   * disables the cache.
+   */
+  void set_tiff_cache_size(size_t bytes);
+
+  struct TIFFCacheStatistics {
+    size_t hits;    ///< chunks that were found in the cache (or were being decoded by another reader)
+    size_t misses;  ///< chunks that were decoded
+    size_t bytes;   ///< the size of the cached chunks
+    size_t chunks;  ///< the number of cached chunks
+  };
+
+  TIFFCacheStatistics get_tiff_cache_statistics();
+
+  // The bytes of a TIFF file that is read
+  struct TIFFMemory;
+
+  // The TIFF file that pages are appended to
+  struct TIFFWriter;
+
   class TIFFFile: public bob::io::base::File {
 
     public: //api
 
 
+      /**
+       * Opens the TIFF file with the given path. Files are read through a
+       * read-only memory mapping, which libtiff decodes straight out of.
+       */
       TIFFFile(const char* path, char mode);
 
+      /**
+       * Opens the bytes of a TIFF file held in memory, e.g., received over the
+       * network, for reading. The data is referenced, not copied.
+       */
+      TIFFFile(const blitz::Array<uint8_t,1>& data);
+
       virtual ~TIFFFile() { }
 
       virtual const char* filename() const {
         return m_filename.c_str();
       }
 
+      /**
+       * The type of all pages stacked along a new first dimension, like the
+       * frames of GIF files; files with a single page, or with pages that
+       * differ in type or shape, have the type of their first page
+       */
       virtual const bob::io::base::array::typeinfo& type_all() const {
-        return m_type;
+        return m_type_all;
       }
 
+      // The type of the first page
       virtual const bob::io::base::array::typeinfo& type() const {
         return m_type;
       }
 
+      // The number of pages (directories) in the file
       virtual size_t size() const {
-        return m_length;
+        return m_offsets.size();
       }
 
       virtual const char* name() const {
         return s_codecname.c_str();
       }
 
-      virtual void read_all(bob::io::base::array::interface& buffer) {
-        read(buffer, 0); ///we only have 1 image in an image file anyways
-      }
+      // Reads all pages stacked into a buffer of type_all(), or the first page
+      virtual void read_all(bob::io::base::array::interface& buffer);
+
+      // The same as type_all()
+      bob::io::base::array::typeinfo pages_type() const;
+
+      // Reads all pages stacked along a new first dimension; they need to have the same type
+      void read_pages(bob::io::base::array::interface& buffer);
 
+      /**
+       * Reads the page with the given index. The page is found through the
+       * offset of its directory, which is indexed when the file is opened,
+       * so that no other page is parsed.
+       */
       virtual void read(bob::io::base::array::interface& buffer, size_t index);
 
+      // Adds a new page to the end of the file
       virtual size_t append (const bob::io::base::array::interface& buffer);
 
       virtual void write (const bob::io::base::array::interface& buffer);
 
+      /**
+       * Adds a new page to the end of the file together with levels-1
+       * reduced-resolution versions of it, which are stored as SubIFDs of the
+       * page. Each level halves the size of the level before by averaging
+       * blocks of 2x2 pixels.
+       */
+      size_t append_pyramid(const bob::io::base::array::interface& buffer, size_t levels);
+
+      template <typename T, int N> size_t append_pyramid(const blitz::Array<T,N>& image, size_t levels) {
+        blitz::Array<T,N> data = image.isStorageContiguous() ? image : image.copy();
+        bob::io::base::array::blitz_array buffer(data);
+        return append_pyramid(buffer, levels);
+      }
+
       using bob::io::base::File::write;
       using bob::io::base::File::read;
+      using bob::io::base::File::append;
+
+      /**
+       * Reads a 1 bit image bit-packed: (width+7)/8 bytes per row, the first
+       * pixel in the most significant bit, set bits are black as in PBM. The
+       * width is type().shape[1].
+       */
+      void read_packed(blitz::Array<uint8_t,2>& bits);
+
+      // Writes bit-packed rows of an image of the given width as 1 bit MINISWHITE image
+      void write_packed(const blitz::Array<uint8_t,2>& bits, int width);
+
+      /**
+       * Reads the region of h x w pixels with the upper left corner at (y, x)
+       * of the page with the given index. Only the strips or tiles that
+       * overlap the region are decoded. The pixels are converted to the data
+       * type of the buffer, if it has the shape of the region and a supported
+       * type. Levels above 0 read the reduced-resolution levels of the page.
+       */
+      void read_region(bob::io::base::array::interface& buffer, size_t y, size_t x, size_t h, size_t w, size_t index = 0, size_t level = 0);
+
+      template <typename T, int N> blitz::Array<T,N> read_region(size_t y, size_t x, size_t h, size_t w, size_t index = 0, size_t level = 0) {
+        const bob::io::base::array::typeinfo& info = level_type(level, index);
+        if (info.nd != N) {
+          boost::format m("cannot read the image in file `%s' with %d dimensions into an array with %d dimensions");
+          m % m_filename % info.nd % N;
+          throw std::runtime_error(m.str());
+        }
+        const bob::io::base::array::typeinfo region_info = region_type(info, y, x, h, w, m_filename);
+        bob::io::base::array::typeinfo converted(region_info);
+        converted.dtype = bob::io::base::array::getElementType<T>();
+        if (!is_decodable_as(converted, region_info)){
+          // other data types are converted after decoding the stored type
+          if (region_info.dtype == bob::io::base::array::t_uint8)
+            return bob::core::array::convert<T>(read_region<uint8_t,N>(y, x, h, w, index, level));
+          if (region_info.dtype == bob::io::base::array::t_uint16)
+            return bob::core::array::convert<T>(read_region<uint16_t,N>(y, x, h, w, index, level));
+          throw std::runtime_error("TIFF regions of this data type can only be read as uint8_t, uint16_t, float or double");
+        }
+        blitz::TinyVector<int,N> shape;
+        for (int i = 0; i < N; ++i)
+          shape[i] = region_info.shape[i];
+        blitz::Array<T,N> region(shape);
+        bob::io::base::array::blitz_array buffer(region);
+        read_region(buffer, y, x, h, w, index, level);
+        return region;
+      }
+
+      // The type of the page with the given index
+      const bob::io::base::array::typeinfo& page_type(size_t index) const;
+
+      // The number of resolution levels of the page, including the page itself
+      size_t levels(size_t index = 0) const;
+
+      // The type of the given resolution level of the page
+      const bob::io::base::array::typeinfo& level_type(size_t level, size_t index = 0) const;
+
+      // Sets the layout and compression of the pages that are written afterwards
+      void set_write_options(const TIFFWriteOptions& options);
+
+    private: //methods
+      void index_page();
+
+      // The mapped file, which is mapped again after pages were appended
+      const boost::shared_ptr<const TIFFMemory>& memory();
+
+      // Throws unless the file was opened with mode 'w' or 'a'
+      void check_writable() const;
 
     private: //representation
       std::string m_filename;
+      char m_mode;
       bool m_newfile;
       bob::io::base::array::typeinfo m_type;
-      size_t m_length;
+      bob::io::base::array::typeinfo m_type_all; ///< the type of the stacked pages
+      std::vector<uint64_t> m_offsets; ///< the directory offsets of the pages
+      std::vector<bob::io::base::array::typeinfo> m_types; ///< the types of the pages
+      std::vector<std::vector<uint64_t> > m_level_offsets; ///< the SubIFD offsets of the reduced levels of each page
+      std::vector<std::vector<bob::io::base::array::typeinfo> > m_level_types; ///< the types of the reduced levels
+      TIFFWriteOptions m_options;
+      boost::shared_ptr<const TIFFMemory> m_memory; ///< the mapped file or the data in memory; empty until the next read after appending
+      boost::shared_ptr<TIFFWriter> m_writer; ///< the file that is open for appending, if any
 
       static std::string s_codecname;
   };
@@ -96,15 +266,74 @@ namespace bob { namespace io { namespace image {
   template <class T, int N>
   blitz::Array<T,N> read_tiff(const std::string& filename){
     TIFFFile tiff(filename.c_str(), 'r');
-    return tiff.read<T,N>(0);
+    // the pixels are converted to T while decoding
+    return read_converted<T,N>(tiff);
   }
 
+  // Reads the TIFF image from the bytes of a TIFF file held in memory
   template <class T, int N>
-  void write_tiff(const blitz::Array<T,N>& image, const std::string& filename){
+  blitz::Array<T,N> read_tiff_memory(const blitz::Array<uint8_t,1>& data){
+    TIFFFile tiff(data);
+    return read_converted<T,N>(tiff);
+  }
+
+  // Reads the page with the given index of a multi-page TIFF file
+  template <class T, int N>
+  blitz::Array<T,N> read_tiff_page(const std::string& filename, size_t index){
+    TIFFFile tiff(filename.c_str(), 'r');
+    const bob::io::base::array::typeinfo& info = tiff.page_type(index);
+    return tiff.read_region<T,N>(0, 0, info.shape[info.nd-2], info.shape[info.nd-1], index);
+  }
+
+  // Reads the region of h x w pixels with the upper left corner at (y, x)
+  template <class T, int N>
+  blitz::Array<T,N> read_tiff_roi(const std::string& filename, int y, int x, int h, int w){
+    TIFFFile tiff(filename.c_str(), 'r');
+    return tiff.read_region<T,N>(y, x, h, w);
+  }
+
+  template <class T, int N>
+  void write_tiff(const blitz::Array<T,N>& image, const std::string& filename, const TIFFWriteOptions& options = TIFFWriteOptions()){
     TIFFFile tiff(filename.c_str(), 'w');
+    tiff.set_write_options(options);
     tiff.write(image);
   }
 
+  /**
+   * Writes a tiled image pyramid: the image, followed by levels-1 versions
+   * of half the size of the level before, which are stored as reduced-
+   * resolution SubIFDs of the image.
+   */
+  template <class T, int N>
+  void write_tiff_pyramid(const blitz::Array<T,N>& image, const std::string& filename, size_t levels,
+    size_t tile_size = 256, TIFFWriteOptions::Compression compression = TIFFWriteOptions::NONE){
+    TIFFWriteOptions options;
+    options.tile_width = options.tile_height = tile_size;
+    options.compression = compression;
+    TIFFFile tiff(filename.c_str(), 'w');
+    tiff.set_write_options(options);
+    tiff.append_pyramid(image, levels);
+  }
+
+  // Reads the given resolution level of an image pyramid, where level 0 is the image itself
+  template <class T, int N>
+  blitz::Array<T,N> read_tiff_level(const std::string& filename, size_t level){
+    TIFFFile tiff(filename.c_str(), 'r');
+    const bob::io::base::array::typeinfo& info = tiff.level_type(level);
+    return tiff.read_region<T,N>(0, 0, info.shape[info.nd-2], info.shape[info.nd-1], 0, level);
+  }
+
+  inline int read_tiff_packed(const std::string& filename, blitz::Array<uint8_t,2>& bits){
+    TIFFFile tiff(filename.c_str(), 'r');
+    tiff.read_packed(bits);
+    return tiff.type().shape[1];
+  }
+
+  inline void write_tiff_packed(const blitz::Array<uint8_t,2>& bits, int width, const std::string& filename){
+    TIFFFile tiff(filename.c_str(), 'w');
+    tiff.write_packed(bits, width);
+  }
+
 }}}
 
 #endif // HAVE_LIBTIFF
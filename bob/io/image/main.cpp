@@ -14,6 +14,7 @@
 #endif
 
 #include <bob.blitz/capi.h>
+#include <bob.blitz/cppapi.h>
 #include <bob.blitz/cleanup.h>
 #include <bob.core/api.h>
 #include <bob.core/array_convert.h>
@@ -56,6 +57,117 @@ BOB_CATCH_FUNCTION("get_correct_image_extension", 0)
 }
 
 
+static auto s_read_indexed = bob::extension::FunctionDoc(
+  "read_indexed",
+  "Reads the color indices and the palette of a palette image",
+  "Palette images (PNG palette images, GIF images and BMP images with 8 bits or less) are read without expanding the indices to colors, which uses a third of the memory. "
+  "The color image can be obtained as ``palette[indices].transpose(2,0,1)``."
+)
+.add_prototype("filename, [extension]", "indices, palette")
+.add_parameter("filename", "str", "The name (including path) of the palette image to read")
+.add_parameter("extension", "str", "[Default: ``None``] If given, the given extension will determine the type of the image")
+.add_return("indices", ":py:class:`numpy.ndarray` (2D, uint8)", "The palette indices of the image")
+.add_return("palette", ":py:class:`numpy.ndarray` (2D, uint8)", "The palette, with one RGB color per row")
+;
+static PyObject* read_indexed(PyObject*, PyObject *args, PyObject* kwds) {
+BOB_TRY
+  static char** kwlist = s_read_indexed.kwlist();
+
+  const char* filename;
+  const char* extension = 0;
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|z", kwlist, &filename, &extension)) return 0;
+
+  blitz::Array<uint8_t,2> indices, palette;
+  bob::io::image::read_indexed(filename, indices, palette, extension ? extension : "");
+
+  return Py_BuildValue("NN", PyBlitzArrayCxx_AsNumpy(indices), PyBlitzArrayCxx_AsNumpy(palette));
+
+BOB_CATCH_FUNCTION("read_indexed", 0)
+}
+
+static auto s_set_trusted_input = bob::extension::FunctionDoc(
+  "set_trusted_input",
+  "Declares whether the images that are read afterwards are trusted",
+  "Images that we have produced ourselves do not need all integrity checks. "
+  "For trusted input, PNG chunk CRCs are not verified and ancillary PNG chunks are skipped, warnings of the PNG and JPEG decoders are not formatted, and BMP headers are not validated. "
+  "Corrupted files might then be decoded silently into wrong pixel values."
+)
+.add_prototype("trusted")
+.add_parameter("trusted", "bool", "Are the images read afterwards trusted?")
+;
+static PyObject* set_trusted_input(PyObject*, PyObject *args, PyObject* kwds) {
+BOB_TRY
+  static char** kwlist = s_set_trusted_input.kwlist();
+
+  PyObject* trusted;
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O", kwlist, &trusted)) return 0;
+
+  bob::io::image::set_trusted_input(PyObject_IsTrue(trusted));
+  Py_RETURN_NONE;
+
+BOB_CATCH_FUNCTION("set_trusted_input", 0)
+}
+
+static auto s_get_trusted_input = bob::extension::FunctionDoc(
+  "get_trusted_input",
+  "Returns whether images are currently read as trusted input, see :py:func:`set_trusted_input`"
+)
+.add_prototype("", "trusted")
+.add_return("trusted", "bool", "Are images read as trusted input?")
+;
+static PyObject* get_trusted_input(PyObject*, PyObject *args, PyObject* kwds) {
+BOB_TRY
+  static char** kwlist = s_get_trusted_input.kwlist();
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "", kwlist)) return 0;
+
+  if (bob::io::image::get_trusted_input()) Py_RETURN_TRUE;
+  Py_RETURN_FALSE;
+
+BOB_CATCH_FUNCTION("get_trusted_input", 0)
+}
+
+static auto s_set_decoding_threads = bob::extension::FunctionDoc(
+  "set_decoding_threads",
+  "Sets the number of threads that decode large TIFF images in parallel",
+  "The strips or tiles of large TIFF images are decoded concurrently, each thread using its own handle of the file. "
+  "By default, all cores of the machine are used."
+)
+.add_prototype("threads")
+.add_parameter("threads", "int", "The number of decoding threads; ``0`` uses all cores and ``1`` decodes on the calling thread only")
+;
+static PyObject* set_decoding_threads(PyObject*, PyObject *args, PyObject* kwds) {
+BOB_TRY
+  static char** kwlist = s_set_decoding_threads.kwlist();
+
+  unsigned int threads;
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "I", kwlist, &threads)) return 0;
+
+  bob::io::image::set_decoding_threads(threads);
+  Py_RETURN_NONE;
+
+BOB_CATCH_FUNCTION("set_decoding_threads", 0)
+}
+
+static auto s_get_decoding_threads = bob::extension::FunctionDoc(
+  "get_decoding_threads",
+  "Returns the number of threads that decode large images, see :py:func:`set_decoding_threads`"
+)
+.add_prototype("", "threads")
+.add_return("threads", "int", "The number of decoding threads")
+;
+static PyObject* get_decoding_threads(PyObject*, PyObject *args, PyObject* kwds) {
+BOB_TRY
+  static char** kwlist = s_get_decoding_threads.kwlist();
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "", kwlist)) return 0;
+
+  return Py_BuildValue("n", (Py_ssize_t)bob::io::image::get_decoding_threads());
+
+BOB_CATCH_FUNCTION("get_decoding_threads", 0)
+}
+
+
 static PyMethodDef module_methods[] = {
   {
     s_image_extension.name(),
@@ -63,6 +175,36 @@ static PyMethodDef module_methods[] = {
     METH_VARARGS|METH_KEYWORDS,
     s_image_extension.doc(),
   },
+  {
+    s_read_indexed.name(),
+    (PyCFunction)read_indexed,
+    METH_VARARGS|METH_KEYWORDS,
+    s_read_indexed.doc(),
+  },
+  {
+    s_set_trusted_input.name(),
+    (PyCFunction)set_trusted_input,
+    METH_VARARGS|METH_KEYWORDS,
+    s_set_trusted_input.doc(),
+  },
+  {
+    s_get_trusted_input.name(),
+    (PyCFunction)get_trusted_input,
+    METH_VARARGS|METH_KEYWORDS,
+    s_get_trusted_input.doc(),
+  },
+  {
+    s_set_decoding_threads.name(),
+    (PyCFunction)set_decoding_threads,
+    METH_VARARGS|METH_KEYWORDS,
+    s_set_decoding_threads.doc(),
+  },
+  {
+    s_get_decoding_threads.name(),
+    (PyCFunction)get_decoding_threads,
+    METH_VARARGS|METH_KEYWORDS,
+    s_get_decoding_threads.doc(),
+  },
   {0}  /* Sentinel */
 };
 
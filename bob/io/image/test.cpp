@@ -6,10 +6,30 @@
  */
 
 #include <bob.blitz/cleanup.h>
+#include <bob.core/array_convert.h>
+#include <bob.core/logging.h>
 #include <bob.extension/documentation.h>
 #include <boost/filesystem.hpp>
+#include <boost/format.hpp>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <thread>
+#include <vector>
 
 #include <bob.io.image/image.h>
+#include <bob.io.image/sampler.h>
+
+// Restores the number of decoding threads when the test leaves, also by an exception
+class DecodingThreadsGuard {
+  public:
+    DecodingThreadsGuard() : m_threads(bob::io::image::get_decoding_threads()) { }
+    ~DecodingThreadsGuard() { bob::io::image::set_decoding_threads(m_threads); }
+  private:
+    const size_t m_threads;
+};
 
 static auto s_test_io = bob::extension::FunctionDoc(
   "_test_io",
@@ -36,7 +56,7 @@ BOB_TRY
   for (int i = 0; i < 3; ++i)
     color_image(i, blitz::Range::all(), blitz::Range::all()) = gray_image(blitz::Range::all(), blitz::Range::all());
 
-  // BMP; only color images are supported
+  // BMP; color images are written with 24 bits per pixel
   boost::filesystem::path bmp(tempdir); bmp /= std::string("color.bmp");
   bob::io::image::write_color_image(color_image, bmp.string());
   if (bob::io::image::get_correct_image_extension(bmp.string()) != ".bmp")
@@ -48,19 +68,221 @@ BOB_TRY
   if (blitz::any(blitz::abs(color_image - color_bmp) > 0))
     throw std::runtime_error("BMP image IO did not succeed, check " + bmp.string());
 
+  // BMP with 32 bits BGRA pixels, stored top-down
+  boost::filesystem::path bmp_bgra(tempdir); bmp_bgra /= std::string("color_bgra.bmp");
+  bob::io::image::BMPWriteOptions bmp_options;
+  bmp_options.alpha = true;
+  bmp_options.top_down = true;
+  bob::io::image::write_bmp(color_image, bmp_bgra.string(), bmp_options);
+  if (boost::filesystem::file_size(bmp_bgra) != 54 + 4 * 100 * 100 || blitz::any(bob::io::image::read_bmp(bmp_bgra.string()) != color_image))
+    throw std::runtime_error("BMP image IO with 32 bits did not succeed, check " + bmp_bgra.string());
+
+  // BMP with 24 and 32 bits, stored bottom-up and top-down; the channels differ and the width leaves a tail and row padding
+  blitz::Array<uint8_t, 3> channel_image(3, 20, 37);
+  for (int c = 0; c < 3; ++c)
+    for (int y = 0; y < 20; ++y)
+      for (int x = 0; x < 37; ++x)
+        channel_image(c, y, x) = static_cast<uint8_t>(80 * c + 7 * y + 3 * x);
+  for (bool alpha : {false, true})
+    for (bool top_down : {false, true}){
+      boost::filesystem::path bmp_layout(tempdir);
+      bmp_layout /= (boost::format("layout_%d_%s.bmp") % (alpha ? 32 : 24) % (top_down ? "top_down" : "bottom_up")).str();
+      bmp_options.alpha = alpha;
+      bmp_options.top_down = top_down;
+      bob::io::image::write_bmp(channel_image, bmp_layout.string(), bmp_options);
+      const size_t row_size = alpha ? 4 * 37 : (3 * 37 + 3) / 4 * 4;
+      if (boost::filesystem::file_size(bmp_layout) != 54 + row_size * 20 || blitz::any(bob::io::image::read_bmp(bmp_layout.string()) != channel_image))
+        throw std::runtime_error("BMP image IO did not succeed, check " + bmp_layout.string());
+    }
+
+  // BMP files that are truncated, before or while they are open, and headers with a width of 0 raise exceptions
+  boost::filesystem::path bmp_broken(tempdir); bmp_broken /= std::string("broken.bmp");
+  boost::filesystem::copy_file(bmp, bmp_broken, boost::filesystem::copy_option::overwrite_if_exists);
+  {
+    bob::io::image::BMPFile open_bmp(bmp_broken.string().c_str(), 'r');
+    boost::filesystem::resize_file(bmp_broken, 54 + 3 * 100 * 50);
+    bool thrown = false;
+    try { open_bmp.read<uint8_t, 3>(0); } catch (std::runtime_error&) { thrown = true; }
+    if (!thrown)
+      throw std::runtime_error("BMP file that was truncated while it was open could be read, check " + bmp_broken.string());
+  }
+  {
+    boost::filesystem::copy_file(bmp, bmp_broken, boost::filesystem::copy_option::overwrite_if_exists);
+    bob::io::image::BMPFile open_bmp(bmp_broken.string().c_str(), 'r');
+    bob::io::image::write_bmp(channel_image, bmp_broken.string());
+    bool thrown = false;
+    blitz::Array<uint8_t, 3> region(3, 10, 10);
+    bob::io::base::array::blitz_array buffer(region);
+    try { open_bmp.read_region(buffer, 50, 50, 10, 10); } catch (std::runtime_error&) { thrown = true; }
+    if (!thrown)
+      throw std::runtime_error("region outside of a BMP image that was replaced while it was open could be read, check " + bmp_broken.string());
+  }
+  bool truncated_thrown = false;
+  try { bob::io::image::read_bmp(bmp_broken.string()); } catch (std::runtime_error&) { truncated_thrown = true; }
+  if (!truncated_thrown)
+    throw std::runtime_error("truncated BMP file could be read, check " + bmp_broken.string());
+  {
+    std::fstream header(bmp_broken.string(), std::ios::in | std::ios::out | std::ios::binary);
+    header.seekp(18); // the width in the DIB header
+    header.write("\0\0\0\0", 4);
+  }
+  bool empty_thrown = false;
+  try { bob::io::image::read_bmp(bmp_broken.string()); } catch (std::runtime_error&) { empty_thrown = true; }
+  if (!empty_thrown)
+    throw std::runtime_error("BMP file with a width of 0 could be read, check " + bmp_broken.string());
+
+  // BMP; gray images are written with 8 bits per pixel and a gray color map
+  boost::filesystem::path bmp_gray(tempdir); bmp_gray /= std::string("gray.bmp");
+  bob::io::image::write_gray_image(gray_image, bmp_gray.string());
+  if (boost::filesystem::file_size(bmp_gray) != 54 + 4 * 256 + 100 * 100)
+    throw std::runtime_error("BMP gray image has an unexpected size, check " + bmp_gray.string());
+  if (bob::io::image::is_color_image(bmp_gray.string()))
+    throw std::runtime_error("BMP image " + bmp_gray.string() + " is not gray as expected");
+  if (blitz::any(bob::io::image::read_gray_image(bmp_gray.string()) != gray_image) || blitz::any(bob::io::image::read_color_image(bmp_gray.string()) != color_image))
+    throw std::runtime_error("BMP gray image IO did not succeed, check " + bmp_gray.string());
+
 
 #ifdef HAVE_GIFLIB
-  // GIF; only color images are supported
+  // GIF; the colors of the color image are all gray, which gives a gray color map
   boost::filesystem::path gif(tempdir); gif /= std::string("color.gif");
   bob::io::image::write_color_image(color_image, gif.string());
   if (bob::io::image::get_correct_image_extension(gif.string()) != ".gif")
     throw std::runtime_error("GIF image type check did not succeed, check " + gif.string());
-  if (!bob::io::image::is_color_image(gif.string(), ".gif"))
-    throw std::runtime_error("GIF image " + gif.string() + " is not color as expected");
+  if (bob::io::image::is_color_image(gif.string(), ".gif"))
+    throw std::runtime_error("GIF image " + gif.string() + " is not gray as expected");
 
   blitz::Array<uint8_t, 3> color_gif = bob::io::image::read_color_image(gif.string(), ".gif");
-  if (blitz::any(blitz::abs(color_image - color_gif) > 8)) // TODO: why is GIF not lossless?
+  if (blitz::any(color_image != color_gif)) // images with at most 256 colors are stored without loss
     throw std::runtime_error("GIF image IO did not succeed, check " + gif.string());
+
+  blitz::Array<uint8_t, 4> gif_frames = bob::io::image::read_gif_frames(gif.string());
+  if (gif_frames.extent(0) != 1 || blitz::any(gif_frames(0, blitz::Range::all(), blitz::Range::all(), blitz::Range::all()) != color_gif))
+    throw std::runtime_error("GIF frames could not be read, check " + gif.string());
+
+  blitz::Array<uint8_t, 2> gif_indices, gif_palette;
+  bob::io::image::read_gif_indexed(gif.string(), gif_indices, gif_palette);
+  if (gif_indices.extent(0) != 100 || gif_indices.extent(1) != 100)
+    throw std::runtime_error("GIF color indices could not be read, check " + gif.string());
+  for (int y = 0; y < 100; ++y)
+    for (int x = 0; x < 100; ++x)
+      for (int i = 0; i < 3; ++i)
+        if (gif_palette(gif_indices(y, x), i) != color_gif(i, y, x))
+          throw std::runtime_error("GIF color indices could not be read, check " + gif.string());
+
+  // animated GIF with a global color map of the first frame
+  boost::filesystem::path animated(tempdir); animated /= std::string("animated.gif");
+  blitz::Array<uint8_t, 4> animation(2, 3, 100, 100);
+  animation(0, blitz::Range::all(), blitz::Range::all(), blitz::Range::all()) = color_image;
+  animation(1, blitz::Range::all(), blitz::Range::all(), blitz::Range::all()) = 255 - color_image;
+  bob::io::image::GIFWriteOptions gif_options;
+  gif_options.delay = 20;
+  gif_options.palette_frames = 1;
+  bob::io::image::write_gif_frames(animation, animated.string(), gif_options);
+  blitz::Array<uint8_t, 4> animation_gif = bob::io::image::read_gif_frames(animated.string());
+  if (animation_gif.extent(0) != 2 || blitz::any(animation_gif(0, blitz::Range::all(), blitz::Range::all(), blitz::Range::all()) != color_image))
+    throw std::runtime_error("animated GIF image IO did not succeed, check " + animated.string());
+  // the second frame is mapped to the color map of the first one, which has 127 instead of 128
+  blitz::Array<int, 3> animation_error(blitz::abs(blitz::cast<int>(animation_gif(1, blitz::Range::all(), blitz::Range::all(), blitz::Range::all())) - (255 - blitz::cast<int>(color_image))));
+  if (blitz::max(animation_error) > 1)
+    throw std::runtime_error("animated GIF frame mapped to the global color map differs too much, check " + animated.string());
+  bob::io::image::GIFFile animated_gif(animated.string().c_str(), 'r');
+  if (animated_gif.frame(1).delay != 20)
+    throw std::runtime_error("animated GIF delay was not written, check " + animated.string());
+
+  // frames that are appended one by one get their own color maps and delays
+  boost::filesystem::path animated_local(tempdir); animated_local /= std::string("animated_local.gif");
+  {
+    bob::io::image::GIFFile local(animated_local.string().c_str(), 'w');
+    gif_options = bob::io::image::GIFWriteOptions();
+    gif_options.delay = 10;
+    local.set_write_options(gif_options);
+    local.append(color_image);
+    gif_options.delay = 30;
+    local.set_write_options(gif_options);
+    local.append(blitz::Array<uint8_t, 3>(255 - color_image));
+    local.close();
+  }
+  bob::io::image::GIFFile local_gif(animated_local.string().c_str(), 'r');
+  blitz::Array<uint8_t, 4> local_frames = bob::io::image::read_gif_frames(animated_local.string());
+  if (local_gif.frame(0).delay != 10 || local_gif.frame(1).delay != 30 ||
+      blitz::any(local_frames(0, blitz::Range::all(), blitz::Range::all(), blitz::Range::all()) != color_image) ||
+      blitz::any(local_frames(1, blitz::Range::all(), blitz::Range::all(), blitz::Range::all()) != 255 - color_image))
+    throw std::runtime_error("animated GIF with a color map per frame could not be read, check " + animated_local.string());
+
+  // GIF; gray images are stored without loss with a gray color map
+  boost::filesystem::path gif_gray(tempdir); gif_gray /= std::string("gray.gif");
+  bob::io::image::write_gray_image(gray_image, gif_gray.string());
+  if (bob::io::image::is_color_image(gif_gray.string()))
+    throw std::runtime_error("GIF image " + gif_gray.string() + " is not gray as expected");
+  if (blitz::any(bob::io::image::read_gray_image(gif_gray.string()) != gray_image))
+    throw std::runtime_error("GIF gray image IO did not succeed, check " + gif_gray.string());
+
+  // the frames of gray animations are stacked as they are read by read_frames()
+  boost::filesystem::path gif_gray_frames(tempdir); gif_gray_frames /= std::string("gray_frames.gif");
+  {
+    bob::io::image::GIFFile gray_frames(gif_gray_frames.string().c_str(), 'w');
+    for (int i = 0; i < 3; ++i) gray_frames.append(gray_image);
+    gray_frames.close();
+    if (gray_frames.type().nd != 2 || gray_frames.type_all().nd != 3 || gray_frames.type_all().shape[0] != 3)
+      throw std::runtime_error("GIF gray frames have an unexpected type, check " + gif_gray_frames.string());
+    bob::io::base::array::blitz_array all(gray_frames.type_all());
+    gray_frames.read_all(all);
+    for (int i = 0; i < 3; ++i)
+      if (std::memcmp(static_cast<const uint8_t*>(all.ptr()) + i * gray_image.size(), gray_image.data(), gray_image.size()))
+        throw std::runtime_error("GIF gray frames could not be read, check " + gif_gray_frames.string());
+  }
+
+  // GIF with colors
+  boost::filesystem::path gif_colors(tempdir); gif_colors /= std::string("colors.gif");
+  blitz::Array<uint8_t, 3> colors(3, 100, 100);
+  colors(0, blitz::Range::all(), blitz::Range::all()) = gray_image;
+  colors(1, blitz::Range::all(), blitz::Range::all()) = 255 - gray_image;
+  colors(2, blitz::Range::all(), blitz::Range::all()) = 64;
+  bob::io::image::write_color_image(colors, gif_colors.string());
+  if (!bob::io::image::is_color_image(gif_colors.string()))
+    throw std::runtime_error("GIF image " + gif_colors.string() + " is not color as expected");
+  if (blitz::any(bob::io::image::read_color_image(gif_colors.string()) != colors))
+    throw std::runtime_error("GIF color image IO did not succeed, check " + gif_colors.string());
+
+  // images with more than 256 colors are quantized with a bounded error, also
+  // on several threads and while other images are written at the same time
+  blitz::Array<uint8_t, 3> gradient(3, 800, 700);
+  gradient(0, blitz::Range::all(), blitz::Range::all()) = blitz::tensor::j * 255 / 699;
+  gradient(1, blitz::Range::all(), blitz::Range::all()) = blitz::tensor::i * 255 / 799;
+  gradient(2, blitz::Range::all(), blitz::Range::all()) = (blitz::tensor::i + blitz::tensor::j) * 255 / 1498;
+  boost::filesystem::path gif_gradient(tempdir); gif_gradient /= std::string("gradient.gif");
+  const size_t gif_threads = bob::io::image::get_decoding_threads();
+  bob::io::image::set_decoding_threads(1);
+  bob::io::image::write_gif(gradient, gif_gradient.string());
+  blitz::Array<uint8_t, 3> gradient_gif = bob::io::image::read_gif(gif_gradient.string());
+  blitz::Array<int, 3> gradient_error(blitz::abs(blitz::cast<int>(gradient_gif) - blitz::cast<int>(gradient)));
+  if (blitz::max(gradient_error) > 32 || blitz::mean(gradient_error) > 8)
+    throw std::runtime_error("GIF image with more than 256 colors was not quantized well, check " + gif_gradient.string());
+  bob::io::image::set_decoding_threads(4);
+  std::vector<std::thread> gif_writers;
+  for (int i = 0; i < 4; ++i)
+    gif_writers.emplace_back([&gradient, &tempdir, i](){
+      bob::io::image::write_gif(gradient, (boost::filesystem::path(tempdir) / (boost::format("gradient_%d.gif") % i).str()).string());
+    });
+  for (std::thread& writer : gif_writers) writer.join();
+  bob::io::image::set_decoding_threads(gif_threads);
+  for (int i = 0; i < 4; ++i) {
+    boost::filesystem::path written(tempdir); written /= (boost::format("gradient_%d.gif") % i).str();
+    if (blitz::any(bob::io::image::read_gif(written.string()) != gradient_gif))
+      throw std::runtime_error("GIF images written at the same time differ from a single one, check " + written.string());
+  }
+
+  // a gray first frame makes an animation gray, whose later frames with colors are still read in color into color buffers
+  boost::filesystem::path gif_mixed(tempdir); gif_mixed /= std::string("mixed.gif");
+  blitz::Array<uint8_t, 4> mixed(2, 3, 100, 100);
+  mixed(0, blitz::Range::all(), blitz::Range::all(), blitz::Range::all()) = color_image;
+  mixed(1, blitz::Range::all(), blitz::Range::all(), blitz::Range::all()) = colors;
+  bob::io::image::write_gif_frames(mixed, gif_mixed.string());
+  if (bob::io::image::is_color_image(gif_mixed.string()) || bob::io::image::GIFFile(gif_mixed.string().c_str(), 'r').frame(1).gray)
+    throw std::runtime_error("GIF image " + gif_mixed.string() + " is not gray with a color frame as expected");
+  blitz::Array<uint8_t, 4> mixed_gif = bob::io::image::read_gif_frames(gif_mixed.string());
+  if (blitz::any(mixed_gif(1, blitz::Range::all(), blitz::Range::all(), blitz::Range::all()) != colors))
+    throw std::runtime_error("animated GIF with colors could not be read, check " + gif_mixed.string());
 #endif
 
   // NetPBM
@@ -110,6 +332,18 @@ BOB_TRY
   blitz::Array<uint8_t, 3> color_jpeg = bob::io::image::read_color_image(jpeg_color.string());
   if (blitz::any(blitz::abs(color_image - color_jpeg) > 10))
     throw std::runtime_error("JPEG color image IO did not succeed, check " + jpeg_color.string());
+
+  // regions, also off the 8x8 blocks, are decoded as the same part of the full image
+  blitz::Array<uint8_t, 3> region_jpeg(3, 30, 40);
+  bob::io::base::array::blitz_array region_jpeg_buffer(region_jpeg);
+  bob::io::image::JPEGFile(jpeg_color.string().c_str(), 'r').read_region(region_jpeg_buffer, 13, 21, 30, 40);
+  if (blitz::any(region_jpeg != color_jpeg(blitz::Range::all(), blitz::Range(13, 42), blitz::Range(21, 60))))
+    throw std::runtime_error("JPEG color image region could not be read, check " + jpeg_color.string());
+  blitz::Array<uint8_t, 2> region_gray_jpeg(20, 50);
+  bob::io::base::array::blitz_array region_gray_jpeg_buffer(region_gray_jpeg);
+  bob::io::image::JPEGFile(jpeg_gray.string().c_str(), 'r').read_region(region_gray_jpeg_buffer, 80, 50, 20, 50);
+  if (blitz::any(region_gray_jpeg != gray_jpeg(blitz::Range(80, 99), blitz::Range(50, 99))))
+    throw std::runtime_error("JPEG gray image region could not be read, check " + jpeg_gray.string());
 #endif
 
 #ifdef HAVE_LIBPNG
@@ -153,6 +387,72 @@ BOB_TRY
   if (blitz::any(blitz::abs(color_image - uint8_color) > 1))
     throw std::runtime_error("PNG color type conversion not succeed, check " + png_uint16c.string());
 
+  // test converting pixels while decoding
+  blitz::Array<float, 2> float_gray = bob::io::image::read_png<float, 2>(png_gray.string());
+  if (blitz::any(blitz::abs(float_gray - blitz::cast<float>(gray_image) / 255.f) > 1e-6))
+    throw std::runtime_error("PNG gray image could not be read as normalized float, check " + png_gray.string());
+  blitz::Array<float, 3> float_color = bob::io::image::read_png<float, 3>(png_uint16c.string());
+  if (blitz::any(blitz::abs(float_color - blitz::cast<float>(color_image) / 255.f) > 1e-6))
+    throw std::runtime_error("PNG 16 bit color image could not be read as normalized float, check " + png_uint16c.string());
+  // other data types are converted after decoding
+  if (blitz::any(bob::io::image::read_png<int32_t, 2>(png_gray.string()) != bob::core::array::convert<int32_t>(gray_image)))
+    throw std::runtime_error("PNG gray image could not be read as int32, check " + png_gray.string());
+
+  // test auto-packing; the levels 0, 85 and 170 are stored with 2 bits
+  blitz::Array<uint8_t, 2> gray_levels(blitz::cast<uint8_t>(gray_image / 127 * 85));
+  boost::filesystem::path png_levels(tempdir); png_levels /= std::string("levels.png");
+  bob::io::image::write_png(gray_levels, png_levels.string());
+  boost::filesystem::path png_packed(tempdir); png_packed /= std::string("packed.png");
+  bob::io::image::write_png(gray_levels, png_packed.string(), true);
+  if (bob::io::image::is_color_png(png_packed.string()) || boost::filesystem::file_size(png_packed) >= boost::filesystem::file_size(png_levels))
+    throw std::runtime_error("PNG gray image was not packed, check " + png_packed.string());
+  if (blitz::any(gray_levels != bob::io::image::read_png<uint8_t, 2>(png_packed.string())))
+    throw std::runtime_error("PNG packed gray image IO did not succeed, check " + png_packed.string());
+
+  // gray levels off the 1, 2 and 4 bit grids are stored with 8 bits, and stay gray
+  bob::io::image::write_png(gray_image, png_packed.string(), true);
+  if (bob::io::image::is_color_png(png_packed.string()) || blitz::any(gray_image != bob::io::image::read_png<uint8_t, 2>(png_packed.string())))
+    throw std::runtime_error("PNG packed gray image IO did not succeed, check " + png_packed.string());
+
+  boost::filesystem::path png_packedc(tempdir); png_packedc /= std::string("packedc.png");
+  bob::io::image::write_png(color_image, png_packedc.string(), true);
+  if (!bob::io::image::is_color_png(png_packedc.string()) || boost::filesystem::file_size(png_packedc) >= boost::filesystem::file_size(png_color))
+    throw std::runtime_error("PNG color image was not packed, check " + png_packedc.string());
+  if (blitz::any(color_image != bob::io::image::read_png<uint8_t, 3>(png_packedc.string())))
+    throw std::runtime_error("PNG packed color image IO did not succeed, check " + png_packedc.string());
+
+  // label maps are stored as palette indices on request only
+  blitz::Array<uint8_t, 2> labels(blitz::cast<uint8_t>(gray_image / 127));
+  bob::io::image::PNGPackOptions label_options;
+  label_options.gray_palette = true;
+  bob::io::image::write_png(labels, png_packed.string(), true);
+  if (bob::io::image::is_color_png(png_packed.string()) || blitz::any(labels != bob::io::image::read_png<uint8_t, 2>(png_packed.string())))
+    throw std::runtime_error("PNG packed label map IO did not succeed, check " + png_packed.string());
+  bob::io::image::write_png(labels, png_packed.string(), true, label_options);
+  blitz::Array<uint8_t, 2> label_indices, label_palette;
+  bob::io::image::read_png_indexed(png_packed.string(), label_indices, label_palette);
+  if (!bob::io::image::is_color_png(png_packed.string()) || blitz::any(label_indices != labels) ||
+      label_palette.extent(0) != blitz::max(labels) + 1)
+    throw std::runtime_error("PNG label map was not stored as palette indices, check " + png_packed.string());
+
+  // 16 bit images with values below 256 are stored with 8 bits on request only
+  blitz::Array<uint16_t, 2> small_gray(100, 100);
+  for (int i = 0; i < 100; ++i)
+    for (int j = 0; j < 100; ++j)
+      small_gray(i, j) = (i * j) % 250;
+  bob::io::image::write_png(small_gray, png_packed.string(), true);
+  if (bob::io::image::PNGFile(png_packed.string().c_str(), 'r').type().dtype != bob::io::base::array::t_uint16 ||
+      blitz::any(bob::io::image::read_png<uint16_t, 2>(png_packed.string()) != small_gray))
+    throw std::runtime_error("PNG 16 bit image did not keep 16 bits, check " + png_packed.string());
+  bob::io::image::PNGPackOptions narrow_options;
+  narrow_options.narrow_16_bits = true;
+  bob::io::image::write_png(small_gray, png_packed.string(), true, narrow_options);
+  bob::io::image::PNGFile png_small(png_packed.string().c_str(), 'r');
+  if (png_small.type().dtype != bob::io::base::array::t_uint8)
+    throw std::runtime_error("PNG 16 bit image was not packed to 8 bits, check " + png_packed.string());
+  if (blitz::any(blitz::cast<uint16_t>(png_small.read<uint8_t, 2>(0)) != small_gray))
+    throw std::runtime_error("PNG packed 16 bit image IO did not succeed, check " + png_packed.string());
+
 #endif
 
 #ifdef HAVE_LIBTIFF
@@ -178,13 +478,519 @@ BOB_TRY
   blitz::Array<uint8_t, 3> color_tiff = bob::io::image::read_color_image(tiff_color.string());
   if (blitz::any(blitz::abs(color_image - color_tiff) > 1))
     throw std::runtime_error("TIFF color image IO did not succeed, check " + tiff_color.string());
+
+  blitz::Array<double, 3> double_tiff = bob::io::image::read_tiff<double, 3>(tiff_color.string());
+  if (blitz::any(blitz::abs(double_tiff - blitz::cast<double>(color_image) / 255.) > 1e-12))
+    throw std::runtime_error("TIFF color image could not be read as normalized double, check " + tiff_color.string());
+  blitz::Array<uint16_t, 2> uint16_tiff = bob::io::image::read_tiff<uint16_t, 2>(tiff_gray.string());
+  if (blitz::any(uint16_tiff != blitz::cast<uint16_t>(gray_image) * 257))
+    throw std::runtime_error("TIFF gray image could not be read as uint16, check " + tiff_gray.string());
+  blitz::Array<uint8_t, 3> roi_tiff = bob::io::image::read_tiff_roi<uint8_t, 3>(tiff_color.string(), 10, 20, 30, 40);
+  if (blitz::any(roi_tiff != color_tiff(blitz::Range::all(), blitz::Range(10, 39), blitz::Range(20, 59))))
+    throw std::runtime_error("TIFF color image region could not be read, check " + tiff_color.string());
+
+  bob::io::image::TIFFWriteOptions tiff_options;
+  tiff_options.compression = bob::io::image::TIFFWriteOptions::LZW;
+  tiff_options.predictor = true;
+  tiff_options.tile_width = tiff_options.tile_height = 32;
+  tiff_options.separate_planes = true;
+  boost::filesystem::path tiff_tiled(tempdir); tiff_tiled /= std::string("tiled.tiff");
+  bob::io::image::write_tiff(color_image, tiff_tiled.string(), tiff_options);
+  if (blitz::any(bob::io::image::read_tiff<uint8_t, 3>(tiff_tiled.string()) != color_image))
+    throw std::runtime_error("TIFF compressed tiles could not be written, check " + tiff_tiled.string());
+  // regions across several tiles and into the partial tiles at the right and bottom edges
+  blitz::Array<uint8_t, 3> roi_tiled = bob::io::image::read_tiff_roi<uint8_t, 3>(tiff_tiled.string(), 20, 25, 50, 60);
+  blitz::Array<uint8_t, 3> edge_tiled = bob::io::image::read_tiff_roi<uint8_t, 3>(tiff_tiled.string(), 70, 90, 30, 10);
+  if (blitz::any(roi_tiled != color_image(blitz::Range::all(), blitz::Range(20, 69), blitz::Range(25, 84))) ||
+      blitz::any(edge_tiled != color_image(blitz::Range::all(), blitz::Range(70, 99), blitz::Range(90, 99))))
+    throw std::runtime_error("TIFF tiled image region could not be read, check " + tiff_tiled.string());
+  bool roi_type_thrown = false;
+  try { bob::io::image::read_tiff_roi<int32_t, 3>(tiff_tiled.string(), 20, 25, 50, 60); } catch (std::runtime_error&) { roi_type_thrown = true; }
+  if (!roi_type_thrown)
+    throw std::runtime_error("TIFF image region could be read as an unsupported data type, check " + tiff_tiled.string());
+
+  std::ifstream tiff_stream(tiff_tiled.string().c_str(), std::ios::binary);
+  std::vector<char> tiff_bytes((std::istreambuf_iterator<char>(tiff_stream)), std::istreambuf_iterator<char>());
+  blitz::Array<uint8_t, 1> tiff_memory(tiff_bytes.size());
+  std::copy(tiff_bytes.begin(), tiff_bytes.end(), tiff_memory.begin());
+  if (blitz::any(bob::io::image::read_tiff_memory<uint8_t, 3>(tiff_memory) != color_image))
+    throw std::runtime_error("TIFF image could not be read from memory, check " + tiff_tiled.string());
+
+  // separate planes are written and read without interleaving
+  tiff_options = bob::io::image::TIFFWriteOptions();
+  tiff_options.separate_planes = true;
+  bob::io::image::write_tiff(color_image, tiff_tiled.string(), tiff_options);
+  if (blitz::any(bob::io::image::read_tiff<uint8_t, 3>(tiff_tiled.string()) != color_image))
+    throw std::runtime_error("TIFF separate planes could not be written, check " + tiff_tiled.string());
+
+  tiff_options = bob::io::image::TIFFWriteOptions();
+  tiff_options.bigtiff = true;
+  boost::filesystem::path bigtiff(tempdir); bigtiff /= std::string("big.tiff");
+  bob::io::image::write_tiff(color_image, bigtiff.string(), tiff_options);
+  if (bob::io::image::get_correct_image_extension(bigtiff.string()) != ".tiff")
+    throw std::runtime_error("BigTIFF image type check did not succeed, check " + bigtiff.string());
+  if (blitz::any(bob::io::image::read_tiff<uint8_t, 3>(bigtiff.string()) != color_image))
+    throw std::runtime_error("BigTIFF image IO did not succeed, check " + bigtiff.string());
+
+  // sparse files of more than 4 GB: pages are appended beyond 4 GB to BigTIFF
+  // files, and are rejected by classic TIFF files, also when compressed
+  const uintmax_t four_gb = uintmax_t(1) << 32;
+  boost::filesystem::resize_file(bigtiff, four_gb + (uintmax_t(1) << 30));
+  {
+    bob::io::image::TIFFFile big(bigtiff.string().c_str(), 'a');
+    big.append(gray_image);
+  }
+  if (blitz::any(bob::io::image::read_tiff_page<uint8_t, 2>(bigtiff.string(), 1) != gray_image))
+    throw std::runtime_error("BigTIFF page could not be appended beyond 4 GB, check " + bigtiff.string());
+  boost::filesystem::remove(bigtiff);
+
+  boost::filesystem::path classic(tempdir); classic /= std::string("classic.tiff");
+  bob::io::image::write_tiff(gray_image, classic.string());
+  boost::filesystem::resize_file(classic, four_gb - 1000);
+  tiff_options = bob::io::image::TIFFWriteOptions();
+  tiff_options.compression = bob::io::image::TIFFWriteOptions::DEFLATE;
+  {
+    bob::io::image::TIFFFile full(classic.string().c_str(), 'a');
+    full.set_write_options(tiff_options);
+    bool failed = false;
+    try { full.append(gray_image); } catch (std::runtime_error&) { failed = true; }
+    if (!failed)
+      throw std::runtime_error("TIFF page was appended beyond the 4 GB of classic TIFF, check " + classic.string());
+  }
+  boost::filesystem::remove(classic);
+
+  // large enough to be decoded in parallel
+  blitz::Array<uint16_t, 2> large_image(600, 700);
+  large_image = blitz::tensor::i * 100 + blitz::tensor::j;
+  tiff_options = bob::io::image::TIFFWriteOptions();
+  tiff_options.compression = bob::io::image::TIFFWriteOptions::DEFLATE;
+  tiff_options.rows_per_strip = 16;
+  boost::filesystem::path tiff_strips(tempdir); tiff_strips /= std::string("strips.tiff");
+  bob::io::image::write_tiff(large_image, tiff_strips.string(), tiff_options);
+  if (blitz::any(bob::io::image::read_tiff<uint16_t, 2>(tiff_strips.string()) != large_image))
+    throw std::runtime_error("TIFF compressed strips could not be written, check " + tiff_strips.string());
+
+  // regions that are read again are converted from the cached strips
+  bob::io::image::set_tiff_cache_size(1 << 24);
+  bob::io::image::TIFFCacheStatistics tiff_cache = bob::io::image::get_tiff_cache_statistics();
+  for (int repeat = 0; repeat < 2; ++repeat)
+    if (blitz::any(bob::io::image::read_tiff_roi<uint16_t, 2>(tiff_strips.string(), 100, 200, 50, 60) != large_image(blitz::Range(100, 149), blitz::Range(200, 259))))
+      throw std::runtime_error("TIFF region could not be read through the cache, check " + tiff_strips.string());
+  bob::io::image::TIFFCacheStatistics tiff_cached = bob::io::image::get_tiff_cache_statistics();
+  bob::io::image::set_tiff_cache_size(0);
+  if (tiff_cached.misses - tiff_cache.misses != 4 || tiff_cached.hits - tiff_cache.hits != 4 || bob::io::image::get_tiff_cache_statistics().bytes != 0)
+    throw std::runtime_error("TIFF strips were not cached, check " + tiff_strips.string());
+
+  // files that are written again are not read from the cache, even within the same modification time
+  bob::io::image::set_tiff_cache_size(1 << 24);
+  blitz::Array<uint16_t, 2> changed_image(large_image + 1);
+  bob::io::image::read_tiff_roi<uint16_t, 2>(tiff_strips.string(), 100, 200, 50, 60);
+  bob::io::image::write_tiff(changed_image, tiff_strips.string(), tiff_options);
+  const bool changed = blitz::all(bob::io::image::read_tiff_roi<uint16_t, 2>(tiff_strips.string(), 100, 200, 50, 60) == changed_image(blitz::Range(100, 149), blitz::Range(200, 259)));
+  bob::io::image::set_tiff_cache_size(0);
+  if (!changed)
+    throw std::runtime_error("TIFF file that was written again was read from the cache, check " + tiff_strips.string());
+
+  boost::filesystem::path tiff_pages(tempdir); tiff_pages /= std::string("pages.tiff");
+  {
+    bob::io::image::TIFFFile pages(tiff_pages.string().c_str(), 'w');
+    pages.append(gray_image);
+    pages.append(color_image);
+  }
+  {
+    bob::io::image::TIFFFile pages(tiff_pages.string().c_str(), 'a');
+    // the page that is appended after a read is read from the grown file
+    if (blitz::any(pages.read<uint8_t, 2>(0) != gray_image))
+      throw std::runtime_error("TIFF page could not be read before appending, check " + tiff_pages.string());
+    pages.append(gray_image);
+    if (pages.size() != 3 || blitz::any(pages.read<uint8_t, 2>(2) != gray_image))
+      throw std::runtime_error("TIFF pages could not be appended, check " + tiff_pages.string());
+  }
+  if (blitz::any(bob::io::image::read_tiff_page<uint8_t, 3>(tiff_pages.string(), 1) != color_image) ||
+      blitz::any(bob::io::image::read_tiff_page<uint8_t, 2>(tiff_pages.string(), 2) != gray_image))
+    throw std::runtime_error("TIFF pages could not be read, check " + tiff_pages.string());
+  {
+    // the pages differ in type, so that the file reads as its first page instead of a stack
+    bob::io::image::TIFFFile pages(tiff_pages.string().c_str(), 'r');
+    if (pages.type_all().nd != 2 || pages.pages_type().nd != 2)
+      throw std::runtime_error("TIFF file with pages of different types does not read as its first page, check " + tiff_pages.string());
+    // files opened for reading are not extended
+    bool read_only_thrown = false;
+    try { pages.append(gray_image); } catch (std::runtime_error&) { read_only_thrown = true; }
+    if (!read_only_thrown || pages.size() != 3 || bob::io::image::TIFFFile(tiff_pages.string().c_str(), 'r').size() != 3)
+      throw std::runtime_error("TIFF page was appended to a file opened for reading, check " + tiff_pages.string());
+  }
+  boost::filesystem::path tiff_stack(tempdir); tiff_stack /= std::string("stack.tiff");
+  {
+    bob::io::image::TIFFFile stack(tiff_stack.string().c_str(), 'w');
+    for (int i = 0; i < 3; ++i) stack.append(gray_image);
+    blitz::Array<uint8_t, 3> pages(3, gray_image.extent(0), gray_image.extent(1));
+    bob::io::base::array::blitz_array buffer(pages);
+    stack.read_pages(buffer);
+    if (stack.type_all().nd != 3 || stack.pages_type().nd != 3 ||
+        blitz::any(pages(2, blitz::Range::all(), blitz::Range::all()) != gray_image))
+      throw std::runtime_error("TIFF pages could not be read as a stack, check " + tiff_stack.string());
+  }
+
+  boost::filesystem::path tiff_pyramid(tempdir); tiff_pyramid /= std::string("pyramid.tiff");
+  bob::io::image::write_tiff_pyramid(color_image, tiff_pyramid.string(), 3, 32, bob::io::image::TIFFWriteOptions::DEFLATE);
+  blitz::Array<uint8_t, 3> level = bob::io::image::read_tiff_level<uint8_t, 3>(tiff_pyramid.string(), 2);
+  if (bob::io::image::TIFFFile(tiff_pyramid.string().c_str(), 'r').levels() != 3 ||
+      blitz::any(bob::io::image::read_tiff_level<uint8_t, 3>(tiff_pyramid.string(), 0) != color_image) ||
+      level.extent(1) != 25 || level.extent(2) != 25)
+    throw std::runtime_error("TIFF pyramid could not be written, check " + tiff_pyramid.string());
+  // each level holds the rounded averages of the 2x2 blocks of the level above
+  blitz::Array<uint8_t, 3> upper = color_image;
+  for (int l = 1; l < 3; ++l){
+    blitz::Array<uint8_t, 3> lower = bob::io::image::read_tiff_level<uint8_t, 3>(tiff_pyramid.string(), l);
+    for (int c = 0; c < 3; ++c)
+      for (int y = 0; y < lower.extent(1); ++y)
+        for (int x = 0; x < lower.extent(2); ++x)
+          if (lower(c, y, x) != (upper(c, 2*y, 2*x) + upper(c, 2*y, 2*x+1) + upper(c, 2*y+1, 2*x) + upper(c, 2*y+1, 2*x+1) + 2) / 4)
+            throw std::runtime_error((boost::format("TIFF pyramid level %d is not reduced from level %d, check %s") % l % (l-1) % tiff_pyramid.string()).str());
+    upper.reference(lower);
+  }
 #endif
 
+  // bit-packed bilevel images; the width of 100 pixels leaves 4 bits of padding per row
+  blitz::Array<uint8_t, 2> bilevel(blitz::cast<uint8_t>(gray_image > 0));
+  blitz::Array<uint8_t, 2> bits = bob::io::image::pack_bits(bilevel);
+  if (bits.extent(0) != 100 || bits.extent(1) != 13 || blitz::any(bob::io::image::unpack_bits(bits, 100) != bilevel))
+    throw std::runtime_error("Packing and unpacking of bits did not succeed");
+
+  std::vector<std::string> bilevel_formats = {".pbm"};
+#ifdef HAVE_LIBPNG
+  bilevel_formats.push_back(".png");
+#endif
+#ifdef HAVE_LIBTIFF
+  bilevel_formats.push_back(".tiff");
+#endif
+  for (const auto& extension : bilevel_formats){
+    boost::filesystem::path packed(tempdir); packed /= std::string("bilevel") + extension;
+    bob::io::image::write_packed(bits, 100, packed.string());
+    blitz::Array<uint8_t, 2> packed_bits;
+    if (bob::io::image::read_packed(packed.string(), packed_bits) != 100 || blitz::any(packed_bits != bits))
+      throw std::runtime_error("Bit-packed image IO did not succeed, check " + packed.string());
+    // set bits are black: 1 in PBM images, 0 in 8 bit PNG and TIFF images
+    blitz::Array<uint8_t, 2> unpacked = bob::io::image::read_gray_image(packed.string());
+    blitz::Array<uint8_t, 2> expected = bob::io::image::unpack_bits(bits, 100, extension == ".pbm" ? 1 : 255);
+    if (extension != ".pbm") expected = 255 - expected;
+    if (blitz::any(unpacked != expected))
+      throw std::runtime_error("Bit-packed image could not be read unpacked, check " + packed.string());
+  }
+
+#ifdef HAVE_LIBPNG
+  // PBM -> PNG -> PBM keeps the polarity of the pixels
+  {
+    boost::filesystem::path pbm_in(tempdir); pbm_in /= std::string("bilevel.pbm");
+    boost::filesystem::path png_out(tempdir); png_out /= std::string("bilevel_from_pbm.png");
+    boost::filesystem::path pbm_out(tempdir); pbm_out /= std::string("bilevel_from_png.pbm");
+    blitz::Array<uint8_t, 2> pbm_bits, png_bits, pbm_bits2;
+    bob::io::image::read_packed(pbm_in.string(), pbm_bits);
+    bob::io::image::write_packed(pbm_bits, 100, png_out.string());
+    bob::io::image::read_packed(png_out.string(), png_bits);
+    bob::io::image::write_packed(png_bits, 100, pbm_out.string());
+    bob::io::image::read_packed(pbm_out.string(), pbm_bits2);
+    if (blitz::any(pbm_bits2 != bits) || blitz::any(bob::io::image::read_gray_image(pbm_out.string()) != bilevel))
+      throw std::runtime_error("Bit-packed PBM -> PNG -> PBM round trip did not succeed, check " + pbm_out.string());
+    if (blitz::any(bob::io::image::read_gray_image(png_out.string()) != 255 - 255 * bilevel))
+      throw std::runtime_error("Black pixels of the PBM image are not black in the PNG image, check " + png_out.string());
+  }
+#endif
+
+  // random patches are crops of the fully decoded images
+  std::vector<std::string> patch_files = {bmp.string(), ppm.string()};
+#ifdef HAVE_LIBPNG
+  patch_files.push_back(png_color.string());
+#endif
+#ifdef HAVE_LIBJPEG
+  patch_files.push_back(jpeg_color.string());
+#endif
+#ifdef HAVE_LIBTIFF
+  patch_files.push_back(tiff_color.string());
+#endif
+  std::vector<blitz::Array<uint8_t, 3>> patch_images;
+  for (const auto& patch_file : patch_files)
+    patch_images.push_back(bob::io::image::read_color_image(patch_file));
+  // batches of a few patches read sparse JPEG patches one by one, and only two files stay open between batches
+  for (int count : {40, 3}){
+    bob::io::image::PatchSampler sampler(patch_files, 16, 24, count, 0, 2);
+    for (int batch = 0; batch < 3; ++batch){
+      blitz::Array<uint8_t, 4> patches = sampler.sample<uint8_t>();
+      for (int n = 0; n < count; ++n){
+        const bob::io::image::PatchSampler::Patch& patch = sampler.patches()[n];
+        blitz::Array<uint8_t, 3> crop = patch_images[patch.file](blitz::Range::all(), blitz::Range(patch.y, patch.y + 15), blitz::Range(patch.x, patch.x + 23));
+        if (blitz::any(patches(n, blitz::Range::all(), blitz::Range::all(), blitz::Range::all()) != crop))
+          throw std::runtime_error("Random patch sampling did not succeed, check " + patch_files[patch.file]);
+      }
+    }
+  }
+
   Py_RETURN_NONE;
 BOB_CATCH_FUNCTION("_test_io", 0)
 }
 
 
+static auto s_test_png_interlace = bob::extension::FunctionDoc(
+  "_test_png_interlace",
+  "Tests the coarse previews of Adam7 interlaced PNG images"
+)
+.add_prototype("interlaced, reference")
+.add_parameter("interlaced", "str", "An Adam7 interlaced PNG image")
+.add_parameter("reference", "str", "The same image, stored without interlacing")
+;
+static PyObject* _test_png_interlace(PyObject*, PyObject *args, PyObject* kwds) {
+BOB_TRY
+  static char** kwlist = s_test_png_interlace.kwlist();
+
+  const char* interlaced;
+  const char* reference;
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "ss", kwlist, &interlaced, &reference)) return 0;
+
+#ifdef HAVE_LIBPNG
+  static const int ystart[7] = {0, 0, 4, 0, 2, 0, 1};
+  static const int yinc[7] = {8, 8, 8, 4, 4, 2, 2};
+  static const int xstart[7] = {0, 4, 0, 2, 0, 1, 0};
+  static const int xinc[7] = {8, 8, 4, 4, 2, 2, 1};
+
+  blitz::Array<uint8_t, 3> ref = bob::io::image::read_png<uint8_t, 3>(reference);
+  for (int passes = 1; passes <= 7; ++passes){
+    blitz::Array<uint8_t, 3> preview = bob::io::image::read_png_preview<uint8_t, 3>(interlaced, passes);
+    if (preview.extent(1) != ref.extent(1) || preview.extent(2) != ref.extent(2))
+      throw std::runtime_error("PNG preview does not have the size of the full image");
+    // all pixels that were decoded until the given pass must be exact
+    for (int p = 0; p < passes; ++p)
+      for (int c = 0; c < 3; ++c)
+        for (int y = ystart[p]; y < ref.extent(1); y += yinc[p])
+          for (int x = xstart[p]; x < ref.extent(2); x += xinc[p])
+            if (preview(c, y, x) != ref(c, y, x))
+              throw std::runtime_error((boost::format("PNG preview with %d passes differs at pixel (%d,%d,%d)") % passes % c % y % x).str());
+  }
+#endif
+
+  Py_RETURN_NONE;
+BOB_CATCH_FUNCTION("_test_png_interlace", 0)
+}
+
+
+static auto s_test_bmp_regions = bob::extension::FunctionDoc(
+  "_test_bmp_regions",
+  "Tests that regions of BMP images are read as the same part of the full image"
+)
+.add_prototype("filename")
+.add_parameter("filename", "str", "A BMP image, e.g., with RLE compression")
+;
+static PyObject* _test_bmp_regions(PyObject*, PyObject *args, PyObject* kwds) {
+BOB_TRY
+  static char** kwlist = s_test_bmp_regions.kwlist();
+
+  const char* filename;
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "s", kwlist, &filename)) return 0;
+
+  bob::io::image::BMPFile file(filename, 'r');
+  const bob::io::base::array::typeinfo& info = file.type();
+  bob::io::base::array::blitz_array image(info);
+  file.read(image, 0);
+
+  // single pixels and regions up to the last row and column, from a grid of corners
+  const size_t height = info.shape[info.nd-2], width = info.shape[info.nd-1];
+  for (size_t y = 0; y < height; y += std::max<size_t>(height / 5, 1))
+    for (size_t x = 0; x < width; x += std::max<size_t>(width / 5, 1))
+      for (size_t h : {size_t(1), height - y})
+        for (size_t w : {size_t(1), width - x}){
+          const bob::io::base::array::typeinfo part = bob::io::image::region_type(info, y, x, h, w, filename);
+          bob::io::base::array::blitz_array expected(part), region(part);
+          bob::io::image::copy_region(image, y, x, expected);
+          file.read_region(region, y, x, h, w);
+          if (std::memcmp(region.ptr(), expected.ptr(), part.buffer_size()))
+            throw std::runtime_error((boost::format("BMP region of size %dx%d at (%d,%d) differs from the full image in file `%s'") % h % w % y % x % filename).str());
+        }
+
+  Py_RETURN_NONE;
+BOB_CATCH_FUNCTION("_test_bmp_regions", 0)
+}
+
+
+// Restores the trusted input mode when the test leaves, also by an exception
+class TrustedInputGuard {
+  public:
+    TrustedInputGuard() : m_trusted(bob::io::image::get_trusted_input()) { }
+    ~TrustedInputGuard() { bob::io::image::set_trusted_input(m_trusted); }
+  private:
+    const bool m_trusted;
+};
+
+// Collects the messages of the given stream, and restores its buffer when the test leaves
+class StreamCapture {
+  public:
+    explicit StreamCapture(std::ostream& stream) : m_stream(stream), m_buffer(stream.rdbuf(m_captured.rdbuf())) { }
+    ~StreamCapture() { m_stream.rdbuf(m_buffer); }
+    std::string str() const { return m_captured.str(); }
+  private:
+    std::ostream& m_stream;
+    std::ostringstream m_captured;
+    std::streambuf* m_buffer;
+};
+
+static auto s_test_trusted_input = bob::extension::FunctionDoc(
+  "_test_trusted_input",
+  "Tests that corrupted images are reported when they are checked, and are decoded as trusted input"
+)
+.add_prototype("tempdir")
+.add_parameter("tempdir", "str", "A temporary directory to write data to")
+;
+static PyObject* _test_trusted_input(PyObject*, PyObject *args, PyObject* kwds) {
+BOB_TRY
+  static char** kwlist = s_test_trusted_input.kwlist();
+
+  const char* tempdir;
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "s", kwlist, &tempdir)) return 0;
+
+  blitz::Array<uint8_t, 3> color_image(3, 64, 80);
+  color_image = (blitz::tensor::i * 80 + blitz::tensor::j * 3 + blitz::tensor::k * 2) % 256;
+
+  TrustedInputGuard guard;
+  bob::io::image::set_trusted_input(false);
+
+#ifdef HAVE_LIBPNG
+  // a wrong CRC of the image data is an error, unless the input is trusted
+  boost::filesystem::path png(tempdir); png /= std::string("wrong_crc.png");
+  bob::io::image::write_png(color_image, png.string());
+  {
+    std::fstream stream(png.string().c_str(), std::ios::in | std::ios::out | std::ios::binary);
+    std::string bytes((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+    const size_t idat = bytes.find("IDAT");
+    if (idat == std::string::npos)
+      throw std::runtime_error("PNG image has no image data, check " + png.string());
+    const size_t length = (uint8_t(bytes[idat-4]) << 24) | (uint8_t(bytes[idat-3]) << 16) | (uint8_t(bytes[idat-2]) << 8) | uint8_t(bytes[idat-1]);
+    stream.seekp(idat + 4 + length);
+    stream.put(char(~bytes[idat + 4 + length]));
+  }
+  bool png_failed = false;
+  try { bob::io::image::read_color_image(png.string()); } catch (std::runtime_error&) { png_failed = true; }
+  if (!png_failed)
+    throw std::runtime_error("PNG image with a wrong CRC was read without an error, check " + png.string());
+  bob::io::image::set_trusted_input(true);
+  if (blitz::any(bob::io::image::read_color_image(png.string()) != color_image))
+    throw std::runtime_error("PNG image with a wrong CRC could not be read as trusted input, check " + png.string());
+  bob::io::image::set_trusted_input(false);
+#endif
+
+#ifdef HAVE_LIBJPEG
+  // a truncated JPEG image decodes with a warning, which is not even formatted for trusted input
+  boost::filesystem::path jpeg(tempdir); jpeg /= std::string("truncated.jpg");
+  bob::io::image::write_jpeg(color_image, jpeg.string());
+  boost::filesystem::resize_file(jpeg, boost::filesystem::file_size(jpeg) / 2);
+  blitz::Array<uint8_t, 3> checked, trusted;
+  std::string checked_messages, trusted_messages;
+  {
+    StreamCapture capture(bob::core::debug);
+    checked.reference(bob::io::image::read_color_image(jpeg.string()));
+    checked_messages = capture.str();
+  }
+  bob::io::image::set_trusted_input(true);
+  {
+    StreamCapture capture(bob::core::debug);
+    trusted.reference(bob::io::image::read_color_image(jpeg.string()));
+    trusted_messages = capture.str();
+  }
+  if (checked_messages.find("JPEG warning") == std::string::npos)
+    throw std::runtime_error("Truncated JPEG image was read without a warning, check " + jpeg.string());
+  if (!trusted_messages.empty() || blitz::any(trusted != checked))
+    throw std::runtime_error("Truncated JPEG image was not read silently as trusted input, check " + jpeg.string());
+#endif
+
+  Py_RETURN_NONE;
+BOB_CATCH_FUNCTION("_test_trusted_input", 0)
+}
+
+
+#ifdef HAVE_LIBTIFF
+static auto s_test_tiff_decoding = bob::extension::FunctionDoc(
+  "_test_tiff_decoding",
+  "Tests that the strips and tiles of large TIFF images decoded by several threads give the same pixels as a serial decoding, and that their files encoded by several threads are identical to serially encoded ones"
+)
+.add_prototype("tempdir")
+.add_parameter("tempdir", "str", "A temporary directory to write data to")
+;
+static PyObject* _test_tiff_decoding(PyObject*, PyObject *args, PyObject* kwds) {
+BOB_TRY
+  static char** kwlist = s_test_tiff_decoding.kwlist();
+
+  const char* tempdir;
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "s", kwlist, &tempdir)) return 0;
+
+  // large enough to be decoded in parallel, and noisy enough that the chunks do not compress to nothing
+  blitz::Array<uint16_t, 2> gray_image(600, 700);
+  gray_image = blitz::tensor::i * 100 + blitz::tensor::j;
+  blitz::Array<uint8_t, 3> color_image(3, 600, 700);
+  uint32_t state = 1;
+  for (uint8_t* pixel = color_image.data(); pixel != color_image.data() + color_image.size(); ++pixel){
+    state = state * 1664525u + 1013904223u;
+    *pixel = (state >> 24) & 0x3f;
+  }
+
+  std::vector<std::pair<std::string, bob::io::image::TIFFWriteOptions>> layouts(4);
+  layouts[0].first = "strips_deflate.tiff";
+  layouts[0].second.compression = bob::io::image::TIFFWriteOptions::DEFLATE;
+  layouts[0].second.rows_per_strip = 16;
+  layouts[1].first = "tiles_lzw.tiff";
+  layouts[1].second.compression = bob::io::image::TIFFWriteOptions::LZW;
+  layouts[1].second.predictor = true;
+  layouts[1].second.tile_width = layouts[1].second.tile_height = 64;
+  layouts[2].first = "strips_lzw_planes.tiff";
+  layouts[2].second.compression = bob::io::image::TIFFWriteOptions::LZW;
+  layouts[2].second.rows_per_strip = 8;
+  layouts[2].second.separate_planes = true;
+  layouts[3].first = "tiles_deflate_planes.tiff";
+  layouts[3].second.compression = bob::io::image::TIFFWriteOptions::DEFLATE;
+  layouts[3].second.predictor = true;
+  layouts[3].second.tile_width = 48; layouts[3].second.tile_height = 32;
+  layouts[3].second.separate_planes = true;
+
+  auto file_bytes = [](const boost::filesystem::path& path){
+    std::ifstream stream(path.string().c_str(), std::ios::binary);
+    return std::string((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+  };
+
+  DecodingThreadsGuard guard;
+  for (const auto& layout : layouts){
+    boost::filesystem::path gray(tempdir); gray /= std::string("gray_") + layout.first;
+    boost::filesystem::path color(tempdir); color /= std::string("color_") + layout.first;
+    boost::filesystem::path gray_encoded(tempdir); gray_encoded /= std::string("gray_parallel_") + layout.first;
+    boost::filesystem::path color_encoded(tempdir); color_encoded /= std::string("color_parallel_") + layout.first;
+    bob::io::image::set_decoding_threads(1);
+    bob::io::image::write_tiff(gray_image, gray.string(), layout.second);
+    bob::io::image::write_tiff(color_image, color.string(), layout.second);
+    bob::io::image::set_decoding_threads(4);
+    bob::io::image::write_tiff(gray_image, gray_encoded.string(), layout.second);
+    bob::io::image::write_tiff(color_image, color_encoded.string(), layout.second);
+    if (file_bytes(gray) != file_bytes(gray_encoded))
+      throw std::runtime_error("TIFF chunks encoded in parallel differ from a serial encoding, check " + gray_encoded.string());
+    if (file_bytes(color) != file_bytes(color_encoded))
+      throw std::runtime_error("TIFF chunks encoded in parallel differ from a serial encoding, check " + color_encoded.string());
+
+    bob::io::image::set_decoding_threads(1);
+    blitz::Array<uint16_t, 2> gray_serial = bob::io::image::read_tiff<uint16_t, 2>(gray.string());
+    blitz::Array<uint8_t, 3> color_serial = bob::io::image::read_tiff<uint8_t, 3>(color.string());
+    bob::io::image::set_decoding_threads(4);
+    blitz::Array<uint16_t, 2> gray_parallel = bob::io::image::read_tiff<uint16_t, 2>(gray.string());
+    blitz::Array<uint8_t, 3> color_parallel = bob::io::image::read_tiff<uint8_t, 3>(color.string());
+    blitz::Array<uint8_t, 2> converted = bob::io::image::read_tiff<uint8_t, 2>(gray.string());
+
+    if (blitz::any(gray_serial != gray_image) || blitz::any(gray_parallel != gray_serial) ||
+        blitz::any(converted != bob::io::image::read_tiff_roi<uint8_t, 2>(gray.string(), 0, 0, 600, 700)))
+      throw std::runtime_error("TIFF chunks decoded in parallel differ from a serial decoding, check " + gray.string());
+    if (blitz::any(color_serial != color_image) || blitz::any(color_parallel != color_serial))
+      throw std::runtime_error("TIFF chunks decoded in parallel differ from a serial decoding, check " + color.string());
+  }
+
+  Py_RETURN_NONE;
+BOB_CATCH_FUNCTION("_test_tiff_decoding", 0)
+}
+#endif
+
+
 static PyMethodDef module_methods[] = {
   {
     s_test_io.name(),
@@ -192,6 +998,32 @@ static PyMethodDef module_methods[] = {
     METH_VARARGS|METH_KEYWORDS,
     s_test_io.doc(),
   },
+  {
+    s_test_png_interlace.name(),
+    (PyCFunction)_test_png_interlace,
+    METH_VARARGS|METH_KEYWORDS,
+    s_test_png_interlace.doc(),
+  },
+  {
+    s_test_bmp_regions.name(),
+    (PyCFunction)_test_bmp_regions,
+    METH_VARARGS|METH_KEYWORDS,
+    s_test_bmp_regions.doc(),
+  },
+  {
+    s_test_trusted_input.name(),
+    (PyCFunction)_test_trusted_input,
+    METH_VARARGS|METH_KEYWORDS,
+    s_test_trusted_input.doc(),
+  },
+#ifdef HAVE_LIBTIFF
+  {
+    s_test_tiff_decoding.name(),
+    (PyCFunction)_test_tiff_decoding,
+    METH_VARARGS|METH_KEYWORDS,
+    s_test_tiff_decoding.doc(),
+  },
+#endif
   {0}  /* Sentinel */
 };
 
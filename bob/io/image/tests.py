@@ -11,6 +11,7 @@
 import os
 import numpy
 from bob.io.base import load, write, test_utils
+import bob.io.base
 import bob.io.image
 import nose
 
@@ -20,6 +21,7 @@ PNG_INDEXED_COLOR_ALPHA = test_utils.datafile('img_indexed_color_alpha.png', __n
 PNG_RGBA_COLOR = test_utils.datafile('img_rgba_color.png', __name__)
 PNG_GRAY_ALPHA = test_utils.datafile('img_gray_alpha.png', __name__)
 PNG_tRNS = test_utils.datafile('img_trns.png', __name__)
+PNG_INTERLACED = test_utils.datafile('img_interlaced.png', __name__)
 
 
 def test_png_indexed_color():
@@ -50,6 +52,12 @@ def test_png_indexed_trns():
   assert img[0,0,0] == 255
   assert img[0,17,17] == 117
 
+def test_png_interlaced():
+  # Read an Adam7 interlaced PNG image, and compare with its non-interlaced version
+  img = load(PNG_INTERLACED)
+  assert img.shape == (3,22,32)
+  assert numpy.array_equal(img, load(PNG_RGBA_COLOR))
+
 def test_png_gray_alpha():
   # Read a gray+alpha PNG image, and compared with hardcoded values
   img = load(PNG_GRAY_ALPHA)
@@ -131,12 +139,124 @@ def test_image_load():
 
 
 def test_cpp_interface():
-  from ._test import _test_io
+  from ._test import _test_io, _test_png_interlace
   import tempfile
   import shutil
 
   tmpdir = tempfile.mkdtemp(prefix="bob_io_image")
   try:
     _test_io(tmpdir)
+    _test_png_interlace(PNG_INTERLACED, PNG_RGBA_COLOR)
+  finally:
+    shutil.rmtree(tmpdir)
+
+
+def test_read_indexed():
+  # the palette indices and the palette give the same image as expanding the colors
+  for filename in ('img_indexed_color.png', 'img_indexed_4bit.bmp', 'test.gif'):
+    full_file = test_utils.datafile(filename, __name__)
+    indices, palette = bob.io.image.read_indexed(full_file)
+    assert indices.dtype == numpy.uint8 and indices.ndim == 2
+    assert palette.dtype == numpy.uint8 and palette.shape[1] == 3
+    image = load(full_file)
+    expanded = palette[indices].transpose(2,0,1)
+    # images with gray palettes are read as gray images
+    assert numpy.array_equal(image, expanded[0] if image.ndim == 2 else expanded)
+
+  # images without palette cannot be read
+  nose.tools.assert_raises(RuntimeError, bob.io.image.read_indexed, PNG_RGBA_COLOR)
+  nose.tools.assert_raises(RuntimeError, bob.io.image.read_indexed, test_utils.datafile('test.jpg', __name__))
+
+
+def test_bmp_rle():
+  from ._test import _test_bmp_regions
+  # RLE8 and RLE4 compressed bitmaps hold the same image as the uncompressed one
+  expected = load(test_utils.datafile('img_indexed_4bit.bmp', __name__))
+  for filename in ('img_rle8.bmp', 'img_rle4.bmp'):
+    full_file = test_utils.datafile(filename, __name__)
+    assert numpy.array_equal(load(full_file), expected)
+    indices, palette = bob.io.image.read_indexed(full_file)
+    assert numpy.array_equal(palette[indices].transpose(2,0,1), expected)
+    # regions are decoded as the same part of the full image
+    _test_bmp_regions(full_file)
+
+def test_bmp_bitfields():
+  # 10 bits per channel, scaled to the full range of 8 bits
+  expected = load(test_utils.datafile('img_indexed_4bit.bmp', __name__))
+  full_file = test_utils.datafile('img_bitfields_32bit.bmp', __name__)
+  assert numpy.array_equal(load(full_file), expected)
+
+def test_gray_bmp_gif():
+  # gray images are written with gray color maps and read back as gray images
+  image = load(test_utils.datafile('test.gif', __name__))
+  assert image.ndim == 2
+  for extension in ('.bmp', '.gif'):
+    tmpname = test_utils.temporary_filename(suffix=extension)
+    try:
+      write(image, tmpname)
+      assert numpy.array_equal(load(tmpname), image)
+    finally:
+      if os.path.exists(tmpname):
+        os.unlink(tmpname)
+
+def test_gif_animation():
+  # frames are composited onto the canvas: transparent pixels keep the frames
+  # below, disposal 2 clears a frame to the background color (index 0) and
+  # disposal 3 restores the canvas from before the frame
+  full_file = test_utils.datafile('img_animated_disposal.gif', __name__)
+  colors = numpy.array([[0, 0, 0], [255, 0, 0], [0, 255, 0], [0, 0, 255]], numpy.uint8)
+  canvas = numpy.ones((6, 8), numpy.uint8)
+  expected = [canvas.copy()]
+  canvas[1:4, 2:6] = numpy.where(numpy.array([[2, 0, 2, 0], [0, 2, 0, 2], [2, 2, 0, 0]]) == 2, 2, canvas[1:4, 2:6])
+  expected.append(canvas.copy())
+  canvas[1:4, 2:6] = 0
+  previous = canvas.copy()
+  canvas[3:5, 0:4] = numpy.where(numpy.array([[3, 3, 0, 3], [0, 3, 3, 3]]) == 3, 3, canvas[3:5, 0:4])
+  expected.append(canvas.copy())
+  canvas = previous
+  canvas[0:2, 6:8] = [[2, 3], [3, 2]]
+  expected.append(canvas.copy())
+  expected = numpy.array([colors[e].transpose(2, 0, 1) for e in expected])
+
+  # all frames are read as a 4D array, each frame also on its own
+  assert numpy.array_equal(load(full_file), expected)
+  animation = bob.io.base.File(full_file, 'r')
+  assert len(animation) == 4
+  for index in (3, 1, 2, 0):
+    assert numpy.array_equal(animation.read(index), expected[index])
+
+def test_trusted_input():
+  from ._test import _test_trusted_input
+  import tempfile
+  import shutil
+
+  assert not bob.io.image.get_trusted_input()
+  for filename in ('grace_hopper.png', 'img_trns.png', 'test.jpg', 'cmyk.jpg'):
+    full_file = test_utils.datafile(filename, __name__)
+    checked = load(full_file)
+    bob.io.image.set_trusted_input(True)
+    try:
+      assert bob.io.image.get_trusted_input()
+      assert numpy.array_equal(checked, load(full_file))
+    finally:
+      bob.io.image.set_trusted_input(False)
+
+  # corrupted images are reported when they are checked only
+  tmpdir = tempfile.mkdtemp(prefix="bob_io_image")
+  try:
+    _test_trusted_input(tmpdir)
+  finally:
+    shutil.rmtree(tmpdir)
+  assert not bob.io.image.get_trusted_input()
+
+def test_tiff_decoding():
+  from ._test import _test_tiff_decoding
+  import tempfile
+  import shutil
+
+  # tiled and striped LZW and Deflate images, decoded on one and on four threads
+  tmpdir = tempfile.mkdtemp(prefix="bob_io_image")
+  try:
+    _test_tiff_decoding(tmpdir)
   finally:
     shutil.rmtree(tmpdir)
@@ -335,8 +335,6 @@ system_include_dirs = [
     tiff_pkg.include_directory,
     gif_pkg.include_directory,
     ]
-if LooseVersion(gif_pkg.version) >= LooseVersion("5.1.9"):
-  system_include_dirs.append("bob/io/image/giflib")
 
 library_dirs = [
     jpeg_pkg.library_directory,
@@ -398,6 +396,7 @@ setup(
           "bob/io/image/cpp/pnmio.cpp",
           "bob/io/image/cpp/netpbm.cpp",
           "bob/io/image/cpp/image.cpp",
+          "bob/io/image/cpp/sampler.cpp",
         ],
         packages = packages,
         boost_modules = boost_modules,